@@ -30,6 +30,7 @@
 #include <stdint.h>
 
 #include <algorithm>
+#include <atomic>
 #include <memory>
 #include <new>
 #include <random>
@@ -214,6 +215,72 @@ static void bench_fastpath_rnd_dependent_8cores(long iterations, uintptr_t _para
   }
 }
 
+// One thread allocates "messages" and passes them through a
+// single-producer single-consumer ring to another thread that frees
+// them. So every object is allocated on one thread and freed on the
+// other, which makes thread caches continuously overflow on consumer
+// side and underflow on producer side.
+static void bench_producer_consumer(long iterations, uintptr_t param) {
+  size_t sz = static_cast<size_t>(param);
+  static constexpr size_t kRingSize = 4096;
+  std::unique_ptr<std::atomic<void*>[]> ring = std::make_unique<std::atomic<void*>[]>(kRingSize);
+  for (size_t i = 0; i < kRingSize; i++) {
+    ring[i].store(nullptr, std::memory_order_relaxed);
+  }
+
+  std::thread consumer{[&ring, iterations]() {
+    size_t pos = 0;
+    for (long i = 0; i < iterations; i++) {
+      void* p;
+      while ((p = ring[pos].load(std::memory_order_acquire)) == nullptr) {
+        std::this_thread::yield();
+      }
+      ring[pos].store(nullptr, std::memory_order_relaxed);
+      (operator delete)(p);
+      pos = (pos + 1) & (kRingSize - 1);
+    }
+  }};
+
+  size_t pos = 0;
+  for (long i = 0; i < iterations; i++) {
+    void* p = (operator new)(sz);
+    while (ring[pos].load(std::memory_order_relaxed) != nullptr) {
+      std::this_thread::yield();
+    }
+    ring[pos].store(p, std::memory_order_release);
+    pos = (pos + 1) & (kRingSize - 1);
+  }
+
+  consumer.join();
+}
+
+// Allocates a bunch of objects and then keeps reading their first
+// cache lines, like a lookup into a collection of small hash tables
+// would. When objects of the size class start at the same offsets
+// within their spans, those lines compete for a few cache sets and
+// we see conflict misses. Comparing runs with and without
+// TCMALLOC_CACHE_COLORING=f shows how much span coloring helps.
+static void bench_object_heads(long iterations, uintptr_t param) {
+  size_t sz = static_cast<size_t>(param);
+  static constexpr size_t kObjects = 1024;
+  std::unique_ptr<uintptr_t*[]> objects = std::make_unique<uintptr_t*[]>(kObjects);
+  for (size_t i = 0; i < kObjects; i++) {
+    objects[i] = static_cast<uintptr_t*>((operator new)(sz));
+    *objects[i] = i;
+  }
+
+  uintptr_t sum = 0;
+  for (long i = 0; i < iterations; i++) {
+    sum += *objects[i & (kObjects - 1)];
+  }
+  // Make sure compiler doesn't throw away the loop above.
+  *objects[0] = sum;
+
+  for (size_t i = 0; i < kObjects; i++) {
+    (operator delete)(objects[i]);
+  }
+}
+
 void randomize_one_size_class(size_t size) {
   size_t count = (100 << 20) / size;
   auto randomize_buffer = std::make_unique<void*[]>(count);
@@ -289,5 +356,12 @@ int main(int argc, char** argv) {
 
   report_benchmark("bench_fastpath_rnd_dependent_8cores", bench_fastpath_rnd_dependent_8cores, 32768);
 
+  report_benchmark("bench_producer_consumer", bench_producer_consumer, 64);
+  report_benchmark("bench_producer_consumer", bench_producer_consumer, 1024);
+
+  report_benchmark("bench_object_heads", bench_object_heads, 1536);
+  report_benchmark("bench_object_heads", bench_object_heads, 5120);
+  report_benchmark("bench_object_heads", bench_object_heads, 10240);
+
   return 0;
 }
@@ -162,6 +162,13 @@
 #  endif
 #endif
 
+/* Define to 1 if you have the <linux/perf_event.h> header file. */
+#if defined __has_include
+#  if __has_include(<linux/perf_event.h>)
+#    define HAVE_LINUX_PERF_EVENT_H 1
+#  endif
+#endif
+
 /* Define if this is Linux that has SIGEV_THREAD_ID */
 #if __linux__
 #define HAVE_LINUX_SIGEV_THREAD_ID 1
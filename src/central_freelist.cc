@@ -47,10 +47,14 @@
 
 namespace tcmalloc {
 
+// Marks handoff slot that is being filled or emptied by some thread.
+static void* const kHandoffBusy = reinterpret_cast<void*>(uintptr_t{1});
+
 void CentralFreeList::Init(size_t cl) {
   size_class_ = cl;
   tcmalloc::DLL_Init(&empty_);
   tcmalloc::DLL_Init(&nonempty_);
+  tcmalloc::DLL_Init(&cold_nonempty_);
   num_spans_ = 0;
   counter_ = 0;
 
@@ -76,8 +80,55 @@ void CentralFreeList::Init(size_t cl) {
     max_cache_size_ = std::min(max_cache_size_, std::max(1, (1024 * 1024) / (bytes * objs_to_move)));
     cache_size_ = std::min(cache_size_, max_cache_size_);
   }
+  // Handoff slots come out of the same budget, so batches held in
+  // both never exceed max_cache_size_.  At least one locked slot is
+  // kept, since only those grow and shrink with traffic.
+  num_handoff_slots_ = 0;
+  if (cl > 0) {
+    num_handoff_slots_ = std::max<int32_t>(0, std::min<int32_t>(kMaxNumHandoffSlots, max_cache_size_ - 1));
+    max_cache_size_ -= num_handoff_slots_;
+    cache_size_ = std::min(cache_size_, max_cache_size_);
+  }
   used_slots_ = 0;
   ASSERT(cache_size_ <= max_cache_size_);
+
+  for (int i = 0; i < kMaxNumHandoffSlots; i++) {
+    handoff_slots_[i].head.store(nullptr, std::memory_order_relaxed);
+    handoff_slots_[i].tail = nullptr;
+  }
+}
+
+bool CentralFreeList::TryHandoffInsert(void* start, void* end) {
+  for (int i = 0; i < num_handoff_slots_; i++) {
+    HandoffSlot* slot = &handoff_slots_[i];
+    void* expected = nullptr;
+    if (slot->head.load(std::memory_order_relaxed) != nullptr ||
+        !slot->head.compare_exchange_strong(expected, kHandoffBusy, std::memory_order_acquire,
+                                            std::memory_order_relaxed)) {
+      continue;
+    }
+    slot->tail = end;
+    slot->head.store(start, std::memory_order_release);
+    return true;
+  }
+  return false;
+}
+
+bool CentralFreeList::TryHandoffRemove(void** start, void** end) {
+  for (int i = 0; i < num_handoff_slots_; i++) {
+    HandoffSlot* slot = &handoff_slots_[i];
+    void* head = slot->head.load(std::memory_order_acquire);
+    if (head == nullptr || head == kHandoffBusy ||
+        !slot->head.compare_exchange_strong(head, kHandoffBusy, std::memory_order_acquire,
+                                            std::memory_order_relaxed)) {
+      continue;
+    }
+    *start = head;
+    *end = slot->tail;
+    slot->head.store(nullptr, std::memory_order_release);
+    return true;
+  }
+  return false;
 }
 
 void CentralFreeList::ReleaseListToSpans(void* start) {
@@ -97,7 +148,7 @@ void CentralFreeList::ReleaseToSpans(void* object) {
   // If span is empty, move it to non-empty list
   if (span->objects == nullptr) {
     tcmalloc::DLL_Remove(span);
-    tcmalloc::DLL_Prepend(&nonempty_, span);
+    tcmalloc::DLL_Prepend(span->cold ? &cold_nonempty_ : &nonempty_, span);
   }
 
   // The following check is expensive, so it is disabled by default
@@ -211,9 +262,37 @@ bool CentralFreeList::ShrinkCache(int locked_size_class, bool force) NO_THREAD_S
   return true;
 }
 
+void CentralFreeList::ReleaseHandoffSlots() {
+  void* start;
+  void* end;
+  while (TryHandoffRemove(&start, &end)) {
+    ReleaseListToSpans(start);
+  }
+}
+
+void CentralFreeList::ReleaseHandoffBatches() {
+  SpinLockHolder h(&lock_);
+  ReleaseHandoffSlots();
+}
+
+void CentralFreeList::ReleaseTransferCache() {
+  SpinLockHolder h(&lock_);
+  ReleaseHandoffSlots();
+  // ReleaseListToSpans may drop the lock, so slot is taken out first.
+  while (used_slots_ > 0) {
+    int slot = --used_slots_;
+    ReleaseListToSpans(tc_slots_[slot].head);
+  }
+}
+
 void CentralFreeList::InsertRange(void* start, void* end, int N) {
+  const bool full_batch = (N == Static::sizemap()->num_objects_to_move(size_class_));
+  if (full_batch && TryHandoffInsert(start, end)) {
+    return;
+  }
+
   SpinLockHolder h(&lock_);
-  if (N == Static::sizemap()->num_objects_to_move(size_class_) && MakeCacheSpace()) {
+  if (full_batch && MakeCacheSpace()) {
     int slot = used_slots_++;
     ASSERT(slot >= 0);
     ASSERT(slot < max_cache_size_);
@@ -227,8 +306,13 @@ void CentralFreeList::InsertRange(void* start, void* end, int N) {
 
 int CentralFreeList::RemoveRange(void** start, void** end, int N) {
   ASSERT(N > 0);
+  const bool full_batch = (N == Static::sizemap()->num_objects_to_move(size_class_));
+  if (full_batch && TryHandoffRemove(start, end)) {
+    return N;
+  }
+
   lock_.Lock();
-  if (N == Static::sizemap()->num_objects_to_move(size_class_) && used_slots_ > 0) {
+  if (full_batch && used_slots_ > 0) {
     int slot = --used_slots_;
     ASSERT(slot >= 0);
     TCEntry* entry = &tc_slots_[slot];
@@ -258,6 +342,24 @@ int CentralFreeList::RemoveRange(void** start, void** end, int N) {
   return result;
 }
 
+void* CentralFreeList::RemoveCold() {
+  SpinLockHolder h(&lock_);
+  void* start;
+  void* end;
+  if (FetchFromOneSpans(1, &start, &end, true) == 0) {
+    Populate(true);
+    if (FetchFromOneSpans(1, &start, &end, true) == 0) {
+      return nullptr;
+    }
+  }
+  return start;
+}
+
+void CentralFreeList::InsertCold(void* object) {
+  SpinLockHolder h(&lock_);
+  ReleaseToSpans(object);
+}
+
 int CentralFreeList::FetchFromOneSpansSafe(int N, void** start, void** end) {
   int result = FetchFromOneSpans(N, start, end);
   if (!result) {
@@ -267,9 +369,10 @@ int CentralFreeList::FetchFromOneSpansSafe(int N, void** start, void** end) {
   return result;
 }
 
-int CentralFreeList::FetchFromOneSpans(int N, void** start, void** end) {
-  if (tcmalloc::DLL_IsEmpty(&nonempty_)) return 0;
-  Span* span = nonempty_.next;
+int CentralFreeList::FetchFromOneSpans(int N, void** start, void** end, bool cold) {
+  Span* list = cold ? &cold_nonempty_ : &nonempty_;
+  if (tcmalloc::DLL_IsEmpty(list)) return 0;
+  Span* span = list->next;
 
   ASSERT(span->objects != nullptr);
 
@@ -297,7 +400,7 @@ int CentralFreeList::FetchFromOneSpans(int N, void** start, void** end) {
 }
 
 // Fetch memory from the system and add to the central cache freelist.
-void CentralFreeList::Populate() {
+void CentralFreeList::Populate(bool cold) {
   // Release central list lock while operating on pageheap
   lock_.Unlock();
   const size_t npages = Static::sizemap()->class_to_pages(size_class_);
@@ -312,16 +415,25 @@ void CentralFreeList::Populate() {
   // Cache sizeclass info eagerly.  Locking is not necessary.
   // (Instead of being eager, we could just replace any stale info
   // about this span, but that seems to be no better in practice.)
+  // Cold spans are kept out of the cache, so that free() always
+  // looks at their span and returns objects to it (see do_free).
   for (int i = 0; i < npages; i++) {
-    Static::pageheap()->SetCachedSizeClass(span->start + i, size_class_);
+    if (cold) {
+      Static::pageheap()->InvalidateCachedSizeClass(span->start + i);
+    } else {
+      Static::pageheap()->SetCachedSizeClass(span->start + i, size_class_);
+    }
   }
 
-  // Split the block into pieces and add to the free-list
-  // TODO: coloring of objects to avoid cache conflicts?
+  // Split the block into pieces and add to the free-list.  Objects
+  // start at span's color offset, which only eats into the space
+  // that would be left over anyways, so the number of objects is the
+  // same.
   void** tail = &span->objects;
   char* ptr = reinterpret_cast<char*>(span->start << kPageShift);
   char* limit = ptr + (npages << kPageShift);
   const size_t size = Static::sizemap()->ByteSizeForClass(size_class_);
+  ptr += Static::sizemap()->ColorOffset(size_class_, span->start);
   int num = 0;
 
   // Note, when ptr is close to the top of address space, ptr + size
@@ -357,17 +469,28 @@ void CentralFreeList::Populate() {
   ASSERT(ptr > limit - size);  // same as ptr + size > limit but avoiding overflow
   *tail = nullptr;
   span->refcount = 0;  // No sub-object in use yet
+  span->cold = cold;
 
   // Add span to list of non-empty spans
   lock_.Lock();
-  tcmalloc::DLL_Prepend(&nonempty_, span);
+  tcmalloc::DLL_Prepend(cold ? &cold_nonempty_ : &nonempty_, span);
   ++num_spans_;
   counter_ += num;
 }
 
+int CentralFreeList::handoff_length() {
+  int handoff_batches = 0;
+  for (int i = 0; i < num_handoff_slots_; i++) {
+    void* head = handoff_slots_[i].head.load(std::memory_order_relaxed);
+    handoff_batches += (head != nullptr && head != kHandoffBusy);
+  }
+  return handoff_batches * Static::sizemap()->num_objects_to_move(size_class_);
+}
+
 int CentralFreeList::tc_length() {
+  const int handoff = handoff_length();
   SpinLockHolder h(&lock_);
-  return used_slots_ * Static::sizemap()->num_objects_to_move(size_class_);
+  return used_slots_ * Static::sizemap()->num_objects_to_move(size_class_) + handoff;
 }
 
 size_t CentralFreeList::OverheadBytes() {
@@ -37,6 +37,7 @@
 #include "config.h"
 #include <stddef.h>
 #include <stdint.h>
+#include <atomic>
 #include "base/spinlock.h"
 #include "base/thread_annotations.h"
 #include "span.h"
@@ -59,21 +60,45 @@ class CACHELINE_ALIGNED CentralFreeList {
   // Returns the actual number of fetched elements and sets *start and *end.
   int RemoveRange(void** start, void** end, int N);
 
+  // Returns single object carved from "cold" spans, which never serve
+  // RemoveRange().  This keeps rarely touched objects out of the spans
+  // that hot objects come from.  Returns nullptr on allocation failure.
+  void* RemoveCold();
+
+  // Returns object that came from RemoveCold() back to its span.
+  // Unlike InsertRange() it never goes into the transfer cache, so
+  // cold objects are never handed out by RemoveRange().
+  void InsertCold(void* object) LOCKS_EXCLUDED(lock_);
+
   // Returns the number of free objects in cache.
   int length() {
     SpinLockHolder h(&lock_);
     return counter_;
   }
 
-  // Returns the number of free objects in the transfer cache.
+  // Returns the number of free objects in the transfer cache
+  // (including the lock-free handoff slots).
   int tc_length();
 
+  // Returns the number of free objects in the handoff slots alone.
+  int handoff_length();
+
   // Returns the memory overhead (internal fragmentation) attributable
   // to the freelist.  This is memory lost when the size of elements
   // in a freelist doesn't exactly divide the page-size (an 8192-byte
   // page full of 5-byte objects would have 2 bytes memory overhead).
   size_t OverheadBytes();
 
+  // Returns objects held in the transfer cache (and handoff slots)
+  // to their spans, so that spans that become fully free go back to
+  // page heap. Used to reclaim memory under the soft heap limit.
+  void ReleaseTransferCache() LOCKS_EXCLUDED(lock_);
+
+  // Returns only the batches sitting in handoff slots to their spans.
+  // Unlike the locked slots they aren't shrunk on demand, so
+  // ReleaseFreeMemory drains them this way.
+  void ReleaseHandoffBatches() LOCKS_EXCLUDED(lock_);
+
   // Lock/Unlock the internal SpinLock. Used on the pthread_atfork call
   // to set the lock in a consistent state before the fork.
   void Lock() EXCLUSIVE_LOCK_FUNCTION(lock_) { lock_.Lock(); }
@@ -102,10 +127,42 @@ class CACHELINE_ALIGNED CentralFreeList {
   static const int kMaxNumTransferEntries = 64;
 #endif
 
+  // Handoff slots let full batches move between thread caches without
+  // taking lock_.  This is the common case for producer/consumer
+  // patterns, where one thread keeps releasing batches (via
+  // ListTooLong) and another one keeps fetching them.  Each slot is
+  // either empty (nullptr), claimed by some thread (kHandoffBusy) or
+  // holds the head of a full batch whose tail is in 'tail'.  Claiming
+  // a slot is a single CAS, so nobody ever waits on it.
+#ifdef TCMALLOC_SMALL_BUT_SLOW
+  static const int kMaxNumHandoffSlots = 0;
+#else
+  static const int kMaxNumHandoffSlots = 4;
+#endif
+
+  struct HandoffSlot {
+    constexpr HandoffSlot() {}
+    std::atomic<void*> head{};
+    void* tail{};
+  };
+
+  // Tries to publish batch [start, end] into one of the empty handoff
+  // slots.  Returns false if all slots are occupied.
+  bool TryHandoffInsert(void* start, void* end);
+
+  // Tries to grab full batch from one of the handoff slots.  Returns
+  // false if there is none.
+  bool TryHandoffRemove(void** start, void** end);
+
+  // REQUIRES: lock_ is held
+  // Releases all batches in handoff slots to spans.
+  // May temporarily release lock_.
+  void ReleaseHandoffSlots() EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
   // REQUIRES: lock_ is held
   // Remove object from cache and return.
   // Return nullptr if no free entries in cache.
-  int FetchFromOneSpans(int N, void** start, void** end) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  int FetchFromOneSpans(int N, void** start, void** end, bool cold = false) EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
   // REQUIRES: lock_ is held
   // Remove object from cache and return.  Fetches
@@ -126,7 +183,7 @@ class CACHELINE_ALIGNED CentralFreeList {
   // REQUIRES: lock_ is held
   // Populate cache by fetching from the page heap.
   // May temporarily release lock_.
-  void Populate() EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void Populate(bool cold = false) EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
   // REQUIRES: lock is held.
   // Tries to make room for a TCEntry.  If the cache is full it will try to
@@ -158,6 +215,7 @@ class CACHELINE_ALIGNED CentralFreeList {
   size_t size_class_{};  // My size class
   Span empty_;           // Dummy header for list of empty spans
   Span nonempty_;        // Dummy header for list of non-empty spans
+  Span cold_nonempty_;   // Same, but for spans serving RemoveCold()
   size_t num_spans_{};   // Number of spans in empty_ plus nonempty_
   size_t counter_{};     // Number of free objects in cache entry
 
@@ -177,6 +235,13 @@ class CACHELINE_ALIGNED CentralFreeList {
   int32_t cache_size_{};
   // Maximum size of the cache for a given size class.
   int32_t max_cache_size_{};
+
+  // Number of handoff_slots_ entries in use for this size class.  They
+  // are taken out of max_cache_size_, so big size classes don't hold
+  // more memory than before.  Set once by Init().
+  int32_t num_handoff_slots_{};
+
+  HandoffSlot handoff_slots_[kMaxNumHandoffSlots];
 };
 
 }  // namespace tcmalloc
@@ -0,0 +1,279 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+
+#include "cgroup_pressure.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+
+#include "base/commandlineflags.h"
+#include "base/spinlock.h"
+#include "getenv_safe.h"
+#include "internal_logging.h"
+#include "page_heap.h"
+#include "static_vars.h"
+#include "thread_cache.h"
+
+namespace tcmalloc {
+
+std::atomic<bool> cgroup_pressure_monitor_enabled;
+
+namespace {
+
+// memory.current below this fraction of memory.high is no pressure,
+// and it goes up linearly to full pressure at memory.high.
+constexpr double kUsagePressureStart = 0.9;
+// PSI "some avg10" percentage that counts as full pressure.
+constexpr double kFullPsiPercent = 10.0;
+// Pressure level at which we also trim thread caches.
+constexpr double kTrimThreadCachesPressure = 0.5;
+
+constexpr uint64_t kDefaultPollIntervalMs = 100;
+
+std::atomic<uint64_t> poll_interval_ns{kDefaultPollIntervalMs * 1000000};
+std::atomic<uint64_t> next_poll_ns;
+std::atomic<bool> poll_in_progress;
+
+std::atomic<uint64_t> polls;
+std::atomic<uint64_t> pressure_events;
+std::atomic<uint64_t> released_bytes;
+std::atomic<uint64_t> thread_cache_trims;
+std::atomic<uint64_t> last_pressure_permille;
+
+#ifdef __linux__
+
+// Full paths of the files we read, set up once by
+// InitCgroupPressureMonitor.
+char memory_current_path[PATH_MAX];
+char memory_high_path[PATH_MAX];
+char memory_pressure_path[PATH_MAX];
+
+uint64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Reads small file into buf, NUL-terminated. Plain syscalls rather
+// than stdio, since FILE streams would allocate from us. Returns
+// false if the file cannot be read.
+bool ReadCgroupFile(const char* path, char* buf, size_t buf_size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  size_t total = 0;
+  while (total < buf_size - 1) {
+    ssize_t rv = read(fd, buf + total, buf_size - 1 - total);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      break;
+    }
+    total += rv;
+  }
+  close(fd);
+  buf[total] = '\0';
+  return total > 0;
+}
+
+// Concatenates dir and file name into path. Returns false if it
+// doesn't fit.
+bool MakeCgroupFilePath(char* path, const char* dir, const char* name) {
+  size_t dir_len = strlen(dir);
+  size_t name_len = strlen(name);
+  if (dir_len + 1 + name_len >= PATH_MAX) {
+    return false;
+  }
+  memcpy(path, dir, dir_len);
+  path[dir_len] = '/';
+  memcpy(path + dir_len + 1, name, name_len + 1);
+  return true;
+}
+
+// Parses memory.current or memory.high. "max" (no limit) is returned
+// as 0.
+bool ReadCgroupBytes(const char* path, uint64_t* value) {
+  char buf[64];
+  if (!ReadCgroupFile(path, buf, sizeof(buf))) {
+    return false;
+  }
+  if (strncmp(buf, "max", 3) == 0) {
+    *value = 0;
+    return true;
+  }
+  char* end;
+  *value = strtoull(buf, &end, 10);
+  return end != buf;
+}
+
+// Parses "avg10=" value of "some" line of memory.pressure, which
+// looks like "some avg10=1.23 avg60=0.50 avg300=0.10 total=12345".
+// Returns stall percentage, or 0 if PSI is not available.
+double ReadPsiSomeAvg10() {
+  char buf[256];
+  if (!ReadCgroupFile(memory_pressure_path, buf, sizeof(buf))) {
+    return 0;
+  }
+  if (strncmp(buf, "some ", 5) != 0) {
+    return 0;
+  }
+  const char* p = strstr(buf, "avg10=");
+  if (p == nullptr) {
+    return 0;
+  }
+  p += 6;
+  // strtod is locale dependent, so we parse "NN.NN" by hand.
+  double value = 0;
+  for (; *p >= '0' && *p <= '9'; p++) {
+    value = value * 10 + (*p - '0');
+  }
+  if (*p == '.') {
+    double scale = 0.1;
+    for (p++; *p >= '0' && *p <= '9'; p++, scale /= 10) {
+      value += (*p - '0') * scale;
+    }
+  }
+  return value;
+}
+
+double ComputePressure() {
+  double pressure = 0;
+
+  uint64_t current, high;
+  if (ReadCgroupBytes(memory_current_path, &current) && ReadCgroupBytes(memory_high_path, &high) && high > 0) {
+    double usage = static_cast<double>(current) / high;
+    pressure = (usage - kUsagePressureStart) / (1 - kUsagePressureStart);
+  }
+  pressure = std::max(pressure, ReadPsiSomeAvg10() / kFullPsiPercent);
+
+  return std::min(std::max(pressure, 0.0), 1.0);
+}
+
+void ReleaseForPressure(double pressure) {
+  pressure_events.fetch_add(1, std::memory_order_relaxed);
+
+  if (pressure >= kTrimThreadCachesPressure) {
+    thread_cache_trims.fetch_add(1, std::memory_order_relaxed);
+    // Threads scavenge their caches down to the new limits as they go.
+    SpinLockHolder h(Static::pageheap_lock());
+    ThreadCache::ShrinkAllCacheLimits();
+  }
+
+  SpinLockHolder h(Static::pageheap_lock());
+  uint64_t free_bytes = Static::pageheap()->StatsLocked().free_bytes;
+  Length num_pages = pages(static_cast<size_t>(free_bytes * pressure));
+  if (num_pages > 0) {
+    Length released = Static::pageheap()->ReleaseAtLeastNPages(num_pages);
+    released_bytes.fetch_add(released << kPageShift, std::memory_order_relaxed);
+  }
+}
+
+#endif  // __linux__
+
+}  // namespace
+
+void InitCgroupPressureMonitor() {
+#ifdef __linux__
+  const char* interval = TCMallocGetenvSafe("TCMALLOC_CGROUP_POLL_MS");
+  if (interval != nullptr) {
+    SetCgroupPollIntervalMs(commandlineflags::StringToLongLong(interval, kDefaultPollIntervalMs));
+  }
+
+  const char* path = TCMallocGetenvSafe("TCMALLOC_CGROUP_PATH");
+  if (path == nullptr || *path == '\0') {
+    return;
+  }
+  if (!MakeCgroupFilePath(memory_current_path, path, "memory.current") ||
+      !MakeCgroupFilePath(memory_high_path, path, "memory.high") ||
+      !MakeCgroupFilePath(memory_pressure_path, path, "memory.pressure")) {
+    Log(kLog, __FILE__, __LINE__, "TCMALLOC_CGROUP_PATH is too long, ignoring it");
+    return;
+  }
+  cgroup_pressure_monitor_enabled.store(true, std::memory_order_relaxed);
+#endif
+}
+
+void SetCgroupPollIntervalMs(uint64_t interval_ms) {
+  poll_interval_ns.store(interval_ms * 1000000, std::memory_order_relaxed);
+#ifdef __linux__
+  // New interval counts from now, rather than from the last poll.
+  next_poll_ns.store(NowNanos() + interval_ms * 1000000, std::memory_order_relaxed);
+#endif
+}
+
+uint64_t GetCgroupPollIntervalMs() { return poll_interval_ns.load(std::memory_order_relaxed) / 1000000; }
+
+CgroupPressureStats GetCgroupPressureStats() {
+  CgroupPressureStats stats;
+  stats.polls = polls.load(std::memory_order_relaxed);
+  stats.pressure_events = pressure_events.load(std::memory_order_relaxed);
+  stats.released_bytes = released_bytes.load(std::memory_order_relaxed);
+  stats.thread_cache_trims = thread_cache_trims.load(std::memory_order_relaxed);
+  stats.last_pressure_permille = last_pressure_permille.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void PollCgroupPressure() {
+#ifdef __linux__
+  uint64_t now = NowNanos();
+  if (now < next_poll_ns.load(std::memory_order_relaxed)) {
+    return;
+  }
+  if (poll_in_progress.exchange(true, std::memory_order_acquire)) {
+    return;
+  }
+  next_poll_ns.store(now + poll_interval_ns.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+  double pressure = ComputePressure();
+  last_pressure_permille.store(static_cast<uint64_t>(pressure * 1000), std::memory_order_relaxed);
+  if (pressure > 0) {
+    ReleaseForPressure(pressure);
+  }
+  polls.fetch_add(1, std::memory_order_release);
+
+  poll_in_progress.store(false, std::memory_order_release);
+#endif
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,91 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TCMALLOC_CGROUP_PRESSURE_H_
+#define TCMALLOC_CGROUP_PRESSURE_H_
+#include "config.h"
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "base/basictypes.h"
+
+// Optional cgroup v2 memory pressure monitor. It is enabled by
+// pointing TCMALLOC_CGROUP_PATH at cgroup v2 directory (typically
+// /sys/fs/cgroup inside a container), which must have memory.current,
+// memory.high and (optionally) memory.pressure files. Any directory
+// with files in the same format works, which is what tests do.
+//
+// MallocExtension::ProcessBackgroundActions polls those files at most
+// every TCMALLOC_CGROUP_POLL_MS milliseconds (default 100) and
+// computes pressure level between 0 and 1 from how close
+// memory.current is to memory.high and from PSI "some avg10" stall
+// percentage. Under pressure it releases that fraction of free page
+// heap memory to the system, and at high pressure it also trims
+// thread caches, so memory goes back to the kernel before
+// memory.high throttling kicks in. Allocation paths never touch
+// cgroup files; without the background thread the monitor is idle.
+
+namespace tcmalloc {
+
+struct CgroupPressureStats {
+  uint64_t polls;                // Times cgroup files were read
+  uint64_t pressure_events;      // Polls that found non-zero pressure
+  uint64_t released_bytes;       // Bytes released due to pressure
+  uint64_t thread_cache_trims;   // Times thread caches were trimmed
+  uint64_t last_pressure_permille;  // Pressure level at last poll
+};
+
+// Reads TCMALLOC_CGROUP_PATH and TCMALLOC_CGROUP_POLL_MS. Called
+// once from Static::InitStaticVars.
+void InitCgroupPressureMonitor();
+
+void SetCgroupPollIntervalMs(uint64_t interval_ms);
+uint64_t GetCgroupPollIntervalMs();
+
+CgroupPressureStats GetCgroupPressureStats();
+
+// Reads cgroup files and releases memory if it's time to. Called
+// from background actions thread only.
+// REQUIRES: no tcmalloc locks are held.
+void PollCgroupPressure();
+
+extern std::atomic<bool> cgroup_pressure_monitor_enabled;
+
+inline void MaybePollCgroupPressure() {
+  if (cgroup_pressure_monitor_enabled.load(std::memory_order_relaxed)) {
+    PollCgroupPressure();
+  }
+}
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_CGROUP_PRESSURE_H_
@@ -54,6 +54,14 @@ static int32_t FLAGS_tcmalloc_transfer_num_objects;
 
 static constexpr int32_t kDefaultTransferNumObjecs = 32;
 
+// Largest object size to serve from size classes.  Read from the
+// environment in SizeMap::Init for the same reason as above.
+static size_t MaxCachedObjectBytes() {
+  const char* envval = TCMallocGetenvSafe("TCMALLOC_MAX_CACHED_OBJECT_BYTES");
+  int64_t val = tcmalloc::commandlineflags::StringToLongLong(envval, kMaxSize);
+  return std::min<size_t>(std::max<int64_t>(val, kMaxSize), kMaxSizeLimit);
+}
+
 // The init function is provided to explicit initialize the variable value
 // from the env. var to avoid C++ global construction that might defer its
 // initialization after a malloc/new call.
@@ -82,9 +90,12 @@ static inline int LgFloor(size_t n) {
 
 static int AlignmentForSize(size_t size) {
   int alignment = kAlignment;
-  if (size > kMaxSize) {
-    // Cap alignment at kPageSize for large sizes.
-    alignment = kPageSize;
+  if (size >= kMaxSize) {
+    // Extended size classes (see TCMALLOC_MAX_CACHED_OBJECT_BYTES)
+    // keep 12.5% spacing but are always whole pages.  Starting this
+    // at kMaxSize itself keeps every extended size a multiple of
+    // kMaxSize/8, which SizeMap::ExtendedSizeClass relies on.
+    return std::max<size_t>(kPageSize, (1 << LgFloor(size)) / 8);
   } else if (size >= 128) {
     // Space wasted due to alignment is at most 1/8, i.e., 12.5%.
     alignment = (1 << LgFloor(size)) / 8;
@@ -104,6 +115,11 @@ static int AlignmentForSize(size_t size) {
 
 int SizeMap::NumMoveSize(size_t size) {
   if (size == 0) return 0;
+  // Extended size classes (see TCMALLOC_MAX_CACHED_OBJECT_BYTES) move
+  // one object at a time.  Even that is up to 4 MiB, and a transfer
+  // cache entry or thread cache batch of several would be a lot of
+  // memory sitting idle.
+  if (size > kMaxSize) return 1;
   // Use approx 64k transfers between thread and central caches.
   int num = static_cast<int>(64.0 * 1024.0 / size);
   if (num < 2) num = 2;
@@ -151,15 +167,17 @@ void SizeMap::Init() {
   if (ClassIndex(0) != 0) {
     Log(kCrash, __FILE__, __LINE__, "Invalid class index for size 0", ClassIndex(0));
   }
-  if (ClassIndex(kMaxSize) >= sizeof(class_array_)) {
-    Log(kCrash, __FILE__, __LINE__, "Invalid class index for kMaxSize", ClassIndex(kMaxSize));
+  if (ClassIndex(kMaxSizeLimit) >= sizeof(class_array_)) {
+    Log(kCrash, __FILE__, __LINE__, "Invalid class index for kMaxSizeLimit", ClassIndex(kMaxSizeLimit));
   }
 
+  const size_t wanted_max_size = MaxCachedObjectBytes();
+
   // Compute the size classes we want to use
   int sc = 1;  // Next size class to assign
   int alignment = kAlignment;
   CHECK_CONDITION(kAlignment <= kMinAlign);
-  for (size_t size = kAlignment; size <= kMaxSize; size += alignment) {
+  for (size_t size = kAlignment; size <= wanted_max_size; size += alignment) {
     alignment = AlignmentForSize(size);
     CHECK_CONDITION((size % alignment) == 0);
 
@@ -190,6 +208,13 @@ void SizeMap::Init() {
       }
     }
 
+    if (size > kMaxSize && sc >= kClassSizesMax) {
+      // Extended classes are optional. With small pages there may be
+      // no room for all of them, so we stop at what fits.
+      Log(kLog, __FILE__, __LINE__, "Out of size classes, capping max cached object size at", class_to_size_[sc - 1]);
+      break;
+    }
+
     // Add new class
     class_to_pages_[sc] = my_pages;
     class_to_size_[sc] = size;
@@ -199,6 +224,8 @@ void SizeMap::Init() {
   if (sc > kClassSizesMax) {
     Log(kCrash, __FILE__, __LINE__, "too many size classes: (found vs. max)", sc, kClassSizesMax);
   }
+  max_size_ = class_to_size_[sc - 1];
+  CHECK_CONDITION(max_size_ >= kMaxSize);
 
   // Initialize the mapping arrays
   int next_size = 0;
@@ -211,7 +238,7 @@ void SizeMap::Init() {
   }
 
   // Double-check sizes just to be safe
-  for (size_t size = 0; size <= kMaxSize;) {
+  for (size_t size = 0; size <= max_size_;) {
     const int sc = SizeClass(size);
     if (sc <= 0 || sc >= num_size_classes) {
       Log(kCrash, __FILE__, __LINE__, "Bad size class (class, size)", sc, size);
@@ -225,8 +252,10 @@ void SizeMap::Init() {
     }
     if (size <= kMaxSmallSize) {
       size += 8;
-    } else {
+    } else if (size < kMaxSize) {
       size += 128;
+    } else {
+      size += kPageSize;
     }
   }
 
@@ -249,6 +278,23 @@ void SizeMap::Init() {
   for (size_t cl = 1; cl < num_size_classes; ++cl) {
     num_objects_to_move_[cl] = NumMoveSize(ByteSizeForClass(cl));
   }
+
+  // Compute cache coloring parameters.  Step is at least a cache line
+  // (shifting by less would still hit the same line), and a multiple
+  // of object alignment.
+  const bool coloring = tcmalloc::commandlineflags::StringToBool(TCMallocGetenvSafe("TCMALLOC_CACHE_COLORING"), true);
+  for (size_t cl = 0; cl < num_size_classes; ++cl) {
+    class_to_color_step_[cl] = 0;
+    class_to_colors_[cl] = 1;
+    const size_t size = class_to_size_[cl];
+    if (!coloring || size == 0) {
+      continue;
+    }
+    const size_t step = std::max<size_t>(kCacheColorStep, size & -size);
+    const size_t slack = (class_to_pages_[cl] << kPageShift) % size;
+    class_to_color_step_[cl] = step;
+    class_to_colors_[cl] = slack / step + 1;
+  }
 }
 
 // Metadata allocator -- keeps stats about how many bytes allocated.
@@ -85,7 +85,14 @@ static const size_t kMaxThreadCacheSize = 4 << 20;
 
 static const size_t kPageSize = 1 << kPageShift;
 static const size_t kMaxSize = 256 * 1024;
+// Upper bound for the largest size class.  By default objects up to
+// kMaxSize are served from size classes, but this can be raised at
+// startup (see TCMALLOC_MAX_CACHED_OBJECT_BYTES) up to kMaxSizeLimit.
+static const size_t kMaxSizeLimit = 4 << 20;
 static const size_t kAlignment = 8;
+// Granularity of cache coloring of small object spans (see
+// SizeMap::ColorOffset).  Typical cache line size.
+static const size_t kCacheColorStep = 64;
 // For all span-lengths <= kMaxPages we keep an exact-size list in PageHeap.
 static const size_t kMaxPages = 1 << (20 - kPageShift);
 
@@ -174,24 +181,40 @@ class SizeMap {
   //   1025       (1025 + 127 + (120<<7)) / 128   129
   //   ...
   //   32768      (32768 + 127 + (120<<7)) / 128  376
+  //
+  // When max_size_ is raised above kMaxSize, sizes above kMaxSize are
+  // spaced at least kMaxSize/8 apart (see AlignmentForSize), so a
+  // third logical array indexed by ceil((size - kMaxSize) / 32k) is
+  // appended after the index of kMaxSize.
   static const int kMaxSmallSize = 1024;
-  static const size_t kClassArraySize = ((kMaxSize + 127 + (120 << 7)) >> 7) + 1;
+  static const int kExtendedSizeShift = 15;
+  static const size_t kMaxSizeIndex = (kMaxSize + 127 + (120 << 7)) >> 7;
+  static const size_t kClassArraySize = kMaxSizeIndex + ((kMaxSizeLimit - kMaxSize) >> kExtendedSizeShift) + 1;
   unsigned char class_array_[kClassArraySize];
 
+  static_assert((kMaxSize >> 3) == (size_t{1} << kExtendedSizeShift), "extended size classes are kMaxSize/8 apart");
+
   static inline size_t SmallSizeClass(size_t s) { return (static_cast<uint32_t>(s) + 7) >> 3; }
 
   static inline size_t LargeSizeClass(size_t s) { return (static_cast<uint32_t>(s) + 127 + (120 << 7)) >> 7; }
 
-  // If size is no more than kMaxSize, compute index of the
+  static inline size_t ExtendedSizeClass(size_t s) {
+    return kMaxSizeIndex + ((static_cast<uint32_t>(s - kMaxSize) + (1 << kExtendedSizeShift) - 1) >> kExtendedSizeShift);
+  }
+
+  // If size is no more than max_size_, compute index of the
   // class_array[] entry for it, putting the class index in output
   // parameter idx and returning true. Otherwise return false.
-  static ALWAYS_INLINE bool ClassIndexMaybe(size_t s, uint32_t* idx) {
+  ALWAYS_INLINE bool ClassIndexMaybe(size_t s, uint32_t* idx) {
     if (PREDICT_TRUE(s <= kMaxSmallSize)) {
       *idx = (static_cast<uint32_t>(s) + 7) >> 3;
       return true;
     } else if (s <= kMaxSize) {
       *idx = (static_cast<uint32_t>(s) + 127 + (120 << 7)) >> 7;
       return true;
+    } else if (s <= max_size_) {
+      *idx = ExtendedSizeClass(s);
+      return true;
     }
     return false;
   }
@@ -200,14 +223,21 @@ class SizeMap {
   static inline size_t ClassIndex(size_t s) {
     // Use unsigned arithmetic to avoid unnecessary sign extensions.
     ASSERT(0 <= s);
-    ASSERT(s <= kMaxSize);
+    ASSERT(s <= kMaxSizeLimit);
     if (PREDICT_TRUE(s <= kMaxSmallSize)) {
       return SmallSizeClass(s);
-    } else {
+    } else if (s <= kMaxSize) {
       return LargeSizeClass(s);
+    } else {
+      return ExtendedSizeClass(s);
     }
   }
 
+  // Largest size served by size classes.  kMaxSize unless raised via
+  // TCMALLOC_MAX_CACHED_OBJECT_BYTES, and always equal to the size of
+  // the largest size class.
+  size_t max_size_;
+
   // Number of objects to move between a per-thread list and a central
   // list in one shot.  We want this to be not too small so we can
   // amortize the lock overhead for accessing the central list.  Making
@@ -225,6 +255,12 @@ class SizeMap {
 
   size_t min_span_size_in_pages_;
 
+  // Cache coloring parameters: first object of a span is placed at
+  // color * class_to_color_step_[cl] bytes from span start, where
+  // color is in [0, class_to_colors_[cl]).  See ColorOffset().
+  uint32_t class_to_color_step_[kClassSizesMax];
+  uint32_t class_to_colors_[kClassSizesMax];
+
  public:
   size_t num_size_classes;
 
@@ -265,9 +301,28 @@ class SizeMap {
   // per-thread free list until the scavenger cleans up the list.
   int num_objects_to_move(uint32_t cl) { return num_objects_to_move_[cl]; }
 
+  // Returns byte offset of the first object in span of class cl that
+  // starts at page 'start'.  When objects don't fill span exactly, we
+  // shift them into the leftover space at the end of the span by a
+  // different amount for different spans ("cache coloring"), so that
+  // first objects of all spans don't compete for same cache sets.
+  // Offsets are multiples of largest power of two dividing object
+  // size, so alignment of objects is not affected.
+  size_t ColorOffset(uint32_t cl, PageID start) {
+    const uint32_t colors = class_to_colors_[cl];
+    if (colors <= 1) {
+      return 0;
+    }
+    return ((start / class_to_pages_[cl]) % colors) * class_to_color_step_[cl];
+  }
+
   // Smallest Span size in bytes (max of system's page size and
   // kPageSize).
   Length min_span_size_in_pages() { return min_span_size_in_pages_; }
+
+  // Largest object size that is served by size classes (and thus
+  // thread caches).  Larger objects are allocated from the page heap.
+  size_t max_size() { return max_size_; }
 };
 
 // Allocates "bytes" worth of memory and returns it.  Increments
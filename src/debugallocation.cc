@@ -1530,3 +1530,76 @@ extern "C" PERFTOOLS_DLL_DECL void* tc_malloc_skip_new_handler(size_t size) PERF
   tcmalloc::InvokeNewHook(result, size);
   return result;
 }
+
+// Debug allocations all come from page heap, so there is nothing to
+// segregate.
+extern "C" PERFTOOLS_DLL_DECL void* tc_malloc_hinted(size_t size, int hint) PERFTOOLS_NOTHROW {
+  void* ptr = do_debug_malloc_or_debug_cpp_alloc(size);
+  tcmalloc::InvokeNewHook(ptr, size);
+  return ptr;
+}
+
+// Debug versions of mallocx family. Cold and thread cache bypassing
+// flags are no-ops here for the same reason as above, and blocks
+// never change size in place.
+extern "C" PERFTOOLS_DLL_DECL void* tc_mallocx(size_t size, int flags) {
+  const int lg_align = flags & 0x3f;
+  void* ptr;
+  if (lg_align != 0) {
+    ptr = do_debug_memalign_or_debug_cpp_memalign(size_t{1} << lg_align, size, MallocBlock::kMallocType, false, true);
+  } else {
+    ptr = do_debug_malloc_or_debug_cpp_alloc(size);
+  }
+  if (ptr != nullptr && (flags & MALLOCX_ZERO)) memset(ptr, 0, tc_malloc_size(ptr));
+  tcmalloc::InvokeNewHook(ptr, size);
+  return ptr;
+}
+
+extern "C" PERFTOOLS_DLL_DECL void* tc_rallocx(void* ptr, size_t size, int flags) {
+  if (ptr == nullptr) {
+    return tc_mallocx(size, flags);
+  }
+  if (PREDICT_FALSE(tcmalloc::IsEmergencyPtr(ptr))) {
+    if ((flags & 0x3f) == 0 && !(flags & MALLOCX_ZERO)) {
+      return tcmalloc::EmergencyRealloc(ptr, size);
+    }
+    void* new_ptr = tc_mallocx(size, flags);
+    if (new_ptr == nullptr) return nullptr;
+    memcpy(new_ptr, ptr, std::min(tcmalloc::EmergencyAllocatedSize(ptr), size));
+    tcmalloc::EmergencyFree(ptr);
+    return new_ptr;
+  }
+
+  MallocBlock* old = MallocBlock::FromRawPointer(ptr);
+  old->Check(MallocBlock::kMallocType);
+  size_t old_size = old->actual_data_size(ptr);
+
+  void* new_ptr = tc_mallocx(size, flags & ~MALLOCX_ZERO);
+  if (new_ptr == nullptr) return nullptr;
+
+  memcpy(new_ptr, ptr, std::min(old_size, size));
+  size_t new_size = tc_malloc_size(new_ptr);
+  if ((flags & MALLOCX_ZERO) && new_size > old_size) {
+    memset(static_cast<char*>(new_ptr) + old_size, 0, new_size - old_size);
+  }
+  tc_free(ptr);
+  return new_ptr;
+}
+
+extern "C" PERFTOOLS_DLL_DECL size_t tc_xallocx(void* ptr, size_t size, size_t extra, int flags) {
+  return tc_malloc_size(ptr);
+}
+
+extern "C" PERFTOOLS_DLL_DECL size_t tc_sallocx(const void* ptr, int flags) {
+  return tc_malloc_size(const_cast<void*>(ptr));
+}
+
+extern "C" PERFTOOLS_DLL_DECL void tc_dallocx(void* ptr, int flags) { tc_free(ptr); }
+
+extern "C" PERFTOOLS_DLL_DECL void tc_sdallocx(void* ptr, size_t size, int flags) {
+  if (flags == 0) {
+    tc_free_sized(ptr, size);
+  } else {
+    tc_free(ptr);
+  }
+}
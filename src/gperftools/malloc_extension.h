@@ -222,6 +222,51 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   //        virtual memory usage, and depending on the OS, typically
   //        do not count towards physical memory usage.  This property
   //        is not writable.
+  //
+  // "tcmalloc.soft_heap_limit_mb"
+  //      Soft limit on committed page heap memory in MiB, 0 means no
+  //      limit.  See SetSoftHeapLimitCallback below.
+  //
+  // "tcmalloc.soft_limit_pageheap_reclaims"
+  // "tcmalloc.soft_limit_thread_cache_reclaims"
+  // "tcmalloc.soft_limit_transfer_cache_reclaims"
+  // "tcmalloc.soft_limit_callback_reclaims"
+  //      Number of times each stage of soft limit reclaim ran.  These
+  //      properties are not writable.
+  //
+  // "tcmalloc.min_free_mb"
+  //      Amount of free committed page heap memory in MiB that
+  //      ProcessBackgroundActions keeps around.  See below.
+  //
+  // "tcmalloc.background_interval_ms"
+  //      How often ProcessBackgroundActions does its work.
+  //
+  // "tcmalloc.cgroup_poll_interval_ms"
+  //      How often cgroup v2 memory pressure monitor (enabled by
+  //      TCMALLOC_CGROUP_PATH) reads cgroup files.
+  //
+  // "tcmalloc.cgroup_polls"
+  // "tcmalloc.cgroup_pressure_permille"
+  // "tcmalloc.cgroup_pressure_events"
+  // "tcmalloc.cgroup_released_bytes"
+  // "tcmalloc.cgroup_thread_cache_trims"
+  //      Statistics of cgroup memory pressure monitor: number of
+  //      polls, pressure level seen by the last poll (0..1000), number
+  //      of polls that saw pressure, bytes released to the system and
+  //      number of times thread caches were trimmed because of
+  //      pressure.  These properties are not writable.
+  //
+  // "tcmalloc.heap_reservation_bytes"
+  // "tcmalloc.heap_reservation_used_bytes"
+  //      Size of the address range reserved for the heap up front
+  //      (see TCMALLOC_HEAP_RESERVE_MB) and number of bytes of it
+  //      that were handed out to the page heap.  Both are 0 when
+  //      there is no reservation.  These properties are not writable.
+  //
+  // "tcmalloc.stack_cache_bytes"
+  //      Number of bytes in stacks (see AllocateStack) that were freed
+  //      and are cached for reuse, including their guard pages.  This
+  //      property is not writable.
   // -------------------------------------------------------------------
 
   // Get the named "property"'s value.  Returns true if the property
@@ -413,6 +458,69 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   // Note, as of gperftools 3.11 it is identical to
   // MarkThreadIdle. See github issue #880
   virtual void MarkThreadTemporarilyIdle();
+
+  // When committed page heap memory goes over the soft heap limit
+  // ("tcmalloc.soft_heap_limit_mb" property), tcmalloc reclaims
+  // memory in stages of increasing cost: free page heap memory, then
+  // thread caches, then transfer caches, releasing memory to the
+  // system after each stage.  If that isn't enough, the callback set
+  // here is called with the number of bytes we're still over the
+  // limit, so that the application may drop some of its own caches.
+  // Reclaim runs on the thread running ProcessBackgroundActions, or
+  // otherwise at the end of an allocation call that found the heap
+  // over the limit, after the allocation itself is done.  Either way
+  // the callback may allocate and free memory.  Pass nullptr to
+  // remove the callback.
+  typedef void(SoftHeapLimitCallback)(size_t bytes_over_limit);
+  virtual void SetSoftHeapLimitCallback(SoftHeapLimitCallback* callback);
+
+  // Takes "bytes" of memory from the system into the page heap and
+  // faults it in, so that following allocations neither map memory
+  // nor page fault.  With use_hugepages the memory is aligned to and
+  // advised as transparent huge pages.  Returns number of bytes
+  // added.  TCMALLOC_PREFAULT_MB environment variable does the same
+  // at startup.
+  virtual size_t PrefaultHeap(size_t bytes, bool use_hugepages);
+
+  // Runs malloc's background work, which for tcmalloc is keeping
+  // "tcmalloc.min_free_mb" of free committed memory in the page heap,
+  // so that application threads don't have to grow the heap, and
+  // reclaiming memory over the soft heap limit.  It wakes up every
+  // "tcmalloc.background_interval_ms" milliseconds (default 1000)
+  // and doesn't return until StopBackgroundActions is called, so it
+  // should be called from a dedicated thread.  Default
+  // implementation returns immediately.
+  virtual void ProcessBackgroundActions();
+
+  // Makes all running ProcessBackgroundActions calls return soon.
+  // If none is running, the next call returns right away.
+  virtual void StopBackgroundActions();
+
+  // Budgeted ReleaseToSystem(), meant for periodic housekeeping that
+  // must not stall the allocator.  Releases free memory until at
+  // least num_bytes are released or the page heap lock has been held
+  // for max_lock_usec microseconds (0 means no time budget).  Each
+  // call resumes where the previous one stopped, so repeated calls
+  // walk the whole heap.  Returns the number of bytes released and,
+  // if lock_held_usec is not nullptr, sets it to how long the lock
+  // was held.  (Currently only implemented in tcmalloc.)
+  virtual size_t ReleaseToSystemWithBudget(size_t num_bytes, size_t max_lock_usec, size_t* lock_held_usec);
+
+  // Allocates a stack for a coroutine or fiber: at least size usable
+  // bytes, with at least guard_size bytes of inaccessible guard pages
+  // right below them.  Returns the lowest usable address (so the
+  // stack grows down from address + size), or nullptr if out of
+  // memory.  Unlike memalign plus mprotect, freed stacks are cached
+  // with their guard pages in place, so reusing one costs no system
+  // calls.  (Currently only implemented in tcmalloc.)
+  virtual void* AllocateStack(size_t size, size_t guard_size);
+
+  // Returns stack obtained from AllocateStack().  If release_bytes
+  // is non-zero, about that many bytes at the top of the stack
+  // (i.e. its used part) are given back to the system before the
+  // stack is cached.  Don't pass stacks to free() or the other way
+  // around.
+  virtual void FreeStack(void* stack, size_t release_bytes);
 };
 
 namespace base {
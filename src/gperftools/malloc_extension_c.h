@@ -77,12 +77,20 @@ PERFTOOLS_DLL_DECL void MallocExtension_MarkThreadIdle(void);
 PERFTOOLS_DLL_DECL void MallocExtension_MarkThreadBusy(void);
 PERFTOOLS_DLL_DECL void MallocExtension_ReleaseToSystem(size_t num_bytes);
 PERFTOOLS_DLL_DECL void MallocExtension_ReleaseFreeMemory(void);
+PERFTOOLS_DLL_DECL size_t MallocExtension_ReleaseToSystemWithBudget(size_t num_bytes, size_t max_lock_usec,
+                                                                    size_t* lock_held_usec);
+PERFTOOLS_DLL_DECL void* MallocExtension_AllocateStack(size_t size, size_t guard_size);
+PERFTOOLS_DLL_DECL void MallocExtension_FreeStack(void* stack, size_t release_bytes);
 PERFTOOLS_DLL_DECL void MallocExtension_SetMemoryReleaseRate(double rate);
 PERFTOOLS_DLL_DECL double MallocExtension_GetMemoryReleaseRate(void);
 PERFTOOLS_DLL_DECL size_t MallocExtension_GetEstimatedAllocatedSize(size_t size);
 PERFTOOLS_DLL_DECL size_t MallocExtension_GetAllocatedSize(const void* p);
 PERFTOOLS_DLL_DECL size_t MallocExtension_GetThreadCacheSize(void);
 PERFTOOLS_DLL_DECL void MallocExtension_MarkThreadTemporarilyIdle(void);
+PERFTOOLS_DLL_DECL void MallocExtension_SetSoftHeapLimitCallback(void (*callback)(size_t bytes_over_limit));
+PERFTOOLS_DLL_DECL size_t MallocExtension_PrefaultHeap(size_t bytes, int use_hugepages);
+PERFTOOLS_DLL_DECL void MallocExtension_ProcessBackgroundActions(void);
+PERFTOOLS_DLL_DECL void MallocExtension_StopBackgroundActions(void);
 
 /*
  * NOTE: These enum values MUST be kept in sync with the version in
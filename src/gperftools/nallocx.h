@@ -15,6 +15,10 @@ extern "C" {
 #endif
 
 #define MALLOCX_LG_ALIGN(la) ((int)(la))
+#define MALLOCX_ZERO ((int)0x40)
+/* gperftools extension: same as tc_malloc_hinted(size, TC_MALLOC_HINT_COLD) */
+#define MALLOCX_COLD ((int)0x80)
+#define MALLOCX_TCACHE_NONE ((int)0x100)
 
 /*
  * The nallocx function allocates no memory, but it performs the same size
@@ -23,13 +27,54 @@ extern "C" {
  * nallocx is a malloc extension originally implemented by jemalloc:
  * http://www.unix.com/man-page/freebsd/3/nallocx/
  *
- * Note, we only support MALLOCX_LG_ALIGN flag and nothing else.
+ * Note, only MALLOCX_LG_ALIGN flag affects result of nallocx. Other
+ * flags are ignored.
  */
 PERFTOOLS_DLL_DECL size_t nallocx(size_t size, int flags);
 
 /* same as above but never weak */
 PERFTOOLS_DLL_DECL size_t tc_nallocx(size_t size, int flags);
 
+/*
+ * The rest of jemalloc's "non-standard API" family. Supported flags
+ * are MALLOCX_LG_ALIGN, MALLOCX_ZERO, MALLOCX_COLD and
+ * MALLOCX_TCACHE_NONE. Other jemalloc flags (arenas, explicit
+ * tcaches) are not supported and must not be passed.
+ *
+ * mallocx returns at least size bytes of memory (size must not be
+ * 0). MALLOCX_ZERO zero-fills entire usable size of the result.
+ *
+ * rallocx resizes ptr to at least size bytes, moving it if needed,
+ * and returns NULL (leaving ptr intact) on failure. Large
+ * (page-level) allocations are grown and shrunk in place when
+ * possible.
+ *
+ * xallocx resizes ptr in place to at least size bytes and at most
+ * size + extra bytes if possible, and never moves it. It returns
+ * resulting usable size, which is less than size if ptr couldn't be
+ * grown. Only large (page-level) allocations can change their size.
+ *
+ * sallocx returns usable size of ptr.
+ *
+ * dallocx frees ptr. sdallocx is same but takes size hint, which must
+ * be the size passed to mallocx/rallocx/xallocx or any value between
+ * it and usable size, together with same alignment flag.
+ */
+PERFTOOLS_DLL_DECL void* mallocx(size_t size, int flags);
+PERFTOOLS_DLL_DECL void* rallocx(void* ptr, size_t size, int flags);
+PERFTOOLS_DLL_DECL size_t xallocx(void* ptr, size_t size, size_t extra, int flags);
+PERFTOOLS_DLL_DECL size_t sallocx(const void* ptr, int flags);
+PERFTOOLS_DLL_DECL void dallocx(void* ptr, int flags);
+PERFTOOLS_DLL_DECL void sdallocx(void* ptr, size_t size, int flags);
+
+/* same as above but never weak */
+PERFTOOLS_DLL_DECL void* tc_mallocx(size_t size, int flags);
+PERFTOOLS_DLL_DECL void* tc_rallocx(void* ptr, size_t size, int flags);
+PERFTOOLS_DLL_DECL size_t tc_xallocx(void* ptr, size_t size, size_t extra, int flags);
+PERFTOOLS_DLL_DECL size_t tc_sallocx(const void* ptr, int flags);
+PERFTOOLS_DLL_DECL void tc_dallocx(void* ptr, int flags);
+PERFTOOLS_DLL_DECL void tc_sdallocx(void* ptr, size_t size, int flags);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
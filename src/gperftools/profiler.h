@@ -147,7 +147,8 @@ PERFTOOLS_DLL_DECL void ProfilerDisable(void);
 /* Returns nonzero if profile is currently enabled, zero if it's not. */
 PERFTOOLS_DLL_DECL int ProfilingIsEnabledForAllThreads(void);
 
-/* Routine for registering new threads with the profiler.
+/* Routine for registering new threads with the profiler.  Calling it
+ * more than once in the same thread has no effect.
  */
 PERFTOOLS_DLL_DECL void ProfilerRegisterThread(void);
 
@@ -160,6 +161,50 @@ struct ProfilerState {
 };
 PERFTOOLS_DLL_DECL void ProfilerGetCurrentState(struct ProfilerState* state);
 
+/* Returns number of samples lost since profiling was started (0 if
+ * it's not enabled). Samples are "dropped" when the signal handler
+ * finds all sample buffers busy, and "write dropped" when the
+ * profile writer thread falls so far behind that an evicted entry
+ * can't be queued for writing. Either pointer may be nullptr.
+ */
+PERFTOOLS_DLL_DECL void ProfilerGetDroppedSamples(int* samples_dropped, int* samples_write_dropped);
+
+/* Label attached to cpu profile samples, e.g. {"tenant", "acme"}, so
+ * that one profile can be split by tenant, request type and so on.
+ * Samples with the same stack but different labels are counted
+ * separately. Labels are only written in profile.proto formats (see
+ * CPUPROFILE_FORMAT). In legacy format they are ignored, which
+ * ProfilerStop logs once.
+ *
+ * The profiler refers to labels by address. So the label and its
+ * strings must not change or go away while profiling, and the same
+ * label should always be passed as the same object (e.g. keep labels
+ * in static storage or intern them).
+ */
+struct ProfilerLabel {
+  const char* key;
+  const char* value;
+};
+
+/* Sets label of samples taken in the calling thread, replacing its
+ * previous label. nullptr removes the label. This only stores a
+ * thread-local pointer, so it is cheap enough to call per request.
+ */
+PERFTOOLS_DLL_DECL void ProfilerSetLabel(const struct ProfilerLabel* label);
+
+/* Returns label of the calling thread, or nullptr. */
+PERFTOOLS_DLL_DECL const struct ProfilerLabel* ProfilerGetLabel(void);
+
+/* Like ProfilerSetLabel, but returns the previous label. Pass it to
+ * ProfilerPopLabel to restore it when the labeled work is done:
+ *
+ *   const struct ProfilerLabel* prev = ProfilerPushLabel(&kRpcLabel);
+ *   ...
+ *   ProfilerPopLabel(prev);
+ */
+PERFTOOLS_DLL_DECL const struct ProfilerLabel* ProfilerPushLabel(const struct ProfilerLabel* label);
+PERFTOOLS_DLL_DECL void ProfilerPopLabel(const struct ProfilerLabel* previous);
+
 /* Returns the current stack trace, to be called from a SIGPROF handler. */
 PERFTOOLS_DLL_DECL int ProfilerGetStackTrace(void** result, int max_depth, int skip_count, const void* uc);
 
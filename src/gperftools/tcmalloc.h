@@ -108,6 +108,21 @@ PERFTOOLS_DLL_DECL const char* tc_version(int* major, int* minor, const char** p
 
 PERFTOOLS_DLL_DECL void* tc_malloc(size_t size) PERFTOOLS_NOTHROW;
 PERFTOOLS_DLL_DECL void* tc_malloc_skip_new_handler(size_t size) PERFTOOLS_NOTHROW;
+
+/*
+ * Same as tc_malloc, but with a hint on how the object is going to
+ * be used.  TC_MALLOC_HINT_COLD is for rarely touched (e.g. long
+ * lived bookkeeping) objects.  Those are carved from separate spans,
+ * so they don't take cache lines and TLB entries away from hot
+ * objects of the same size.  Cold allocations bypass the thread
+ * cache, so they're slower.  Memory is freed as usual, but sized
+ * frees (tc_free_sized, sized delete) skip the span lookup, so
+ * objects freed that way may be reused for ordinary allocations
+ * before they get back to their cold span.
+ */
+#define TC_MALLOC_HINT_NONE 0
+#define TC_MALLOC_HINT_COLD 1
+PERFTOOLS_DLL_DECL void* tc_malloc_hinted(size_t size, int hint) PERFTOOLS_NOTHROW;
 PERFTOOLS_DLL_DECL void tc_free(void* ptr) PERFTOOLS_NOTHROW;
 
 // Versions of C23 sized free stuff
@@ -50,6 +50,7 @@
 #include <poll.h>
 #endif
 #include <stdarg.h>
+#include <time.h>
 
 #include <algorithm>  // for sort(), equal(), and copy()
 #include <string>
@@ -59,6 +60,7 @@
 #include "base/commandlineflags.h"
 #include "base/logging.h"
 #include "base/proc_maps_iterator.h"
+#include "profile-proto.h"
 
 //----------------------------------------------------------------------
 
@@ -244,6 +246,32 @@ void HeapProfileTable::SaveProfile(tcmalloc::GenericWriter* writer) const {
   tcmalloc::SaveProcSelfMaps(writer);
 }
 
+void HeapProfileTable::SaveProfileProto(tcmalloc::GenericWriter* writer) const {
+  // Same sample types pprof gives to converted legacy heap profiles.
+  // Last one is the default.
+  static const tcmalloc::ProfileProtoWriter::ValueType kSampleTypes[] = {
+      {"alloc_objects", "count"},
+      {"alloc_space", "bytes"},
+      {"inuse_objects", "count"},
+      {"inuse_space", "bytes"},
+  };
+  static const tcmalloc::ProfileProtoWriter::ValueType kPeriodType = {"space", "bytes"};
+
+  tcmalloc::ProfileProtoWriter proto(writer, alloc_, dealloc_);
+  // Every allocation is recorded, so there is no sampling period to
+  // scale by.
+  proto.WriteHeader(kSampleTypes, arraysize(kSampleTypes), kPeriodType, 1, time(nullptr) * int64_t{1000000000});
+
+  for (int i = 0; i < kHashTableSize; i++) {
+    for (Bucket* b = bucket_table_[i]; b != nullptr; b = b->next) {
+      int64_t values[] = {b->allocs, b->alloc_size, b->allocs - b->frees, b->alloc_size - b->free_size};
+      proto.AddSample(values, arraysize(values), b->stack, b->depth, false);
+    }
+  }
+
+  proto.Finish(0);
+}
+
 bool HeapProfileTable::WriteProfile(const char* file_name, const Bucket& total, AllocationMap* allocations) {
   RAW_VLOG(1, "Dumping non-live heap profile to %s", file_name);
   RawFD fd = RawOpenForWriting(file_name);
@@ -130,6 +130,9 @@ class HeapProfileTable {
 
   void SaveProfile(tcmalloc::GenericWriter* write) const;
 
+  // Same as SaveProfile, but writes pprof's profile.proto format.
+  void SaveProfileProto(tcmalloc::GenericWriter* writer) const;
+
   // Cleanup any old profile files matching prefix + ".*" + kFileExt.
   static void CleanupOldProfiles(const char* prefix);
 
@@ -64,6 +64,7 @@
 #include "base/sysinfo.h"  // for GetUniquePathFromEnv()
 #include "heap-profile-table.h"
 #include "malloc_backtrace.h"
+#include "profile-proto.h"
 
 #ifndef PATH_MAX
 #ifdef MAXPATHLEN
@@ -99,6 +100,9 @@ DEFINE_int64(heap_profile_inuse_interval, EnvToInt64("HEAP_PROFILE_INUSE_INTERVA
 DEFINE_int64(heap_profile_time_interval, EnvToInt64("HEAP_PROFILE_TIME_INTERVAL", 0),
              "If non-zero, dump heap profiling information once every "
              "specified number of seconds since the last dump.");
+DEFINE_string(heap_profile_format, EnvToString("HEAPPROFILE_FORMAT", ""),
+              "Format of dumped heap profiles: legacy (default), proto "
+              "(pprof's profile.proto) or proto.gz (same in gzip container).");
 
 //----------------------------------------------------------------------
 // Locking
@@ -191,14 +195,26 @@ static void DumpProfileLocked(const char* reason) {
     return;
   }
 
-  using FileWriter = tcmalloc::RawFDGenericWriter<1 << 20>;
-  FileWriter* writer = new (ProfilerMalloc(sizeof(FileWriter))) FileWriter(fd);
+  tcmalloc::ProfileFormat format = tcmalloc::ParseProfileFormat(FLAGS_heap_profile_format.c_str());
+  if (format == tcmalloc::kLegacyProfileFormat) {
+    using FileWriter = tcmalloc::RawFDGenericWriter<1 << 20>;
+    FileWriter* writer = new (ProfilerMalloc(sizeof(FileWriter))) FileWriter(fd);
 
-  DoDumpHeapProfileLocked(writer);
+    DoDumpHeapProfileLocked(writer);
+
+    // Note: as part of running destructor, it saves whatever stuff we left buffered in the writer
+    writer->~FileWriter();
+    ProfilerFree(writer);
+  } else {
+    using ProtoWriter = tcmalloc::ProfileFileWriter;
+    ProtoWriter* writer =
+        new (ProfilerMalloc(sizeof(ProtoWriter))) ProtoWriter(fd, format == tcmalloc::kProtoGzipProfileFormat);
 
-  // Note: as part of running destructor, it saves whatever stuff we left buffered in the writer
-  writer->~FileWriter();
-  ProfilerFree(writer);
+    heap_profile->SaveProfileProto(writer);
+
+    writer->~ProtoWriter();
+    ProfilerFree(writer);
+  }
 
   RawClose(fd);
 
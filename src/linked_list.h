@@ -39,6 +39,8 @@
 
 #include <stddef.h>
 
+#include <atomic>
+
 namespace tcmalloc {
 
 inline void* SLL_Next(void* t) { return *(reinterpret_cast<void**>(t)); }
@@ -46,9 +48,15 @@ inline void* SLL_Next(void* t) { return *(reinterpret_cast<void**>(t)); }
 inline void SLL_SetNext(void* t, void* n) { *(reinterpret_cast<void**>(t)) = n; }
 
 inline void SLL_Push(void** list, void* element) {
-  void* next = *list;
+  // Link element before publishing it, so that list is consistent at
+  // every point.  Forked child relies on that when it reclaims caches
+  // of threads that were stopped in the middle of this.  The fence
+  // only keeps compiler from reordering (or merging) the stores;
+  // the thread that does them is the one that stops, so no cpu
+  // ordering is needed.
+  SLL_SetNext(element, *list);
+  std::atomic_signal_fence(std::memory_order_release);
   *list = element;
-  SLL_SetNext(element, next);
 }
 
 inline void* SLL_Pop(void** list) {
@@ -93,7 +101,9 @@ inline void SLL_PopRange(void** head, int N, void** start, void** end) {
 
 inline void SLL_PushRange(void** head, void* start, void* end) {
   if (!start) return;
+  // Same as SLL_Push.
   SLL_SetNext(end, *head);
+  std::atomic_signal_fence(std::memory_order_release);
   *head = start;
 }
 
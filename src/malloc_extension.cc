@@ -109,6 +109,23 @@ void MallocExtension::ReleaseFreeMemory() {
   ReleaseToSystem(static_cast<size_t>(-1));  // SIZE_T_MAX
 }
 
+size_t MallocExtension::ReleaseToSystemWithBudget(size_t num_bytes, size_t max_lock_usec, size_t* lock_held_usec) {
+  // Default implementation does nothing
+  if (lock_held_usec != nullptr) {
+    *lock_held_usec = 0;
+  }
+  return 0;
+}
+
+void* MallocExtension::AllocateStack(size_t size, size_t guard_size) {
+  // Default implementation does nothing
+  return nullptr;
+}
+
+void MallocExtension::FreeStack(void* stack, size_t release_bytes) {
+  // Default implementation does nothing
+}
+
 void MallocExtension::SetMemoryReleaseRate(double rate) {
   // Default implementation does nothing
 }
@@ -132,6 +149,20 @@ void MallocExtension::MarkThreadTemporarilyIdle() {
   // Default implementation does nothing
 }
 
+void MallocExtension::SetSoftHeapLimitCallback(SoftHeapLimitCallback* callback) {
+  // Default implementation does nothing
+}
+
+size_t MallocExtension::PrefaultHeap(size_t bytes, bool use_hugepages) { return 0; }
+
+void MallocExtension::ProcessBackgroundActions() {
+  // Default implementation does nothing
+}
+
+void MallocExtension::StopBackgroundActions() {
+  // Default implementation does nothing
+}
+
 // The current malloc extension object.
 
 static std::atomic<MallocExtension*> current_instance;
@@ -275,12 +306,20 @@ C_SHIM(MarkThreadIdle, void, (void), ());
 C_SHIM(MarkThreadBusy, void, (void), ());
 C_SHIM(ReleaseFreeMemory, void, (void), ());
 C_SHIM(ReleaseToSystem, void, (size_t num_bytes), (num_bytes));
+C_SHIM(ReleaseToSystemWithBudget, size_t, (size_t num_bytes, size_t max_lock_usec, size_t* lock_held_usec),
+       (num_bytes, max_lock_usec, lock_held_usec));
+C_SHIM(AllocateStack, void*, (size_t size, size_t guard_size), (size, guard_size));
+C_SHIM(FreeStack, void, (void* stack, size_t release_bytes), (stack, release_bytes));
 C_SHIM(SetMemoryReleaseRate, void, (double rate), (rate));
 C_SHIM(GetMemoryReleaseRate, double, (void), ());
 C_SHIM(GetEstimatedAllocatedSize, size_t, (size_t size), (size));
 C_SHIM(GetAllocatedSize, size_t, (const void* p), (p));
 C_SHIM(GetThreadCacheSize, size_t, (void), ());
 C_SHIM(MarkThreadTemporarilyIdle, void, (void), ());
+C_SHIM(SetSoftHeapLimitCallback, void, (void (*callback)(size_t)), (callback));
+C_SHIM(PrefaultHeap, size_t, (size_t bytes, int use_hugepages), (bytes, use_hugepages != 0));
+C_SHIM(ProcessBackgroundActions, void, (void), ());
+C_SHIM(StopBackgroundActions, void, (void), ());
 
 // Can't use the shim here because of the need to translate the enums.
 extern "C" MallocExtension_Ownership MallocExtension_GetOwnership(const void* p) {
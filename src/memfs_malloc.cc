@@ -40,6 +40,7 @@
 
 #include <config.h>
 #include <errno.h>       // for errno, EINVAL
+#include <fcntl.h>       // for fallocate, FALLOC_FL_PUNCH_HOLE
 #include <inttypes.h>    // for PRId64
 #include <limits.h>      // for PATH_MAX
 #include <stddef.h>      // for size_t
@@ -50,6 +51,8 @@
 #include <sys/mman.h>    // for mmap, MAP_FAILED, etc
 #include <sys/statfs.h>  // for fstatfs, statfs
 #include <unistd.h>      // for ftruncate, off_t, unlink
+#include <algorithm>
+#include <limits>
 #include <string>
 
 #include <gperftools/malloc_extension.h>
@@ -57,6 +60,7 @@
 #include "base/static_storage.h"
 #include "internal_logging.h"
 #include "safe_strerror.h"
+#include "system-alloc.h"
 
 // TODO(sanjay): Move the code below into the tcmalloc namespace
 using tcmalloc::kCrash;
@@ -66,7 +70,8 @@ using tcmalloc::Log;
 DEFINE_string(memfs_malloc_path, EnvToString("TCMALLOC_MEMFS_MALLOC_PATH", ""),
               "Path where hugetlbfs or tmpfs is mounted. The caller is "
               "responsible for ensuring that the path is unique and does "
-              "not conflict with another process");
+              "not conflict with another process. \"memfd:\" and "
+              "\"memfd:hugetlb\" use anonymous memfd_create files instead.");
 DEFINE_int64(memfs_malloc_limit_mb, EnvToInt("TCMALLOC_MEMFS_LIMIT_MB", 0),
              "Limit total allocation size to the "
              "specified number of MiB.  0 == no limit.");
@@ -88,19 +93,47 @@ class HugetlbSysAllocator : public SysAllocator {
         big_page_size_(0),
         hugetlb_fd_(-1),
         hugetlb_base_(0),
+        map_private_(false),
         fallback_(fallback) {}
 
   void* Alloc(size_t size, size_t* actual_size, size_t alignment);
   bool Initialize();
 
+  // Punches holes in the file behind [start, start + length), which
+  // frees the pages.  Returns false if the range isn't ours.
+  bool Release(void* start, size_t length, bool* released);
+
   bool failed_;  // Whether failed to allocate memory.
 
  private:
   void* AllocInternal(size_t size, size_t* actual_size, size_t alignment);
 
+  // Creates and unlinks file under FLAGS_memfs_malloc_path, and sets
+  // hugetlb_fd_.
+  bool CreateTempFile();
+
+  // Remembers that the file at offset is mapped at [start, end).
+  // Returns false if there is no room for it.
+  bool AddRegion(uintptr_t start, uintptr_t end, off_t offset);
+
   int64_t big_page_size_;
   int hugetlb_fd_;  // file descriptor for hugetlb
   off_t hugetlb_base_;
+  // Whether file is mapped MAP_PRIVATE.  Anonymous memfd files always
+  // are, since nobody else can map them, and shared mappings would
+  // let forked children write into our heap.
+  bool map_private_;
+
+  // Mappings of the file, for Release.  Mappings that continue
+  // previous one both in memory and in the file share a region.
+  struct Region {
+    uintptr_t start;
+    uintptr_t end;
+    off_t offset;
+  };
+  static const int kMaxRegions = 256;
+  Region regions_[kMaxRegions];
+  int num_regions_ = 0;
 
   SysAllocator* fallback_;  // Default system allocator to fall back to.
 };
@@ -147,6 +180,13 @@ void* HugetlbSysAllocator::AllocInternal(size_t size, size_t* actual_size, size_
     extra = alignment - big_page_size_;
   }
 
+  // Absurdly big requests would overflow file offsets below, and
+  // ftruncate could then shrink the file under memory that is in use.
+  if (size + extra < size ||
+      size + extra > static_cast<size_t>(std::numeric_limits<off_t>::max() - hugetlb_base_)) {
+    return nullptr;
+  }
+
   // Test if this allocation would put us over the limit.
   off_t limit = FLAGS_memfs_malloc_limit_mb * 1024 * 1024;
   if (limit > 0 && hugetlb_base_ + size + extra > limit) {
@@ -173,9 +213,13 @@ void* HugetlbSysAllocator::AllocInternal(size_t size, size_t* actual_size, size_
   //            size + alignment < (1<<NBITS).
   // and        extra <= alignment
   // therefore  size + extra < (1<<NBITS)
+  //
+  // We hint to continue previous mapping, so that it can share a
+  // region with it.
+  void* hint = num_regions_ > 0 ? reinterpret_cast<void*>(regions_[num_regions_ - 1].end) : nullptr;
   void* result;
-  result = mmap(0, size + extra, PROT_WRITE | PROT_READ, FLAGS_memfs_malloc_map_private ? MAP_PRIVATE : MAP_SHARED,
-                hugetlb_fd_, hugetlb_base_);
+  result = mmap(hint, size + extra, PROT_WRITE | PROT_READ, map_private_ ? MAP_PRIVATE : MAP_SHARED, hugetlb_fd_,
+                hugetlb_base_);
   if (result == reinterpret_cast<void*>(MAP_FAILED)) {
     if (!FLAGS_memfs_malloc_ignore_mmap_fail) {
       Log(kLog, __FILE__, __LINE__, "mmap failed (size, error)", size + extra, tcmalloc::SafeStrError(errno).c_str());
@@ -185,6 +229,13 @@ void* HugetlbSysAllocator::AllocInternal(size_t size, size_t* actual_size, size_
   }
   uintptr_t ptr = reinterpret_cast<uintptr_t>(result);
 
+  if (!AddRegion(ptr, ptr + size + extra, hugetlb_base_)) {
+    Log(kLog, __FILE__, __LINE__, "too many memfs mappings to track");
+    munmap(result, size + extra);
+    failed_ = true;
+    return nullptr;
+  }
+
   // Adjust the return memory so it is aligned
   size_t adjust = 0;
   if ((ptr & (alignment - 1)) != 0) {
@@ -200,7 +251,105 @@ void* HugetlbSysAllocator::AllocInternal(size_t size, size_t* actual_size, size_
   return reinterpret_cast<void*>(ptr);
 }
 
+bool HugetlbSysAllocator::AddRegion(uintptr_t start, uintptr_t end, off_t offset) {
+  if (num_regions_ > 0) {
+    Region* last = &regions_[num_regions_ - 1];
+    if (last->end == start && last->offset + static_cast<off_t>(last->end - last->start) == offset) {
+      last->end = end;
+      return true;
+    }
+  }
+  if (num_regions_ == kMaxRegions) {
+    return false;
+  }
+  regions_[num_regions_++] = Region{start, end, offset};
+  return true;
+}
+
+bool HugetlbSysAllocator::Release(void* start, size_t length, bool* released) {
+  uintptr_t range_start = reinterpret_cast<uintptr_t>(start);
+  uintptr_t range_end = range_start + length;
+  bool found = false;
+  *released = true;
+
+  // Page heap may have merged spans from neighbouring regions, so
+  // the range may span several of them.
+  for (int i = 0; i < num_regions_; i++) {
+    const Region& r = regions_[i];
+    if (range_end <= r.start || r.end <= range_start) continue;
+    found = true;
+
+    // Only whole (big) pages can be punched out.
+    uintptr_t punch_start = std::max(range_start, r.start) - r.start;
+    uintptr_t punch_end = std::min(range_end, r.end) - r.start;
+    const uintptr_t pagemask = big_page_size_ - 1;
+    punch_start = (punch_start + pagemask) & ~pagemask;
+    punch_end = punch_end & ~pagemask;
+    if (punch_end <= punch_start) {
+      *released = false;
+      continue;
+    }
+    // Private mappings also have their own copies of pages we wrote.
+    if (map_private_ &&
+        madvise(reinterpret_cast<void*>(r.start + punch_start), punch_end - punch_start, MADV_DONTNEED) != 0) {
+      *released = false;
+    }
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (fallocate(hugetlb_fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, r.offset + punch_start,
+                  punch_end - punch_start) != 0) {
+      *released = false;
+    }
+#else
+    *released = false;
+#endif
+  }
+  return found;
+}
+
+static bool MemfsReleaseHook(void* start, size_t length, bool* released) {
+  return hugetlb_space.get()->Release(start, length, released);
+}
+
 bool HugetlbSysAllocator::Initialize() {
+  static const char kMemfdPrefix[] = "memfd:";
+  if (FLAGS_memfs_malloc_path.compare(0, sizeof(kMemfdPrefix) - 1, kMemfdPrefix) == 0) {
+#ifdef MFD_CLOEXEC
+    std::string kind = FLAGS_memfs_malloc_path.substr(sizeof(kMemfdPrefix) - 1);
+    unsigned flags = MFD_CLOEXEC;
+    if (kind == "hugetlb") {
+      flags |= MFD_HUGETLB;
+    } else if (!kind.empty()) {
+      Log(kLog, __FILE__, __LINE__, "warning: unknown memfd kind", kind.c_str());
+      return false;
+    }
+    hugetlb_fd_ = memfd_create("tcmalloc_memfs", flags);
+    if (hugetlb_fd_ == -1) {
+      Log(kLog, __FILE__, __LINE__, "warning: memfd_create failed", tcmalloc::SafeStrError(errno).c_str());
+      return false;
+    }
+    map_private_ = true;
+#else
+    Log(kLog, __FILE__, __LINE__, "warning: memfd_create is not supported");
+    return false;
+#endif
+  } else if (!CreateTempFile()) {
+    return false;
+  } else {
+    map_private_ = FLAGS_memfs_malloc_map_private;
+  }
+
+  // Use fstatfs to figure out the default page size for memfs
+  struct statfs sfs;
+  if (fstatfs(hugetlb_fd_, &sfs) == -1) {
+    Log(kCrash, __FILE__, __LINE__, "fatal: error fstatfs of memfs_malloc_path", tcmalloc::SafeStrError(errno).c_str());
+    return false;
+  }
+  big_page_size_ = sfs.f_bsize;
+  failed_ = false;
+  return true;
+}
+
+bool HugetlbSysAllocator::CreateTempFile() {
   char path[PATH_MAX];
   const int pathlen = FLAGS_memfs_malloc_path.size();
   if (pathlen + 8 > sizeof(path)) {
@@ -224,17 +373,7 @@ bool HugetlbSysAllocator::Initialize() {
     return false;
   }
 
-  // Use fstatfs to figure out the default page size for memfs
-  struct statfs sfs;
-  if (fstatfs(hugetlb_fd, &sfs) == -1) {
-    Log(kCrash, __FILE__, __LINE__, "fatal: error fstatfs of memfs_malloc_path", tcmalloc::SafeStrError(errno).c_str());
-    return false;
-  }
-  int64_t page_size = sfs.f_bsize;
-
   hugetlb_fd_ = hugetlb_fd;
-  big_page_size_ = page_size;
-  failed_ = false;
   return true;
 }
 
@@ -244,6 +383,7 @@ REGISTER_MODULE_INITIALIZER(memfs_malloc, {
     HugetlbSysAllocator* hp = hugetlb_space.Construct(alloc);
     if (hp->Initialize()) {
       MallocExtension::instance()->SetSystemAllocator(hp);
+      TCMalloc_SetSystemReleaseHook(MemfsReleaseHook);
     }
   }
 });
@@ -36,6 +36,8 @@
 #include <inttypes.h>  // for PRIuPTR
 #include <errno.h>     // for ENOMEM, errno
 
+#include <algorithm>
+#include <chrono>
 #include <limits>
 
 #include "base/basictypes.h"
@@ -61,6 +63,30 @@ DEFINE_int64(tcmalloc_heap_limit_mb, EnvToInt("TCMALLOC_HEAP_LIMIT_MB", 0),
              "to the system more aggressively (more minor page faults). "
              "Zero means to allocate as long as system allows.");
 
+DEFINE_int64(tcmalloc_soft_heap_limit_mb, EnvToInt("TCMALLOC_SOFT_HEAP_LIMIT_MB", 0),
+             "Soft limit on committed size of the process heap in MiB. "
+             "When we cross it, free memory is reclaimed from thread, "
+             "transfer and central caches and released to the system. "
+             "Allocations never fail because of it. "
+             "Zero means no soft limit.");
+
+DEFINE_int64(tcmalloc_min_free_mb, EnvToInt("TCMALLOC_MIN_FREE_MB", 0),
+             "Amount of free committed memory in MiB that "
+             "MallocExtension::ProcessBackgroundActions keeps in page "
+             "heap, so that allocations don't have to grow the heap. "
+             "Free memory below this amount is not released to the "
+             "system by incremental scavenging.");
+
+DEFINE_int64(tcmalloc_background_interval_ms, EnvToInt("TCMALLOC_BACKGROUND_INTERVAL_MS", 1000),
+             "How often MallocExtension::ProcessBackgroundActions "
+             "refills free pages and reclaims memory over the soft "
+             "heap limit, in milliseconds.");
+
+DEFINE_bool(tcmalloc_prefault_hugepages, EnvToBool("TCMALLOC_PREFAULT_HUGEPAGES", false),
+            "Whether memory taken by prefaulting (TCMALLOC_PREFAULT_MB "
+            "and TCMALLOC_MIN_FREE_MB) is aligned to and advised as "
+            "huge pages.");
+
 namespace tcmalloc {
 
 struct SCOPED_LOCKABLE PageHeap::LockingContext {
@@ -141,6 +167,8 @@ void PageHeap::HandleUnlock(LockingContext* context) {
     t->size = context->grown_by;
   }
 
+  CheckSoftLimitLocked();
+
   lock_.Unlock();
 
   if (t) {
@@ -317,6 +345,7 @@ Span* PageHeap::Split(Span* span, Length n) {
   const int extra = span->length - n;
   Span* leftover = NewSpan(span->start + n, extra);
   ASSERT(leftover->location == Span::IN_USE);
+  leftover->zeroed = span->zeroed;
   RecordSpan(leftover);
   pagemap_.set(span->start + n - 1, span);  // Update map from pageid to span
   span->length = n;
@@ -335,12 +364,15 @@ void PageHeap::CommitSpan(Span* span) {
 
 bool PageHeap::DecommitSpan(Span* span) {
   ++stats_.decommit_count;
+  ++stats_.release_syscalls;
 
   bool rv = TCMalloc_SystemRelease(reinterpret_cast<void*>(span->start << kPageShift),
                                    static_cast<size_t>(span->length << kPageShift));
   if (rv) {
     stats_.committed_bytes -= span->length << kPageShift;
     stats_.total_decommit_bytes += (span->length << kPageShift);
+    span->zeroed = TCMalloc_SystemReleaseZeroes(reinterpret_cast<void*>(span->start << kPageShift),
+                                                static_cast<size_t>(span->length << kPageShift));
   }
 
   return rv;
@@ -358,6 +390,7 @@ Span* PageHeap::Carve(Span* span, Length n) {
   if (extra > 0) {
     Span* leftover = NewSpan(span->start + n, extra);
     leftover->location = old_location;
+    leftover->zeroed = span->zeroed;
     RecordSpan(leftover);
 
     // The previous span of |leftover| was just splitted -- no need to
@@ -387,9 +420,53 @@ Span* PageHeap::Carve(Span* span, Length n) {
 
 void PageHeap::Delete(Span* span) {
   SpinLockHolder h(&lock_);
+  span->zeroed = 0;
   DeleteLocked(span);
 }
 
+bool PageHeap::ResizeInPlace(Span* span, Length n) {
+  SpinLockHolder h(&lock_);
+  ASSERT(Check());
+  ASSERT(span->location == Span::IN_USE);
+  ASSERT(span->sizeclass == 0);
+  ASSERT(GetDescriptor(span->start) == span);
+
+  if (n == 0 || n > kMaxValidPages) return false;
+  n = RoundUpSize(n);
+
+  if (n < span->length) {
+    Span* trailer = Split(span, n);
+    trailer->zeroed = 0;
+    DeleteLocked(trailer);
+    return true;
+  }
+
+  if (n == span->length) return true;
+
+  const Length extra = n - span->length;
+  Span* next = GetDescriptor(span->start + span->length);
+  if (next == nullptr || next->location == Span::IN_USE || next->length < extra) {
+    return false;
+  }
+  if (next->location == Span::ON_RETURNED_FREELIST && !EnsureLimit(extra, false)) {
+    return false;
+  }
+
+  // Carve the pages we need off 'next' and glue them to 'span'. The
+  // carved pages still map to 'next', which is about to be deleted,
+  // so all of them are pointed at 'span'.
+  next = Carve(next, extra);
+  ASSERT(next->start == span->start + span->length);
+  for (Length i = 0; i < extra; i++) {
+    pagemap_.set(next->start + i, span);
+  }
+  span->length += extra;
+  span->zeroed = 0;
+  DeleteSpan(next);
+  ASSERT(Check());
+  return true;
+}
+
 void PageHeap::DeleteLocked(Span* span) {
   ASSERT(lock_.IsHeld());
   ASSERT(Check());
@@ -400,6 +477,7 @@ void PageHeap::DeleteLocked(Span* span) {
   const Length n = span->length;
   span->sizeclass = 0;
   span->sample = 0;
+  span->cold = 0;
   span->location = Span::ON_NORMAL_FREELIST;
   MergeIntoFreeList(span);  // Coalesces if possible
   IncrementalScavenge(n);
@@ -467,6 +545,7 @@ void PageHeap::MergeIntoFreeList(Span* span) {
     // Merge preceding span into this span
     ASSERT(prev->start + prev->length == p);
     const Length len = prev->length;
+    span->zeroed &= prev->zeroed;
     DeleteSpan(prev);
     span->start -= len;
     span->length += len;
@@ -477,6 +556,7 @@ void PageHeap::MergeIntoFreeList(Span* span) {
     // Merge next span into this span
     ASSERT(next->start == p + n);
     const Length len = next->length;
+    span->zeroed &= next->zeroed;
     DeleteSpan(next);
     span->length += len;
     pagemap_.set(span->start + span->length - 1, span);
@@ -530,6 +610,8 @@ void PageHeap::RemoveFromFreeList(Span* span) {
   }
 }
 
+static uint64_t MinFreeBytes() { return static_cast<uint64_t>(FLAGS_tcmalloc_min_free_mb) << 20; }
+
 void PageHeap::IncrementalScavenge(Length n) {
   ASSERT(lock_.IsHeld());
   // Fast path; not yet time to release memory
@@ -543,6 +625,12 @@ void PageHeap::IncrementalScavenge(Length n) {
     return;
   }
 
+  if (stats_.free_bytes <= MinFreeBytes()) {
+    // Keep what background refill gave us.
+    scavenge_counter_ = kDefaultReleaseDelay;
+    return;
+  }
+
   ++stats_.scavenge_count;
 
   Length released_pages = ReleaseAtLeastNPages(1);
@@ -564,29 +652,79 @@ void PageHeap::IncrementalScavenge(Length n) {
   }
 }
 
-Length PageHeap::ReleaseSpan(Span* s) {
-  ASSERT(s->location == Span::ON_NORMAL_FREELIST);
+Length PageHeap::ReleaseSpans(Span** spans, int count) {
+  std::sort(spans, spans + count, [](Span* a, Span* b) { return a->start < b->start; });
+
+  SystemReleaseRange ranges[kMaxReleaseBatch];
+  int num_ranges = 0;
+  PageID range_end = 0;
+  for (int i = 0; i < count; i++) {
+    Span* s = spans[i];
+    ASSERT(s->location == Span::ON_NORMAL_FREELIST);
+    ASSERT(i == 0 || spans[i - 1]->start + spans[i - 1]->length < s->start);
+    // Normal free spans are never adjacent, but the gap between
+    // them is often a returned span. Releasing it again is harmless,
+    // and lets us cover both spans with one range.
+    Span* gap = (num_ranges > 0 ? GetDescriptor(range_end) : nullptr);
+    if (gap != nullptr && gap->location == Span::ON_RETURNED_FREELIST && gap->start == range_end &&
+        gap->start + gap->length == s->start) {
+      ranges[num_ranges - 1].length += (gap->length + s->length) << kPageShift;
+    } else {
+      ranges[num_ranges].start = reinterpret_cast<void*>(s->start << kPageShift);
+      ranges[num_ranges].length = s->length << kPageShift;
+      num_ranges++;
+    }
+    range_end = s->start + s->length;
+  }
+
+  int syscalls;
+  bool rv = TCMalloc_SystemReleaseBatch(ranges, num_ranges, &syscalls);
+  stats_.release_syscalls += syscalls;
+  if (!rv) {
+    for (int i = 0; i < count; i++) {
+      PrependToFreeList(spans[i]);
+    }
+    return 0;
+  }
+  // Falling back from process_madvise to madvise may take more
+  // system calls than there were spans.
+  if (syscalls < count) stats_.release_syscalls_saved += count - syscalls;
 
-  if (DecommitSpan(s)) {
-    RemoveFromFreeList(s);
-    const Length n = s->length;
+  Length released_pages = 0;
+  for (int i = 0; i < count; i++) {
+    Span* s = spans[i];
+    void* start = reinterpret_cast<void*>(s->start << kPageShift);
+    const size_t length = s->length << kPageShift;
+    ++stats_.decommit_count;
+    stats_.committed_bytes -= length;
+    stats_.total_decommit_bytes += length;
+    s->zeroed = TCMalloc_SystemReleaseZeroes(start, length);
     s->location = Span::ON_RETURNED_FREELIST;
+    released_pages += s->length;
     MergeIntoFreeList(s);  // Coalesces if possible.
-    return n;
   }
+  return released_pages;
+}
 
-  return 0;
+uint64_t PageHeap::NowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
 }
 
-Length PageHeap::ReleaseAtLeastNPages(Length num_pages) {
+Length PageHeap::ReleaseAtLeastNPages(Length num_pages, uint64_t deadline_ns) {
   ASSERT(lock_.IsHeld());
   Length released_pages = 0;
 
-  // Round robin through the lists of free spans, releasing a
-  // span from each list.  Stop after releasing at least num_pages
-  // or when there is nothing more to release.
-  while (released_pages < num_pages && stats_.free_bytes > 0) {
-    for (int i = 0; i < kMaxPages + 1 && released_pages < num_pages; i++, release_index_++) {
+  // Round robin through the lists of free spans, taking a span from
+  // each list.  Taken spans are decommitted in batches (see
+  // ReleaseSpans).  Stop after releasing at least num_pages or when
+  // there is nothing more to release.
+  Span* batch[kMaxReleaseBatch];
+  int batch_size = 0;
+  Length batch_pages = 0;
+  const bool has_deadline = (deadline_ns != std::numeric_limits<uint64_t>::max());
+  while (released_pages + batch_pages < num_pages && stats_.free_bytes > 0) {
+    for (int i = 0; i < kMaxPages + 1 && released_pages + batch_pages < num_pages; i++, release_index_++) {
       Span* s;
       if (release_index_ > kMaxPages) release_index_ = 0;
 
@@ -606,10 +744,34 @@ Length PageHeap::ReleaseAtLeastNPages(Length num_pages) {
       // is significantly smaller than s->length, and s is on the
       // large freelist, should we carve s instead of releasing?
       // the whole thing?
-      Length released_len = ReleaseSpan(s);
-      // Some systems do not support release
-      if (released_len == 0) return released_pages;
-      released_pages += released_len;
+      RemoveFromFreeList(s);
+      batch[batch_size++] = s;
+      batch_pages += s->length;
+      if (has_deadline && NowNanos() >= deadline_ns) {
+        // Out of time.  Release what we've taken so far; next call
+        // starts from the list after s's.
+        release_index_++;
+        return released_pages + ReleaseSpans(batch, batch_size);
+      }
+      if (batch_size == kMaxReleaseBatch) {
+        Length released_len = ReleaseSpans(batch, batch_size);
+        // Some systems do not support release
+        if (released_len == 0) return released_pages;
+        released_pages += released_len;
+        batch_size = 0;
+        batch_pages = 0;
+      }
+    }
+  }
+  if (batch_size > 0) {
+    if (has_deadline && NowNanos() >= deadline_ns) {
+      // Ran out of time since the last span was taken.  Put the
+      // batch back rather than spend more time decommitting it.
+      for (int i = 0; i < batch_size; i++) {
+        PrependToFreeList(batch[i]);
+      }
+    } else {
+      released_pages += ReleaseSpans(batch, batch_size);
     }
   }
   return released_pages;
@@ -639,6 +801,33 @@ bool PageHeap::EnsureLimit(Length n, bool withRelease) {
   return takenPages + n <= limit;
 }
 
+static uint64_t SoftLimitBytes() { return static_cast<uint64_t>(FLAGS_tcmalloc_soft_heap_limit_mb) << 20; }
+
+size_t PageHeap::SoftLimitExcessLocked() {
+  ASSERT(lock_.IsHeld());
+  const uint64_t limit = SoftLimitBytes();
+  if (limit == 0 || stats_.committed_bytes <= limit) return 0;
+  return stats_.committed_bytes - limit;
+}
+
+void PageHeap::FinishSoftLimitReclaimLocked() {
+  ASSERT(lock_.IsHeld());
+  soft_limit_exceeded_.store(false, std::memory_order_relaxed);
+  soft_limit_rearm_bytes_ = 0;
+  if (SoftLimitExcessLocked() > 0) {
+    soft_limit_rearm_bytes_ = stats_.committed_bytes + SoftLimitBytes() / 16;
+  }
+}
+
+void PageHeap::CheckSoftLimitLocked() {
+  ASSERT(lock_.IsHeld());
+  const uint64_t limit = SoftLimitBytes();
+  if (PREDICT_TRUE(limit == 0)) return;
+  if (stats_.committed_bytes > std::max(limit, soft_limit_rearm_bytes_)) {
+    soft_limit_exceeded_.store(true, std::memory_order_relaxed);
+  }
+}
+
 void PageHeap::RegisterSizeClass(Span* span, uint32_t sc) {
   // Associate span object with all interior pages as well
   ASSERT(span->location == Span::IN_USE);
@@ -725,8 +914,13 @@ bool PageHeap::GrowHeap(Length n, LockingContext* context) {
     }
     if (ptr == nullptr) return false;
   }
-  ask = actual_size >> kPageShift;
-  context->grown_by += ask << kPageShift;
+  context->grown_by += (actual_size >> kPageShift) << kPageShift;
+  return AddSystemMemoryLocked(ptr, actual_size, false);
+}
+
+bool PageHeap::AddSystemMemoryLocked(void* ptr, size_t size, bool prefaulted) {
+  ASSERT(lock_.IsHeld());
+  const Length ask = size >> kPageShift;
 
   ++stats_.reserve_count;
   ++stats_.commit_count;
@@ -756,8 +950,16 @@ bool PageHeap::GrowHeap(Length n, LockingContext* context) {
     // Pretend the new area is allocated and then Delete() it to cause
     // any necessary coalescing to occur.
     Span* span = NewSpan(p, ask);
+    span->zeroed = TCMalloc_SystemAllocZeroes();
     RecordSpan(span);
-    DeleteLocked(span);
+    if (prefaulted) {
+      // Don't let incremental scavenging give back what we've just
+      // faulted in.
+      span->location = Span::ON_NORMAL_FREELIST;
+      MergeIntoFreeList(span);
+    } else {
+      DeleteLocked(span);
+    }
     ASSERT(stats_.unmapped_bytes + stats_.committed_bytes == stats_.system_bytes);
     ASSERT(Check());
     return true;
@@ -768,6 +970,99 @@ bool PageHeap::GrowHeap(Length n, LockingContext* context) {
   }
 }
 
+Length PageHeap::SoftLimitRoomLocked() {
+  ASSERT(lock_.IsHeld());
+  const uint64_t limit = SoftLimitBytes();
+  if (limit == 0) return kMaxValidPages;
+  if (stats_.committed_bytes >= limit) return 0;
+  return (limit - stats_.committed_bytes) >> kPageShift;
+}
+
+Length PageHeap::Prefault(Length n, bool use_hugepages) {
+  if (n == 0 || n > kMaxValidPages) return 0;
+  {
+    SpinLockHolder h(&lock_);
+    // Aggressive decommit would release this memory right away.
+    if (aggressive_decommit_ || !EnsureLimit(n, false)) return 0;
+    // And going over the soft limit would reclaim it.
+    n = std::min(n, SoftLimitRoomLocked());
+    if (n == 0) return 0;
+  }
+
+  // Page faults are the slow part, so we don't hold lock_ for them.
+  const size_t kHugePageSize = 2 << 20;
+  size_t actual_size;
+  void* ptr = TCMalloc_SystemAlloc(n << kPageShift, &actual_size, use_hugepages ? kHugePageSize : kPageSize);
+  if (ptr == nullptr) return 0;
+  TCMalloc_SystemPrefault(ptr, actual_size, use_hugepages);
+
+  SpinLockHolder h(&lock_);
+  if (!AddSystemMemoryLocked(ptr, actual_size, true)) return 0;
+  return actual_size >> kPageShift;
+}
+
+Span* PageHeap::AnyReturnedSpanLocked() {
+  ASSERT(lock_.IsHeld());
+  // Biggest spans first, to recommit in few steps.
+  if (!large_returned_.empty()) {
+    return large_returned_.rbegin()->span;
+  }
+  for (int i = kMaxPages - 1; i >= 0; i--) {
+    if (!DLL_IsEmpty(&free_[i].returned)) {
+      return free_[i].returned.next;
+    }
+  }
+  return nullptr;
+}
+
+Length PageHeap::PrefaultReturned(Length n, bool use_hugepages) {
+  Length done = 0;
+  while (done < n) {
+    Span* span;
+    {
+      SpinLockHolder h(&lock_);
+      if (aggressive_decommit_) break;
+      span = AnyReturnedSpanLocked();
+      if (span == nullptr) break;
+      Length want = std::min(RoundUpSize(n - done), span->length);
+      want = std::min(want, SoftLimitRoomLocked() & ~(smallest_span_size_ - 1));
+      if (want == 0 || !EnsureLimit(want, false)) break;
+      // Carving marks span in use, so nobody touches it while we
+      // fault it in without the lock.
+      span = Carve(span, want);
+    }
+
+    TCMalloc_SystemPrefault(reinterpret_cast<void*>(span->start << kPageShift), span->length << kPageShift,
+                            use_hugepages);
+    done += span->length;
+
+    SpinLockHolder h(&lock_);
+    // Like in AddSystemMemoryLocked, don't let incremental scavenging
+    // give it back right away.
+    span->location = Span::ON_NORMAL_FREELIST;
+    MergeIntoFreeList(span);
+  }
+  return done;
+}
+
+void PageHeap::RefillFreePages() {
+  uint64_t free_bytes;
+  {
+    SpinLockHolder h(&lock_);
+    free_bytes = stats_.free_bytes;
+  }
+  const uint64_t min_free = MinFreeBytes();
+  if (free_bytes >= min_free) return;
+
+  // Address space we've released is cheaper to reuse than new one.
+  Length needed = pages(min_free - free_bytes);
+  needed -= std::min(needed, PrefaultReturned(needed, FLAGS_tcmalloc_prefault_hugepages));
+  if (needed == 0) return;
+
+  // Grow in reasonably big steps, to not fragment address space.
+  Prefault(std::max<Length>(needed, kMinSystemAlloc), FLAGS_tcmalloc_prefault_hugepages);
+}
+
 bool PageHeap::Check() {
   ASSERT(lock_.IsHeld());
   return true;
@@ -37,6 +37,10 @@
 #include <config.h>
 #include <stddef.h>  // for size_t
 #include <stdint.h>  // for uint64_t, int64_t, uint16_t
+
+#include <atomic>
+#include <limits>
+
 #include "base/basictypes.h"
 #include "base/spinlock.h"
 #include "base/thread_annotations.h"
@@ -128,10 +132,19 @@ class PageHeap {
   //           has not yet been deleted.
   void Delete(Span* span);
 
+  // Tries to change length of the span to "n" pages without moving
+  // it.  Growing takes pages from the free span that follows it (if
+  // any), shrinking gives tail pages back to the heap.  Returns true
+  // on success.
+  // REQUIRES: span was returned by earlier call to New() or
+  //           NewAligned() and has not yet been deleted.
+  bool ResizeInPlace(Span* span, Length n);
+
   template <typename Body>
   void PrepareAndDelete(Span* span, const Body& body) LOCKS_EXCLUDED(lock_) {
     SpinLockHolder h(&lock_);
     body();
+    span->zeroed = 0;
     DeleteLocked(span);
   }
 
@@ -168,7 +181,9 @@ class PageHeap {
           decommit_count(0),
           total_decommit_bytes(0),
           reserve_count(0),
-          total_reserve_bytes(0) {}
+          total_reserve_bytes(0),
+          release_syscalls(0),
+          release_syscalls_saved(0) {}
     uint64_t system_bytes;     // Total bytes allocated from system
     uint64_t free_bytes;       // Total bytes on normal freelists
     uint64_t unmapped_bytes;   // Total bytes on returned freelists
@@ -183,6 +198,9 @@ class PageHeap {
 
     uint64_t reserve_count;        // Number of virtual memory reserves
     uint64_t total_reserve_bytes;  // Bytes reserved in lifetime of process
+
+    uint64_t release_syscalls;        // System calls made to decommit memory
+    uint64_t release_syscalls_saved;  // Decommits that shared a system call
   };
   inline Stats StatsLocked() const { return stats_; }
 
@@ -217,7 +235,41 @@ class PageHeap {
   // may also be larger than num_pages since page_heap might decide to
   // release one large range instead of fragmenting it into two
   // smaller released and unreleased ranges.
-  Length ReleaseAtLeastNPages(Length num_pages);
+  Length ReleaseAtLeastNPages(Length num_pages) {
+    return ReleaseAtLeastNPages(num_pages, std::numeric_limits<uint64_t>::max());
+  }
+
+  // Same as above, but also gives up once NowNanos() passes
+  // deadline_ns.  The deadline is checked after each span is taken,
+  // so it is overshot by at most decommitting the spans taken since
+  // the last full batch.  Next call resumes from the free list where
+  // this one stopped.
+  Length ReleaseAtLeastNPages(Length num_pages, uint64_t deadline_ns);
+
+  // Monotonic clock for release deadlines, in nanoseconds.
+  static uint64_t NowNanos();
+
+  // Takes at least n pages from the system, faults them in and puts
+  // them on the free lists, so that later allocations neither grow
+  // the heap nor page fault.  With use_hugepages, memory is aligned
+  // to and advised as huge pages.  Never takes us over the soft
+  // limit, so may add less.  Returns number of pages added, which is
+  // 0 in aggressive decommit mode.
+  // REQUIRES: lock_ is not held.  Pages are faulted in without it.
+  Length Prefault(Length n, bool use_hugepages) LOCKS_EXCLUDED(lock_);
+
+  // Same as Prefault, but instead of taking new memory from the
+  // system, recommits free spans that were released to it.  Returns
+  // number of pages recommitted, which may be less than n if there
+  // aren't enough of them.
+  Length PrefaultReturned(Length n, bool use_hugepages) LOCKS_EXCLUDED(lock_);
+
+  // Tops up free committed memory to TCMALLOC_MIN_FREE_MB
+  // ("tcmalloc.min_free_mb" property), recommitting released spans
+  // first and only then prefaulting new memory.  Called periodically
+  // by MallocExtension::ProcessBackgroundActions, so that
+  // application threads don't have to grow the heap.
+  void RefillFreePages() LOCKS_EXCLUDED(lock_);
 
   // Reads and writes to pagemap_cache_ do not require locking.
   bool TryGetSizeClass(PageID p, uint32_t* out) const { return pagemap_cache_.TryGet(p, out); }
@@ -237,6 +289,27 @@ class PageHeap {
   bool GetAggressiveDecommit(void) { return aggressive_decommit_; }
   void SetAggressiveDecommit(bool aggressive_decommit) { aggressive_decommit_ = aggressive_decommit; }
 
+  // Soft heap limit (see soft_limit.h). Unlike the hard limit
+  // enforced by EnsureLimit, we never fail allocations because of
+  // it. Instead, the page heap raises this flag when committed memory
+  // grows over the limit, and soft_limit.cc reclaims memory from the
+  // caches above it once it's safe to do so.
+  bool SoftLimitExceeded() const { return soft_limit_exceeded_.load(std::memory_order_relaxed); }
+
+  // Returns how many bytes of committed memory we are over the soft
+  // limit, or 0.
+  size_t SoftLimitExcessLocked() EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Called at the end of soft limit reclaim. Clears the flag, and if
+  // we are still over the limit, delays raising it again until the
+  // heap grows by limit/16 more, so that we don't flush caches on
+  // every page heap allocation.
+  void FinishSoftLimitReclaimLocked() EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Raises the flag if we're over the soft limit. Used when the limit
+  // changes.
+  void CheckSoftLimitLocked() EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
  private:
   struct LockingContext;
 
@@ -298,6 +371,8 @@ class PageHeap {
   Stats stats_;
 
   Span* NewLocked(Length n, LockingContext* context) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  // Note, this keeps span->zeroed as is.  Spans that were handed out
+  // to the user must have it cleared by the caller.
   void DeleteLocked(Span* span) EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
   // Split an allocated span into two spans: one of length "n" pages
@@ -314,6 +389,18 @@ class PageHeap {
 
   bool GrowHeap(Length n, LockingContext* context) EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
+  // Returns how many pages can be committed without crossing the soft
+  // limit.
+  Length SoftLimitRoomLocked() EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Returns some span from returned free lists, or nullptr.
+  Span* AnyReturnedSpanLocked() EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Adds memory just taken from the system to page heap as a free
+  // span, and accounts for it.  Prefaulted memory skips incremental
+  // scavenging.
+  bool AddSystemMemoryLocked(void* ptr, size_t size, bool prefaulted) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
   // REQUIRES: span->length >= n
   // REQUIRES: span->location != IN_USE
   // Remove span from its free list, and move any leftover part of
@@ -354,12 +441,19 @@ class PageHeap {
   // IncrementalScavenge(n) is called whenever n pages are freed.
   void IncrementalScavenge(Length n);
 
-  // Attempts to decommit 's' and move it to the returned freelist.
+  // Maximum number of spans ReleaseAtLeastNPages decommits at once.
+  static const int kMaxReleaseBatch = 64;
+
+  // Attempts to decommit given spans and move them to the returned
+  // freelist. Address ranges that are adjacent, or only separated by
+  // already returned span, are merged, and the whole batch goes to
+  // TCMalloc_SystemReleaseBatch, so we make few system calls.
   //
-  // Returns the length of the Span or zero if release failed.
+  // Returns the total length of spans or zero if release failed, in
+  // which case spans are put back on the NORMAL freelist.
   //
-  // REQUIRES: 's' must be on the NORMAL freelist.
-  Length ReleaseSpan(Span* s);
+  // REQUIRES: spans were taken off the NORMAL freelist.
+  Length ReleaseSpans(Span** spans, int count);
 
   // Checks if we are allowed to take more memory from the system.
   // If limit is reached and allowRelease is true, tries to release
@@ -375,6 +469,12 @@ class PageHeap {
   int release_index_;
 
   bool aggressive_decommit_;
+
+  std::atomic<bool> soft_limit_exceeded_{};
+
+  // Committed bytes above which soft limit is considered exceeded
+  // again after unsuccessful reclaim. 0 means just the limit.
+  uint64_t soft_limit_rearm_bytes_{};
 };
 
 }  // namespace tcmalloc
@@ -41,8 +41,10 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <sched.h>
 #include <sys/time.h>
 
+#include <atomic>
 #include <list>
 
 #if HAVE_LINUX_SIGEV_THREAD_ID
@@ -55,6 +57,31 @@
 #include <sys/syscall.h>
 #endif
 
+// perf_event_open(2) backend. It needs F_SETOWN_EX, which comes with
+// the same kernels as SIGEV_THREAD_ID.
+#if HAVE_LINUX_SIGEV_THREAD_ID && defined(HAVE_LINUX_PERF_EVENT_H)
+#define PROFILE_HANDLER_PERF_EVENTS 1
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#else
+#define PROFILE_HANDLER_PERF_EVENTS 0
+#endif
+
+// With CPUPROFILE_AUTO_REGISTER_THREADS, we register threads created
+// by pthread_create, which we interpose. That only works from a
+// shared library, where the real pthread_create can be found with
+// dlsym(RTLD_NEXT). In static archive our definition could clash
+// with static libc, so leave it out there.
+#if HAVE_LINUX_SIGEV_THREAD_ID && defined(HAVE_DLFCN_H) && defined(__PIC__) && !defined(__PIE__)
+#define PROFILE_HANDLER_THREAD_HOOK 1
+#include <dlfcn.h>
+#else
+#define PROFILE_HANDLER_THREAD_HOOK 0
+#endif
+
 #include "base/googleinit.h"
 #include "base/logging.h"
 #include "base/spinlock.h"
@@ -84,21 +111,6 @@ struct ProfileHandlerToken {
   void* callback_arg;
 };
 
-// Blocks a signal from being delivered to the current thread while the object
-// is alive. Unblocks it upon destruction.
-class ScopedSignalBlocker {
- public:
-  ScopedSignalBlocker(int signo) {
-    sigemptyset(&sig_set_);
-    sigaddset(&sig_set_, signo);
-    RAW_CHECK(sigprocmask(SIG_BLOCK, &sig_set_, nullptr) == 0, "sigprocmask (block)");
-  }
-  ~ScopedSignalBlocker() { RAW_CHECK(sigprocmask(SIG_UNBLOCK, &sig_set_, nullptr) == 0, "sigprocmask (unblock)"); }
-
- private:
-  sigset_t sig_set_;
-};
-
 // This class manages profile timers and associated signal handler. This is a
 // a singleton.
 class ProfileHandler {
@@ -106,6 +118,12 @@ class ProfileHandler {
   // Registers the current thread with the profile handler.
   void RegisterThread();
 
+#if PROFILE_HANDLER_THREAD_HOOK
+  // Registers the current thread, which just started, unless it
+  // blocks the profiling signal (like profiler's own threads do).
+  void RegisterNewThread();
+#endif
+
   // Registers a callback routine to receive profile timer ticks. The returned
   // token is to be used when unregistering this callback and must not be
   // deleted by the caller.
@@ -113,7 +131,7 @@ class ProfileHandler {
 
   // Unregisters a previously registered callback. Expects the token returned
   // by the corresponding RegisterCallback routine.
-  void UnregisterCallback(ProfileHandlerToken* token) NO_THREAD_SAFETY_ANALYSIS;
+  void UnregisterCallback(ProfileHandlerToken* token);
 
   // Unregisters all the callbacks and stops the timer(s).
   void Reset();
@@ -121,6 +139,9 @@ class ProfileHandler {
   // Gets the current state of profile handler.
   void GetState(ProfileHandlerState* state);
 
+  // See ProfileHandlerGetThreadIds.
+  int GetThreadIds(pid_t* tids, int max_tids);
+
   // Initializes and returns the ProfileHandler singleton.
   static ProfileHandler* Instance();
 
@@ -143,7 +164,7 @@ class ProfileHandler {
   bool timer_running_;
 
   // The number of profiling signal interrupts received.
-  int64_t interrupts_ GUARDED_BY(signal_lock_);
+  std::atomic<int64_t> interrupts_;
 
   // Profiling signal interrupt frequency, read-only after construction.
   int32_t frequency_;
@@ -165,41 +186,87 @@ class ProfileHandler {
   // Must be false if HAVE_LINUX_SIGEV_THREAD_ID is not defined.
   bool per_thread_timer_enabled_;
 
+  // True if CPUPROFILE_PERF_EVENTS is set and perf events can be
+  // opened. Then threads are sampled by perf events instead of
+  // timers. Must be false if PROFILE_HANDLER_PERF_EVENTS is 0.
+  bool perf_events_enabled_;
+
 #if HAVE_LINUX_SIGEV_THREAD_ID
   // this is used to destroy per-thread profiling timers on thread
   // termination
   tcmalloc::TlsKey thread_timer_key;
 #endif
 
-  // This lock serializes the registration of threads and protects the
-  // callbacks_ list below.
-  // Locking order:
-  // In the context of a signal handler, acquire signal_lock_ to walk the
-  // callback list. Otherwise, acquire control_lock_, disable the signal
-  // handler and then acquire signal_lock_.
-  SpinLock control_lock_ ACQUIRED_BEFORE(signal_lock_);
-  SpinLock signal_lock_;
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  // Live thread that called RegisterThread. Threads are linked
+  // together, so that GetThreadIds can list them and UpdateTimer can
+  // start and stop their perf events, and each thread points to its
+  // own in registered_thread_key_ so that it is unlinked on thread
+  // termination. tid is 0 for threads that were left behind by fork.
+  struct RegisteredThread {
+    pid_t tid;
+    pid_t pid;
+    int perf_fd;  // -1 if none
+    RegisteredThread* next;
+  };
+
+  tcmalloc::TlsKey registered_thread_key_;
+  RegisteredThread* registered_threads_ GUARDED_BY(control_lock_);
+
+  // Returns entry of the calling thread, adding it if necessary.
+  RegisteredThread* RecordThread() EXCLUSIVE_LOCKS_REQUIRED(control_lock_);
+
+  // Forgets threads (and closes perf event fds) that were inherited
+  // through fork, since they still refer to the parent's threads.
+  void DropForkedThreads() EXCLUSIVE_LOCKS_REQUIRED(control_lock_);
+
+  // TLS destructor for registered_thread_key_.
+  static void RegisteredThreadDestructor(void* arg);
+#endif
+
+#if PROFILE_HANDLER_PERF_EVENTS
+  // Event to open for every thread. Read-only after construction.
+  struct perf_event_attr perf_attr_;
+
+  // Chooses perf_attr_ for the event named by CPUPROFILE_PERF_EVENTS
+  // value 'spec'. Returns false if no suitable event can be opened.
+  bool InitPerfEvents(const char* spec);
+
+  // Opens perf event that signals 'thread', which is the calling
+  // thread, unless it has one already.
+  void OpenPerfEvent(RegisteredThread* thread) EXCLUSIVE_LOCKS_REQUIRED(control_lock_);
+#endif
+
+  // This lock serializes the registration of threads and changes to
+  // the callbacks_ list below.
+  SpinLock control_lock_;
 
   // Holds the list of registered callbacks. We expect the list to be pretty
   // small. Currently, the cpu profiler (base/profiler) and thread module
   // (base/thread.h) are the only two components registering callbacks.
-  // Following are the locking requirements for callbacks_:
-  // For read-write access outside the SIGPROF handler:
-  //  - Acquire control_lock_
-  //  - Disable SIGPROF handler.
-  //  - Acquire signal_lock_
-  //  - Nothing that takes ~any other lock can be nested
-  //    here. E.g. including malloc. Otherwise deadlock is possible.
-  // For read-only access in the context of SIGPROF handler
-  // (Read-write access is *not allowed* in the SIGPROF handler)
-  //  - Acquire signal_lock_
-  // For read-only access outside SIGPROF handler:
-  //  - Acquire control_lock_
+  //
+  // Signal handlers, which may run in many threads at once, read the
+  // list without taking any locks. So the list is never modified in
+  // place. Instead, code holding control_lock_ builds a new list,
+  // publishes it with ReplaceCallbacks, which waits until no signal
+  // handler can still be walking the old one, and then frees the old
+  // list. nullptr means no callbacks.
   typedef std::list<ProfileHandlerToken*> CallbackList;
   typedef CallbackList::iterator CallbackIterator;
-  CallbackList callbacks_ GUARDED_BY(signal_lock_);
+  std::atomic<CallbackList*> callbacks_;
+
+  // Numbers of signal handlers currently running, split by the parity
+  // of handler_epoch_ they saw on entry. Waiting for one of the
+  // counters to drain while new handlers go to the other one means
+  // writers never starve, no matter how often signals arrive.
+  std::atomic<int> active_handlers_[2];
+  std::atomic<unsigned> handler_epoch_;
+
+  // Publishes new callback list and returns the previous one, which
+  // no signal handler uses anymore.
+  CallbackList* ReplaceCallbacks(CallbackList* callbacks) EXCLUSIVE_LOCKS_REQUIRED(control_lock_);
 
-  // Starts or stops the interval timer.
+  // Starts or stops the interval timer, or all perf events.
   // Will ignore any requests to enable or disable when
   // per_thread_timer_enabled_ is true.
   void UpdateTimer(bool enable) EXCLUSIVE_LOCKS_REQUIRED(control_lock_);
@@ -257,6 +324,11 @@ static void CreateThreadTimerKey(tcmalloc::TlsKey* pkey) {
 }
 
 static void StartLinuxThreadTimer(int timer_type, int signal_number, int32_t frequency, tcmalloc::TlsKey timer_key) {
+  if (tcmalloc::GetTlsValue(timer_key) != nullptr) {
+    // Thread is already registered.
+    return;
+  }
+
   int rv;
   struct sigevent sevp;
   timer_t timerid;
@@ -290,6 +362,156 @@ static void StartLinuxThreadTimer(int timer_type, int signal_number, int32_t fre
 }
 #endif
 
+#if HAVE_LINUX_SIGEV_THREAD_ID
+ProfileHandler::RegisteredThread* ProfileHandler::RecordThread() {
+  DropForkedThreads();
+
+  RegisteredThread* thread = static_cast<RegisteredThread*>(tcmalloc::GetTlsValue(registered_thread_key_));
+  if (thread == nullptr) {
+    thread = new RegisteredThread;
+    thread->tid = 0;
+    thread->pid = getpid();
+    thread->perf_fd = -1;
+    thread->next = registered_threads_;
+    registered_threads_ = thread;
+    int rv = tcmalloc::SetTlsValue(registered_thread_key_, thread);
+    if (rv) {
+      RAW_LOG(FATAL, "aborting due to tcmalloc::SetTlsValue error: %s", strerror(rv));
+    }
+  }
+  if (thread->tid == 0) {
+    thread->tid = syscall(SYS_gettid);
+  }
+  return thread;
+}
+
+void ProfileHandler::DropForkedThreads() {
+  pid_t pid = getpid();
+  for (RegisteredThread* thread = registered_threads_; thread != nullptr; thread = thread->next) {
+    if (thread->pid != pid) {
+      if (thread->perf_fd >= 0) {
+        close(thread->perf_fd);
+      }
+      thread->tid = 0;
+      thread->pid = pid;
+      thread->perf_fd = -1;
+    }
+  }
+}
+
+void ProfileHandler::RegisteredThreadDestructor(void* arg) {
+  RegisteredThread* thread = static_cast<RegisteredThread*>(arg);
+  ProfileHandler* instance = instance_;
+
+  SpinLockHolder cl(&instance->control_lock_);
+  for (RegisteredThread** p = &instance->registered_threads_; *p != nullptr; p = &(*p)->next) {
+    if (*p == thread) {
+      *p = thread->next;
+      break;
+    }
+  }
+  // The fd is ours even if we're in a forked child, where closing it
+  // doesn't affect the parent.
+  if (thread->perf_fd >= 0) {
+    close(thread->perf_fd);
+  }
+  delete thread;
+}
+
+static void CreateRegisteredThreadKey(tcmalloc::TlsKey* pkey, void (*destructor)(void*)) {
+  int rv = tcmalloc::CreateTlsKey(pkey, destructor);
+  if (rv) {
+    RAW_LOG(FATAL, "aborting due to tcmalloc::CreateTlsKey error: %s", strerror(rv));
+  }
+}
+#endif
+
+#if PROFILE_HANDLER_PERF_EVENTS
+static int PerfEventOpen(struct perf_event_attr* attr) {
+  // Measure the calling thread on any cpu.
+  int fd = syscall(SYS_perf_event_open, attr, 0, -1, -1, 0);
+  if (fd >= 0) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  return fd;
+}
+
+// Checks that the event can be opened. Unprivileged processes
+// typically may not sample kernel code (see perf_event_paranoid), so
+// we retry with user-space-only sampling. Samples that land in the
+// kernel are then lost rather than attributed to the syscall site.
+static bool ProbePerfEvent(struct perf_event_attr* attr) {
+  int fd = PerfEventOpen(attr);
+  if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+    attr->exclude_kernel = 1;
+    attr->exclude_hv = 1;
+    fd = PerfEventOpen(attr);
+  }
+  if (fd < 0) {
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+bool ProfileHandler::InitPerfEvents(const char* spec) {
+  memset(&perf_attr_, 0, sizeof(perf_attr_));
+  perf_attr_.size = sizeof(perf_attr_);
+  perf_attr_.disabled = 1;
+
+  if (strcmp(spec, "cycles") == 0) {
+    // Hardware counters are often missing (e.g. in VMs), so cycles
+    // are only a preference.
+    struct perf_event_attr cycles = perf_attr_;
+    cycles.type = PERF_TYPE_HARDWARE;
+    cycles.config = PERF_COUNT_HW_CPU_CYCLES;
+    // Cycles don't map to time, so let the kernel adjust the period
+    // to hit our frequency.
+    cycles.freq = 1;
+    cycles.sample_freq = frequency_;
+    if (ProbePerfEvent(&cycles)) {
+      perf_attr_ = cycles;
+      return true;
+    }
+    RAW_LOG(INFO, "No cpu cycles perf event (%s), using task-clock instead", strerror(errno));
+  }
+
+  // Both clocks count nanoseconds the thread spent running.
+  perf_attr_.type = PERF_TYPE_SOFTWARE;
+  perf_attr_.config = (strcmp(spec, "cpu-clock") == 0 ? PERF_COUNT_SW_CPU_CLOCK : PERF_COUNT_SW_TASK_CLOCK);
+  perf_attr_.sample_period = 1000000000 / frequency_;
+  return ProbePerfEvent(&perf_attr_);
+}
+
+void ProfileHandler::OpenPerfEvent(RegisteredThread* thread) {
+  if (thread->perf_fd >= 0) {
+    return;
+  }
+
+  int fd = PerfEventOpen(&perf_attr_);
+  if (fd < 0) {
+    RAW_LOG(INFO, "Thread not profiled: perf_event_open failed: %s", strerror(errno));
+    return;
+  }
+
+  // Overflows are reported as signal_number_ to this very thread.
+  struct f_owner_ex owner;
+  owner.type = F_OWNER_TID;
+  owner.pid = thread->tid;
+  if (fcntl(fd, F_SETOWN_EX, &owner) != 0 || fcntl(fd, F_SETSIG, signal_number_) != 0 ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC) != 0) {
+    RAW_LOG(INFO, "Thread not profiled: can't set up perf event signal: %s", strerror(errno));
+    close(fd);
+    return;
+  }
+  thread->perf_fd = fd;
+
+  if (timer_running_) {
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+#endif
+
 void ProfileHandler::Init() { instance_ = new ProfileHandler(); }
 
 ProfileHandler* ProfileHandler::Instance() {
@@ -303,7 +525,15 @@ ProfileHandler* ProfileHandler::Instance() {
 }
 
 ProfileHandler::ProfileHandler()
-    : timer_running_(false), interrupts_(0), callback_count_(0), allowed_(true), per_thread_timer_enabled_(false) {
+    : timer_running_(false),
+      interrupts_(0),
+      callback_count_(0),
+      allowed_(true),
+      per_thread_timer_enabled_(false),
+      perf_events_enabled_(false),
+      callbacks_(nullptr),
+      active_handlers_{},
+      handler_epoch_(0) {
   SpinLockHolder cl(&control_lock_);
 
   timer_type_ = (getenv("CPUPROFILE_REALTIME") ? ITIMER_REAL : ITIMER_PROF);
@@ -319,6 +549,11 @@ ProfileHandler::ProfileHandler()
     frequency_ = kDefaultFrequency;
   }
 
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  registered_threads_ = nullptr;
+  CreateRegisteredThreadKey(&registered_thread_key_, RegisteredThreadDestructor);
+#endif
+
   if (!allowed_) {
     return;
   }
@@ -329,7 +564,24 @@ ProfileHandler::ProfileHandler()
   const char* per_thread = getenv("CPUPROFILE_PER_THREAD_TIMERS");
   const char* signal_number = getenv("CPUPROFILE_TIMER_SIGNAL");
 
-  if (per_thread || signal_number) {
+#if PROFILE_HANDLER_PERF_EVENTS
+  const char* perf_events = getenv("CPUPROFILE_PERF_EVENTS");
+  if (perf_events) {
+    if (InitPerfEvents(perf_events)) {
+      perf_events_enabled_ = true;
+    } else {
+      RAW_LOG(INFO, "Ignoring CPUPROFILE_PERF_EVENTS: perf_event_open failed: %s", strerror(errno));
+    }
+  }
+#endif
+
+  if (perf_events_enabled_) {
+    // Per-thread timers are superseded, but the signal still can be
+    // chosen.
+    if (signal_number) {
+      signal_number_ = strtol(signal_number, nullptr, 0);
+    }
+  } else if (per_thread || signal_number) {
     if (timer_create) {
       CreateThreadTimerKey(&thread_timer_key);
       per_thread_timer_enabled_ = true;
@@ -374,11 +626,23 @@ ProfileHandler::~ProfileHandler() {
 void ProfileHandler::RegisterThread() {
   SpinLockHolder cl(&control_lock_);
 
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  // Threads are recorded even if we're not allowed to use the timer
+  // signal, since the wall-clock profiler has its own signal.
+  RegisteredThread* thread = RecordThread();
+#endif
+
   if (!allowed_) {
     return;
   }
 
   // Record the thread identifier and start the timer if profiling is on.
+#if PROFILE_HANDLER_PERF_EVENTS
+  if (perf_events_enabled_) {
+    OpenPerfEvent(thread);
+    return;
+  }
+#endif
 #if HAVE_LINUX_SIGEV_THREAD_ID
   if (per_thread_timer_enabled_) {
     StartLinuxThreadTimer(timer_type_, signal_number_, frequency_, thread_timer_key);
@@ -388,17 +652,24 @@ void ProfileHandler::RegisterThread() {
   UpdateTimer(callback_count_ > 0);
 }
 
+#if PROFILE_HANDLER_THREAD_HOOK
+void ProfileHandler::RegisterNewThread() {
+  sigset_t mask;
+  if (pthread_sigmask(SIG_BLOCK, nullptr, &mask) == 0 && sigismember(&mask, signal_number_)) {
+    return;
+  }
+  RegisterThread();
+}
+#endif
+
 ProfileHandlerToken* ProfileHandler::RegisterCallback(ProfileHandlerCallback callback, void* callback_arg) {
   ProfileHandlerToken* token = new ProfileHandlerToken(callback, callback_arg);
-  CallbackList copy;
-  copy.push_back(token);
 
   SpinLockHolder cl(&control_lock_);
-  {
-    ScopedSignalBlocker block(signal_number_);
-    SpinLockHolder sl(&signal_lock_);
-    callbacks_.splice(callbacks_.end(), copy);
-  }
+  CallbackList* old = callbacks_.load(std::memory_order_relaxed);
+  CallbackList* copy = old ? new CallbackList(*old) : new CallbackList;
+  copy->push_back(token);
+  delete ReplaceCallbacks(copy);
 
   ++callback_count_;
   UpdateTimer(true);
@@ -409,13 +680,13 @@ void ProfileHandler::UnregisterCallback(ProfileHandlerToken* token) {
   SpinLockHolder cl(&control_lock_);
   RAW_CHECK(callback_count_ > 0, "Invalid callback count");
 
-  CallbackList copy;
+  CallbackList* copy = new CallbackList;
   bool found = false;
-  for (ProfileHandlerToken* callback_token : callbacks_) {
+  for (ProfileHandlerToken* callback_token : *callbacks_.load(std::memory_order_relaxed)) {
     if (callback_token == token) {
       found = true;
     } else {
-      copy.push_back(callback_token);
+      copy->push_back(callback_token);
     }
   }
 
@@ -423,16 +694,8 @@ void ProfileHandler::UnregisterCallback(ProfileHandlerToken* token) {
     RAW_LOG(FATAL, "Invalid token");
   }
 
-  {
-    ScopedSignalBlocker block(signal_number_);
-    SpinLockHolder sl(&signal_lock_);
-    // Replace callback list holding signal lock. We cannot call
-    // pretty much anything that takes locks. Including malloc
-    // locks. So we only swap here and cleanup later.
-    using std::swap;
-    swap(copy, callbacks_);
-  }
-  // copy gets deleted after signal_lock_ is dropped
+  // After this no signal handler can be running token's callback.
+  delete ReplaceCallbacks(copy);
 
   --callback_count_;
   if (callback_count_ == 0) {
@@ -443,34 +706,61 @@ void ProfileHandler::UnregisterCallback(ProfileHandlerToken* token) {
 
 void ProfileHandler::Reset() {
   SpinLockHolder cl(&control_lock_);
-  CallbackList copy;
-  {
-    ScopedSignalBlocker block(signal_number_);
-    SpinLockHolder sl(&signal_lock_);
-    // Only do swap under this critical lock.
-    using std::swap;
-    swap(copy, callbacks_);
-  }
-  for (ProfileHandlerToken* token : copy) {
-    delete token;
+  CallbackList* old = ReplaceCallbacks(nullptr);
+  if (old != nullptr) {
+    for (ProfileHandlerToken* token : *old) {
+      delete token;
+    }
+    delete old;
   }
   callback_count_ = 0;
   UpdateTimer(false);
-  // copy gets deleted here
+}
+
+ProfileHandler::CallbackList* ProfileHandler::ReplaceCallbacks(CallbackList* callbacks) {
+  CallbackList* old = callbacks_.exchange(callbacks);
+
+  // Handler that entered before the exchange above has its epoch
+  // parity counted in active_handlers_. But it could have read the
+  // epoch long ago (it might have been preempted right after), so
+  // we wait for both parities, flipping the epoch each time so that
+  // handlers entering now don't keep the counter we're waiting for
+  // busy.
+  for (int i = 0; i < 2; i++) {
+    unsigned idx = handler_epoch_.fetch_add(1) & 1;
+    while (active_handlers_[idx].load() != 0) {
+      sched_yield();
+    }
+  }
+  return old;
 }
 
 void ProfileHandler::GetState(ProfileHandlerState* state) {
   SpinLockHolder cl(&control_lock_);
-  {
-    ScopedSignalBlocker block(signal_number_);
-    SpinLockHolder sl(&signal_lock_);  // Protects interrupts_.
-    state->interrupts = interrupts_;
-  }
+  state->interrupts = interrupts_.load(std::memory_order_relaxed);
   state->frequency = frequency_;
   state->callback_count = callback_count_;
   state->allowed = allowed_;
 }
 
+int ProfileHandler::GetThreadIds(pid_t* tids, int max_tids) {
+  int count = 0;
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  SpinLockHolder cl(&control_lock_);
+  DropForkedThreads();
+  for (RegisteredThread* thread = registered_threads_; thread != nullptr; thread = thread->next) {
+    if (thread->tid == 0) {
+      continue;
+    }
+    if (count < max_tids) {
+      tids[count] = thread->tid;
+    }
+    count++;
+  }
+#endif
+  return count;
+}
+
 void ProfileHandler::UpdateTimer(bool enable) {
   if (per_thread_timer_enabled_) {
     // Ignore any attempts to disable it because that's not supported, and it's
@@ -483,6 +773,18 @@ void ProfileHandler::UpdateTimer(bool enable) {
   }
   timer_running_ = enable;
 
+#if PROFILE_HANDLER_PERF_EVENTS
+  if (perf_events_enabled_) {
+    DropForkedThreads();
+    for (RegisteredThread* thread = registered_threads_; thread != nullptr; thread = thread->next) {
+      if (thread->perf_fd >= 0) {
+        ioctl(thread->perf_fd, enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+      }
+    }
+    return;
+  }
+#endif
+
   struct itimerval timer;
   static const int kMillion = 1000000;
   int interval_usec = enable ? kMillion / frequency_ : 0;
@@ -513,13 +815,20 @@ void ProfileHandler::SignalHandler(int sig, siginfo_t* sinfo, void* ucontext) {
   // ProfileHandler::Instance runs.
   ProfileHandler* instance = instance_;
   RAW_CHECK(instance != nullptr, "ProfileHandler is not initialized");
-  {
-    SpinLockHolder sl(&instance->signal_lock_);
-    ++instance->interrupts_;
-    for (CallbackIterator it = instance->callbacks_.begin(); it != instance->callbacks_.end(); ++it) {
+
+  // No locks here, so signal handlers in different threads don't
+  // serialize. See ReplaceCallbacks for how writers know when it is
+  // safe to free the list we're walking.
+  unsigned idx = instance->handler_epoch_.load() & 1;
+  instance->active_handlers_[idx].fetch_add(1);
+  instance->interrupts_.fetch_add(1, std::memory_order_relaxed);
+  CallbackList* callbacks = instance->callbacks_.load();
+  if (callbacks != nullptr) {
+    for (CallbackIterator it = callbacks->begin(); it != callbacks->end(); ++it) {
       (*it)->callback(sig, sinfo, ucontext, (*it)->callback_arg);
     }
   }
+  instance->active_handlers_[idx].fetch_sub(1);
   errno = saved_errno;
 }
 
@@ -541,6 +850,66 @@ void ProfileHandlerReset() { return ProfileHandler::Instance()->Reset(); }
 
 void ProfileHandlerGetState(ProfileHandlerState* state) { ProfileHandler::Instance()->GetState(state); }
 
+int ProfileHandlerGetThreadIds(pid_t* tids, int max_tids) {
+  return ProfileHandler::Instance()->GetThreadIds(tids, max_tids);
+}
+
+#if PROFILE_HANDLER_THREAD_HOOK
+
+// __THROWNL is glibc's exception specification of pthread_create.
+#ifndef __THROWNL
+#define __THROWNL
+#endif
+
+namespace {
+
+typedef int (*PthreadCreateFn)(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*);
+
+struct ThreadStart {
+  void* (*start_routine)(void*);
+  void* arg;
+};
+
+bool AutoRegisterThreads() {
+  static const bool enabled = (getenv("CPUPROFILE_AUTO_REGISTER_THREADS") != nullptr);
+  return enabled;
+}
+
+void* RegisteredThreadStart(void* arg) {
+  ThreadStart start = *static_cast<ThreadStart*>(arg);
+  delete static_cast<ThreadStart*>(arg);
+  // Timer (and the rest) is cleaned up by thread-specific data
+  // destructors when the thread exits.
+  ProfileHandler::Instance()->RegisterNewThread();
+  return start.start_routine(start.arg);
+}
+
+}  // namespace
+
+// Interposes pthread_create, so that with
+// CPUPROFILE_AUTO_REGISTER_THREADS every thread is registered,
+// including threads created by code that doesn't know about the
+// profiler.
+extern "C" PERFTOOLS_DLL_DECL int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
+                                                 void* (*start_routine)(void*), void* arg) __THROWNL {
+  static PthreadCreateFn real_pthread_create = reinterpret_cast<PthreadCreateFn>(dlsym(RTLD_NEXT, "pthread_create"));
+  if (real_pthread_create == nullptr) {
+    return ENOSYS;
+  }
+  if (!AutoRegisterThreads()) {
+    return real_pthread_create(thread, attr, start_routine, arg);
+  }
+
+  ThreadStart* start = new ThreadStart{start_routine, arg};
+  int rv = real_pthread_create(thread, attr, RegisteredThreadStart, start);
+  if (rv != 0) {
+    delete start;
+  }
+  return rv;
+}
+
+#endif  // PROFILE_HANDLER_THREAD_HOOK
+
 #else  // OS_CYGWIN
 
 // ITIMER_PROF doesn't work under cygwin.  ITIMER_REAL is available, but doesn't
@@ -559,4 +928,6 @@ void ProfileHandlerReset() {}
 
 void ProfileHandlerGetState(ProfileHandlerState* state) {}
 
+int ProfileHandlerGetThreadIds(pid_t* tids, int max_tids) { return 0; }
+
 #endif  // OS_CYGWIN
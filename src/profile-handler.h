@@ -43,6 +43,11 @@
  * with CPUPROFILE_PER_THREAD_TIMERS. The signal defaults to SIGPROF/SIGALRM to
  * match the choice of timer and can be set to an arbitrary value using
  * CPUPROFILE_TIMER_SIGNAL with CPUPROFILE_PER_THREAD_TIMERS.
+ *
+ * On Linux, CPUPROFILE_PERF_EVENTS replaces the timers with per-thread
+ * perf_event_open(2) counters that deliver the same signal on overflow
+ * (see ProfileHandler::OpenPerfEvent). Threads are only sampled after
+ * they call ProfileHandlerRegisterThread, same as with per-thread timers.
  */
 
 #ifndef BASE_PROFILE_HANDLER_H_
@@ -52,6 +57,7 @@
 
 #include <signal.h>  // IWYU pragma: keep
 #include <stdint.h>
+#include <sys/types.h>  /* for pid_t */
 
 /* Forward declaration. */
 struct ProfileHandlerToken;
@@ -67,8 +73,10 @@ struct ProfileHandlerToken;
  * - Callback must be async-signal-safe.
  * - None of the functions in ProfileHandler are async-signal-safe. Therefore,
  *   callback function *must* not call any of the ProfileHandler functions.
- * - Callback is not required to be re-entrant. At most one instance of
- *   callback can run at a time.
+ * - Callback is not required to be re-entrant within one thread. But
+ *   profiling signals are handled without taking any locks, so the
+ *   same callback may run concurrently in different threads. Any
+ *   state shared between threads has to be lock-free.
  *
  * Notes:
  * - The SIGPROF signal handler saves and restores errno, so the callback
@@ -89,10 +97,12 @@ struct ProfileHandlerToken;
 typedef void (*ProfileHandlerCallback)(int sig, siginfo_t* sig_info, void* ucontext, void* callback_arg);
 
 /*
- * Registers a new thread with profile handler and should be called only once
- * per thread. The main thread is registered at program startup. This routine
- * is called by the Thread module in google3/thread whenever a new thread is
- * created. This function is not async-signal-safe.
+ * Registers a new thread with profile handler. Calling it again in the same
+ * thread has no effect. The main thread is registered at program startup. This
+ * routine is called by the Thread module in google3/thread whenever a new
+ * thread is created, and for every thread created with pthread_create when
+ * CPUPROFILE_AUTO_REGISTER_THREADS is set (Linux, shared library only). This
+ * function is not async-signal-safe.
  */
 void ProfileHandlerRegisterThread();
 
@@ -135,4 +145,12 @@ struct ProfileHandlerState {
 };
 void ProfileHandlerGetState(struct ProfileHandlerState* state);
 
+/*
+ * Stores kernel thread ids (as returned by gettid) of up to 'max_tids' live
+ * threads that called ProfileHandlerRegisterThread into 'tids' and returns
+ * the number of such threads, which may be larger than 'max_tids'. Only
+ * implemented on Linux, returns 0 elsewhere. Not async-signal-safe.
+ */
+int ProfileHandlerGetThreadIds(pid_t* tids, int max_tids);
+
 #endif /* BASE_PROFILE_HANDLER_H_ */
@@ -0,0 +1,422 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+
+#include "profile-proto.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "base/proc_maps_iterator.h"
+
+namespace tcmalloc {
+
+namespace {
+
+// Wire types we use.
+constexpr int kVarintWireType = 0;
+constexpr int kLengthDelimitedWireType = 2;
+
+constexpr int kMaxVarintSize = 10;
+
+// We cap stack depth and number of values per sample, so that
+// encoding buffers for samples can live on stack.
+constexpr int kMaxDepth = 256;
+constexpr int kMaxValues = 8;
+
+// Field numbers of Profile message.
+enum {
+  kProfileSampleType = 1,
+  kProfileSample = 2,
+  kProfileMapping = 3,
+  kProfileLocation = 4,
+  kProfileStringTable = 6,
+  kProfileTimeNanos = 9,
+  kProfileDurationNanos = 10,
+  kProfilePeriodType = 11,
+  kProfilePeriod = 12,
+  kProfileComment = 13,
+};
+
+// Encodes protobuf wire format into fixed-size buffer. Callers make
+// sure the buffer is large enough.
+class Encoder {
+ public:
+  explicit Encoder(char* buf) : begin_(buf), ptr_(buf) {}
+
+  void Varint(uint64_t v) {
+    while (v >= 0x80) {
+      *ptr_++ = static_cast<char>((v & 0x7f) | 0x80);
+      v >>= 7;
+    }
+    *ptr_++ = static_cast<char>(v);
+  }
+
+  void Tag(int field, int wire_type) { Varint((static_cast<uint64_t>(field) << 3) | wire_type); }
+
+  void VarintField(int field, uint64_t v) {
+    Tag(field, kVarintWireType);
+    Varint(v);
+  }
+
+  void BytesField(int field, const char* data, size_t size) {
+    Tag(field, kLengthDelimitedWireType);
+    Varint(size);
+    memcpy(ptr_, data, size);
+    ptr_ += size;
+  }
+
+  const char* data() const { return begin_; }
+  size_t size() const { return ptr_ - begin_; }
+
+ private:
+  char* const begin_;
+  char* ptr_;
+};
+
+// Writes top-level length-delimited field (i.e. submessage or string).
+void WriteBytesField(GenericWriter* out, int field, const char* data, size_t size) {
+  char header[2 * kMaxVarintSize];
+  Encoder e(header);
+  e.Tag(field, kLengthDelimitedWireType);
+  e.Varint(size);
+  out->AppendMem(e.data(), e.size());
+  out->AppendMem(data, size);
+}
+
+void WriteVarintField(GenericWriter* out, int field, uint64_t v) {
+  char buf[2 * kMaxVarintSize];
+  Encoder e(buf);
+  e.VarintField(field, v);
+  out->AppendMem(e.data(), e.size());
+}
+
+struct Crc32Table {
+  uint32_t entries[256];
+
+  constexpr Crc32Table() : entries{} {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+      }
+      entries[i] = c;
+    }
+  }
+};
+
+constexpr Crc32Table kCrc32Table;
+
+uint32_t Crc32Update(uint32_t crc, const char* data, size_t size) {
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++) {
+    crc = kCrc32Table.entries[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+void PutLE32(char* p, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = static_cast<char>(v >> (8 * i));
+  }
+}
+
+}  // namespace
+
+ProfileFormat ParseProfileFormat(const char* str) {
+  if (str == nullptr || *str == '\0' || strcmp(str, "legacy") == 0) {
+    return kLegacyProfileFormat;
+  }
+  if (strcmp(str, "proto") == 0) {
+    return kProtoProfileFormat;
+  }
+  if (strcmp(str, "proto.gz") == 0) {
+    return kProtoGzipProfileFormat;
+  }
+  RAW_LOG(WARNING, "Unknown profile format '%s', using legacy format", str);
+  return kLegacyProfileFormat;
+}
+
+ProfileProtoWriter::ProfileProtoWriter(GenericWriter* out, malloc_fn chunk_malloc, free_fn chunk_free)
+    : out_(out), malloc_(chunk_malloc), free_(chunk_free) {
+  // string_table[0] must be empty string.
+  WriteString("");
+}
+
+ProfileProtoWriter::~ProfileProtoWriter() {
+  if (locations_.entries != nullptr) {
+    free_(locations_.entries);
+  }
+  if (strings_.entries != nullptr) {
+    free_(strings_.entries);
+  }
+}
+
+int64_t ProfileProtoWriter::WriteString(const char* str) {
+  WriteBytesField(out_, kProfileStringTable, str, strlen(str));
+  return num_strings_++;
+}
+
+void ProfileProtoWriter::WriteValueType(int field, const ValueType& vt) {
+  int64_t type = WriteString(vt.type);
+  int64_t unit = WriteString(vt.unit);
+
+  char buf[4 * kMaxVarintSize];
+  Encoder e(buf);
+  e.VarintField(1, type);  // ValueType.type
+  e.VarintField(2, unit);  // ValueType.unit
+  WriteBytesField(out_, field, e.data(), e.size());
+}
+
+void ProfileProtoWriter::WriteHeader(const ValueType* sample_types, int num_sample_types,
+                                     const ValueType& period_type, int64_t period, int64_t time_nanos) {
+  for (int i = 0; i < num_sample_types; i++) {
+    WriteValueType(kProfileSampleType, sample_types[i]);
+  }
+  WriteValueType(kProfilePeriodType, period_type);
+  WriteVarintField(out_, kProfilePeriod, period);
+  WriteVarintField(out_, kProfileTimeNanos, time_nanos);
+}
+
+void ProfileProtoWriter::AddComment(const char* comment) {
+  WriteVarintField(out_, kProfileComment, WriteString(comment));
+}
+
+void ProfileProtoWriter::Grow(IdTable* table) {
+  uint64_t old_capacity = table->capacity;
+  IdEntry* old = table->entries;
+
+  table->capacity = std::max<uint64_t>(1024, old_capacity * 2);
+  size_t bytes = sizeof(IdEntry) * table->capacity;
+  table->entries = static_cast<IdEntry*>(malloc_(bytes));
+  RAW_CHECK(table->entries != nullptr, "out of memory for profile");
+  memset(table->entries, 0, bytes);
+
+  uint64_t mask = table->capacity - 1;
+  for (uint64_t i = 0; i < old_capacity; i++) {
+    if (old[i].id != 0) {
+      uint64_t h = (old[i].key * 0x9E3779B97F4A7C15ULL) >> 16;
+      while (table->entries[h & mask].id != 0) {
+        h++;
+      }
+      table->entries[h & mask] = old[i];
+    }
+  }
+  if (old != nullptr) {
+    free_(old);
+  }
+}
+
+uint64_t ProfileProtoWriter::FindOrInsert(IdTable* table, uint64_t key, uint64_t new_id) {
+  if ((table->size + 1) * 2 > table->capacity) {
+    Grow(table);
+  }
+  uint64_t mask = table->capacity - 1;
+  uint64_t h = (key * 0x9E3779B97F4A7C15ULL) >> 16;
+  for (;; h++) {
+    IdEntry* e = &table->entries[h & mask];
+    if (e->id == 0) {
+      e->key = key;
+      e->id = new_id;
+      table->size++;
+      return e->id;
+    }
+    if (e->key == key) {
+      return e->id;
+    }
+  }
+}
+
+int64_t ProfileProtoWriter::InternString(const char* str) {
+  // Index 0 is taken by the empty string, so new_id is never 0.
+  int64_t id = FindOrInsert(&strings_, reinterpret_cast<uintptr_t>(str), num_strings_);
+  if (id == num_strings_) {
+    WriteString(str);
+  }
+  return id;
+}
+
+void ProfileProtoWriter::AddSample(const int64_t* values, int num_values, const void* const* stack, int depth,
+                                   bool leaf_is_pc, const ProfileLabel* label) {
+  depth = std::min(depth, kMaxDepth);
+  num_values = std::min(num_values, kMaxValues);
+
+  char locations[kMaxDepth * kMaxVarintSize];
+  Encoder loc(locations);
+  for (int i = 0; i < depth; i++) {
+    uint64_t address = reinterpret_cast<uintptr_t>(stack[i]);
+    if (!(i == 0 && leaf_is_pc) && address > 0) {
+      address--;
+    }
+    loc.Varint(LocationId(address));
+  }
+
+  char vals[kMaxValues * kMaxVarintSize];
+  Encoder val(vals);
+  for (int i = 0; i < num_values; i++) {
+    val.Varint(static_cast<uint64_t>(values[i]));
+  }
+
+  char lab[4 * kMaxVarintSize];
+  Encoder l(lab);
+  if (label != nullptr) {
+    l.VarintField(1, InternString(label->key));    // Label.key
+    l.VarintField(2, InternString(label->value));  // Label.str
+  }
+
+  char sample[sizeof(locations) + sizeof(vals) + sizeof(lab) + 6 * kMaxVarintSize];
+  Encoder e(sample);
+  e.BytesField(1, loc.data(), loc.size());  // Sample.location_id, packed
+  e.BytesField(2, val.data(), val.size());  // Sample.value, packed
+  if (label != nullptr) {
+    e.BytesField(3, l.data(), l.size());  // Sample.label
+  }
+  WriteBytesField(out_, kProfileSample, e.data(), e.size());
+}
+
+void ProfileProtoWriter::Finish(int64_t duration_nanos) {
+  WriteVarintField(out_, kProfileDurationNanos, duration_nanos);
+
+  struct MappingEntry {
+    uint64_t start;
+    uint64_t limit;
+    uint64_t offset;
+    int64_t filename;
+  };
+
+  // Only executable mappings are interesting to pprof.
+  auto is_code = [](const ProcMapping& m) { return m.flags != nullptr && strchr(m.flags, 'x') != nullptr; };
+
+  int capacity = 0;
+  ForEachProcMapping([&](const ProcMapping& m) { capacity += is_code(m); });
+
+  MappingEntry* mappings = nullptr;
+  int num_mappings = 0;
+  if (capacity > 0) {
+    mappings = static_cast<MappingEntry*>(malloc_(sizeof(MappingEntry) * capacity));
+    RAW_CHECK(mappings != nullptr, "out of memory for profile mappings");
+    ForEachProcMapping([&](const ProcMapping& m) {
+      if (!is_code(m) || num_mappings == capacity) {
+        return;
+      }
+      const char* filename = m.filename != nullptr ? m.filename : "";
+      mappings[num_mappings++] = MappingEntry{m.start, m.end, m.offset, WriteString(filename)};
+    });
+    std::sort(mappings, mappings + num_mappings,
+              [](const MappingEntry& a, const MappingEntry& b) { return a.start < b.start; });
+  }
+
+  for (int i = 0; i < num_mappings; i++) {
+    char buf[6 * kMaxVarintSize];
+    Encoder e(buf);
+    e.VarintField(1, i + 1);                 // Mapping.id
+    e.VarintField(2, mappings[i].start);     // Mapping.memory_start
+    e.VarintField(3, mappings[i].limit);     // Mapping.memory_limit
+    e.VarintField(4, mappings[i].offset);    // Mapping.file_offset
+    e.VarintField(5, mappings[i].filename);  // Mapping.filename
+    WriteBytesField(out_, kProfileMapping, e.data(), e.size());
+  }
+
+  for (uint64_t i = 0; i < locations_.capacity; i++) {
+    const IdEntry& l = locations_.entries[i];
+    if (l.id == 0) {
+      continue;
+    }
+
+    // First mapping with limit above the address.
+    MappingEntry* m = std::upper_bound(mappings, mappings + num_mappings, l.key,
+                                       [](uint64_t address, const MappingEntry& m) { return address < m.limit; });
+    uint64_t mapping_id = 0;
+    if (m != mappings + num_mappings && m->start <= l.key) {
+      mapping_id = m - mappings + 1;
+    }
+
+    char buf[4 * kMaxVarintSize];
+    Encoder e(buf);
+    e.VarintField(1, l.id);  // Location.id
+    if (mapping_id != 0) {
+      e.VarintField(2, mapping_id);  // Location.mapping_id
+    }
+    e.VarintField(3, l.key);      // Location.address
+    WriteBytesField(out_, kProfileLocation, e.data(), e.size());
+  }
+
+  if (mappings != nullptr) {
+    free_(mappings);
+  }
+}
+
+ProfileFileWriter::ProfileFileWriter(RawFD fd, bool gzip) : fd_(fd), gzip_(gzip) {
+  if (!gzip_) {
+    return;
+  }
+  // Magic, deflate method, no flags, no mtime, no extra flags,
+  // unknown OS.
+  static const char kHeader[10] = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, '\xff'};
+  RawWrite(fd_, kHeader, sizeof(kHeader));
+}
+
+ProfileFileWriter::~ProfileFileWriter() {
+  FinalRecycle();
+  if (!gzip_) {
+    return;
+  }
+
+  // Empty final stored block followed by gzip trailer.
+  char trailer[5 + 8] = {1, 0, 0, '\xff', '\xff'};
+  PutLE32(trailer + 5, crc_);
+  PutLE32(trailer + 9, size_);
+  RawWrite(fd_, trailer, sizeof(trailer));
+}
+
+std::pair<char*, char*> ProfileFileWriter::RecycleBuffer(char* buf_begin, char* buf_end, int want_at_least) {
+  RAW_CHECK(want_at_least <= kSize, "ProfileFileWriter can't append this much at once");
+
+  uint32_t len = buf_end - buf_begin;
+  if (len > 0 && !gzip_) {
+    RawWrite(fd_, buf_begin, len);
+  } else if (len > 0) {
+    crc_ = Crc32Update(crc_, buf_begin, len);
+    size_ += len;
+
+    // Non-final stored block: BFINAL=0, BTYPE=00, then LEN and its
+    // complement.
+    char header[5] = {0, static_cast<char>(len), static_cast<char>(len >> 8), static_cast<char>(~len),
+                      static_cast<char>(~len >> 8)};
+    RawWrite(fd_, header, sizeof(header));
+    RawWrite(fd_, buf_begin, len);
+  }
+
+  return {buffer_, buffer_ + kSize};
+}
+
+}  // namespace tcmalloc
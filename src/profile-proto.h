@@ -0,0 +1,182 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef PROFILE_PROTO_H_
+#define PROFILE_PROTO_H_
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <gperftools/profiler.h>
+
+#include "base/basictypes.h"
+#include "base/generic_writer.h"
+#include "base/logging.h"
+
+// This module writes profiles in pprof's profile.proto format (see
+// https://github.com/google/pprof/blob/main/proto/profile.proto),
+// which modern pprof and related tooling read without converting
+// from our legacy formats first. We don't depend on protobuf
+// library. Instead, messages are encoded by hand and streamed into
+// GenericWriter as samples come in. profile.proto has no required
+// ordering of fields, so only locations and mappings, which need to
+// know every address seen, are written at the end.
+
+namespace tcmalloc {
+
+enum ProfileFormat {
+  kLegacyProfileFormat,     // cpuprofile-fileformat or heap profile text
+  kProtoProfileFormat,      // profile.proto
+  kProtoGzipProfileFormat,  // profile.proto in gzip container
+};
+
+// Parses value of CPUPROFILE_FORMAT or HEAPPROFILE_FORMAT
+// environment variables: "legacy" (or empty/nullptr), "proto" or
+// "proto.gz". Unknown values are logged and treated as "legacy".
+ProfileFormat ParseProfileFormat(const char* str);
+
+// String label attached to profile samples, e.g. {"thread_state",
+// "off-cpu"}. Labels are identified by address, so the same label
+// must always be passed as the same object, which has to live until
+// the profile is written. It's the same type the profiler API uses
+// for labels set by applications.
+typedef ::ProfilerLabel ProfileLabel;
+
+class ATTRIBUTE_VISIBILITY_HIDDEN ProfileProtoWriter {
+ public:
+  typedef void* (*malloc_fn)(size_t);
+  typedef void (*free_fn)(void*);
+
+  // pprof's ValueType, e.g. {"cpu", "nanoseconds"}.
+  struct ValueType {
+    const char* type;
+    const char* unit;
+  };
+
+  // All memory is obtained via given functions, so heap profiler can
+  // use us while holding its lock.
+  ProfileProtoWriter(GenericWriter* out, malloc_fn chunk_malloc, free_fn chunk_free);
+  ~ProfileProtoWriter();
+
+  // Writes sample types (which also gives number of values each
+  // sample has), sampling period and profile start time.
+  void WriteHeader(const ValueType* sample_types, int num_sample_types, const ValueType& period_type, int64_t period,
+                   int64_t time_nanos);
+
+  // Writes sample with 'values' (one per sample type) and stack.
+  // Stack entries are return addresses, which point past calls. So
+  // we subtract one to land addresses on call instructions, as
+  // pprof does when reading legacy profiles. Except stack[0] when
+  // 'leaf_is_pc' is true (cpu profiles). 'label', if not nullptr, is
+  // attached to the sample.
+  void AddSample(const int64_t* values, int num_values, const void* const* stack, int depth, bool leaf_is_pc,
+                 const ProfileLabel* label = nullptr);
+
+  // Writes free-form comment, which "pprof -comments" shows.
+  void AddComment(const char* comment);
+
+  // Writes profile duration, mappings of executable code from
+  // /proc/self/maps and deduplicated locations of all addresses seen
+  // by AddSample. Must be called once, after all samples.
+  void Finish(int64_t duration_nanos);
+
+ private:
+  // Open addressing hash table from keys (addresses) to ids.
+  struct IdEntry {
+    uint64_t key;
+    uint64_t id;  // 0 means empty hash table slot
+  };
+
+  struct IdTable {
+    IdEntry* entries = nullptr;
+    uint64_t capacity = 0;  // power of 2
+    uint64_t size = 0;
+  };
+
+  struct Mapping {
+    uint64_t start;
+    uint64_t limit;
+  };
+
+  // Returns id of 'key' in 'table', adding it with 'new_id' if
+  // necessary.
+  uint64_t FindOrInsert(IdTable* table, uint64_t key, uint64_t new_id);
+  void Grow(IdTable* table);
+
+  // Returns id of location for 'address', adding it if necessary.
+  uint64_t LocationId(uint64_t address) { return FindOrInsert(&locations_, address, locations_.size + 1); }
+
+  int64_t WriteString(const char* str);
+
+  // Like WriteString, but writes each 'str' (by address) only once.
+  int64_t InternString(const char* str);
+  void WriteValueType(int field, const ValueType& vt);
+
+  GenericWriter* const out_;
+  malloc_fn const malloc_;
+  free_fn const free_;
+
+  int64_t num_strings_ = 0;
+
+  IdTable locations_;
+  IdTable strings_;  // string table indices of InternString-ed strings
+
+  DISALLOW_COPY_AND_ASSIGN(ProfileProtoWriter);
+};
+
+// ProfileFileWriter is GenericWriter that writes profile to given
+// file descriptor, either as is or wrapped into gzip container (for
+// kProtoGzipProfileFormat). We don't implement deflate, so gzip-ed
+// data goes in "stored" (uncompressed) deflate blocks. This is for
+// pipelines that expect .gz files, not for saving space. Like
+// RawFDGenericWriter it holds its buffer within itself, so it doesn't
+// allocate memory.
+class ATTRIBUTE_VISIBILITY_HIDDEN ProfileFileWriter : public GenericWriter {
+ public:
+  // Largest payload of one stored deflate block.
+  static constexpr int kSize = 65535;
+
+  ProfileFileWriter(RawFD fd, bool gzip);
+  ~ProfileFileWriter() override;
+
+ private:
+  std::pair<char*, char*> RecycleBuffer(char* buf_begin, char* buf_end, int want_at_least) override;
+
+  const RawFD fd_;
+  const bool gzip_;
+  uint32_t crc_ = 0;
+  uint32_t size_ = 0;  // of uncompressed data, mod 2^32
+  char buffer_[kSize];
+};
+
+}  // namespace tcmalloc
+
+#endif  // PROFILE_PROTO_H_
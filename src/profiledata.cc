@@ -45,46 +45,189 @@
 #include <sys/time.h>
 #include <string.h>
 #include <fcntl.h>
+#include <signal.h>
+
+#include <algorithm>
 
 #include "profiledata.h"
 
 #include "base/logging.h"
 #include "base/proc_maps_iterator.h"
+#include "base/threading.h"
 
 // All of these are initialized in profiledata.h.
 const int ProfileData::kMaxStackDepth;
-const int ProfileData::kAssociativity;
-const int ProfileData::kBuckets;
+const int ProfileData::kMaxFrequencyChanges;
+const uint32_t ProfileData::kInitialStackNodes;
+const uint32_t ProfileData::kMaxStackNodes;
+const uint32_t ProfileData::kInitialAggregates;
+const uint32_t ProfileData::kMaxAggregates;
+const int ProfileData::kGenerationBufferLength;
 const int ProfileData::kBufferLength;
+const int ProfileData::kNumWriteBuffers;
+const int ProfileData::kWriteBufferLength;
+const int ProfileSampleBuffers::kShardSlots;
+const int ProfileSampleBuffers::kDrainBatch;
+const int ProfileSampleBuffers::kMaxProbes;
+
+// profile.proto output. It is defined here, so that ProfileData,
+// which libprofiler exports, doesn't expose internal types.
+struct ATTRIBUTE_VISIBILITY_HIDDEN ProfileData::ProtoOutput {
+  ProtoOutput(int fd, bool gzip) : file(fd, gzip), writer(&file, malloc, free) {}
+
+  tcmalloc::ProfileFileWriter file;
+  tcmalloc::ProfileProtoWriter writer;
+};
+
+ProfileData::Options::Options()
+    : frequency_(1), format_(tcmalloc::kLegacyProfileFormat), wall_clock_(false), max_file_bytes_(0) {}
 
-ProfileData::Options::Options() : frequency_(1) {}
+// How long the writer thread sleeps when there is nothing to write.
+static const long kWriterPollNanos = 10 * 1000 * 1000;
 
 // This function is safe to call from asynchronous signals (but is not
 // re-entrant).  However, that's not part of its public interface.
-void ProfileData::Evict(const Entry& entry) {
-  const int d = entry.depth;
-  const int nslots = d + 2;  // Number of slots needed in eviction buffer
-  if (num_evicted_ + nslots > kBufferLength) {
-    FlushEvicted();
+void ProfileData::Evict(Slot count, int depth, Slot label, const void* const* stack) {
+  const int header = (proto_ != nullptr ? 3 : 2);
+  const int nslots = depth + header;  // Number of slots needed in eviction buffer
+  if (num_evicted_ + nslots > kWriteBufferLength) {
+    if (!FlushEvicted()) {
+      // All buffers are waiting for the writer. We must not wait for
+      // it here, so the sample is lost.
+      write_dropped_ += count;
+      return;
+    }
     assert(num_evicted_ == 0);
-    assert(nslots <= kBufferLength);
+    assert(nslots <= kWriteBufferLength);
+  }
+  evict_[num_evicted_++] = count;
+  evict_[num_evicted_++] = depth;
+  if (proto_ != nullptr) {
+    evict_[num_evicted_++] = label;
+  }
+  memcpy(&evict_[num_evicted_], stack, depth * sizeof(Slot));
+  num_evicted_ += depth;
+}
+
+static inline uint32_t HashSlots(uintptr_t a, uintptr_t b) {
+  uint64_t h = static_cast<uint64_t>(a) * 0x9E3779B97F4A7C15ULL + static_cast<uint64_t>(b);
+  h ^= h >> 29;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  return static_cast<uint32_t>(h >> 32);
+}
+
+// This function is safe to call from asynchronous signals.
+uint32_t ProfileData::InternStack(Generation* gen, int depth, const void* const* stack) {
+  const uint32_t mask = 2 * gen->node_capacity - 1;
+  uint32_t caller = 0;
+  for (int i = depth - 1; i >= 0; i--) {
+    Slot pc = reinterpret_cast<Slot>(stack[i]);
+    uint32_t h = HashSlots(caller, pc) & mask;
+    uint32_t id;
+    while ((id = gen->node_index[h]) != 0) {
+      const StackNode& node = gen->nodes[id];
+      if (node.pc == pc && node.caller == caller) {
+        break;
+      }
+      h = (h + 1) & mask;
+    }
+    if (id == 0) {
+      if (gen->num_nodes == gen->node_capacity) {
+        return 0;
+      }
+      id = gen->num_nodes++;
+      gen->nodes[id].pc = pc;
+      gen->nodes[id].caller = caller;
+      gen->nodes[id].depth = gen->nodes[caller].depth + 1;
+      gen->node_index[h] = id;
+    }
+    caller = id;
+  }
+  return caller;
+}
+
+// This function is safe to call from asynchronous signals.
+ProfileData::Aggregate* ProfileData::FindAggregate(Generation* gen, uint32_t stack, Slot label) {
+  const uint32_t mask = 2 * gen->aggregate_capacity - 1;
+  for (uint32_t h = HashSlots(stack, label) & mask;; h = (h + 1) & mask) {
+    Aggregate* a = &gen->aggregates[h];
+    if (a->stack == stack && a->label == label) {
+      return a;
+    }
+    if (a->stack == 0) {
+      if (gen->num_aggregates == gen->aggregate_capacity) {
+        return nullptr;
+      }
+      gen->num_aggregates++;
+      a->count = 0;
+      a->label = label;
+      a->stack = stack;
+      return a;
+    }
+  }
+}
+
+void ProfileData::AllocateGeneration(Generation* gen, uint32_t node_capacity, uint32_t aggregate_capacity) {
+  gen->nodes = new StackNode[node_capacity];
+  gen->node_index = new uint32_t[2 * node_capacity];
+  gen->node_capacity = node_capacity;
+  gen->aggregates = new Aggregate[2 * aggregate_capacity];
+  gen->aggregate_capacity = aggregate_capacity;
+  memset(gen->node_index, 0, sizeof(gen->node_index[0]) * 2 * node_capacity);
+  memset(gen->aggregates, 0, sizeof(gen->aggregates[0]) * 2 * aggregate_capacity);
+  memset(&gen->nodes[0], 0, sizeof(gen->nodes[0]));
+  gen->num_nodes = 1;
+  gen->num_aggregates = 0;
+}
+
+void ProfileData::FreeGeneration(Generation* gen) {
+  delete[] gen->nodes;
+  delete[] gen->node_index;
+  delete[] gen->aggregates;
+  memset(gen, 0, sizeof(*gen));
+}
+
+void ProfileData::ClearGeneration(Generation* gen) {
+  if (gen->num_nodes > 1) {
+    memset(gen->node_index, 0, sizeof(gen->node_index[0]) * 2 * gen->node_capacity);
+    gen->num_nodes = 1;
+  }
+  if (gen->num_aggregates > 0) {
+    memset(gen->aggregates, 0, sizeof(gen->aggregates[0]) * 2 * gen->aggregate_capacity);
+    gen->num_aggregates = 0;
   }
-  evict_[num_evicted_++] = entry.count;
-  evict_[num_evicted_++] = d;
-  memcpy(&evict_[num_evicted_], entry.stack, d * sizeof(Slot));
-  num_evicted_ += d;
 }
 
 ProfileData::ProfileData()
-    : hash_(0),
+    : generations_{},
+      active_(0),
+      frozen_(nullptr),
+      generation_buffer_(nullptr),
       evict_(0),
       num_evicted_(0),
       out_(-1),
       count_(0),
       evictions_(0),
+      write_dropped_(0),
+      truncated_(0),
+      labels_lost_(false),
       total_bytes_(0),
+      file_bytes_(0),
       fname_(0),
-      start_time_(0) {}
+      start_time_(0),
+      proto_(nullptr),
+      period_nanos_(0),
+      start_nanos_(0),
+      num_frequency_changes_(0),
+      effective_frequency_(0),
+      synchronous_(false),
+      buffers_{},
+      write_lengths_{},
+      current_buffer_(0),
+      next_write_(0),
+      writer_running_(false),
+      writer_pid_(0),
+      writer_stop_(false) {}
 
 bool ProfileData::Start(const char* fname, const ProfileData::Options& options) {
   if (enabled()) {
@@ -98,31 +241,115 @@ bool ProfileData::Start(const char* fname, const ProfileData::Options& options)
     return false;
   }
 
+  CHECK_NE(0, options.frequency());
+  options_ = options;
+  effective_frequency_ = options.frequency();
   start_time_ = time(nullptr);
-  fname_ = strdup(fname);
 
   // Reset counters
-  num_evicted_ = 0;
   count_ = 0;
   evictions_ = 0;
+  write_dropped_ = 0;
+  truncated_ = 0;
+  labels_lost_ = false;
   total_bytes_ = 0;
 
-  hash_ = new Bucket[kBuckets];
-  evict_ = new Slot[kBufferLength];
-  memset(hash_, 0, sizeof(hash_[0]) * kBuckets);
+  for (int i = 0; i < 2; i++) {
+    AllocateGeneration(&generations_[i], kInitialStackNodes, kInitialAggregates);
+  }
+  active_ = 0;
+  frozen_.store(nullptr, std::memory_order_relaxed);
+  generation_buffer_ = new Slot[kGenerationBufferLength];
+  for (int i = 0; i < kNumWriteBuffers; i++) {
+    buffers_[i] = new Slot[kWriteBufferLength];
+    write_lengths_[i].store(0, std::memory_order_relaxed);
+  }
+  current_buffer_ = 0;
+  next_write_ = 0;
+  evict_ = buffers_[0];
+
+  BeginFile(fd, fname);
+
+  StartWriter();
+
+  if (proto_ != nullptr && !writer_running_) {
+    Reset();
+    return false;
+  }
+
+  return true;
+}
+
+void ProfileData::BeginFile(int fd, const char* fname) {
+  fname_ = strdup(fname);
+  file_bytes_ = 0;
 
   // Record special entries
+  num_evicted_ = 0;
   evict_[num_evicted_++] = 0;  // count for header
   evict_[num_evicted_++] = 3;  // depth for header
   evict_[num_evicted_++] = 0;  // Version number
-  CHECK_NE(0, options.frequency());
-  int period = 1000000 / options.frequency();
+  int period = 1000000 / options_.frequency();
   evict_[num_evicted_++] = period;  // Period (microseconds)
   evict_[num_evicted_++] = 0;       // Padding
 
   out_ = fd;
 
-  return true;
+  if (options_.format() != tcmalloc::kLegacyProfileFormat) {
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    start_nanos_ = tv.tv_sec * int64_t{1000000000} + tv.tv_usec * int64_t{1000};
+    period_nanos_ = int64_t{1000000000} / options_.frequency();
+
+    proto_ = new ProtoOutput(fd, options_.format() == tcmalloc::kProtoGzipProfileFormat);
+    const tcmalloc::ProfileProtoWriter::ValueType sample_types[] = {
+        {"samples", "count"}, {options_.wall_clock() ? "wall" : "cpu", "nanoseconds"}};
+    proto_->writer.WriteHeader(sample_types, arraysize(sample_types), sample_types[1], period_nanos_, start_nanos_);
+
+    // A file that doesn't start at full frequency says so right away.
+    num_frequency_changes_ = 0;
+    if (effective_frequency_ != options_.frequency()) {
+      RecordFrequency();
+    }
+  }
+}
+
+void ProfileData::SetEffectiveFrequency(int frequency) {
+  if (!enabled() || frequency == effective_frequency_) {
+    return;
+  }
+  effective_frequency_ = frequency;
+  if (proto_ != nullptr) {
+    RecordFrequency();
+  }
+}
+
+int ProfileData::AdaptSampleEvery(int every, double overhead, double max_overhead, int max_every) {
+  // Time spent is roughly proportional to the number of samples
+  // recorded, so each doubling halves overhead. Only go back up when
+  // overhead stays well under the target, so we don't flip back and
+  // forth.
+  while (overhead > max_overhead && every < max_every) {
+    every *= 2;
+    overhead /= 2;
+  }
+  while (overhead * 4 < max_overhead && every > 1) {
+    every /= 2;
+    overhead *= 2;
+  }
+  return every;
+}
+
+void ProfileData::RecordFrequency() {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  int64_t now = tv.tv_sec * int64_t{1000000000} + tv.tv_usec * int64_t{1000};
+  if (num_frequency_changes_ == kMaxFrequencyChanges) {
+    num_frequency_changes_--;
+  }
+  FrequencyChange* change = &frequency_changes_[num_frequency_changes_++];
+  change->offset_nanos = std::max<int64_t>(now - start_nanos_, 0);
+  change->frequency = effective_frequency_;
 }
 
 ProfileData::~ProfileData() { Stop(); }
@@ -147,32 +374,81 @@ void ProfileData::Stop() {
     return;
   }
 
-  // Move data from hash table to eviction buffer
-  for (int b = 0; b < kBuckets; b++) {
-    Bucket* bucket = &hash_[b];
-    for (int a = 0; a < kAssociativity; a++) {
-      if (bucket->entry[a].count > 0) {
-        Evict(bucket->entry[a]);
-      }
-    }
+  // Everything below is written synchronously, after what the writer
+  // thread has been handed.
+  StopWriter(false);
+  FinishFile();
+
+  Reset();
+  fprintf(stderr, "PROFILE: interrupts/evictions/bytes = %d/%d/%zu\n", count_, evictions_, total_bytes_);
+  if (write_dropped_ > 0) {
+    fprintf(stderr, "PROFILE: %d samples dropped because writer fell behind\n", write_dropped_);
   }
+  if (truncated_ > 0) {
+    fprintf(stderr, "PROFILE: %d samples not written because profile reached size limit\n", truncated_);
+  }
+  static bool labels_lost_logged;
+  if (labels_lost_ && !labels_lost_logged) {
+    labels_lost_logged = true;
+    fprintf(stderr, "PROFILE: sample labels are not written in legacy format, set CPUPROFILE_FORMAT=proto\n");
+  }
+}
 
-  if (num_evicted_ + 3 > kBufferLength) {
-    // Ensure there is enough room for end of data marker
-    FlushEvicted();
+bool ProfileData::Rotate(const char* fname) {
+  if (!enabled()) {
+    return false;
   }
 
-  // Write end of data marker
-  evict_[num_evicted_++] = 0;  // count
-  evict_[num_evicted_++] = 1;  // depth
-  evict_[num_evicted_++] = 0;  // end of data marker
-  FlushEvicted();
+  int fd = open(fname, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+  if (fd < 0) {
+    return false;
+  }
+
+  StopWriter(false);
+  FinishFile();
+  close(out_);
+  free(fname_);
 
-  // Dump "/proc/self/maps" so we get list of mapped shared libraries
-  tcmalloc::SaveProcSelfMapsToRawFD(static_cast<RawFD>(out_));
+  BeginFile(fd, fname);
+  StartWriter();
+  return true;
+}
 
-  Reset();
-  fprintf(stderr, "PROFILE: interrupts/evictions/bytes = %d/%d/%zu\n", count_, evictions_, total_bytes_);
+void ProfileData::FinishFile() {
+  synchronous_ = true;
+
+  // Write out what's in the eviction buffer and sample table
+  FlushEvicted();
+  WriteGeneration(&generations_[active_]);
+
+  if (proto_ != nullptr) {
+    // Mappings and locations go last, after all samples.
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    int64_t now = tv.tv_sec * int64_t{1000000000} + tv.tv_usec * int64_t{1000};
+    for (int i = 0; i < num_frequency_changes_; i++) {
+      const FrequencyChange& change = frequency_changes_[i];
+      char comment[96];
+      snprintf(comment, sizeof(comment), "sampling frequency %d Hz (of %d Hz) from %.3fs", change.frequency,
+               options_.frequency(), change.offset_nanos / 1e9);
+      proto_->writer.AddComment(comment);
+    }
+    proto_->writer.Finish(now - start_nanos_);
+    delete proto_;  // flushes what's buffered
+    proto_ = nullptr;
+    file_bytes_ = lseek(out_, 0, SEEK_CUR);
+  } else {
+    // Write end of data marker
+    evict_[num_evicted_++] = 0;  // count
+    evict_[num_evicted_++] = 1;  // depth
+    evict_[num_evicted_++] = 0;  // end of data marker
+    FlushEvicted();
+
+    // Dump "/proc/self/maps" so we get list of mapped shared libraries
+    tcmalloc::SaveProcSelfMapsToRawFD(static_cast<RawFD>(out_));
+  }
+  synchronous_ = false;
+  total_bytes_ += file_bytes_;
 }
 
 void ProfileData::Reset() {
@@ -180,13 +456,25 @@ void ProfileData::Reset() {
     return;
   }
 
-  // Don't reset count_, evictions_, or total_bytes_ here.  They're used
-  // by Stop to print information about the profile after reset, and are
-  // cleared by Start when starting a new profile.
+  StopWriter(true);
+
+  delete proto_;
+  proto_ = nullptr;
+
+  // Don't reset count_, evictions_, write_dropped_, truncated_ or
+  // total_bytes_ here.
+  // They're used by Stop to print information about the profile after
+  // reset, and are cleared by Start when starting a new profile.
   close(out_);
-  delete[] hash_;
-  hash_ = 0;
-  delete[] evict_;
+  for (int i = 0; i < 2; i++) {
+    FreeGeneration(&generations_[i]);
+  }
+  delete[] generation_buffer_;
+  generation_buffer_ = nullptr;
+  for (int i = 0; i < kNumWriteBuffers; i++) {
+    delete[] buffers_[i];
+    buffers_[i] = 0;
+  }
   evict_ = 0;
   num_evicted_ = 0;
   free(fname_);
@@ -203,6 +491,7 @@ void ProfileData::GetCurrentState(State* state) const {
     state->enabled = true;
     state->start_time = start_time_;
     state->samples_gathered = count_;
+    state->samples_write_dropped = write_dropped_;
     int buf_size = sizeof(state->profile_name);
     strncpy(state->profile_name, fname_ ? fname_ : "", buf_size);
     state->profile_name[buf_size - 1] = '\0';
@@ -210,34 +499,28 @@ void ProfileData::GetCurrentState(State* state) const {
     state->enabled = false;
     state->start_time = 0;
     state->samples_gathered = 0;
+    state->samples_write_dropped = 0;
     state->profile_name[0] = '\0';
   }
 }
 
-// This function is safe to call from asynchronous signals (but is not
-// re-entrant).  However, that's not part of its public interface.
 void ProfileData::FlushTable() {
   if (!enabled()) {
     return;
   }
 
-  // Move data from hash table to eviction buffer
-  for (int b = 0; b < kBuckets; b++) {
-    Bucket* bucket = &hash_[b];
-    for (int a = 0; a < kAssociativity; a++) {
-      if (bucket->entry[a].count > 0) {
-        Evict(bucket->entry[a]);
-        bucket->entry[a].depth = 0;
-        bucket->entry[a].count = 0;
-      }
-    }
-  }
+  StopWriter(false);
+  synchronous_ = true;
 
   // Write out all pending data
   FlushEvicted();
+  WriteGeneration(&generations_[active_]);
+  synchronous_ = false;
+
+  StartWriter();
 }
 
-void ProfileData::Add(int depth, const void* const* stack) {
+void ProfileData::Add(int depth, const void* const* stack, const tcmalloc::ProfileLabel* label, int count) {
   if (!enabled()) {
     return;
   }
@@ -245,67 +528,362 @@ void ProfileData::Add(int depth, const void* const* stack) {
   if (depth > kMaxStackDepth) depth = kMaxStackDepth;
   RAW_CHECK(depth > 0, "ProfileData::Add depth <= 0");
 
-  // Make hash-value
-  Slot h = 0;
-  for (int i = 0; i < depth; i++) {
-    Slot slot = reinterpret_cast<Slot>(stack[i]);
-    h = (h << 8) | (h >> (8 * (sizeof(h) - 1)));
-    h += (slot * 31) + (slot * 7) + (slot * 3);
+  count_ += count;
+
+  if (label != nullptr && options_.format() == tcmalloc::kLegacyProfileFormat) {
+    labels_lost_ = true;
+    label = nullptr;
+  }
+  const Slot l = reinterpret_cast<Slot>(label);
+  // Any stack fits into an empty generation, so we try at most twice.
+  for (int attempt = 0; attempt < 2; attempt++) {
+    Generation* gen = &generations_[active_];
+    uint32_t id = InternStack(gen, depth, stack);
+    Aggregate* a = (id != 0 ? FindAggregate(gen, id, l) : nullptr);
+    if (a != nullptr) {
+      a->count += count;
+      return;
+    }
+    if (!SwitchGeneration()) {
+      break;
+    }
   }
 
-  count_++;
+  evictions_++;
+  Evict(count, depth, l, stack);
+}
 
-  // See if table already has an entry for this trace
-  bool done = false;
-  Bucket* bucket = &hash_[h % kBuckets];
-  for (int a = 0; a < kAssociativity; a++) {
-    Entry* e = &bucket->entry[a];
-    if (e->depth == depth) {
-      bool match = true;
-      for (int i = 0; i < depth; i++) {
-        if (e->stack[i] != reinterpret_cast<Slot>(stack[i])) {
-          match = false;
-          break;
-        }
-      }
-      if (match) {
-        e->count++;
-        done = true;
-        break;
-      }
+// This function is safe to call from asynchronous signals (but is not
+// re-entrant).  However, that's not part of its public interface.
+bool ProfileData::SwitchGeneration() {
+  Generation* full = &generations_[active_];
+  if (writer_running_) {
+    // Evicted samples go first, so that the legacy header they may
+    // hold precedes everything else in the file.
+    if (frozen_.load(std::memory_order_acquire) != nullptr || !FlushEvicted()) {
+      // Writer is still busy.
+      return false;
     }
+    evictions_ += full->num_aggregates;
+    active_ ^= 1;
+    frozen_.store(full, std::memory_order_release);
+    return true;
   }
 
-  if (!done) {
-    // Evict entry with smallest count
-    Entry* e = &bucket->entry[0];
-    for (int a = 1; a < kAssociativity; a++) {
-      if (bucket->entry[a].count < e->count) {
-        e = &bucket->entry[a];
-      }
+  if (proto_ != nullptr && !synchronous_) {
+    // Can't convert samples here, as we may be in signal handler.
+    return false;
+  }
+  FlushEvicted();
+  evictions_ += full->num_aggregates;
+  WriteGeneration(full);
+  return true;
+}
+
+void ProfileData::WriteGeneration(Generation* gen) {
+  const int header = (proto_ != nullptr ? 3 : 2);
+  int n = 0;
+  for (uint32_t i = 0; i < 2 * gen->aggregate_capacity; i++) {
+    const Aggregate& a = gen->aggregates[i];
+    if (a.stack == 0) {
+      continue;
     }
-    if (e->count > 0) {
-      evictions_++;
-      Evict(*e);
+    const int depth = gen->nodes[a.stack].depth;
+    if (n + header + depth > kGenerationBufferLength) {
+      WriteSlots(generation_buffer_, n);
+      n = 0;
     }
-
-    // Use the newly evicted entry
-    e->depth = depth;
-    e->count = 1;
-    for (int i = 0; i < depth; i++) {
-      e->stack[i] = reinterpret_cast<Slot>(stack[i]);
+    Slot* p = generation_buffer_ + n;
+    p[0] = a.count;
+    p[1] = depth;
+    if (proto_ != nullptr) {
+      p[2] = a.label;
+    }
+    Slot* pc = p + header;
+    for (uint32_t id = a.stack; id != 0; id = gen->nodes[id].caller) {
+      *pc++ = gen->nodes[id].pc;
     }
+    n += header + depth;
   }
+  if (n > 0) {
+    WriteSlots(generation_buffer_, n);
+  }
+  ClearGeneration(gen);
+}
+
+void ProfileData::WriteFrozen() {
+  Generation* gen = frozen_.load(std::memory_order_acquire);
+  if (gen == nullptr) {
+    return;
+  }
+
+  // It filled up, so make whichever table was busy bigger for next
+  // time.
+  uint32_t node_capacity = gen->node_capacity;
+  if (gen->num_nodes > node_capacity / 2) {
+    node_capacity = std::min(2 * node_capacity, kMaxStackNodes);
+  }
+  uint32_t aggregate_capacity = gen->aggregate_capacity;
+  if (gen->num_aggregates > aggregate_capacity / 2) {
+    aggregate_capacity = std::min(2 * aggregate_capacity, kMaxAggregates);
+  }
+
+  WriteGeneration(gen);
+  if (node_capacity != gen->node_capacity || aggregate_capacity != gen->aggregate_capacity) {
+    FreeGeneration(gen);
+    AllocateGeneration(gen, node_capacity, aggregate_capacity);
+  }
+  frozen_.store(nullptr, std::memory_order_release);
 }
 
 // This function is safe to call from asynchronous signals (but is not
 // re-entrant).  However, that's not part of its public interface.
-void ProfileData::FlushEvicted() {
-  if (num_evicted_ > 0) {
-    const char* buf = reinterpret_cast<char*>(evict_);
-    size_t bytes = sizeof(evict_[0]) * num_evicted_;
-    total_bytes_ += bytes;
-    FDWrite(out_, buf, bytes);
+bool ProfileData::FlushEvicted() {
+  if (num_evicted_ == 0) {
+    return true;
+  }
+
+  if (!writer_running_) {
+    if (proto_ != nullptr && !synchronous_) {
+      // Can't convert samples here, as we may be in signal handler.
+      return false;
+    }
+    WriteSlots(evict_, num_evicted_);
+    num_evicted_ = 0;
+    return true;
+  }
+
+  // The writer handles buffers in order, so the buffer after ours is
+  // the oldest one it may still be busy with.
+  int next = (current_buffer_ + 1) % kNumWriteBuffers;
+  if (write_lengths_[next].load(std::memory_order_acquire) != 0) {
+    return false;
   }
+  write_lengths_[current_buffer_].store(num_evicted_, std::memory_order_release);
+  current_buffer_ = next;
+  evict_ = buffers_[next];
   num_evicted_ = 0;
+  return true;
+}
+
+void ProfileData::WriteSlots(const Slot* slots, int n) {
+  const int64_t max_bytes = options_.max_file_bytes();
+  if (proto_ == nullptr) {
+    size_t bytes = sizeof(Slot) * n;
+    if (max_bytes == 0 || static_cast<int64_t>(file_bytes_ + bytes) <= max_bytes) {
+      file_bytes_ += bytes;
+      FDWrite(out_, reinterpret_cast<const char*>(slots), bytes);
+      return;
+    }
+
+    // Write what fits, but always write header and trailer (which
+    // have zero count), so the file stays valid.
+    int begin = 0;
+    for (int pos = 0; pos < n;) {
+      int len = 2 + static_cast<int>(slots[pos + 1]);
+      if (slots[pos] != 0 && static_cast<int64_t>(file_bytes_ + sizeof(Slot) * (pos - begin + len)) > max_bytes) {
+        bytes = sizeof(Slot) * (pos - begin);
+        file_bytes_ += bytes;
+        FDWrite(out_, reinterpret_cast<const char*>(slots + begin), bytes);
+        truncated_ += slots[pos];
+        begin = pos + len;
+      }
+      pos += len;
+    }
+    bytes = sizeof(Slot) * (n - begin);
+    file_bytes_ += bytes;
+    FDWrite(out_, reinterpret_cast<const char*>(slots + begin), bytes);
+    return;
+  }
+
+  // Compressed and buffered output is only counted as it reaches the
+  // file, so the limit is approximate here.
+  bool full = (max_bytes != 0 && lseek(out_, 0, SEEK_CUR) >= max_bytes);
+  for (int pos = 0; pos < n;) {
+    Slot count = slots[pos];
+    int depth = static_cast<int>(slots[pos + 1]);
+    // Legacy format header has zero count. There is nothing in it
+    // that WriteHeader didn't already write. It also has no label
+    // slot.
+    if (count == 0) {
+      pos += 2 + depth;
+      continue;
+    }
+    if (full) {
+      truncated_ += count;
+      pos += 3 + depth;
+      continue;
+    }
+    const tcmalloc::ProfileLabel* label = reinterpret_cast<const tcmalloc::ProfileLabel*>(slots[pos + 2]);
+    int64_t values[2] = {static_cast<int64_t>(count), static_cast<int64_t>(count) * period_nanos_};
+    proto_->writer.AddSample(values, arraysize(values), reinterpret_cast<const void* const*>(slots + pos + 3), depth,
+                             true, label);
+    pos += 3 + depth;
+  }
+}
+
+void ProfileData::WritePending() {
+  for (;;) {
+    int len = write_lengths_[next_write_].load(std::memory_order_acquire);
+    if (len == 0) {
+      break;
+    }
+    WriteSlots(buffers_[next_write_], len);
+    write_lengths_[next_write_].store(0, std::memory_order_release);
+    next_write_ = (next_write_ + 1) % kNumWriteBuffers;
+  }
+  WriteFrozen();
+}
+
+void* ProfileData::WriterMain(void* arg) {
+  ProfileData* data = static_cast<ProfileData*>(arg);
+  while (!data->writer_stop_.load(std::memory_order_acquire)) {
+    data->WritePending();
+    struct timespec ts = {0, kWriterPollNanos};
+    nanosleep(&ts, nullptr);
+  }
+  return nullptr;
+}
+
+void ProfileData::StartWriter() {
+  RAW_CHECK(!writer_running_, "profile writer is already running");
+  writer_stop_.store(false, std::memory_order_relaxed);
+
+  // The writer thread inherits our signal mask. Block everything, so
+  // that profiling signals and whatever else the program handles go to
+  // application threads.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int err = pthread_create(&writer_, nullptr, WriterMain, this);
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+  // Without a thread we just keep writing synchronously.
+  writer_running_ = (err == 0);
+  writer_pid_ = getpid();
+}
+
+void ProfileData::StopWriter(bool discard) {
+  if (!writer_running_) {
+    return;
+  }
+  writer_running_ = false;
+
+  // After fork, the child has our buffers but not the thread.
+  if (writer_pid_ == getpid()) {
+    writer_stop_.store(true, std::memory_order_release);
+    pthread_join(writer_, nullptr);
+  }
+
+  if (discard) {
+    for (int i = 0; i < kNumWriteBuffers; i++) {
+      write_lengths_[i].store(0, std::memory_order_relaxed);
+    }
+    next_write_ = current_buffer_;
+    Generation* gen = frozen_.load(std::memory_order_relaxed);
+    if (gen != nullptr) {
+      ClearGeneration(gen);
+      frozen_.store(nullptr, std::memory_order_relaxed);
+    }
+  } else {
+    WritePending();
+  }
+}
+
+ProfileSampleBuffers::ProfileSampleBuffers()
+    : shards_(nullptr), num_shards_(0), drain_requested_(false), dropped_(0) {}
+
+ProfileSampleBuffers::~ProfileSampleBuffers() { Destroy(); }
+
+void ProfileSampleBuffers::Init() {
+  Destroy();
+
+  // Twice as many shards as CPUs keeps collisions between threads
+  // hashed to the same shard rare.
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  num_shards_ = std::min<long>(std::max<long>(2 * ncpus, 8), 256);
+  shards_ = new Shard[num_shards_];
+  for (int i = 0; i < num_shards_; i++) {
+    shards_[i].busy.store(false, std::memory_order_relaxed);
+    shards_[i].used = 0;
+    shards_[i].samples = 0;
+    shards_[i].buffer = new Slot[kShardSlots];
+  }
+  drain_requested_.store(false, std::memory_order_relaxed);
+  dropped_.store(0, std::memory_order_relaxed);
+}
+
+void ProfileSampleBuffers::Destroy() {
+  for (int i = 0; i < num_shards_; i++) {
+    delete[] shards_[i].buffer;
+  }
+  delete[] shards_;
+  shards_ = nullptr;
+  num_shards_ = 0;
+}
+
+// This function is safe to call from asynchronous signals and from
+// many threads at once.
+void ProfileSampleBuffers::Add(int depth, const void* const* stack, const tcmalloc::ProfileLabel* label,
+                               int count) {
+  if (num_shards_ == 0) return;
+  if (depth > ProfileData::kMaxStackDepth) depth = ProfileData::kMaxStackDepth;
+  RAW_CHECK(depth > 0, "ProfileSampleBuffers::Add depth <= 0");
+
+  // Addresses of thread-local errno only differ in high bits, so mix
+  // them before picking a shard.
+  uint64_t h = static_cast<uint64_t>(tcmalloc::SelfThreadId()) * 0x9E3779B97F4A7C15ULL;
+  int start = static_cast<int>((h >> 32) % num_shards_);
+
+  for (int probe = 0; probe < kMaxProbes; probe++) {
+    Shard* shard = &shards_[(start + probe) % num_shards_];
+    if (shard->busy.exchange(true, std::memory_order_acquire)) {
+      continue;
+    }
+    bool added = false;
+    if (shard->used + 3 + depth <= kShardSlots) {
+      Slot* p = shard->buffer + shard->used;
+      p[0] = count;
+      p[1] = depth;
+      p[2] = reinterpret_cast<Slot>(label);
+      for (int i = 0; i < depth; i++) {
+        p[3 + i] = reinterpret_cast<Slot>(stack[i]);
+      }
+      shard->used += 3 + depth;
+      shard->samples++;
+      added = true;
+      if (shard->samples >= kDrainBatch || shard->used > kShardSlots / 2) {
+        drain_requested_.store(true, std::memory_order_relaxed);
+      }
+    }
+    shard->busy.store(false, std::memory_order_release);
+    if (added) return;
+  }
+
+  drain_requested_.store(true, std::memory_order_relaxed);
+  dropped_.fetch_add(count, std::memory_order_relaxed);
+}
+
+// This function is safe to call from asynchronous signals, but at
+// most one instance may run at a time.
+void ProfileSampleBuffers::Drain(ProfileData* data) {
+  drain_requested_.store(false, std::memory_order_relaxed);
+  for (int i = 0; i < num_shards_; i++) {
+    Shard* shard = &shards_[i];
+    if (shard->busy.exchange(true, std::memory_order_acquire)) {
+      // Someone is adding to it right now. Leave it for next time.
+      drain_requested_.store(true, std::memory_order_relaxed);
+      continue;
+    }
+    for (int pos = 0; pos < shard->used;) {
+      int count = static_cast<int>(shard->buffer[pos]);
+      int depth = static_cast<int>(shard->buffer[pos + 1]);
+      const tcmalloc::ProfileLabel* label = reinterpret_cast<const tcmalloc::ProfileLabel*>(shard->buffer[pos + 2]);
+      data->Add(depth, reinterpret_cast<const void* const*>(shard->buffer + pos + 3), label, count);
+      pos += 3 + depth;
+    }
+    shard->used = 0;
+    shard->samples = 0;
+    shard->busy.store(false, std::memory_order_release);
+  }
 }
@@ -43,45 +43,71 @@
 #include <config.h>
 #include <time.h>  // for time_t
 #include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>  // for pid_t
+#include <atomic>
 #include "base/basictypes.h"
+#include "profile-proto.h"
 
 // A class that accumulates profile samples and writes them to a file.
 //
-// Each sample contains a stack trace and a count.  Memory usage is
-// reduced by combining profile samples that have the same stack trace
-// by adding up the associated counts.
+// Each sample contains a stack trace, an optional label and a count.
+// Memory usage is reduced by combining profile samples that have the
+// same stack trace and label by adding up the associated counts, and
+// by storing stacks that share callers only once.
+// Labels are only written in profile.proto formats.  Legacy format
+// has no place for them, so there they are ignored (and Stop says so
+// once per process).
 //
 // Profile data is accumulated in a bounded amount of memory, and will
 // flushed to a file as necessary to stay within the memory limit.
+// Tables start small and grow (up to a limit) when they fill up.
+// 'Rotate' finishes the file and continues into a new one, reusing
+// the same memory, so a long running profile can be split into files
+// of bounded size.
+// While collection is enabled, the file is written by a background
+// writer thread, so that 'Add' never blocks on a slow disk.  If the
+// writer falls behind, evicted samples are dropped and counted
+// instead.
 //
 // Use of this class assumes external synchronization.  The exact
 // requirements of that synchronization are that:
 //
 //  - 'Add' may be called from asynchronous signals, but is not
-//    re-entrant.
+//    re-entrant.  At most one thread may be in 'Add' at a time.
 //
-//  - None of 'Start', 'Stop', 'Reset', 'Flush', and 'Add' may be
+//  - None of 'Start', 'Stop', 'Reset', 'FlushTable', 'Rotate' and 'Add' may be
 //    called at the same time.
 //
+//  - 'SetEffectiveFrequency' may run concurrently with 'Add' (it
+//    touches nothing 'Add' does), but not with any other method.
+//
 //  - 'Start', 'Stop', or 'Reset' should not be called while 'Enabled'
 //     or 'GetCurrent' are running, and vice versa.
 //
-// A profiler which uses asyncronous signals to add samples will
-// typically use two locks to protect this data structure:
+// CpuProfiler meets these with a SpinLock and a flag:
+//
+//  - Signal handlers buffer samples without locking, and only the
+//    handler that sets CpuProfiler::draining_ calls 'Add'.
 //
-//  - A SpinLock which is held over all calls except for the 'Add'
-//    call made from the signal handler.
+//  - A SpinLock is held over all other calls.  'Start', 'Stop',
+//    'Reset' and 'FlushTable' are only called with the signal handler
+//    unregistered.  'Rotate' keeps the handler registered, and holds
+//    draining_ instead.
 //
-//  - A SpinLock which is held over calls to 'Start', 'Stop', 'Reset',
-//    'Flush', and 'Add'.  (This SpinLock should be acquired after
-//    the first SpinLock in all cases where both are needed.)
+// The writer thread is owned by this class.  It writes the eviction
+// buffers and frozen sample tables that 'Add' hands over, and does
+// the profile.proto conversion and compression.  It touches nothing
+// else, so callers need not synchronize with it; the methods above
+// that finish or switch files stop it first and restart it after.
 class ProfileData {
  public:
   struct State {
-    bool enabled;             // Is profiling currently enabled?
-    time_t start_time;        // If enabled, when was profiling started?
-    char profile_name[1024];  // Name of file being written, or '\0'
-    int samples_gathered;     // Number of samples gathered to far (or 0)
+    bool enabled;               // Is profiling currently enabled?
+    time_t start_time;          // If enabled, when was profiling started?
+    char profile_name[1024];    // Name of file being written, or '\0'
+    int samples_gathered;       // Number of samples gathered to far (or 0)
+    int samples_write_dropped;  // Number of samples not written because writer fell behind
   };
 
   class Options {
@@ -92,8 +118,28 @@ class ProfileData {
     int frequency() const { return frequency_; }
     void set_frequency(int frequency) { frequency_ = frequency; }
 
+    // Get and set the output format.  In profile.proto formats
+    // samples are converted by the writer thread, so Start fails if
+    // it cannot be created.
+    tcmalloc::ProfileFormat format() const { return format_; }
+    void set_format(tcmalloc::ProfileFormat format) { format_ = format; }
+
+    // Get and set whether samples measure wall time rather than cpu
+    // time.  Only profile.proto formats record this.
+    bool wall_clock() const { return wall_clock_; }
+    void set_wall_clock(bool wall_clock) { wall_clock_ = wall_clock; }
+
+    // Get and set the approximate limit on size of each profile file,
+    // or 0 for no limit.  Samples that don't fit are counted, but
+    // not written.
+    int64_t max_file_bytes() const { return max_file_bytes_; }
+    void set_max_file_bytes(int64_t max_file_bytes) { max_file_bytes_ = max_file_bytes; }
+
    private:
-    int frequency_;  // Sample frequency.
+    int frequency_;                   // Sample frequency.
+    tcmalloc::ProfileFormat format_;  // Output format.
+    bool wall_clock_;                 // Wall time samples?
+    int64_t max_file_bytes_;          // Size limit of each file, or 0.
   };
 
   static const int kMaxStackDepth = 254;  // Max stack depth stored in profile
@@ -119,18 +165,41 @@ class ProfileData {
   void Reset();
 
   // If data collection is enabled, record a sample with 'depth'
-  // entries from 'stack'.  (depth must be > 0.)  At most
-  // kMaxStackDepth stack entries will be recorded, starting with
-  // stack[0].
+  // entries from 'stack' and 'label' (which may be nullptr, see
+  // tcmalloc::ProfileLabel for its lifetime requirements).  (depth
+  // must be > 0.)  At most kMaxStackDepth stack entries will be
+  // recorded, starting with stack[0].  The sample counts as 'count'
+  // samples taken at the frequency given to Start.
   //
   // This function is safe to call from asynchronous signals (but is
   // not re-entrant).
-  void Add(int depth, const void* const* stack);
+  void Add(int depth, const void* const* stack, const tcmalloc::ProfileLabel* label = nullptr, int count = 1);
+
+  // Records that from now on samples are taken at about 'frequency'
+  // per second, rather than at the frequency given to Start, and are
+  // added with a count that makes up for the difference.  Only
+  // profile.proto formats record this, as comments listing each
+  // change.  Must be called under the same lock as Stop.
+  void SetEffectiveFrequency(int frequency);
+
+  // Returns how many ticks to record as one sample from now on, when
+  // recording every 'every'-th tick (a power of two) cost 'overhead'
+  // (a fraction of cpu time).  Doubles it while overhead is above
+  // 'max_overhead', up to 'max_every', and halves it while overhead
+  // would stay under half of 'max_overhead'.
+  static int AdaptSampleEvery(int every, double overhead, double max_overhead, int max_every);
 
   // If data collection is enabled, write the data to disk (and leave
   // the collector enabled).
   void FlushTable();
 
+  // If data collection is enabled, finish the current file as 'Stop'
+  // would and continue collecting into fname, with the same options.
+  // The hash table and buffers are reused.  Returns false if fname
+  // can't be opened, in which case collection continues into the
+  // current file.
+  bool Rotate(const char* fname);
+
   // Is data collection currently enabled?
   bool enabled() const { return out_ >= 0; }
 
@@ -139,43 +208,240 @@ class ProfileData {
 
  private:
   friend class CpuProfiler;
+  friend class ProfileDataTest;
 
-  static const int kAssociativity = 4;       // For hashtable
-  static const int kBuckets = 1 << 10;       // For hashtable
-  static const int kBufferLength = 1 << 18;  // For eviction buffer
+  static const uint32_t kInitialStackNodes = 1 << 14;  // For stack table
+  static const uint32_t kMaxStackNodes = 1 << 18;
+  static const uint32_t kInitialAggregates = 1 << 12;  // For sample table
+  static const uint32_t kMaxAggregates = 1 << 16;
+  static const int kGenerationBufferLength = 1 << 13;  // For writing tables
+  static const int kBufferLength = 1 << 18;            // For eviction buffers
+  static const int kNumWriteBuffers = 4;     // Eviction buffers in flight
+  static const int kWriteBufferLength = kBufferLength / kNumWriteBuffers;
 
   // Type of slots: each slot can be either a count, or a PC value
   typedef uintptr_t Slot;
 
-  // Hash-table/eviction-buffer entry (a.k.a. a sample)
-  struct Entry {
-    Slot count;                  // Number of hits
-    Slot depth;                  // Stack depth
-    Slot stack[kMaxStackDepth];  // Stack contents
+  // Stacks are interned as nodes of a prefix tree, rooted at the
+  // outermost frame, so stacks that share callers share nodes.  A
+  // stack is identified by the node of its innermost frame.
+  struct StackNode {
+    Slot pc;
+    uint32_t caller;  // Node of the calling frame, 0 for outermost frame
+    uint32_t depth;   // Depth of stack ending in this node
+  };
+
+  // Sample table entry (a.k.a. a sample)
+  struct Aggregate {
+    Slot count;      // Number of hits
+    Slot label;      // const tcmalloc::ProfileLabel*, or 0
+    uint32_t stack;  // Node of innermost frame, or 0 if slot is empty
   };
 
-  // Hash table bucket
-  struct Bucket {
-    Entry entry[kAssociativity];
+  // Stack and sample tables.  Both are open addressing hash tables,
+  // which are at most half full.  There are two generations of them.
+  // Add fills the active one.  When it is full, it is frozen and
+  // handed to the writer thread, which writes it out, clears it
+  // (growing it if it was busy) and hands it back, while Add goes on
+  // with the other generation.  If the writer hasn't handed the other
+  // one back yet, samples are evicted one by one.
+  struct Generation {
+    StackNode* nodes;        // nodes[0] is a sentinel
+    uint32_t* node_index;    // 2 * node_capacity ids of nodes, 0 if empty
+    uint32_t node_capacity;  // Power of two
+    uint32_t num_nodes;      // Including sentinel
+    Aggregate* aggregates;   // 2 * aggregate_capacity entries
+    uint32_t aggregate_capacity;
+    uint32_t num_aggregates;
   };
 
-  Bucket* hash_;        // hash table
+  Generation generations_[2];
+  int active_;                       // Generation filled by Add
+  std::atomic<Generation*> frozen_;  // Generation being written, or nullptr
+  Slot* generation_buffer_;          // Scratch buffer of WriteGeneration
+
   Slot* evict_;         // evicted entries
   int num_evicted_;     // how many evicted entries?
   int out_;             // fd for output file.
   int count_;           // How many samples recorded
   int evictions_;       // How many evictions
-  size_t total_bytes_;  // How much output
+  int write_dropped_;   // How many samples dropped by Evict
+  int truncated_;       // How many samples not written due to max_file_bytes
+  bool labels_lost_;    // Whether Add ignored labels, see above
+  size_t total_bytes_;  // How much output, in all files
+  size_t file_bytes_;   // How much output in current file
   char* fname_;         // Profile file name
   time_t start_time_;   // Start time, or 0
+  Options options_;     // Options given to Start
+
+  // Set when writing profile.proto.  Evicted entries are converted
+  // into samples as they're written.  Then evicted entries have a
+  // label slot after depth, which isn't part of the legacy format.
+  struct ProtoOutput;
+  ProtoOutput* proto_;
+  int64_t period_nanos_;
+  int64_t start_nanos_;
+
+  // Changes of effective frequency in the current file, written as
+  // comments of profile.proto.  When there are more, the last one is
+  // replaced.
+  struct FrequencyChange {
+    int64_t offset_nanos;  // Since start of the file
+    int frequency;
+  };
+  static const int kMaxFrequencyChanges = 64;
+  FrequencyChange frequency_changes_[kMaxFrequencyChanges];
+  int num_frequency_changes_;
+  int effective_frequency_;
+
+  // Adds effective_frequency_ to frequency_changes_.
+  void RecordFrequency();
+
+  // True while Stop or FlushTable write evicted entries themselves.
+  // Outside of those, entries may only be converted to profile.proto
+  // by the writer thread, since conversion allocates memory.
+  bool synchronous_;
+
+  // Eviction buffers are handed to the writer thread in round-robin
+  // order.  write_lengths_[i] is the number of slots in buffer i
+  // waiting to be written, or 0 if the buffer is free.  evict_ points
+  // to buffer current_buffer_, which is being filled.
+  Slot* buffers_[kNumWriteBuffers];
+  std::atomic<int> write_lengths_[kNumWriteBuffers];
+  int current_buffer_;  // Buffer being filled by Evict
+  int next_write_;      // Next buffer to be written
+
+  // Background writer thread.  writer_pid_ lets us notice that we
+  // are in a child process, where the thread doesn't exist.
+  bool writer_running_;
+  pthread_t writer_;
+  pid_t writer_pid_;
+  std::atomic<bool> writer_stop_;
+
+  // Move a sample to the eviction buffer.
+  void Evict(Slot count, int depth, Slot label, const void* const* stack);
+
+  // Returns node of 'stack' in 'gen', adding nodes as necessary, or
+  // 0 if the stack table is full.
+  static uint32_t InternStack(Generation* gen, int depth, const void* const* stack);
+
+  // Returns sample table entry for 'stack' and 'label' in 'gen',
+  // adding it as necessary, or nullptr if the sample table is full.
+  static Aggregate* FindAggregate(Generation* gen, uint32_t stack, Slot label);
+
+  static void AllocateGeneration(Generation* gen, uint32_t node_capacity, uint32_t aggregate_capacity);
+  static void FreeGeneration(Generation* gen);
+  static void ClearGeneration(Generation* gen);
+
+  // Makes the other generation active, after the current one filled
+  // up.  Returns false if it can't be done right now.
+  bool SwitchGeneration();
+
+  // Writes all samples of 'gen' to the file and clears it.
+  void WriteGeneration(Generation* gen);
+
+  // Writes the frozen generation, if any, and hands it back.
+  void WriteFrozen();
 
-  // Move 'entry' to the eviction buffer.
-  void Evict(const Entry& entry);
+  // Starts writing profile to 'fd', which was opened for 'fname'.
+  void BeginFile(int fd, const char* fname);
 
-  // Write contents of eviction buffer to disk.
-  void FlushEvicted();
+  // Writes out and clears sample table, and finishes current file.  The
+  // writer thread must be stopped.  Doesn't close the file.
+  void FinishFile();
+
+  // Write contents of eviction buffer to disk, or hand it to the
+  // writer thread if one is running.  Returns false if the writer
+  // has not yet written any of the previously handed buffers, so
+  // there is no free buffer to switch to.
+  bool FlushEvicted();
+
+  // Writes 'n' slots of complete evicted entries to the file.
+  void WriteSlots(const Slot* slots, int n);
+
+  // Writes buffers (in order) and generation handed to the writer
+  // thread.  Called by the writer thread, and by StopWriter after it
+  // is gone.
+  void WritePending();
+
+  // Starts and stops the writer thread.  StopWriter waits until all
+  // handed buffers are written, unless 'discard' is true.  After it
+  // returns, FlushEvicted writes synchronously.
+  void StartWriter();
+  void StopWriter(bool discard);
+
+  static void* WriterMain(void* arg);
 
   DISALLOW_COPY_AND_ASSIGN(ProfileData);
 };
 
+// Sharded buffers for samples taken in signal handlers running
+// concurrently in many threads.  'Add' claims one of the shards with
+// a single atomic exchange and appends the sample to it, so threads
+// taking samples at the same time don't wait on each other (nor on a
+// thread that got descheduled in the middle of its signal handler).
+// Samples are moved into a ProfileData by 'Drain'.
+//
+// Synchronization requirements:
+//
+//  - 'Add', 'Drain' and 'drain_requested' may be called concurrently
+//    with each other and from asynchronous signals.  But at most one
+//    'Drain' may run at a time, since it feeds a single ProfileData.
+//
+//  - 'Init' and 'Destroy' must not run at the same time as any other
+//    method.
+class ProfileSampleBuffers {
+ public:
+  ProfileSampleBuffers();
+  ~ProfileSampleBuffers();
+
+  // Allocates buffers sized for the number of CPUs in the system and
+  // resets the dropped samples counter.  Not async-signal-safe.
+  void Init();
+
+  // Frees the buffers.  Any samples not drained are lost.
+  void Destroy();
+
+  // Records a sample with 'depth' entries from 'stack' and 'label',
+  // which counts as 'count' samples.  (depth must be > 0.)  At most
+  // ProfileData::kMaxStackDepth entries are recorded.  If all shards
+  // this thread may use are busy or full, the sample is counted in
+  // dropped() instead.
+  void Add(int depth, const void* const* stack, const tcmalloc::ProfileLabel* label = nullptr, int count = 1);
+
+  // Moves samples from all shards that aren't in use right now into
+  // 'data'.  Shards that are busy are left for the next call.
+  void Drain(ProfileData* data);
+
+  // True when some shard has enough samples buffered that it is worth
+  // calling Drain.
+  bool drain_requested() const { return drain_requested_.load(std::memory_order_relaxed); }
+
+  // Number of samples lost since the last Init.
+  int64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+ private:
+  typedef uintptr_t Slot;
+
+  static const int kShardSlots = 1 << 12;  // ~16 samples of max depth
+  static const int kDrainBatch = 16;       // samples buffered before drain is requested
+  static const int kMaxProbes = 4;         // shards tried before dropping sample
+
+  // Buffered samples are laid out as [count, depth, label, pc_0,
+  // ..., pc_{depth-1}].
+  struct alignas(64) Shard {
+    std::atomic<bool> busy;
+    int used;     // slots used in buffer
+    int samples;  // samples in buffer
+    Slot* buffer;
+  };
+
+  Shard* shards_;
+  int num_shards_;
+  std::atomic<bool> drain_requested_;
+  std::atomic<int64_t> dropped_;
+
+  DISALLOW_COPY_AND_ASSIGN(ProfileSampleBuffers);
+};
+
 #endif  // BASE_PROFILEDATA_H_
@@ -40,6 +40,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>  // for getpid()
@@ -55,6 +56,13 @@ typedef ucontext ucontext_t;
 typedef int ucontext_t;  // just to quiet the compiler, mostly
 #endif
 #include <sys/time.h>
+#if HAVE_LINUX_SIGEV_THREAD_ID
+#include <sys/syscall.h>
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <atomic>
 #include <gperftools/profiler.h>
 #include <gperftools/stacktrace.h>
 #include "base/logging.h"
@@ -63,6 +71,32 @@ typedef int ucontext_t;  // just to quiet the compiler, mostly
 #include "profiledata.h"
 #include "profile-handler.h"
 
+// Label of the calling thread's samples, see ProfilerSetLabel. It's
+// read by prof_handler, so it must not need lazy allocation.
+static thread_local std::atomic<const ProfilerLabel*> profiler_label ATTR_INITIAL_EXEC;
+
+// Ticks of the thread's profiling signal, for adaptive sampling. 0
+// until the first one.
+static thread_local uint32_t profiler_ticks ATTR_INITIAL_EXEC;
+
+// Size of the ring of files of a continuous profile, unless
+// CPUPROFILE_ROTATE_FILES says otherwise.
+static const int kDefaultRotateFiles = 8;
+// How often the control thread checks whether it's time to rotate
+// or adapt sampling frequency.
+static const long kControlPollNanos = 100 * 1000 * 1000;
+
+// Adaptive sampling measures overhead over windows this long, and
+// goes down to at most 1/kMaxSampleEvery of CPUPROFILE_FREQUENCY.
+static const int64_t kAdaptWindowNanos = 1000 * 1000 * 1000;
+static const int kMaxSampleEvery = 256;
+
+static int64_t ClockNanos(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * int64_t{1000000000} + ts.tv_nsec;
+}
+
 // Collects up all profile data. This is a singleton, which is
 // initialized by a constructor at startup. If no cpu profiler
 // signal is specified then the profiler lifecycle is either
@@ -90,6 +124,9 @@ class CpuProfiler {
 
   void GetCurrentState(ProfilerState* state);
 
+  // See ProfilerGetDroppedSamples.
+  void GetDroppedSamples(int* samples_dropped, int* samples_write_dropped);
+
   static CpuProfiler instance_;
 
  private:
@@ -97,13 +134,18 @@ class CpuProfiler {
   // documentation, specifically:
   //
   // lock_ is held all over all collector_ method calls except for the 'Add'
-  // call made from the signal handler, to protect against concurrent use of
+  // calls made from the signal handler, to protect against concurrent use of
   // collector_'s control routines. Code other than signal handler must
   // unregister the signal handler before calling any collector_ method.
-  // 'Add' method in the collector is protected by a guarantee from
-  // ProfileHandle that only one instance of prof_handler can run at a time.
+  //
+  // Signal handlers may run in many threads at once. They put samples
+  // into buffers_ without waiting on each other, and whichever
+  // handler wins draining_ moves buffered samples into collector_. So
+  // collector_.Add is never called concurrently.
   SpinLock lock_;
   ProfileData collector_;
+  ProfileSampleBuffers buffers_;
+  std::atomic<bool> draining_;
 
   // Filter function and its argument, if any.  (nullptr means include all
   // samples).  Set at start, read-only while running.  Written while holding
@@ -123,6 +165,121 @@ class CpuProfiler {
 
   // Signal handler that records the interrupted pc in the profile data.
   static void prof_handler(int sig, siginfo_t*, void* signal_ucontext, void* cpu_profiler);
+
+  // Continuous profile. When CPUPROFILE_ROTATE_SECONDS is set, the
+  // profile is written to a ring of rotate_files_ files named
+  // "<fname>.<n>", and the control thread switches to the next one
+  // every rotate_seconds_. Unlike ProfilerStop/ProfilerStart cycles
+  // it keeps the handler and timers registered, and collector_ reuses
+  // its memory. Rotate keeps signal handlers away from collector_ by
+  // holding draining_, while they keep adding samples to buffers_.
+  char rotate_base_[PATH_MAX];
+  int rotate_seconds_;
+  int rotate_files_;
+  unsigned rotate_count_;
+
+  // Adaptive sampling. When CPUPROFILE_MAX_OVERHEAD is set,
+  // prof_handler records only every sample_every_-th tick of each
+  // thread, as that many samples, and measures how long it takes. Every
+  // kAdaptWindowNanos the control thread compares the time with cpu
+  // time used by the process, and doubles or halves sample_every_ to
+  // stay under max_overhead_.
+  double max_overhead_;  // Fraction of cpu time, or 0 when not adaptive
+  int frequency_;        // Profile handler frequency
+  std::atomic<int> sample_every_;
+  std::atomic<int64_t> handler_nanos_;
+  int64_t window_cpu_nanos_;  // Process cpu time at start of window
+
+  // Ends the current window of adaptive sampling. Must be called with
+  // lock_ held.
+  void Adapt();
+
+  // The control thread rotates the profile and adapts sampling
+  // frequency, if either is enabled.
+  bool control_running_;
+  pthread_t control_;
+  pid_t control_pid_;
+  std::atomic<bool> control_stop_;
+
+  // Switches collector_ (and wall_collector_) to the next file. Must
+  // be called with lock_ held.
+  void Rotate();
+
+  // Stops the control thread. Must be called with lock_ held.
+  void StopControl();
+
+  static void* ControlMain(void* cpu_profiler);
+
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  // Wall-clock profile. When CPUPROFILE_WALLCLOCK is set, a sampler
+  // thread signals every registered thread (see
+  // ProfileHandlerGetThreadIds) at a fixed wall-clock rate, whether
+  // it is running or blocked, and wall_handler records its stack
+  // into a separate profile. Samples are labeled with whether the
+  // thread used at least half of the cpu time it could have since
+  // the previous tick.
+  //
+  // wall_collector_ and wall_buffers_ follow the same rules as
+  // collector_ and buffers_, except that instead of unregistering the
+  // handler, code clears wall_enabled_ and waits until wall_handlers_
+  // drops to zero.
+  ProfileData wall_collector_;
+  ProfileSampleBuffers wall_buffers_;
+  std::atomic<bool> wall_draining_;
+  std::atomic<bool> wall_enabled_;
+  std::atomic<int> wall_handlers_;
+
+  // Read-only while the sampler runs.
+  int wall_signal_;
+  int64_t wall_period_nanos_;
+
+  // Sampler's record of a thread. Realtime signals are queued rather
+  // than merged, so the sampler doesn't signal threads that haven't
+  // handled their previous signal yet (e.g. ones that block it or
+  // are stopped). Otherwise they would pile up to RLIMIT_SIGPENDING.
+  struct WallThread {
+    pid_t tid;                  // 0 if entry is free
+    int64_t seen_tick;          // last tick that listed the thread
+    int64_t cpu_nanos;          // thread's cpu time at seen_tick
+    std::atomic<bool> pending;  // signalled, but not handled yet
+  };
+
+  // Open addressing table of WallThread by tid. Only the sampler
+  // adds to it, and wall_handler clears 'pending' of the entry whose
+  // index comes with the signal. Allocated once and never freed,
+  // since signals may be handled long after the sampler stops.
+  static const int kWallThreadSlots = 8192;  // power of 2
+  WallThread* wall_threads_;
+
+  bool wall_sampler_running_;
+  pthread_t wall_sampler_;
+  pid_t wall_sampler_pid_;
+  std::atomic<bool> wall_sampler_stop_;
+
+  // Starts wall-clock profile into 'fname' if CPUPROFILE_WALLCLOCK is
+  // set. Failure is logged, but doesn't affect cpu profile.
+  void StartWall(const char* fname, const ProfileData::Options& options);
+
+  // Stops the sampler thread and writes wall-clock profile.
+  void StopWall();
+
+  // Writes wall-clock samples collected so far.
+  void FlushWall();
+
+  // Finishes wall-clock profile and continues into a file named
+  // after 'fname'.
+  void RotateWall(const char* fname);
+
+  // Makes sure wall_handler doesn't touch wall_collector_ or
+  // wall_buffers_ until EnableWallHandler.
+  void DisableWallHandler();
+  void EnableWallHandler() { wall_enabled_.store(true); }
+
+  static void* WallSamplerMain(void* cpu_profiler);
+
+  // Signal handler for wall_signal_.
+  static void wall_handler(int sig, siginfo_t* info, void* signal_ucontext);
+#endif
 };
 
 // Signal handler that is registered when a user selectable signal
@@ -159,7 +316,33 @@ static void CpuProfilerSwitch(int signal_number) {
 CpuProfiler CpuProfiler::instance_;
 
 // Initialize profiling: activated if getenv("CPUPROFILE") exists.
-CpuProfiler::CpuProfiler() : prof_handler_token_(nullptr) {
+CpuProfiler::CpuProfiler()
+    : draining_(false),
+      prof_handler_token_(nullptr),
+      rotate_seconds_(0),
+      rotate_files_(0),
+      rotate_count_(0),
+      max_overhead_(0),
+      frequency_(0),
+      sample_every_(1),
+      handler_nanos_(0),
+      window_cpu_nanos_(0),
+      control_running_(false),
+      control_pid_(0),
+      control_stop_(false)
+#if HAVE_LINUX_SIGEV_THREAD_ID
+      ,
+      wall_draining_(false),
+      wall_enabled_(false),
+      wall_handlers_(0),
+      wall_signal_(0),
+      wall_period_nanos_(0),
+      wall_threads_(nullptr),
+      wall_sampler_running_(false),
+      wall_sampler_pid_(0),
+      wall_sampler_stop_(false)
+#endif
+{
   if (getenv("CPUPROFILE") == nullptr) {
     return;
   }
@@ -208,6 +391,34 @@ bool CpuProfiler::Start(const char* fname, const ProfilerOptions* options) {
 
   ProfileData::Options collector_options;
   collector_options.set_frequency(prof_handler_state.frequency);
+  collector_options.set_format(tcmalloc::ParseProfileFormat(getenv("CPUPROFILE_FORMAT")));
+  const char* max_bytes_str = getenv("CPUPROFILE_MAX_FILE_BYTES");
+  if (max_bytes_str != nullptr) {
+    collector_options.set_max_file_bytes(std::max<long long>(strtoll(max_bytes_str, nullptr, 10), 0));
+  }
+
+  const char* rotate_str = getenv("CPUPROFILE_ROTATE_SECONDS");
+  rotate_seconds_ = rotate_str != nullptr ? atoi(rotate_str) : 0;
+  char rotated_fname[PATH_MAX];
+  if (rotate_seconds_ > 0) {
+    // Each file is complete except the one being written, so keep
+    // at least two.
+    const char* files_str = getenv("CPUPROFILE_ROTATE_FILES");
+    rotate_files_ = std::max(files_str != nullptr ? atoi(files_str) : kDefaultRotateFiles, 2);
+    rotate_count_ = 0;
+    snprintf(rotate_base_, sizeof(rotate_base_), "%s", fname);
+    snprintf(rotated_fname, sizeof(rotated_fname), "%s.0", fname);
+    fname = rotated_fname;
+  }
+
+  const char* overhead_str = getenv("CPUPROFILE_MAX_OVERHEAD");
+  double max_overhead_percent = overhead_str != nullptr ? strtod(overhead_str, nullptr) : 0;
+  max_overhead_ = (max_overhead_percent > 0 && max_overhead_percent < 100) ? max_overhead_percent / 100 : 0;
+  frequency_ = prof_handler_state.frequency;
+  sample_every_.store(1);
+  handler_nanos_.store(0);
+  window_cpu_nanos_ = ClockNanos(CLOCK_PROCESS_CPUTIME_ID);
+
   if (!collector_.Start(fname, collector_options)) {
     return false;
   }
@@ -218,9 +429,32 @@ bool CpuProfiler::Start(const char* fname, const ProfilerOptions* options) {
     filter_arg_ = options->filter_in_thread_arg;
   }
 
+  buffers_.Init();
+
   // Setup handler for SIGPROF interrupts
   EnableHandler();
 
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  StartWall(fname, collector_options);
+#endif
+
+  if (rotate_seconds_ > 0 || max_overhead_ > 0) {
+    // Like profile writer thread, the control thread must not take
+    // the signals meant for application threads.
+    control_stop_.store(false);
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&control_, nullptr, ControlMain, this);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    if (err != 0) {
+      RAW_LOG(ERROR, "Can't start cpu profile rotation or adaptive sampling: %s", strerror(err));
+    } else {
+      control_running_ = true;
+      control_pid_ = getpid();
+    }
+  }
+
   return true;
 }
 
@@ -234,13 +468,25 @@ void CpuProfiler::Stop() {
     return;
   }
 
+  StopControl();
+
   // Unregister prof_handler to stop receiving SIGPROF interrupts before
   // stopping the collector.
   DisableHandler();
 
-  // DisableHandler waits for the currently running callback to complete and
+  // DisableHandler waits for the currently running callbacks to complete and
   // guarantees no future invocations. It is safe to stop the collector.
+  buffers_.Drain(&collector_);
   collector_.Stop();
+
+  if (buffers_.dropped() > 0) {
+    fprintf(stderr, "PROFILE: %lld samples dropped\n", static_cast<long long>(buffers_.dropped()));
+  }
+  buffers_.Destroy();
+
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  StopWall();
+#endif
 }
 
 void CpuProfiler::FlushTable() {
@@ -254,11 +500,16 @@ void CpuProfiler::FlushTable() {
   // flushing the profile data.
   DisableHandler();
 
-  // DisableHandler waits for the currently running callback to complete and
+  // DisableHandler waits for the currently running callbacks to complete and
   // guarantees no future invocations. It is safe to flush the profile data.
+  buffers_.Drain(&collector_);
   collector_.FlushTable();
 
   EnableHandler();
+
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  FlushWall();
+#endif
 }
 
 bool CpuProfiler::Enabled() {
@@ -288,13 +539,29 @@ void CpuProfiler::GetCurrentState(ProfilerState* state) {
   //
   // If there is space in profile_name left for the pointer, then we
   // append address of samples_gathered. The test uses this "ticks
-  // count" as a form of clock to know how long it runs.
+  // count" as a form of clock to know how long it runs. Note, it
+  // only advances as buffered samples are drained, which happens
+  // every few samples.
   if (profile_name.size() + 1 + sizeof(void*) <= kBufSize) {
     void* ptr = &collector_.count_;
     memcpy(state->profile_name + profile_name.size() + 1, &ptr, sizeof(ptr));
   }
 }
 
+void CpuProfiler::GetDroppedSamples(int* samples_dropped, int* samples_write_dropped) {
+  ProfileData::State collector_state;
+  {
+    SpinLockHolder cl(&lock_);
+    collector_.GetCurrentState(&collector_state);
+  }
+  if (samples_dropped != nullptr) {
+    *samples_dropped = collector_state.enabled ? static_cast<int>(buffers_.dropped()) : 0;
+  }
+  if (samples_write_dropped != nullptr) {
+    *samples_write_dropped = collector_state.samples_write_dropped;
+  }
+}
+
 void CpuProfiler::EnableHandler() {
   RAW_CHECK(prof_handler_token_ == nullptr, "SIGPROF handler already registered");
   prof_handler_token_ = ProfileHandlerRegisterCallback(prof_handler, this);
@@ -307,22 +574,60 @@ void CpuProfiler::DisableHandler() {
   prof_handler_token_ = nullptr;
 }
 
-// Signal handler that records the pc in the profile-data structure. We do no
-// synchronization here.  profile-handler.cc guarantees that at most one
-// instance of prof_handler() will run at a time. All other routines that
-// access the data touched by prof_handler() disable this signal handler before
+// Fills 'stack' (of ProfileData::kMaxStackDepth entries) with the
+// stack of the code interrupted by a profiling signal. Returns depth
+// and sets *used_stack to the first entry. 'skip_count' frames of
+// the profiler are skipped.
+static ALWAYS_INLINE int GetSignalStack(void* signal_ucontext, int skip_count, void** stack, void*** used_stack) {
+  // Under frame-pointer-based unwinding at least on x86, the
+  // top-most active routine doesn't show up as a normal frame, but
+  // as the "pc" value in the signal handler context.
+  stack[0] = GetPC(*reinterpret_cast<ucontext_t*>(signal_ucontext));
+
+  int depth = GetStackTraceWithContext(stack + 1, ProfileData::kMaxStackDepth - 1, skip_count, signal_ucontext);
+
+  if (depth > 0 && stack[1] == stack[0]) {
+    // in case of non-frame-pointer-based unwinding we will get
+    // duplicate of PC in stack[1], which we don't want
+    *used_stack = stack + 1;
+  } else {
+    *used_stack = stack;
+    depth++;  // To account for pc value in stack[0];
+  }
+  return depth;
+}
+
+// Signal handler that records the pc in the sample buffers. Many
+// instances of prof_handler() may run at a time in different threads, so
+// samples go into buffers_, which is lock-free, and only the instance that
+// wins draining_ moves them into collector_. All other routines that access
+// the data touched by prof_handler() disable this signal handler before
 // accessing the data and therefore cannot execute concurrently with
 // prof_handler().
 void CpuProfiler::prof_handler(int sig, siginfo_t*, void* signal_ucontext, void* cpu_profiler) {
   CpuProfiler* instance = static_cast<CpuProfiler*>(cpu_profiler);
 
   if (instance->filter_ == nullptr || (*instance->filter_)(instance->filter_arg_)) {
-    void* stack[ProfileData::kMaxStackDepth];
+    // With adaptive sampling, skipped ticks are made up for by the
+    // count of recorded ones. Their (small) cost isn't measured.
+    int count = 1;
+    int64_t start_nanos = 0;
+    if (instance->max_overhead_ > 0) {
+      count = instance->sample_every_.load(std::memory_order_relaxed);
+      uint32_t ticks = profiler_ticks;
+      if (ticks == 0) {
+        // Start at a random phase, so that threads that live for
+        // fewer ticks than count aren't all recorded on their first.
+        ticks = static_cast<uint32_t>(ClockNanos(CLOCK_MONOTONIC)) | kMaxSampleEvery;
+      }
+      profiler_ticks = ticks + 1;
+      if ((ticks & (count - 1)) != 0) {
+        return;
+      }
+      start_nanos = ClockNanos(CLOCK_MONOTONIC);
+    }
 
-    // Under frame-pointer-based unwinding at least on x86, the
-    // top-most active routine doesn't show up as a normal frame, but
-    // as the "pc" value in the signal handler context.
-    stack[0] = GetPC(*reinterpret_cast<ucontext_t*>(signal_ucontext));
+    void* stack[ProfileData::kMaxStackDepth];
 
     // We skip the top three stack trace entries (this function,
     // SignalHandler::SignalHandler and one signal handler frame)
@@ -331,22 +636,441 @@ void CpuProfiler::prof_handler(int sig, siginfo_t*, void* signal_ucontext, void*
     // "pprof" at analysis time.  Instead of skipping the top frames,
     // we could skip nothing, but that would increase the profile size
     // unnecessarily.
-    int depth = GetStackTraceWithContext(stack + 1, arraysize(stack) - 1, 3, signal_ucontext);
-
     void** used_stack;
-    if (depth > 0 && stack[1] == stack[0]) {
-      // in case of non-frame-pointer-based unwinding we will get
-      // duplicate of PC in stack[1], which we don't want
-      used_stack = stack + 1;
-    } else {
-      used_stack = stack;
-      depth++;  // To account for pc value in stack[0];
+    int depth = GetSignalStack(signal_ucontext, 3, stack, &used_stack);
+
+    instance->buffers_.Add(depth, used_stack, profiler_label.load(std::memory_order_relaxed), count);
+
+    // Never wait for a drain in progress. Whoever does it will pick
+    // up our sample, or the next handler will.
+    if (instance->buffers_.drain_requested() && !instance->draining_.exchange(true, std::memory_order_acquire)) {
+      instance->buffers_.Drain(&instance->collector_);
+      instance->draining_.store(false, std::memory_order_release);
+    }
+
+    if (start_nanos != 0) {
+      instance->handler_nanos_.fetch_add(ClockNanos(CLOCK_MONOTONIC) - start_nanos, std::memory_order_relaxed);
+    }
+  }
+}
+
+void CpuProfiler::Rotate() {
+  char fname[PATH_MAX + 16];
+  rotate_count_++;
+  snprintf(fname, sizeof(fname), "%s.%u", rotate_base_, rotate_count_ % rotate_files_);
+
+  // Signal handlers only touch collector_ while holding draining_.
+  // Samples taken while we hold it wait in buffers_.
+  while (draining_.exchange(true, std::memory_order_acquire)) {
+    sched_yield();
+  }
+  buffers_.Drain(&collector_);
+  bool rotated = collector_.Rotate(fname);
+  draining_.store(false, std::memory_order_release);
+  if (!rotated) {
+    RAW_LOG(ERROR, "Can't rotate cpu profile to '%s': %s", fname, strerror(errno));
+    return;
+  }
+
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  RotateWall(fname);
+#endif
+}
+
+void CpuProfiler::StopControl() {
+  if (!control_running_) {
+    return;
+  }
+  control_running_ = false;
+
+  // After fork, the child has our state but not the thread.
+  if (control_pid_ == getpid()) {
+    control_stop_.store(true);
+    pthread_join(control_, nullptr);
+  }
+}
+
+void CpuProfiler::Adapt() {
+  int64_t cpu_nanos = ClockNanos(CLOCK_PROCESS_CPUTIME_ID);
+  int64_t window_nanos = cpu_nanos - window_cpu_nanos_;
+  window_cpu_nanos_ = cpu_nanos;
+  int64_t spent_nanos = handler_nanos_.exchange(0, std::memory_order_relaxed);
+  if (window_nanos <= 0) {
+    return;
+  }
+
+  double overhead = static_cast<double>(spent_nanos) / window_nanos;
+  int every = ProfileData::AdaptSampleEvery(sample_every_.load(std::memory_order_relaxed), overhead, max_overhead_,
+                                            kMaxSampleEvery);
+  sample_every_.store(every, std::memory_order_relaxed);
+  collector_.SetEffectiveFrequency(std::max(frequency_ / every, 1));
+}
+
+void* CpuProfiler::ControlMain(void* cpu_profiler) {
+  CpuProfiler* instance = static_cast<CpuProfiler*>(cpu_profiler);
+
+  const int64_t rotate_nanos = instance->rotate_seconds_ * int64_t{1000000000};
+  int64_t next_rotate = ClockNanos(CLOCK_MONOTONIC) + rotate_nanos;
+  int64_t next_adapt = ClockNanos(CLOCK_MONOTONIC) + kAdaptWindowNanos;
+  while (!instance->control_stop_.load()) {
+    struct timespec ts = {0, kControlPollNanos};
+    nanosleep(&ts, nullptr);
+
+    int64_t now = ClockNanos(CLOCK_MONOTONIC);
+    bool rotate = rotate_nanos > 0 && now >= next_rotate;
+    bool adapt = instance->max_overhead_ > 0 && now >= next_adapt;
+    if (!rotate && !adapt) {
+      continue;
+    }
+
+    // Stop waits for us to exit while holding lock_, so never block
+    // on it.
+    if (!instance->lock_.TryLock()) {
+      continue;
+    }
+    if (adapt) {
+      instance->Adapt();
+      next_adapt = now + kAdaptWindowNanos;
+    }
+    if (rotate) {
+      instance->Rotate();
+      next_rotate += rotate_nanos;
+      if (next_rotate <= now) {
+        next_rotate = now + rotate_nanos;
+      }
     }
+    instance->lock_.Unlock();
+  }
+  return nullptr;
+}
 
-    instance->collector_.Add(depth, used_stack);
+#if HAVE_LINUX_SIGEV_THREAD_ID
+
+// Scheduler states that wall-clock samples are labeled with. The
+// sampler passes them to wall_handler as the low bits of signal
+// value, and index of thread's WallThread above them.
+enum { kWallOnCpu = 1, kWallOffCpu = 2, kWallStateBits = 2 };
+static const tcmalloc::ProfileLabel kOnCpuLabel = {"thread_state", "on-cpu"};
+static const tcmalloc::ProfileLabel kOffCpuLabel = {"thread_state", "off-cpu"};
+
+static const int kMaxWallFrequency = 1000;
+// Threads beyond this many are not sampled.
+static const int kMaxWallThreads = 4096;
+
+// Returns cpu time used by thread 'tid' of our process, or -1 if it's
+// gone. This is the clock pthread_getcpuclockid gives, which Linux
+// encodes from tid, so we don't need the pthread_t.
+static int64_t ThreadCpuNanos(pid_t tid) {
+  const clockid_t clock = static_cast<clockid_t>((~static_cast<unsigned>(tid) << 3) | 6);
+  struct timespec ts;
+  if (clock_gettime(clock, &ts) != 0) {
+    return -1;
   }
+  return ts.tv_sec * int64_t{1000000000} + ts.tv_nsec;
 }
 
+// Returns true if thread 'tid' is running or waiting for a cpu,
+// according to /proc/self/task/<tid>/stat.
+static bool IsThreadRunnable(pid_t tid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/task/%d/stat", static_cast<int>(tid));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  char buf[512];
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) {
+    return false;
+  }
+  buf[len] = '\0';
+  // State follows thread name, which is in parentheses and may
+  // contain anything, including ')'.
+  const char* p = strrchr(buf, ')');
+  return p != nullptr && p[1] == ' ' && p[2] == 'R';
+}
+
+// Returns whether a thread that used 'cpu_used' of the 'elapsed'
+// nanoseconds since the previous tick counts as on cpu. Threads that
+// got most of a cpu obviously are, and ones that made no progress
+// are blocked. Otherwise the thread either ran briefly between
+// blocking, or shared a cpu with others, which doesn't make it
+// blocked, so we ask the scheduler.
+static bool IsWallOnCpu(pid_t tid, int64_t cpu_used, int64_t elapsed) {
+  if (2 * cpu_used >= elapsed) {
+    return true;
+  }
+  if (cpu_used <= 0) {
+    return false;
+  }
+  return IsThreadRunnable(tid);
+}
+
+void CpuProfiler::StartWall(const char* fname, const ProfileData::Options& options) {
+  if (getenv("CPUPROFILE_WALLCLOCK") == nullptr) {
+    return;
+  }
+
+  // Every registered thread gets a signal per tick, so be more
+  // conservative than with cpu time samples.
+  int frequency = std::min(options.frequency(), kMaxWallFrequency);
+
+  const char* signal_str = getenv("CPUPROFILE_WALLCLOCK_SIGNAL");
+  int signal_number = signal_str != nullptr ? atoi(signal_str) : SIGRTMIN + 3;
+  if (wall_signal_ != signal_number) {
+    // The handler is never uninstalled, since queued signals may
+    // arrive long after Stop.
+    struct sigaction sa;
+    if (signal_number <= 0 || signal_number >= NSIG || sigaction(signal_number, nullptr, &sa) != 0 ||
+        (sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN)) {
+      RAW_LOG(ERROR, "Not writing wall-clock profile: signal %d is not available", signal_number);
+      return;
+    }
+    sa.sa_sigaction = wall_handler;
+    // SA_RESTART doesn't cover everything. Blocked threads are
+    // signalled every tick, so e.g. their nanosleep, poll, epoll_wait
+    // and futex waits with timeout fail with EINTR (see
+    // signal(7)).
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    RAW_CHECK(sigaction(signal_number, &sa, nullptr) == 0, "sigaction (wall-clock profile)");
+    wall_signal_ = signal_number;
+  }
+
+  char wall_fname[PATH_MAX];
+  snprintf(wall_fname, sizeof(wall_fname), "%s.wall", fname);
+  ProfileData::Options wall_options = options;
+  wall_options.set_frequency(frequency);
+  wall_options.set_wall_clock(true);
+  // Legacy format has no labels, and on-cpu/off-cpu split is most of
+  // what wall-clock profile is good for. So it is always proto.
+  if (wall_options.format() == tcmalloc::kLegacyProfileFormat) {
+    wall_options.set_format(tcmalloc::kProtoProfileFormat);
+  }
+  if (!wall_collector_.Start(wall_fname, wall_options)) {
+    RAW_LOG(ERROR, "Can't write wall-clock profile to '%s': %s", wall_fname, strerror(errno));
+    return;
+  }
+  wall_buffers_.Init();
+  wall_period_nanos_ = int64_t{1000000000} / frequency;
+  if (wall_threads_ == nullptr) {
+    wall_threads_ = new WallThread[kWallThreadSlots]();
+  }
+  for (int i = 0; i < kWallThreadSlots; i++) {
+    wall_threads_[i].tid = 0;
+    wall_threads_[i].pending.store(false, std::memory_order_relaxed);
+  }
+  EnableWallHandler();
+
+  // Like profile writer thread, the sampler must not take the signals
+  // meant for application threads.
+  wall_sampler_stop_.store(false);
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int err = pthread_create(&wall_sampler_, nullptr, WallSamplerMain, this);
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  if (err != 0) {
+    RAW_LOG(ERROR, "Can't start wall-clock profile sampler: %s", strerror(err));
+    DisableWallHandler();
+    wall_collector_.Reset();
+    wall_buffers_.Destroy();
+    return;
+  }
+  wall_sampler_running_ = true;
+  wall_sampler_pid_ = getpid();
+}
+
+void CpuProfiler::StopWall() {
+  if (!wall_collector_.enabled()) {
+    return;
+  }
+
+  // After fork, the child has our state but not the thread.
+  if (wall_sampler_running_ && wall_sampler_pid_ == getpid()) {
+    wall_sampler_stop_.store(true);
+    pthread_join(wall_sampler_, nullptr);
+  }
+  wall_sampler_running_ = false;
+
+  DisableWallHandler();
+  wall_buffers_.Drain(&wall_collector_);
+  wall_collector_.Stop();
+  if (wall_buffers_.dropped() > 0) {
+    fprintf(stderr, "PROFILE: %lld wall-clock samples dropped\n", static_cast<long long>(wall_buffers_.dropped()));
+  }
+  wall_buffers_.Destroy();
+}
+
+void CpuProfiler::FlushWall() {
+  if (!wall_collector_.enabled()) {
+    return;
+  }
+  DisableWallHandler();
+  wall_buffers_.Drain(&wall_collector_);
+  wall_collector_.FlushTable();
+  EnableWallHandler();
+}
+
+void CpuProfiler::RotateWall(const char* fname) {
+  if (!wall_collector_.enabled()) {
+    return;
+  }
+  char wall_fname[PATH_MAX + 32];
+  snprintf(wall_fname, sizeof(wall_fname), "%s.wall", fname);
+
+  // Same as Rotate, so that the sampler doesn't pause.
+  while (wall_draining_.exchange(true, std::memory_order_acquire)) {
+    sched_yield();
+  }
+  wall_buffers_.Drain(&wall_collector_);
+  bool rotated = wall_collector_.Rotate(wall_fname);
+  wall_draining_.store(false, std::memory_order_release);
+  if (!rotated) {
+    RAW_LOG(ERROR, "Can't rotate wall-clock profile to '%s': %s", wall_fname, strerror(errno));
+  }
+}
+
+void CpuProfiler::DisableWallHandler() {
+  // wall_handler announces itself in wall_handlers_ before checking
+  // wall_enabled_ (and we do the reverse), so either it sees
+  // wall_enabled_ cleared or we see it running.
+  wall_enabled_.store(false);
+  while (wall_handlers_.load() != 0) {
+    sched_yield();
+  }
+}
+
+void* CpuProfiler::WallSamplerMain(void* cpu_profiler) {
+  CpuProfiler* instance = static_cast<CpuProfiler*>(cpu_profiler);
+  const pid_t pid = getpid();
+  const uid_t uid = getuid();
+  const int64_t period = instance->wall_period_nanos_;
+  WallThread* const threads = instance->wall_threads_;
+  pid_t* tids = new pid_t[kMaxWallThreads];
+  int num_threads = 0;  // used entries of 'threads'
+
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  int64_t prev_nanos = next.tv_sec * int64_t{1000000000} + next.tv_nsec;
+  for (int64_t tick = 1; !instance->wall_sampler_stop_.load(); tick++) {
+    next.tv_nsec += period;
+    next.tv_sec += next.tv_nsec / 1000000000;
+    next.tv_nsec %= 1000000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const int64_t now_nanos = now.tv_sec * int64_t{1000000000} + now.tv_nsec;
+    const int64_t elapsed = now_nanos - prev_nanos;
+    prev_nanos = now_nanos;
+
+    int count = std::min(ProfileHandlerGetThreadIds(tids, kMaxWallThreads), kMaxWallThreads);
+    if (num_threads + count > kWallThreadSlots / 2) {
+      // Too many exited threads. Start over; threads with a signal
+      // in flight may get one more.
+      for (int i = 0; i < kWallThreadSlots; i++) {
+        threads[i].tid = 0;
+        threads[i].pending.store(false, std::memory_order_relaxed);
+      }
+      num_threads = 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+      const pid_t tid = tids[i];
+      int slot = static_cast<unsigned>(tid) * 2654435761u & (kWallThreadSlots - 1);
+      while (threads[slot].tid != 0 && threads[slot].tid != tid) {
+        slot = (slot + 1) & (kWallThreadSlots - 1);
+      }
+      WallThread* t = &threads[slot];
+      const int64_t cpu_nanos = ThreadCpuNanos(tid);
+      if (cpu_nanos < 0) {
+        continue;
+      }
+      // Threads that weren't listed on the previous tick are new (or
+      // reuse tid of an exited one), so we have no cpu time to
+      // compare with yet. They are sampled from the next tick.
+      const bool known = (t->tid == tid && t->seen_tick == tick - 1);
+      if (t->tid == 0) {
+        t->tid = tid;
+        num_threads++;
+      }
+      const int64_t cpu_used = cpu_nanos - t->cpu_nanos;
+      t->seen_tick = tick;
+      t->cpu_nanos = cpu_nanos;
+      if (!known) {
+        t->pending.store(false, std::memory_order_relaxed);
+        continue;
+      }
+      if (t->pending.load(std::memory_order_relaxed)) {
+        continue;
+      }
+
+      siginfo_t info;
+      memset(&info, 0, sizeof(info));
+      info.si_signo = instance->wall_signal_;
+      info.si_code = SI_QUEUE;
+      info.si_pid = pid;
+      info.si_uid = uid;
+      const int state = IsWallOnCpu(tid, cpu_used, elapsed) ? kWallOnCpu : kWallOffCpu;
+      info.si_value.sival_int = (slot << kWallStateBits) | state;
+      t->pending.store(true, std::memory_order_relaxed);
+      if (syscall(SYS_rt_tgsigqueueinfo, pid, tid, instance->wall_signal_, &info) != 0) {
+        t->pending.store(false, std::memory_order_relaxed);
+      }
+    }
+
+    // If we fell behind (e.g. many threads), don't try to catch up
+    // with a burst of samples.
+    if (now.tv_sec > next.tv_sec + 1) {
+      next = now;
+    }
+  }
+
+  delete[] tids;
+  return nullptr;
+}
+
+// Like prof_handler, but runs directly as handler of wall_signal_,
+// which only the sampler thread sends.
+void CpuProfiler::wall_handler(int sig, siginfo_t* info, void* signal_ucontext) {
+  if (info->si_code != SI_QUEUE) {
+    return;
+  }
+  const int value = info->si_value.sival_int;
+  const int state = value & ((1 << kWallStateBits) - 1);
+  const int slot = value >> kWallStateBits;
+  if ((state != kWallOnCpu && state != kWallOffCpu) || slot < 0 || slot >= kWallThreadSlots) {
+    return;
+  }
+
+  int saved_errno = errno;
+  CpuProfiler* instance = &instance_;
+  if (instance->wall_threads_ != nullptr) {
+    instance->wall_threads_[slot].pending.store(false, std::memory_order_relaxed);
+  }
+  instance->wall_handlers_.fetch_add(1);
+  if (instance->wall_enabled_.load()) {
+    void* stack[ProfileData::kMaxStackDepth];
+    // Skip this function and the signal handler frame.
+    void** used_stack;
+    int depth = GetSignalStack(signal_ucontext, 2, stack, &used_stack);
+
+    instance->wall_buffers_.Add(depth, used_stack, state == kWallOnCpu ? &kOnCpuLabel : &kOffCpuLabel);
+
+    if (instance->wall_buffers_.drain_requested() &&
+        !instance->wall_draining_.exchange(true, std::memory_order_acquire)) {
+      instance->wall_buffers_.Drain(&instance->wall_collector_);
+      instance->wall_draining_.store(false, std::memory_order_release);
+    }
+  }
+  instance->wall_handlers_.fetch_sub(1);
+  errno = saved_errno;
+}
+
+#endif  // HAVE_LINUX_SIGEV_THREAD_ID
+
 #if !(defined(__CYGWIN__) || defined(__CYGWIN32__))
 
 extern "C" PERFTOOLS_DLL_DECL void ProfilerRegisterThread() { ProfileHandlerRegisterThread(); }
@@ -369,6 +1093,26 @@ extern "C" PERFTOOLS_DLL_DECL void ProfilerGetCurrentState(ProfilerState* state)
   CpuProfiler::instance_.GetCurrentState(state);
 }
 
+extern "C" PERFTOOLS_DLL_DECL void ProfilerGetDroppedSamples(int* samples_dropped, int* samples_write_dropped) {
+  CpuProfiler::instance_.GetDroppedSamples(samples_dropped, samples_write_dropped);
+}
+
+extern "C" PERFTOOLS_DLL_DECL void ProfilerSetLabel(const ProfilerLabel* label) {
+  profiler_label.store(label, std::memory_order_relaxed);
+}
+
+extern "C" PERFTOOLS_DLL_DECL const ProfilerLabel* ProfilerGetLabel() {
+  return profiler_label.load(std::memory_order_relaxed);
+}
+
+extern "C" PERFTOOLS_DLL_DECL const ProfilerLabel* ProfilerPushLabel(const ProfilerLabel* label) {
+  return profiler_label.exchange(label, std::memory_order_relaxed);
+}
+
+extern "C" PERFTOOLS_DLL_DECL void ProfilerPopLabel(const ProfilerLabel* previous) {
+  profiler_label.store(previous, std::memory_order_relaxed);
+}
+
 extern "C" PERFTOOLS_DLL_DECL int ProfilerGetStackTrace(void** result, int max_depth, int skip_count, const void* uc) {
   return GetStackTraceWithContext(result, max_depth, skip_count, uc);
 }
@@ -386,6 +1130,14 @@ extern "C" int ProfilerStart(const char* fname) { return 0; }
 extern "C" int ProfilerStartWithOptions(const char* fname, const ProfilerOptions* options) { return 0; }
 extern "C" void ProfilerStop() {}
 extern "C" void ProfilerGetCurrentState(ProfilerState* state) { memset(state, 0, sizeof(*state)); }
+extern "C" void ProfilerGetDroppedSamples(int* samples_dropped, int* samples_write_dropped) {
+  if (samples_dropped != nullptr) *samples_dropped = 0;
+  if (samples_write_dropped != nullptr) *samples_write_dropped = 0;
+}
+extern "C" void ProfilerSetLabel(const ProfilerLabel* label) {}
+extern "C" const ProfilerLabel* ProfilerGetLabel() { return nullptr; }
+extern "C" const ProfilerLabel* ProfilerPushLabel(const ProfilerLabel* label) { return nullptr; }
+extern "C" void ProfilerPopLabel(const ProfilerLabel* previous) {}
 extern "C" int ProfilerGetStackTrace(void** result, int max_depth, int skip_count, const void* uc) { return 0; }
 
 #endif  // OS_CYGWIN
@@ -0,0 +1,145 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+
+#include "soft_limit.h"
+
+#include <atomic>
+
+#include "base/spinlock.h"
+#include "central_freelist.h"
+#include "stack_allocator.h"
+#include "thread_cache.h"
+#include "thread_cache_ptr.h"
+
+namespace tcmalloc {
+
+namespace {
+
+std::atomic<SoftLimitCallback> soft_limit_callback;
+std::atomic<uint64_t> stage_counts[kSoftLimitNumStages];
+std::atomic<bool> reclaim_in_progress;
+
+// Releases free page heap memory to the system, but not more than we
+// need to get under the limit. Returns how much we're still over.
+size_t ReleaseExcess() {
+  SpinLockHolder h(Static::pageheap_lock());
+  size_t excess = Static::pageheap()->SoftLimitExcessLocked();
+  if (excess > 0) {
+    Static::pageheap()->ReleaseAtLeastNPages(pages(excess));
+    excess = Static::pageheap()->SoftLimitExcessLocked();
+  }
+  return excess;
+}
+
+void FlushCurrentThreadCache() {
+  ThreadCache* cache = ThreadCachePtr::GetIfPresent();
+  if (cache != nullptr) {
+    cache->Flush();
+  }
+}
+
+void ShrinkThreadCaches() {
+  {
+    SpinLockHolder h(Static::pageheap_lock());
+    ThreadCache::ShrinkAllCacheLimits();
+  }
+  // Other threads will scavenge their caches as they go, but we can
+  // flush ours right away.
+  FlushCurrentThreadCache();
+}
+
+void ReleaseTransferCaches() {
+  for (unsigned cl = 0; cl < Static::num_size_classes(); cl++) {
+    Static::central_cache()[cl].ReleaseTransferCache();
+  }
+  FlushStackCache();
+}
+
+size_t RunStage(SoftLimitStage stage, size_t excess) {
+  SoftLimitCallback callback = soft_limit_callback.load(std::memory_order_acquire);
+  if (stage == kSoftLimitCallback && callback == nullptr) {
+    return excess;
+  }
+
+  stage_counts[stage].fetch_add(1, std::memory_order_relaxed);
+  switch (stage) {
+    case kSoftLimitPageHeap:
+      break;
+    case kSoftLimitThreadCaches:
+      ShrinkThreadCaches();
+      break;
+    case kSoftLimitTransferCaches:
+      ReleaseTransferCaches();
+      break;
+    case kSoftLimitCallback:
+      callback(excess);
+      // Whatever the callback freed went to the thread cache first.
+      FlushCurrentThreadCache();
+      ReleaseTransferCaches();
+      break;
+    default:
+      CHECK_CONDITION(false);
+  }
+  return ReleaseExcess();
+}
+
+}  // namespace
+
+void SetSoftLimitCallback(SoftLimitCallback callback) {
+  soft_limit_callback.store(callback, std::memory_order_release);
+}
+
+uint64_t SoftLimitStageCount(SoftLimitStage stage) {
+  ASSERT(stage < kSoftLimitNumStages);
+  return stage_counts[stage].load(std::memory_order_relaxed);
+}
+
+void ReclaimForSoftLimit() {
+  if (reclaim_in_progress.exchange(true, std::memory_order_acquire)) {
+    return;
+  }
+
+  // Releasing free page heap memory is always the first thing to
+  // do. Further stages run only while we're still over the limit.
+  size_t excess = RunStage(kSoftLimitPageHeap, 0);
+  for (int stage = kSoftLimitThreadCaches; stage < kSoftLimitNumStages && excess > 0; stage++) {
+    excess = RunStage(static_cast<SoftLimitStage>(stage), excess);
+  }
+
+  {
+    SpinLockHolder h(Static::pageheap_lock());
+    Static::pageheap()->FinishSoftLimitReclaimLocked();
+  }
+  reclaim_in_progress.store(false, std::memory_order_release);
+}
+
+}  // namespace tcmalloc
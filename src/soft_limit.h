@@ -0,0 +1,97 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TCMALLOC_SOFT_LIMIT_H_
+#define TCMALLOC_SOFT_LIMIT_H_
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "base/basictypes.h"
+#include "page_heap.h"
+#include "static_vars.h"
+
+// This module implements soft heap limit
+// (TCMALLOC_SOFT_HEAP_LIMIT_MB or "tcmalloc.soft_heap_limit_mb"
+// property). Unlike the hard limit, crossing the soft limit never
+// fails allocations. Page heap notices committed memory going over
+// the limit and raises a flag, and that is all allocation paths do
+// at that point. Reclaim itself runs either from
+// MallocExtension::ProcessBackgroundActions, or at the very end of
+// outermost allocation slow path (allocate_full and friends), when
+// the allocation is done and no allocator state is in use. So the
+// callback and cache flushes below are free to call back into
+// malloc. Reclaim goes in stages of increasing cost, releasing free
+// page heap memory to the system after each stage and stopping as
+// soon as we're back under the limit:
+//
+//  * free pages already sitting in page heap;
+//  * thread caches: every cache gets its limit cut, and the current
+//    thread's cache is flushed right away;
+//  * transfer caches: objects go back to their central free list
+//    spans, and fully free spans go back to page heap. Cached
+//    coroutine stacks (see stack_allocator.h) go back too;
+//  * application's callback (see
+//    MallocExtension::SetSoftHeapLimitCallback), which can drop
+//    application-level caches.
+
+namespace tcmalloc {
+
+enum SoftLimitStage {
+  kSoftLimitPageHeap,
+  kSoftLimitThreadCaches,
+  kSoftLimitTransferCaches,
+  kSoftLimitCallback,
+  kSoftLimitNumStages
+};
+
+typedef void (*SoftLimitCallback)(size_t bytes_over_limit);
+
+void SetSoftLimitCallback(SoftLimitCallback callback);
+
+// Returns number of times given reclaim stage ran.
+uint64_t SoftLimitStageCount(SoftLimitStage stage);
+
+// Runs staged reclaim described above. Only one thread reclaims at a
+// time, others return immediately.
+// REQUIRES: no tcmalloc locks are held and no thread cache or
+// central free list operation is in progress on this thread.
+void ReclaimForSoftLimit();
+
+inline void MaybeReclaimForSoftLimit() {
+  if (PREDICT_FALSE(Static::pageheap()->SoftLimitExceeded())) {
+    ReclaimForSoftLimit();
+  }
+}
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_SOFT_LIMIT_H_
@@ -85,11 +85,26 @@ struct Span {
   unsigned int sizeclass : 8;  // Size-class for small objects (or 0)
   unsigned int location : 2;   // Is the span on a freelist, and if so, which?
   unsigned int sample : 1;     // Sampled object?
+  unsigned int zeroed : 1;     // All pages known to be zero? (fresh
+                               // from the system or released). For
+                               // IN_USE spans, as of allocation time.
+  unsigned int cold : 1;       // Small objects span for cold allocations?
   bool has_span_iter : 1;      // Iff span_iter_space has valid
                                // iterator. Only for debug builds.
 
   constexpr Span()
-      : start{}, length{}, next{}, prev{}, objects{}, refcount{}, sizeclass{}, location{}, sample{}, has_span_iter{} {}
+      : start{},
+        length{},
+        next{},
+        prev{},
+        objects{},
+        refcount{},
+        sizeclass{},
+        location{},
+        sample{},
+        zeroed{},
+        cold{},
+        has_span_iter{} {}
 
   // Sets iterator stored in span_iter_space.
   // Requires has_span_iter == 0.
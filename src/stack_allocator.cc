@@ -0,0 +1,243 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+
+#include "stack_allocator.h"
+
+#include <errno.h>
+#include <string.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>  // for mprotect
+#endif
+
+#include <algorithm>
+
+#include "base/spinlock.h"
+#include "base/thread_annotations.h"
+#include "common.h"
+#include "internal_logging.h"
+#include "page_heap.h"
+#include "soft_limit.h"
+#include "span.h"
+#include "static_vars.h"
+#include "system-alloc.h"
+#include "thread_cache.h"
+
+namespace tcmalloc {
+
+namespace {
+
+// Bounds on the stack cache. Stacks are big, so we don't want too
+// many of them sitting idle, but enough to cover typical churn of a
+// coroutine scheduler.
+constexpr int kMaxCachedStacks = 64;
+constexpr size_t kMaxStackCacheBytes = 64 << 20;
+
+struct CachedStack {
+  Span* span;
+  Length guard_pages;
+  // Number of bytes at the top of the stack that were given back to
+  // the system and need TCMalloc_SystemCommit before reuse.
+  size_t released_bytes;
+};
+
+SpinLock stack_cache_lock;
+// Ordered from least to most recently freed.
+CachedStack stack_cache[kMaxCachedStacks] GUARDED_BY(stack_cache_lock);
+int num_cached_stacks GUARDED_BY(stack_cache_lock);
+size_t cached_stack_bytes GUARDED_BY(stack_cache_lock);
+
+// mprotect works on system pages, so both guard and usable part are
+// whole spans of smallest size page heap hands out.
+Length RoundUpToSpanSize(Length n) {
+  const Length granularity = Static::sizemap()->min_span_size_in_pages();
+  return (n + granularity - 1) / granularity * granularity;
+}
+
+char* SpanStart(const Span* span) { return reinterpret_cast<char*>(span->start << kPageShift); }
+
+char* SpanEnd(const Span* span) { return reinterpret_cast<char*>((span->start + span->length) << kPageShift); }
+
+bool ProtectGuard(Span* span, Length guard_pages, bool protect) {
+#ifdef HAVE_MMAP
+  if (guard_pages == 0) {
+    return true;
+  }
+  return mprotect(SpanStart(span), guard_pages << kPageShift, protect ? PROT_NONE : (PROT_READ | PROT_WRITE)) == 0;
+#else
+  // No way to protect guard pages, so they just take up space.
+  return true;
+#endif
+}
+
+void ReturnToPageHeap(const CachedStack& stack) {
+  if (stack.released_bytes > 0) {
+    TCMalloc_SystemCommit(SpanEnd(stack.span) - stack.released_bytes, stack.released_bytes);
+  }
+  if (!ProtectGuard(stack.span, stack.guard_pages, false)) {
+    Log(kCrash, __FILE__, __LINE__, "tcmalloc: failed to unprotect stack guard pages", errno);
+  }
+  Static::pageheap()->Delete(stack.span);
+}
+
+// Removes least recently freed stack. Caller is expected to pass it
+// to ReturnToPageHeap outside of stack_cache_lock.
+CachedStack EvictOldestLocked() EXCLUSIVE_LOCKS_REQUIRED(stack_cache_lock) {
+  ASSERT(num_cached_stacks > 0);
+  CachedStack oldest = stack_cache[0];
+  num_cached_stacks--;
+  memmove(&stack_cache[0], &stack_cache[1], num_cached_stacks * sizeof(stack_cache[0]));
+  cached_stack_bytes -= oldest.span->length << kPageShift;
+  return oldest;
+}
+
+}  // namespace
+
+void* AllocateStack(size_t size, size_t guard_size) {
+  if (PREDICT_FALSE(Static::pageheap() == nullptr)) ThreadCache::InitModule();
+
+  const Length usable_pages = RoundUpToSpanSize(pages(size > 0 ? size : 1));
+  const Length guard_pages = RoundUpToSpanSize(pages(guard_size));
+  const Length total_pages = usable_pages + guard_pages;
+  if (usable_pages == 0 || total_pages < usable_pages || total_pages > kMaxValidPages) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+
+  CachedStack stack{};
+  {
+    SpinLockHolder h(&stack_cache_lock);
+    // Prefer most recently freed stacks, which are more likely to be
+    // in cache and backed by memory.
+    for (int i = num_cached_stacks - 1; i >= 0; i--) {
+      if (stack_cache[i].guard_pages == guard_pages && stack_cache[i].span->length == total_pages) {
+        stack = stack_cache[i];
+        num_cached_stacks--;
+        memmove(&stack_cache[i], &stack_cache[i + 1], (num_cached_stacks - i) * sizeof(stack_cache[0]));
+        cached_stack_bytes -= total_pages << kPageShift;
+        break;
+      }
+    }
+  }
+
+  if (stack.span != nullptr) {
+    if (stack.released_bytes > 0) {
+      TCMalloc_SystemCommit(SpanEnd(stack.span) - stack.released_bytes, stack.released_bytes);
+    }
+    return SpanStart(stack.span) + (guard_pages << kPageShift);
+  }
+
+  Span* span = Static::pageheap()->NewAligned(total_pages, Static::sizemap()->min_span_size_in_pages());
+  if (span == nullptr) {
+    // errno was set inside page heap as necessary.
+    return nullptr;
+  }
+  ASSERT(span->length == total_pages);
+  {
+    // FreeStack finds the span by the page right above the guard, so
+    // all pages must map to the span, not just first and last one.
+    SpinLockHolder h(Static::pageheap_lock());
+    Static::pageheap()->RegisterSizeClass(span, 0);
+  }
+  if (!ProtectGuard(span, guard_pages, true)) {
+    // Most likely we're out of memory mappings (vm.max_map_count).
+    Static::pageheap()->Delete(span);
+    errno = ENOMEM;
+    return nullptr;
+  }
+  MaybeReclaimForSoftLimit();
+
+  return SpanStart(span) + (guard_pages << kPageShift);
+}
+
+void FreeStack(void* stack, size_t release_bytes) {
+  if (stack == nullptr) {
+    return;
+  }
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(stack);
+  Span* span = Static::pageheap()->GetDescriptor(addr >> kPageShift);
+  if (span == nullptr || span->location != Span::IN_USE || span->sizeclass != 0 || (addr & (kPageSize - 1)) != 0) {
+    Log(kCrash, __FILE__, __LINE__, "Attempt to free invalid stack", stack);
+  }
+
+  CachedStack entry{span, (addr >> kPageShift) - span->start, 0};
+  if (release_bytes > 0) {
+    // Only release whole spans, like AllocateStack rounds things.
+    const size_t usable_bytes = SpanEnd(span) - static_cast<char*>(stack);
+    const size_t rounded = RoundUpToSpanSize(pages(release_bytes)) << kPageShift;
+    const size_t length = std::min(usable_bytes, rounded);
+    if (TCMalloc_SystemRelease(SpanEnd(span) - length, length)) {
+      entry.released_bytes = length;
+    }
+  }
+
+  const size_t bytes = span->length << kPageShift;
+  CachedStack evicted[kMaxCachedStacks + 1];
+  int num_evicted = 0;
+  {
+    SpinLockHolder h(&stack_cache_lock);
+    if (bytes > kMaxStackCacheBytes) {
+      evicted[num_evicted++] = entry;
+    } else {
+      while (num_cached_stacks == kMaxCachedStacks || cached_stack_bytes + bytes > kMaxStackCacheBytes) {
+        evicted[num_evicted++] = EvictOldestLocked();
+      }
+      stack_cache[num_cached_stacks++] = entry;
+      cached_stack_bytes += bytes;
+    }
+  }
+
+  for (int i = 0; i < num_evicted; i++) {
+    ReturnToPageHeap(evicted[i]);
+  }
+}
+
+size_t StackCacheBytes() {
+  SpinLockHolder h(&stack_cache_lock);
+  return cached_stack_bytes;
+}
+
+void FlushStackCache() {
+  CachedStack evicted[kMaxCachedStacks];
+  int num_evicted = 0;
+  {
+    SpinLockHolder h(&stack_cache_lock);
+    while (num_cached_stacks > 0) {
+      evicted[num_evicted++] = EvictOldestLocked();
+    }
+  }
+
+  for (int i = 0; i < num_evicted; i++) {
+    ReturnToPageHeap(evicted[i]);
+  }
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,68 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TCMALLOC_STACK_ALLOCATOR_H_
+#define TCMALLOC_STACK_ALLOCATOR_H_
+#include "config.h"
+
+#include <stddef.h>
+
+// This module implements stacks for coroutines and fibers (see
+// MallocExtension::AllocateStack). Every stack is a page heap span
+// (from NewAligned) with guard pages made inaccessible at its low
+// end. Freed stacks go to a small cache with their guard pages still
+// in place, so creating and destroying coroutines with the same
+// stack size doesn't call mprotect and doesn't split and merge
+// kernel's VMAs over and over. Stacks leaving the cache get their
+// guard pages made accessible again and go back to page heap.
+
+namespace tcmalloc {
+
+// Returns lowest usable address of a stack with at least size
+// usable bytes and at least guard_size bytes of guard pages right
+// below it, or nullptr if out of memory.
+void* AllocateStack(size_t size, size_t guard_size);
+
+// Returns stack to the cache. If release_bytes is non-zero, that
+// many bytes at the top of the stack (i.e. its used part) are
+// released to the system first.
+// REQUIRES: stack was returned by AllocateStack and not freed yet.
+void FreeStack(void* stack, size_t release_bytes);
+
+// Returns total size of cached stacks, including guard pages.
+size_t StackCacheBytes();
+
+// Returns all cached stacks to page heap.
+// REQUIRES: no tcmalloc locks are held.
+void FlushStackCache();
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_STACK_ALLOCATOR_H_
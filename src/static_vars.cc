@@ -41,12 +41,16 @@
 #include <pthread.h>  // for pthread_atfork
 #endif
 
+#include "base/commandlineflags.h"
+#include "cgroup_pressure.h"
 #include "common.h"
 #include "getenv_safe.h"  // TCMallocGetenvSafe
 
 #include "thread_cache_ptr.h"
 #include "system-alloc.h"
 
+DECLARE_bool(tcmalloc_prefault_hugepages);
+
 namespace tcmalloc {
 
 bool Static::inited_;
@@ -82,6 +86,8 @@ void Static::InitStaticVars() {
 
   pageheap()->SetAggressiveDecommit(aggressive_decommit);
 
+  InitCgroupPressureMonitor();
+
   inited_ = true;
 
   DLL_Init(&sampled_objects_);
@@ -106,6 +112,15 @@ void CentralCacheUnlockAll() NO_THREAD_SAFETY_ANALYSIS {
   Static::pageheap_lock()->Unlock();
 }
 
+#if !defined(__APPLE__) && !defined(_WIN32) && !defined(TCMALLOC_NO_ATFORK) && !defined(__FreeBSD__) && !defined(_AIX)
+// Child calls this after fork.  Thread caches of threads that didn't
+// make it to the child are reclaimed.
+static void CentralCacheAfterForkChild() {
+  CentralCacheUnlockAll();
+  ThreadCache::DeleteOrphanedCaches();
+}
+#endif
+
 void Static::InitLateMaybeRecursive() {
 #if !defined(__APPLE__) && !defined(_WIN32) && !defined(TCMALLOC_NO_ATFORK) && !defined(__FreeBSD__) && !defined(_AIX)
   // OSX has it's own way of handling atfork in malloc (see
@@ -136,10 +151,20 @@ void Static::InitLateMaybeRecursive() {
   // be less fortunate and allow some early app constructors to run
   // before malloc is ever called.
 
-  pthread_atfork(CentralCacheLockAll,     // parent calls before fork
-                 CentralCacheUnlockAll,   // parent calls after fork
-                 CentralCacheUnlockAll);  // child calls after fork
+  pthread_atfork(CentralCacheLockAll,          // parent calls before fork
+                 CentralCacheUnlockAll,        // parent calls after fork
+                 CentralCacheAfterForkChild);  // child calls after fork
 #endif
+
+  // Latency sensitive programs may ask us to take and fault in some
+  // memory up front (see PageHeap::Prefault).
+  const char* prefault_mb = TCMallocGetenvSafe("TCMALLOC_PREFAULT_MB");
+  if (prefault_mb != nullptr) {
+    int64_t mb = tcmalloc::commandlineflags::StringToLongLong(prefault_mb, 0);
+    if (mb > 0) {
+      pageheap()->Prefault(pages(static_cast<size_t>(mb) << 20), FLAGS_tcmalloc_prefault_hugepages);
+    }
+  }
 }
 
 }  // namespace tcmalloc
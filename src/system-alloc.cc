@@ -51,6 +51,12 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>  // for sbrk, getpagesize, off_t
 #endif
+#ifdef __linux__
+#include <sys/syscall.h>  // for SYS_process_madvise, SYS_pidfd_open
+#include <sys/uio.h>      // for iovec
+#endif
+
+#include <algorithm>  // for min
 
 #include <gperftools/malloc_extension.h>  // For SysAllocator API
 
@@ -60,6 +66,7 @@
 #include "base/spinlock.h"
 #include "base/static_storage.h"
 #include "common.h"
+#include "getenv_safe.h"  // TCMallocGetenvSafe
 #include "internal_logging.h"
 
 // Linux added support for MADV_FREE in 4.5 but we aren't ready to use it
@@ -74,12 +81,20 @@
 #define MADV_FREE MADV_DONTNEED
 #endif
 
+#if defined(__linux__) && defined(MADV_FREE) && !defined(FREE_MMAP_PROT_NONE) && defined(SYS_process_madvise) && \
+    defined(SYS_pidfd_open)
+#define HAVE_PROCESS_MADVISE 1
+#endif
+
 // Number of bytes taken from system.
 size_t TCMalloc_SystemTaken;
 
 // The current system allocator
 SysAllocator* tcmalloc_sys_alloc;
 
+// See TCMalloc_SetSystemReleaseHook.
+static SystemReleaseHook release_hook;
+
 ATTRIBUTE_WEAK ATTRIBUTE_NOINLINE SysAllocator* tc_get_sysalloc_override(SysAllocator* def) { return def; }
 
 DEFINE_bool(malloc_skip_sbrk, EnvToBool("TCMALLOC_SKIP_SBRK", false), "Whether sbrk can be used to obtain memory.");
@@ -132,6 +147,31 @@ class MmapSysAllocator : public SysAllocator {
 };
 static tcmalloc::StaticStorage<MmapSysAllocator> mmap_space;
 
+// Carves memory out of a single PROT_NONE reservation, made on first
+// use, and commits it piece by piece.  This keeps the whole heap in
+// one contiguous range, so there are fewer pagemap leaves and
+// /proc/self/maps entries, huge page alignment isn't a matter of luck
+// and "is this pointer ours" is a range check.
+class ReservedSysAllocator : public SysAllocator {
+ public:
+  explicit ReservedSysAllocator(size_t reserve_bytes) : SysAllocator(), reserve_bytes_(reserve_bytes) {}
+  void* Alloc(size_t size, size_t* actual_size, size_t alignment);
+
+ private:
+  bool Reserve();
+
+  size_t reserve_bytes_;
+  bool reserve_failed_ = false;
+  uintptr_t next_ = 0;
+};
+static tcmalloc::StaticStorage<ReservedSysAllocator> reserved_space;
+
+// Bounds of ReservedSysAllocator's range.  Set once, under spinlock.
+static uintptr_t reservation_start;
+static uintptr_t reservation_end;
+// Number of bytes committed out of the reservation.
+static size_t reservation_used;
+
 class DefaultSysAllocator : public SysAllocator {
  public:
   DefaultSysAllocator() : SysAllocator() {
@@ -148,6 +188,10 @@ class DefaultSysAllocator : public SysAllocator {
       names_[index] = name;
     }
   }
+  // Unlike child allocators, the reserved one is never marked as
+  // failed, since it may have room for smaller requests after
+  // failing a big one.
+  void SetReservedAllocator(SysAllocator* alloc) { reserved_ = alloc; }
   void* Alloc(size_t size, size_t* actual_size, size_t alignment);
 
  private:
@@ -155,6 +199,7 @@ class DefaultSysAllocator : public SysAllocator {
   bool failed_[kMaxAllocators];
   SysAllocator* allocs_[kMaxAllocators];
   const char* names_[kMaxAllocators];
+  SysAllocator* reserved_ = nullptr;
 };
 static tcmalloc::StaticStorage<DefaultSysAllocator> default_space;
 static const char sbrk_name[] = "SbrkSysAllocator";
@@ -318,7 +363,85 @@ void* MmapSysAllocator::Alloc(size_t size, size_t* actual_size, size_t alignment
   return reinterpret_cast<void*>(ptr);
 }
 
+bool ReservedSysAllocator::Reserve() {
+#ifdef HAVE_MMAP
+  if (reserve_failed_) return false;
+  reserve_failed_ = true;
+
+  // Start at huge page boundary, so that transparent huge pages can
+  // back the heap from its first byte.
+  static const size_t kReservationAlign = 2 << 20;
+  size_t bytes = (reserve_bytes_ + kReservationAlign - 1) & ~(kReservationAlign - 1);
+  if (bytes < reserve_bytes_ || bytes + kReservationAlign < bytes) return false;
+
+#ifdef MAP_NORESERVE
+  const int kNoReserve = MAP_NORESERVE;
+#else
+  const int kNoReserve = 0;
+#endif
+  void* result = mmap(nullptr, bytes + kReservationAlign, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | kNoReserve, -1, 0);
+  if (result == MAP_FAILED) {
+    return false;
+  }
+
+  uintptr_t ptr = reinterpret_cast<uintptr_t>(result);
+  uintptr_t start = (ptr + kReservationAlign - 1) & ~(kReservationAlign - 1);
+  if (start > ptr) {
+    munmap(result, start - ptr);
+  }
+  munmap(reinterpret_cast<void*>(start + bytes), ptr + kReservationAlign - start);
+
+  reserve_failed_ = false;
+  reservation_start = start;
+  reservation_end = start + bytes;
+  next_ = start;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void* ReservedSysAllocator::Alloc(size_t size, size_t* actual_size, size_t alignment) {
+#ifdef HAVE_MMAP
+  if (next_ == 0 && !Reserve()) {
+    return nullptr;
+  }
+
+  if (pagesize == 0) pagesize = getpagesize();
+  if (alignment < pagesize) alignment = pagesize;
+  size_t aligned_size = ((size + pagesize - 1) / pagesize) * pagesize;
+  if (aligned_size < size) {
+    return nullptr;
+  }
+  size = aligned_size;
+
+  // Alignment gaps are left uncommitted.
+  uintptr_t ptr = (next_ + alignment - 1) & ~(alignment - 1);
+  if (ptr < next_ || ptr > reservation_end || reservation_end - ptr < size) {
+    return nullptr;
+  }
+  if (mprotect(reinterpret_cast<void*>(ptr), size, PROT_READ | PROT_WRITE) != 0) {
+    return nullptr;
+  }
+
+  if (actual_size) {
+    *actual_size = size;
+  }
+  next_ = ptr + size;
+  reservation_used += size;
+  return reinterpret_cast<void*>(ptr);
+#else
+  return nullptr;
+#endif
+}
+
 void* DefaultSysAllocator::Alloc(size_t size, size_t* actual_size, size_t alignment) {
+  if (reserved_ != nullptr) {
+    void* result = reserved_->Alloc(size, actual_size, alignment);
+    if (result != nullptr) {
+      return result;
+    }
+  }
   for (int i = 0; i < kMaxAllocators; i++) {
     if (!failed_[i] && allocs_[i] != nullptr) {
       void* result = allocs_[i]->Alloc(size, actual_size, alignment);
@@ -358,6 +481,15 @@ void InitSystemAllocators(void) {
     sdef->SetChildAllocator(mmap, 1, mmap_name);
   }
 
+  // Reading the flag would be too early here.
+  const char* reserve_mb = TCMallocGetenvSafe("TCMALLOC_HEAP_RESERVE_MB");
+  if (reserve_mb != nullptr) {
+    int64_t mb = tcmalloc::commandlineflags::StringToLongLong(reserve_mb, 0);
+    if (mb > 0 && static_cast<uint64_t>(mb) < (uint64_t{1} << (kAddressBits - 21))) {
+      sdef->SetReservedAllocator(reserved_space.Construct(static_cast<size_t>(mb) << 20));
+    }
+  }
+
   tcmalloc_sys_alloc = tc_get_sysalloc_override(sdef);
 }
 
@@ -390,9 +522,21 @@ void* TCMalloc_SystemAlloc(size_t size, size_t* actual_size, size_t alignment) {
   return result;
 }
 
+void TCMalloc_SetSystemReleaseHook(SystemReleaseHook hook) {
+  SpinLockHolder lock_holder(&spinlock);
+  release_hook = hook;
+}
+
 bool TCMalloc_SystemRelease(void* start, size_t length) {
 #if defined(FREE_MMAP_PROT_NONE) && defined(HAVE_MMAP) || defined(MADV_FREE)
   if (FLAGS_malloc_disable_memory_release) return false;
+  {
+    SpinLockHolder lock_holder(&spinlock);
+    bool released;
+    if (release_hook != nullptr && release_hook(start, length, &released)) {
+      return released;
+    }
+  }
   if (pagesize == 0) pagesize = getpagesize();
   const size_t pagemask = pagesize - 1;
 
@@ -435,6 +579,144 @@ bool TCMalloc_SystemRelease(void* start, size_t length) {
   return false;
 }
 
+void TCMalloc_SystemPrefault(void* start, size_t length, bool use_hugepages) {
+#if defined(HAVE_MMAP) && defined(MADV_HUGEPAGE)
+  if (use_hugepages) {
+    madvise(start, length, MADV_HUGEPAGE);
+  }
+#endif
+#if defined(HAVE_MMAP) && defined(MADV_POPULATE_WRITE)
+  // Same as MAP_POPULATE, but for memory we already have.
+  if (madvise(start, length, MADV_POPULATE_WRITE) == 0) {
+    return;
+  }
+#endif
+  if (pagesize == 0) pagesize = getpagesize();
+  volatile char* p = static_cast<char*>(start);
+  for (size_t off = 0; off < length; off += pagesize) {
+    p[off] = p[off];
+  }
+}
+
+#ifdef HAVE_PROCESS_MADVISE
+
+// process_madvise needs pidfd of our own process. We open it for
+// every batch and close it right after, instead of keeping a hidden
+// descriptor around that the application might close or dup2 over
+// (and that fork would leave pointing to the parent). Like the rest
+// of memory release, this runs under pageheap_lock.
+static bool process_madvise_unsupported;
+
+// Opening and closing the pidfd costs two system calls, so batches
+// smaller than this are cheaper to release with plain madvise.
+static constexpr int kMinProcessMadviseRanges = 4;
+
+// Releases all ranges with process_madvise, up to kMaxIov ranges per
+// system call. Returns false if it didn't work, in which case caller
+// falls back to plain madvise.
+static bool ProcessMadviseRelease(const SystemReleaseRange* ranges, int count, int* syscalls) {
+  if (process_madvise_unsupported || count < kMinProcessMadviseRanges) return false;
+  if (pagesize == 0) pagesize = getpagesize();
+  const size_t pagemask = pagesize - 1;
+
+  // pidfd_open always sets O_CLOEXEC on the new descriptor.
+  int pidfd = syscall(SYS_pidfd_open, getpid(), 0);
+  ++*syscalls;
+  if (pidfd < 0) {
+    if (errno == ENOSYS) process_madvise_unsupported = true;
+    return false;
+  }
+
+  bool ok = true;
+  static constexpr int kMaxIov = 64;
+  for (int i = 0; ok && i < count; i += kMaxIov) {
+    struct iovec iov[kMaxIov];
+    int n = std::min(count - i, kMaxIov);
+    size_t total = 0;
+    for (int j = 0; j < n; j++) {
+      // Same rounding as TCMalloc_SystemRelease. Kernel would round
+      // length up, so we have to be careful here.
+      size_t start = reinterpret_cast<size_t>(ranges[i + j].start);
+      size_t new_start = (start + pagesize - 1) & ~pagemask;
+      size_t new_end = (start + ranges[i + j].length) & ~pagemask;
+      if (new_end <= new_start) {
+        ok = false;
+        break;
+      }
+      iov[j].iov_base = reinterpret_cast<void*>(new_start);
+      iov[j].iov_len = new_end - new_start;
+      total += new_end - new_start;
+    }
+    if (!ok) break;
+
+    ssize_t rv;
+    do {
+      rv = syscall(SYS_process_madvise, pidfd, iov, n, MADV_FREE, 0);
+    } while (rv < 0 && (errno == EAGAIN || errno == EINTR));
+    ++*syscalls;
+
+    if (rv < 0 && (errno == ENOSYS || errno == EINVAL || errno == EPERM)) {
+      // Old kernels only support MADV_COLD and MADV_PAGEOUT here.
+      process_madvise_unsupported = true;
+    }
+    ok = (rv == static_cast<ssize_t>(total));
+  }
+
+  close(pidfd);
+  ++*syscalls;
+  return ok;
+}
+
+#endif  // HAVE_PROCESS_MADVISE
+
+bool TCMalloc_SystemReleaseBatch(const SystemReleaseRange* ranges, int count, int* syscalls) {
+  *syscalls = 0;
+#ifdef HAVE_PROCESS_MADVISE
+  // Hooked memory isn't necessarily released by madvise.
+  if (!FLAGS_malloc_disable_memory_release && release_hook == nullptr &&
+      ProcessMadviseRelease(ranges, count, syscalls)) {
+    return true;
+  }
+#endif
+  for (int i = 0; i < count; i++) {
+    ++*syscalls;
+    if (!TCMalloc_SystemRelease(ranges[i].start, ranges[i].length)) return false;
+  }
+  return true;
+}
+
+bool TCMalloc_SystemInReservation(const void* ptr) {
+  uintptr_t p = reinterpret_cast<uintptr_t>(ptr);
+  return p - reservation_start < reservation_end - reservation_start;
+}
+
+void TCMalloc_SystemGetReservation(size_t* reserved_bytes, size_t* used_bytes) {
+  SpinLockHolder lock_holder(&spinlock);
+  *reserved_bytes = reservation_end - reservation_start;
+  *used_bytes = reservation_used;
+}
+
+bool TCMalloc_SystemAllocZeroes() {
+  SpinLockHolder lock_holder(&spinlock);
+  return system_alloc_inited && tcmalloc_sys_alloc == default_space.get();
+}
+
+bool TCMalloc_SystemReleaseZeroes(void* start, size_t length) {
+  if (!TCMalloc_SystemAllocZeroes()) {
+    // Someone else's memory. E.g. memfs_malloc maps hugetlbfs files
+    // shared, and releasing shared file pages doesn't zero them.
+    return false;
+  }
+#if defined(FREE_MMAP_PROT_NONE) && defined(HAVE_MMAP) || (defined(__linux__) && defined(MADV_FREE) && MADV_FREE == MADV_DONTNEED)
+  if (pagesize == 0) pagesize = getpagesize();
+  // TCMalloc_SystemRelease only releases whole system pages.
+  const size_t pagemask = pagesize - 1;
+  return ((reinterpret_cast<uintptr_t>(start) | length) & pagemask) == 0;
+#else
+  return false;
+#endif
+}
+
 void TCMalloc_SystemCommit(void* start, size_t length) {
 #if defined(FREE_MMAP_PROT_NONE) && defined(HAVE_MMAP)
   // remaping as MAP_FIXED to same address assuming span size did not change
@@ -76,12 +76,61 @@ extern PERFTOOLS_DLL_DECL void* TCMalloc_SystemAlloc(size_t bytes, size_t* actua
 // Returns false if release failed or not supported.
 extern PERFTOOLS_DLL_DECL bool TCMalloc_SystemRelease(void* start, size_t length);
 
+// Faults in every page of the given range (which came from
+// TCMalloc_SystemAlloc), without changing its contents, so that first
+// touch by the application doesn't page fault.  With use_hugepages
+// the range is also advised to be backed by huge pages.
+ATTRIBUTE_VISIBILITY_HIDDEN void TCMalloc_SystemPrefault(void* start, size_t length, bool use_hugepages);
+
+// Lets a custom system allocator release its memory its own way.
+// E.g. memfs_malloc maps files shared, and madvise doesn't free shared
+// file pages, but punching holes in the file does.  The hook returns
+// false if the range isn't its memory, and otherwise sets *released to
+// whether the release worked.  Called with GetSysAllocLock() held.
+typedef bool (*SystemReleaseHook)(void* start, size_t length, bool* released);
+ATTRIBUTE_VISIBILITY_HIDDEN void TCMalloc_SetSystemReleaseHook(SystemReleaseHook hook);
+
+// Range of memory for TCMalloc_SystemReleaseBatch.
+struct SystemReleaseRange {
+  void* start;
+  size_t length;
+};
+
+// Same as calling TCMalloc_SystemRelease on each of the given
+// ranges, but makes as few system calls as possible: on Linux all
+// ranges go to a single process_madvise call when the kernel
+// supports it and there is no release hook.  Sets *syscalls to the number of system calls made.
+//
+// Returns false if release failed or not supported.
+ATTRIBUTE_VISIBILITY_HIDDEN bool TCMalloc_SystemReleaseBatch(const SystemReleaseRange* ranges, int count,
+                                                             int* syscalls);
+
+// Returns true if ptr is inside the heap address range reserved up
+// front (see TCMALLOC_HEAP_RESERVE_MB).  Doesn't take any locks.
+ATTRIBUTE_VISIBILITY_HIDDEN bool TCMalloc_SystemInReservation(const void* ptr);
+
+// Returns size of the heap reservation and number of bytes of it that
+// were handed out.  Both are 0 if there is no reservation.
+ATTRIBUTE_VISIBILITY_HIDDEN void TCMalloc_SystemGetReservation(size_t* reserved_bytes, size_t* used_bytes);
+
 // Called to ressurect memory which has been previously released
 // to the system via TCMalloc_SystemRelease.  An attempt to
 // commit a page that is already committed does not cause this
 // function to fail.
 extern PERFTOOLS_DLL_DECL void TCMalloc_SystemCommit(void* start, size_t length);
 
+// Returns true if memory returned by TCMalloc_SystemAlloc is known
+// to be zero-filled.  This is the case for our default (mmap/sbrk)
+// allocators, but not necessarily for one installed via
+// MallocExtension::SetSystemAllocator.
+ATTRIBUTE_VISIBILITY_HIDDEN bool TCMalloc_SystemAllocZeroes();
+
+// Returns true if the given range, after a successful
+// TCMalloc_SystemRelease and TCMalloc_SystemCommit, is known to read
+// as zeros.  E.g. MADV_DONTNEED does that for private anonymous
+// memory, while MADV_FREE doesn't.
+ATTRIBUTE_VISIBILITY_HIDDEN bool TCMalloc_SystemReleaseZeroes(void* start, size_t length);
+
 // The current system allocator.
 extern PERFTOOLS_DLL_DECL SysAllocator* tcmalloc_sys_alloc;
 
@@ -97,6 +97,7 @@
 #include <stddef.h>  // for size_t
 #include <stdlib.h>  // for getenv
 #include <string.h>  // for strcmp, memset, strlen, etc
+#include <time.h>    // for nanosleep
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>  // for getpagesize, write, etc
 #endif
@@ -113,13 +114,16 @@
 #include "base/dynamic_annotations.h"  // for RunningOnValgrind
 #include "base/spinlock.h"             // for SpinLockHolder
 #include "central_freelist.h"
+#include "cgroup_pressure.h"
 #include "common.h"               // for StackTrace, kPageShift, etc
 #include "internal_logging.h"     // for ASSERT, TCMalloc_Printer, etc
 #include "linked_list.h"          // for SLL_SetNext
 #include "malloc_hook-inl.h"      // for tcmalloc::InvokeNewHook, etc
 #include "page_heap.h"            // for PageHeap, PageHeap::Stats
 #include "page_heap_allocator.h"  // for PageHeapAllocator
+#include "soft_limit.h"
 #include "span.h"                 // for Span, DLL_Prepend, etc
+#include "stack_allocator.h"
 #include "stack_trace_table.h"    // for StackTraceTable
 #include "static_vars.h"          // for Static
 #include "system-alloc.h"         // for DumpSystemAllocatorStats, etc
@@ -153,6 +157,9 @@ using tcmalloc::TestingPortal;
 
 DECLARE_double(tcmalloc_release_rate);
 DECLARE_int64(tcmalloc_heap_limit_mb);
+DECLARE_int64(tcmalloc_soft_heap_limit_mb);
+DECLARE_int64(tcmalloc_min_free_mb);
+DECLARE_int64(tcmalloc_background_interval_ms);
 
 // Those common architectures are known to be safe w.r.t. aliasing function
 // with "extra" unused args to function with fewer arguments (e.g.
@@ -503,7 +510,7 @@ class ATTRIBUTE_VISIBILITY_HIDDEN TestingPortalImpl : public TestingPortal {
     return Static::sizemap()->min_span_size_in_pages() * kPageSize;
   }
   size_t GetMinAlign() override { return kMinAlign; }
-  size_t GetMaxSize() override { return kMaxSize; }
+  size_t GetMaxSize() override { return Static::sizemap()->max_size(); }
   int64_t& GetSampleParameter() override { return FLAGS_tcmalloc_sample_parameter; }
   double& GetReleaseRate() override { return FLAGS_tcmalloc_release_rate; }
   int32_t& GetMaxFreeQueueSize() override { abort(); }
@@ -512,6 +519,8 @@ class ATTRIBUTE_VISIBILITY_HIDDEN TestingPortalImpl : public TestingPortal {
 
   bool IsEmergencyPtr(void* ptr) override { return tcmalloc::IsEmergencyPtr(ptr); }
 
+  bool IsInHeapReservation(void* ptr) override { return TCMalloc_SystemInReservation(ptr); }
+
   void WithEmergencyMallocEnabled(FunctionRef<void()> body) override {
     auto body_adaptor = [body](bool stacktrace_allowed) {
       CHECK(stacktrace_allowed);
@@ -527,6 +536,21 @@ class ATTRIBUTE_VISIBILITY_HIDDEN TestingPortalImpl : public TestingPortal {
     return span->sizeclass;
   }
 
+  size_t GetHandoffBytes() override {
+    size_t bytes = 0;
+    for (unsigned cl = 0; cl < Static::num_size_classes(); cl++) {
+      bytes += Static::central_cache()[cl].handoff_length() * Static::sizemap()->ByteSizeForClass(cl);
+    }
+    return bytes;
+  }
+
+  size_t GetColorOffset(void* p) override {
+    PageID pageid = reinterpret_cast<uintptr_t>(p) >> kPageShift;
+    Span* span = Static::pageheap()->GetDescriptor(pageid);
+    uintptr_t start = span->start << kPageShift;
+    return (reinterpret_cast<uintptr_t>(p) - start) % Static::sizemap()->ByteSizeForClass(span->sizeclass);
+  }
+
   void* RunReallocWithCallback(void* old_ptr, size_t new_size, void (*invalid_free_fn)(void*),
                                size_t (*invalid_get_size_fn)(const void*)) override;
 
@@ -554,6 +578,22 @@ class TCMallocImplementation : public MallocExtension {
   // NOTE: Protected by Static::pageheap_lock().
   size_t extra_bytes_released_;
 
+  std::atomic<int> background_actions_running_{};
+  std::atomic<bool> background_actions_stop_{};
+
+  // Sleeps for "tcmalloc.background_interval_ms", but wakes up early
+  // if asked to stop. Cgroup pressure monitor has its own, usually
+  // shorter, interval, so we poll it in between.
+  void SleepUntilNextBackgroundActions() {
+    constexpr int64_t kSliceMs = 10;
+    for (int64_t left = FLAGS_tcmalloc_background_interval_ms; left > 0; left -= kSliceMs) {
+      if (background_actions_stop_.load(std::memory_order_acquire)) return;
+      tcmalloc::MaybePollCgroupPressure();
+      struct timespec ts = {0, static_cast<long>(std::min(left, kSliceMs) * 1000000)};
+      nanosleep(&ts, nullptr);
+    }
+  }
+
  public:
   TCMallocImplementation() : extra_bytes_released_(0) {}
 
@@ -724,6 +764,35 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.pageheap_release_syscalls") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->StatsLocked().release_syscalls;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_release_syscalls_saved") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->StatsLocked().release_syscalls_saved;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.heap_reservation_bytes") == 0) {
+      size_t used;
+      TCMalloc_SystemGetReservation(value, &used);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.heap_reservation_used_bytes") == 0) {
+      size_t reserved;
+      TCMalloc_SystemGetReservation(&reserved, value);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.stack_cache_bytes") == 0) {
+      *value = tcmalloc::StackCacheBytes();
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.pageheap_reserve_count") == 0) {
       SpinLockHolder l(Static::pageheap_lock());
       *value = Static::pageheap()->StatsLocked().reserve_count;
@@ -766,6 +835,73 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.soft_heap_limit_mb") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = FLAGS_tcmalloc_soft_heap_limit_mb;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.min_free_mb") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = FLAGS_tcmalloc_min_free_mb;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.background_interval_ms") == 0) {
+      *value = FLAGS_tcmalloc_background_interval_ms;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.soft_limit_pageheap_reclaims") == 0) {
+      *value = tcmalloc::SoftLimitStageCount(tcmalloc::kSoftLimitPageHeap);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.soft_limit_thread_cache_reclaims") == 0) {
+      *value = tcmalloc::SoftLimitStageCount(tcmalloc::kSoftLimitThreadCaches);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.soft_limit_transfer_cache_reclaims") == 0) {
+      *value = tcmalloc::SoftLimitStageCount(tcmalloc::kSoftLimitTransferCaches);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.soft_limit_callback_reclaims") == 0) {
+      *value = tcmalloc::SoftLimitStageCount(tcmalloc::kSoftLimitCallback);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.cgroup_poll_interval_ms") == 0) {
+      *value = tcmalloc::GetCgroupPollIntervalMs();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.cgroup_polls") == 0) {
+      *value = tcmalloc::GetCgroupPressureStats().polls;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.cgroup_pressure_permille") == 0) {
+      *value = tcmalloc::GetCgroupPressureStats().last_pressure_permille;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.cgroup_pressure_events") == 0) {
+      *value = tcmalloc::GetCgroupPressureStats().pressure_events;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.cgroup_released_bytes") == 0) {
+      *value = tcmalloc::GetCgroupPressureStats().released_bytes;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.cgroup_thread_cache_trims") == 0) {
+      *value = tcmalloc::GetCgroupPressureStats().thread_cache_trims;
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.impl.thread_cache_count") == 0) {
       SpinLockHolder h(Static::pageheap_lock());
       *value = ThreadCache::thread_heap_count();
@@ -812,6 +948,32 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.soft_heap_limit_mb") == 0) {
+      {
+        SpinLockHolder l(Static::pageheap_lock());
+        FLAGS_tcmalloc_soft_heap_limit_mb = value;
+        Static::pageheap()->CheckSoftLimitLocked();
+      }
+      tcmalloc::MaybeReclaimForSoftLimit();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.cgroup_poll_interval_ms") == 0) {
+      tcmalloc::SetCgroupPollIntervalMs(value);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.min_free_mb") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      FLAGS_tcmalloc_min_free_mb = value;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.background_interval_ms") == 0) {
+      FLAGS_tcmalloc_background_interval_ms = value;
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.sample_parameter") == 0) {
       FLAGS_tcmalloc_sample_parameter = value;
       // By clearing current thread's cache we force next allocations
@@ -854,6 +1016,28 @@ class TCMallocImplementation : public MallocExtension {
     tcmalloc_sys_alloc = alloc;
   }
 
+  virtual void SetSoftHeapLimitCallback(SoftHeapLimitCallback* callback) { tcmalloc::SetSoftLimitCallback(callback); }
+
+  virtual size_t PrefaultHeap(size_t bytes, bool use_hugepages) {
+    return Static::pageheap()->Prefault(tcmalloc::pages(bytes), use_hugepages) << kPageShift;
+  }
+
+  virtual void ProcessBackgroundActions() {
+    background_actions_running_.fetch_add(1, std::memory_order_relaxed);
+    while (!background_actions_stop_.load(std::memory_order_acquire)) {
+      tcmalloc::MaybeReclaimForSoftLimit();
+      tcmalloc::MaybePollCgroupPressure();
+      Static::pageheap()->RefillFreePages();
+      SleepUntilNextBackgroundActions();
+    }
+    // Last one out lets the next ProcessBackgroundActions run.
+    if (background_actions_running_.fetch_sub(1, std::memory_order_relaxed) == 1) {
+      background_actions_stop_.store(false, std::memory_order_release);
+    }
+  }
+
+  virtual void StopBackgroundActions() { background_actions_stop_.store(true, std::memory_order_release); }
+
   virtual void ReleaseToSystem(size_t num_bytes) {
     SpinLockHolder h(Static::pageheap_lock());
     if (num_bytes <= extra_bytes_released_) {
@@ -878,6 +1062,40 @@ class TCMallocImplementation : public MallocExtension {
     }
   }
 
+  virtual size_t ReleaseToSystemWithBudget(size_t num_bytes, size_t max_lock_usec, size_t* lock_held_usec) {
+    Length num_pages = std::max<Length>(num_bytes >> kPageShift, 1);
+    Length released;
+    uint64_t start, end;
+    {
+      SpinLockHolder h(Static::pageheap_lock());
+      start = PageHeap::NowNanos();
+      uint64_t deadline = std::numeric_limits<uint64_t>::max();
+      if (max_lock_usec != 0 && max_lock_usec < deadline / 1000 - start / 1000) {
+        deadline = start + uint64_t{max_lock_usec} * 1000;
+      }
+      released = Static::pageheap()->ReleaseAtLeastNPages(num_pages, deadline);
+      end = PageHeap::NowNanos();
+    }
+    if (lock_held_usec != nullptr) {
+      *lock_held_usec = (end - start) / 1000;
+    }
+    return released << kPageShift;
+  }
+
+  virtual void* AllocateStack(size_t size, size_t guard_size) { return tcmalloc::AllocateStack(size, guard_size); }
+
+  virtual void FreeStack(void* stack, size_t release_bytes) { tcmalloc::FreeStack(stack, release_bytes); }
+
+  virtual void ReleaseFreeMemory() {
+    // Batches parked in handoff slots and cached stacks count as free
+    // memory too.
+    for (unsigned cl = 0; cl < Static::num_size_classes(); cl++) {
+      Static::central_cache()[cl].ReleaseHandoffBatches();
+    }
+    tcmalloc::FlushStackCache();
+    ReleaseToSystem(static_cast<size_t>(-1));
+  }
+
   virtual void SetMemoryReleaseRate(double rate) { FLAGS_tcmalloc_release_rate = rate; }
 
   virtual double GetMemoryReleaseRate() { return FLAGS_tcmalloc_release_rate; }
@@ -1392,6 +1610,15 @@ ALWAYS_INLINE void* do_malloc_or_cpp_alloc(size_t size) {
   return handle_oom(retry_malloc, reinterpret_cast<void*>(size), false, true);
 }
 
+// Returns true if p starts a span that we just got from page heap and
+// whose pages are all known to be zero. I.e. fresh system memory or
+// pages that were released and not touched since.
+static bool IsKnownZeroSpan(void* p) {
+  const PageID page = reinterpret_cast<uintptr_t>(p) >> kPageShift;
+  const Span* span = Static::pageheap()->GetDescriptor(page);
+  return span != nullptr && span->start == page && span->sizeclass == 0 && span->zeroed;
+}
+
 ALWAYS_INLINE void* do_calloc(size_t n, size_t elem_size) {
   // Overflow check
   const size_t size = n * elem_size;
@@ -1410,6 +1637,13 @@ ALWAYS_INLINE void* do_calloc(size_t n, size_t elem_size) {
       // But we can do it only when not dealing with emergency
       // malloc-ed memory.
       total_size = tc_nallocx(size, 0);
+
+      // Large calloc-ed memory is often used sparsely (e.g. hash
+      // tables), so not touching already zero pages saves us both
+      // the memset and the page faults.
+      if (total_size >= kPageSize && IsKnownZeroSpan(result)) {
+        return result;
+      }
     }
     memset(result, 0, total_size);
   }
@@ -1493,6 +1727,15 @@ void do_free_with_callback(void* ptr, void (*invalid_free_fn)(void*), bool use_h
         do_free_pages(span, ptr);
         return;
       }
+      if (PREDICT_FALSE(span->cold)) {
+        // Pages of cold spans are never in size class cache. Their
+        // objects go straight back, so that they don't turn into hot
+        // allocations via thread cache. Sized deletes don't look at
+        // the page, so their cold objects do go through thread cache
+        // and only get back to their span from central free list.
+        Static::central_cache()[cl].InsertCold(ptr);
+        return;
+      }
       if (!use_hint) {
         Static::pageheap()->SetCachedSizeClass(p, cl);
       }
@@ -1751,6 +1994,9 @@ ALWAYS_INLINE static void* do_allocate_full(size_t size) {
   if (PREDICT_FALSE(p == nullptr)) {
     p = OOMHandler(size);
   }
+  // Allocation is complete, so reclaim (and user's callback) may
+  // use malloc freely.
+  MaybeReclaimForSoftLimit();
   tcmalloc::InvokeNewHook(p, size);
   return CheckedMallocResult(p);
 }
@@ -1795,6 +2041,7 @@ static ATTRIBUTE_NOINLINE void* memalign_pages(size_t align, size_t size, bool f
     data.size = size;
     rv = handle_oom(retry_do_memalign, &data, from_operator, nothrow);
   }
+  MaybeReclaimForSoftLimit();
   tcmalloc::InvokeNewHook(rv, size);
   return CheckedMallocResult(rv);
 }
@@ -1911,6 +2158,7 @@ extern "C" PERFTOOLS_DLL_DECL void tc_deletearray_sized(void* p, size_t size) PE
 
 extern "C" PERFTOOLS_DLL_DECL void* tc_calloc(size_t n, size_t elem_size) PERFTOOLS_NOTHROW {
   void* result = do_calloc(n, elem_size);
+  tcmalloc::MaybeReclaimForSoftLimit();
   tcmalloc::InvokeNewHook(result, n * elem_size);
   return result;
 }
@@ -1943,7 +2191,9 @@ extern "C" PERFTOOLS_DLL_DECL void* tc_realloc(void* old_ptr, size_t new_size) P
     Log(kCrash, __FILE__, __LINE__, "Attempt to realloc invalid pointer", old_ptr);
     return 0;
   };
-  return do_realloc_with_callback(old_ptr, new_size, &InvalidFree, invalid_get_size);
+  void* result = do_realloc_with_callback(old_ptr, new_size, &InvalidFree, invalid_get_size);
+  tcmalloc::MaybeReclaimForSoftLimit();
+  return result;
 }
 
 extern "C" PERFTOOLS_DLL_DECL CACHELINE_ALIGNED_FN void* tc_new(size_t size) {
@@ -2150,4 +2400,322 @@ extern "C" PERFTOOLS_DLL_DECL void* tc_malloc_skip_new_handler(size_t size) PERF
   return result;
 }
 
+// Same as do_malloc, but small objects come straight from central
+// free list, bypassing thread cache. With cold set they are taken
+// from the "cold" spans (see CentralFreeList::RemoveCold), so that
+// cold and hot objects never share spans.
+static void* do_malloc_central(size_t size, bool cold) {
+  ThreadCachePtr cache_ptr = ThreadCachePtr::Grab();
+  if (PREDICT_FALSE(cache_ptr.IsEmergencyMallocEnabled())) {
+    return tcmalloc::EmergencyMalloc(size);
+  }
+
+  uint32_t cl;
+  if (!Static::sizemap()->GetSizeClass(size, &cl)) {
+    // Large objects have spans of their own anyways.
+    return do_malloc_pages(cache_ptr.get(), size);
+  }
+
+  size_t allocated_size = Static::sizemap()->class_to_size(cl);
+  if (PREDICT_FALSE(cache_ptr->SampleAllocation(allocated_size))) {
+    return DoSampledAllocation(size);
+  }
+
+  if (cold) {
+    return CheckedMallocResult(Static::central_cache()[cl].RemoveCold());
+  }
+
+  void* start;
+  void* end;
+  if (Static::central_cache()[cl].RemoveRange(&start, &end, 1) == 0) {
+    return nullptr;
+  }
+  return CheckedMallocResult(start);
+}
+
+static void* retry_malloc_cold(void* size) { return do_malloc_central(reinterpret_cast<size_t>(size), true); }
+
+extern "C" PERFTOOLS_DLL_DECL void* tc_malloc_hinted(size_t size, int hint) PERFTOOLS_NOTHROW {
+  void* result;
+  if (hint == TC_MALLOC_HINT_COLD) {
+    result = do_malloc_central(size, true);
+    if (PREDICT_FALSE(result == nullptr)) {
+      result = handle_oom(retry_malloc_cold, reinterpret_cast<void*>(size), false, true);
+    }
+  } else {
+    result = do_malloc_or_cpp_alloc(size);
+  }
+  tcmalloc::MaybeReclaimForSoftLimit();
+  tcmalloc::InvokeNewHook(result, size);
+  return result;
+}
+
+// Alignment requested by MALLOCX_LG_ALIGN part of flags, or 0.
+static ALWAYS_INLINE size_t mallocx_align(int flags) {
+  int lg_align = flags & 0x3f;
+  return lg_align != 0 ? size_t{1} << lg_align : 0;
+}
+
+static void* do_mallocx(size_t size, int flags) {
+  size_t align = mallocx_align(flags);
+  if (PREDICT_FALSE(align > kPageSize)) {
+    return do_memalign_pages(align, size);
+  }
+  if (align != 0) {
+    size = align_size_up(size, align);
+  }
+  if (flags & (MALLOCX_COLD | MALLOCX_TCACHE_NONE)) {
+    return do_malloc_central(size, (flags & MALLOCX_COLD) != 0);
+  }
+  return do_malloc(size);
+}
+
+struct retry_mallocx_data {
+  size_t size;
+  int flags;
+};
+
+static void* retry_do_mallocx(void* arg) {
+  retry_mallocx_data* data = static_cast<retry_mallocx_data*>(arg);
+  return do_mallocx(data->size, data->flags);
+}
+
+// Frees ptr without going through thread cache. Hooks are the
+// caller's business.
+static void do_free_no_tcache(void* ptr) {
+  if (ptr == nullptr) return;
+  if (PREDICT_FALSE(tcmalloc::IsEmergencyPtr(ptr))) {
+    tcmalloc::EmergencyFree(ptr);
+    return;
+  }
+  const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+  Span* span = Static::pageheap()->GetDescriptor(p);
+  if (PREDICT_FALSE(span == nullptr)) {
+    InvalidFree(ptr);
+    return;
+  }
+  if (span->sizeclass == 0) {
+    do_free_pages(span, ptr);
+    return;
+  }
+  if (span->cold) {
+    Static::central_cache()[span->sizeclass].InsertCold(ptr);
+    return;
+  }
+  tcmalloc::SLL_SetNext(ptr, nullptr);
+  Static::central_cache()[span->sizeclass].InsertRange(ptr, ptr, 1);
+}
+
+static void do_dallocx(void* ptr, int flags) {
+  if (flags & MALLOCX_TCACHE_NONE) {
+    do_free_no_tcache(ptr);
+  } else {
+    do_free(ptr);
+  }
+}
+
+// Tries to resize page-level allocation in place to somewhere
+// between size and size + extra bytes, preferring the latter. Small
+// objects and sampled allocations keep their size. Returns resulting
+// usable size. Hooks are the caller's business.
+static size_t resize_in_place(void* ptr, size_t size, size_t extra, int flags) {
+  const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+  Span* span = Static::pageheap()->GetDescriptor(p);
+  if (PREDICT_FALSE(span == nullptr)) {
+    return InvalidGetAllocatedSize(ptr);
+  }
+  if (span->sizeclass != 0 || span->sample) {
+    return GetSizeWithCallback(ptr, &InvalidGetAllocatedSize);
+  }
+
+  const size_t old_usable = span->length << kPageShift;
+  size_t align = mallocx_align(flags);
+  if (PREDICT_FALSE(align > 0 && (reinterpret_cast<uintptr_t>(ptr) & (align - 1)) != 0)) {
+    return old_usable;
+  }
+
+  size_t limit = size + extra;
+  if (limit < size) limit = size;  // overflow
+  // Don't shrink below max cached object size. Sized deallocation
+  // relies on such sizes not mapping to any size class.
+  const size_t min_size = Static::sizemap()->max_size() + 1;
+  if (limit < min_size) limit = min_size;
+
+  const Length want = tcmalloc::pages(limit);
+  if (want > span->length) {
+    if (!Static::pageheap()->ResizeInPlace(span, want) && tcmalloc::pages(size) > span->length) {
+      Static::pageheap()->ResizeInPlace(span, tcmalloc::pages(size));
+    }
+  } else if (want < span->length) {
+    Static::pageheap()->ResizeInPlace(span, want);
+  }
+
+  const size_t new_usable = span->length << kPageShift;
+  if ((flags & MALLOCX_ZERO) && new_usable > old_usable) {
+    memset(static_cast<char*>(ptr) + old_usable, 0, new_usable - old_usable);
+  }
+  return new_usable;
+}
+
+static size_t do_xallocx(void* ptr, size_t size, size_t extra, int flags) {
+  const size_t old_usable = GetSizeWithCallback(ptr, &InvalidGetAllocatedSize);
+  const size_t new_usable = resize_in_place(ptr, size, extra, flags);
+  if (new_usable != old_usable) {
+    size_t limit = size + extra;
+    if (limit < size) limit = size;  // overflow
+    tcmalloc::InvokeDeleteHook(ptr);
+    tcmalloc::InvokeNewHook(ptr, std::min(limit, new_usable));
+  }
+  return new_usable;
+}
+
+// rallocx of emergency malloc-ed memory. Emergency arena knows
+// nothing about flags, so unless there are none we move to memory
+// from tc_mallocx, which honors them.
+static void* do_emergency_rallocx(void* ptr, size_t size, int flags) {
+  if (mallocx_align(flags) == 0 && !(flags & MALLOCX_ZERO)) {
+    return tcmalloc::EmergencyRealloc(ptr, size);
+  }
+  void* new_ptr = tc_mallocx(size, flags);
+  if (new_ptr == nullptr) {
+    return nullptr;
+  }
+  memcpy(new_ptr, ptr, std::min(tcmalloc::EmergencyAllocatedSize(ptr), size));
+  tcmalloc::EmergencyFree(ptr);
+  return new_ptr;
+}
+
+// Zero-fills entire usable size of fresh mallocx result, unless we
+// know it is zero already.
+static void zero_mallocx_result(void* ptr, size_t size) {
+  if (tcmalloc::IsEmergencyPtr(ptr)) {
+    memset(ptr, 0, size);
+    return;
+  }
+  size_t usable = GetSizeWithCallback(ptr, &InvalidGetAllocatedSize);
+  if (usable >= kPageSize && IsKnownZeroSpan(ptr)) {
+    return;
+  }
+  memset(ptr, 0, usable);
+}
+
+extern "C" PERFTOOLS_DLL_DECL void* tc_mallocx(size_t size, int flags) {
+  void* result = do_mallocx(size, flags);
+  if (PREDICT_FALSE(result == nullptr)) {
+    retry_mallocx_data data;
+    data.size = size;
+    data.flags = flags;
+    result = handle_oom(retry_do_mallocx, &data, false, true);
+  }
+  if (result != nullptr && (flags & MALLOCX_ZERO)) {
+    zero_mallocx_result(result, size);
+  }
+  tcmalloc::MaybeReclaimForSoftLimit();
+  tcmalloc::InvokeNewHook(result, size);
+  return result;
+}
+
+extern "C" PERFTOOLS_DLL_DECL void* tc_rallocx(void* ptr, size_t size, int flags) {
+  if (ptr == nullptr) {
+    return tc_mallocx(size, flags);
+  }
+  if (PREDICT_FALSE(tcmalloc::IsEmergencyPtr(ptr))) {
+    return do_emergency_rallocx(ptr, size, flags);
+  }
+
+  const size_t old_usable = GetSizeWithCallback(ptr, &InvalidGetAllocatedSize);
+  const size_t align = mallocx_align(flags);
+  if (align == 0 || (reinterpret_cast<uintptr_t>(ptr) & (align - 1)) == 0) {
+    if (tc_nallocx(size, flags & 0x3f) == old_usable) {
+      // Same as realloc, stay in place.
+      tcmalloc::InvokeDeleteHook(ptr);
+      tcmalloc::InvokeNewHook(ptr, size);
+      return ptr;
+    }
+    if (size > Static::sizemap()->max_size() && resize_in_place(ptr, size, 0, flags) >= size) {
+      // Even if the span (e.g. sampled one) kept its size, the
+      // object did change, so hooks need to hear about it.
+      tcmalloc::InvokeDeleteHook(ptr);
+      tcmalloc::InvokeNewHook(ptr, size);
+      return ptr;
+    }
+  }
+
+  void* new_ptr = do_mallocx(size, flags);
+  if (PREDICT_FALSE(new_ptr == nullptr)) {
+    retry_mallocx_data data;
+    data.size = size;
+    data.flags = flags;
+    new_ptr = handle_oom(retry_do_mallocx, &data, false, true);
+    if (new_ptr == nullptr) {
+      return nullptr;
+    }
+  }
+
+  memcpy(new_ptr, ptr, std::min(old_usable, size));
+  if (flags & MALLOCX_ZERO) {
+    size_t new_usable = GetSizeWithCallback(new_ptr, &InvalidGetAllocatedSize);
+    if (new_usable > old_usable) {
+      memset(static_cast<char*>(new_ptr) + old_usable, 0, new_usable - old_usable);
+    }
+  }
+  tcmalloc::InvokeNewHook(new_ptr, size);
+  tcmalloc::InvokeDeleteHook(ptr);
+  do_dallocx(ptr, flags);
+  return new_ptr;
+}
+
+extern "C" PERFTOOLS_DLL_DECL size_t tc_xallocx(void* ptr, size_t size, size_t extra, int flags) {
+  return do_xallocx(ptr, size, extra, flags);
+}
+
+extern "C" PERFTOOLS_DLL_DECL size_t tc_sallocx(const void* ptr, int flags) {
+  return GetSizeWithCallback(ptr, &InvalidGetAllocatedSize);
+}
+
+extern "C" PERFTOOLS_DLL_DECL void tc_dallocx(void* ptr, int flags) {
+  if (PREDICT_TRUE(flags == 0)) {
+    free_fast_path(ptr);
+    return;
+  }
+  tcmalloc::InvokeDeleteHook(ptr);
+  do_dallocx(ptr, flags);
+}
+
+extern "C" PERFTOOLS_DLL_DECL void tc_sdallocx(void* ptr, size_t size, int flags) {
+  if (PREDICT_FALSE(flags & MALLOCX_TCACHE_NONE)) {
+    tcmalloc::InvokeDeleteHook(ptr);
+    do_free_no_tcache(ptr);
+    return;
+  }
+  // Aligned allocations came from size class of aligned-up size (see
+  // do_mallocx), so that is the size hint we want.
+  size_t align = mallocx_align(flags);
+  if (PREDICT_FALSE(align > kPageSize)) {
+    free_fast_path(ptr);
+    return;
+  }
+  tc_free_sized(ptr, align != 0 ? align_size_up(size, align) : size);
+}
+
 #endif  // TCMALLOC_USING_DEBUGALLOCATION
+
+// Unprefixed names of the mallocx family. tc_ versions are defined
+// above, or by debugallocation.cc.
+#ifdef TC_ALIAS
+extern "C" PERFTOOLS_DLL_DECL void* mallocx(size_t size, int flags) TC_ALIAS(tc_mallocx);
+extern "C" PERFTOOLS_DLL_DECL void* rallocx(void* ptr, size_t size, int flags) TC_ALIAS(tc_rallocx);
+extern "C" PERFTOOLS_DLL_DECL size_t xallocx(void* ptr, size_t size, size_t extra, int flags) TC_ALIAS(tc_xallocx);
+extern "C" PERFTOOLS_DLL_DECL size_t sallocx(const void* ptr, int flags) TC_ALIAS(tc_sallocx);
+extern "C" PERFTOOLS_DLL_DECL void dallocx(void* ptr, int flags) TC_ALIAS(tc_dallocx);
+extern "C" PERFTOOLS_DLL_DECL void sdallocx(void* ptr, size_t size, int flags) TC_ALIAS(tc_sdallocx);
+#else
+extern "C" PERFTOOLS_DLL_DECL void* mallocx(size_t size, int flags) { return tc_mallocx(size, flags); }
+extern "C" PERFTOOLS_DLL_DECL void* rallocx(void* ptr, size_t size, int flags) { return tc_rallocx(ptr, size, flags); }
+extern "C" PERFTOOLS_DLL_DECL size_t xallocx(void* ptr, size_t size, size_t extra, int flags) {
+  return tc_xallocx(ptr, size, extra, flags);
+}
+extern "C" PERFTOOLS_DLL_DECL size_t sallocx(const void* ptr, int flags) { return tc_sallocx(ptr, flags); }
+extern "C" PERFTOOLS_DLL_DECL void dallocx(void* ptr, int flags) { tc_dallocx(ptr, flags); }
+extern "C" PERFTOOLS_DLL_DECL void sdallocx(void* ptr, size_t size, int flags) { tc_sdallocx(ptr, size, flags); }
+#endif  // TC_ALIAS
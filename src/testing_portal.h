@@ -80,8 +80,18 @@ class ATTRIBUTE_VISIBILITY_HIDDEN TestingPortal {
   virtual bool IsEmergencyPtr(void* ptr) = 0;
   virtual void WithEmergencyMallocEnabled(FunctionRef<void()> body) = 0;
 
+  virtual bool IsInHeapReservation(void* ptr) = 0;
+
   virtual uint32_t GetSizeClass(void* ptr) = 0;
 
+  // Bytes of free objects in transfer cache handoff slots, over all
+  // size classes.
+  virtual size_t GetHandoffBytes() = 0;
+
+  // Offset of first object in the span that holds ptr, relative to
+  // span start (i.e. the span's cache coloring shift).
+  virtual size_t GetColorOffset(void* ptr) = 0;
+
   virtual void* RunReallocWithCallback(void* old_ptr, size_t new_size, void (*invalid_free_fn)(void*),
                                        size_t (*invalid_get_size_fn)(const void*)) = 0;
 
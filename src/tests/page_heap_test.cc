@@ -131,6 +131,56 @@ TEST(PageHeapTest, Decommit) {
   }
 }
 
+TEST(PageHeapTest, BatchedRelease) {
+  if (!HaveSystemRelease()) {
+    return;
+  }
+
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+
+  constexpr size_t kNumPtrs = 10;
+  constexpr size_t kSpanPages = 4;
+
+  {
+    tcmalloc::Span* s = ph->New(kSpanPages * kNumPtrs * 4);
+    ASSERT_NE(s, nullptr);
+    ph->Delete(s);
+  }
+
+  std::vector<tcmalloc::Span*> a_spans;
+  std::vector<tcmalloc::Span*> b_spans;
+  for (size_t i = 0; i < kNumPtrs; ++i) {
+    a_spans.push_back(ph->New(kSpanPages));
+    b_spans.push_back(ph->New(kSpanPages));
+  }
+
+  // Return 'a' spans to the system, then free 'b' spans, so that we
+  // have normal free spans with returned spans in between.
+  for (auto span : a_spans) {
+    ph->Delete(span);
+  }
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    ph->ReleaseAtLeastNPages(static_cast<Length>(-1));
+  }
+  for (auto span : b_spans) {
+    ph->Delete(span);
+  }
+
+  SpinLockHolder l(ph->pageheap_lock());
+  const tcmalloc::PageHeap::Stats before = ph->StatsLocked();
+  ASSERT_EQ(before.free_bytes >> kPageShift, kSpanPages * kNumPtrs);
+
+  EXPECT_EQ(kSpanPages * kNumPtrs, ph->ReleaseAtLeastNPages(kSpanPages * kNumPtrs));
+
+  // All of it is one address range, so it is one system call.
+  const tcmalloc::PageHeap::Stats after = ph->StatsLocked();
+  EXPECT_EQ(after.free_bytes, 0);
+  EXPECT_EQ(after.decommit_count - before.decommit_count, kNumPtrs);
+  EXPECT_EQ(after.release_syscalls - before.release_syscalls, 1);
+  EXPECT_EQ(after.release_syscalls_saved - before.release_syscalls_saved, kNumPtrs - 1);
+}
+
 // The number of kMaxPages-sized Spans we will allocate and free during the
 // tests.
 // We will also do twice this many kMaxPages/2-sized ones.
@@ -18,7 +18,12 @@
 #include <sys/time.h>
 #include <stdint.h>
 #include <time.h>
+#include <unistd.h>
+#if HAVE_LINUX_SIGEV_THREAD_ID
+#include <sys/syscall.h>
+#endif
 
+#include <algorithm>
 #include <atomic>
 #include <mutex>
 
@@ -112,6 +117,9 @@ int kSleepInterval = 200000000;
 int kTimerResetInterval = 5000000;
 
 static bool linux_per_thread_timers_mode_ = false;
+// Perf events are started and stopped like the interval timer, but
+// getitimer can't see them.
+static bool perf_events_mode_ = false;
 static int timer_type_ = ITIMER_PROF;
 
 // Delays processing by the specified number of nano seconds. 'delay_ns'
@@ -185,6 +193,7 @@ class ProfileHandlerTest : public ::testing::Test {
   // Determines the timer type.
   static void SetUpTestCase() {
     timer_type_ = (getenv("CPUPROFILE_REALTIME") ? ITIMER_REAL : ITIMER_PROF);
+    perf_events_mode_ = (getenv("CPUPROFILE_PERF_EVENTS") != nullptr);
 
 #if HAVE_LINUX_SIGEV_THREAD_ID
     linux_per_thread_timers_mode_ = (getenv("CPUPROFILE_PER_THREAD_TIMERS") != nullptr);
@@ -259,7 +268,7 @@ class ProfileHandlerTest : public ::testing::Test {
     // Check the callback count.
     EXPECT_GT(GetCallbackCount(), 0);
     // Check that the profile timer is enabled.
-    EXPECT_TRUE(linux_per_thread_timers_mode_ || IsTimerEnabled());
+    EXPECT_TRUE(linux_per_thread_timers_mode_ || perf_events_mode_ || IsTimerEnabled());
     uint64_t interrupts_before = GetInterruptCount();
     // Sleep for a bit and check that tick counter is making progress.
     int old_tick_count = tick_counter;
@@ -413,7 +422,29 @@ TEST_F(ProfileHandlerTest, RegisterCallbackBeforeThread) {
   RegisterCallback(&tick_count);
   EXPECT_EQ(1, GetCallbackCount());
   VerifyRegistration(tick_count);
-  EXPECT_TRUE(linux_per_thread_timers_mode_ || IsTimerEnabled());
+  EXPECT_TRUE(linux_per_thread_timers_mode_ || perf_events_mode_ || IsTimerEnabled());
 }
 
+#if HAVE_LINUX_SIGEV_THREAD_ID
+// Verifies that registered threads are listed until they exit.
+TEST_F(ProfileHandlerTest, GetThreadIds) {
+  pid_t tids[64];
+  // Main thread (registered by module initializer) and the worker.
+  int count = ProfileHandlerGetThreadIds(tids, arraysize(tids));
+  ASSERT_GE(count, 2);
+  ASSERT_LE(count, arraysize(tids));
+  pid_t self = syscall(SYS_gettid);
+  EXPECT_NE(tids + count, std::find(tids, tids + count, self));
+
+  // Registering again doesn't add duplicates.
+  ProfileHandlerRegisterThread();
+  EXPECT_EQ(count, ProfileHandlerGetThreadIds(tids, arraysize(tids)));
+
+  StopWorker();
+  EXPECT_EQ(count - 1, ProfileHandlerGetThreadIds(tids, arraysize(tids)));
+  StartWorker();
+  EXPECT_EQ(count, ProfileHandlerGetThreadIds(nullptr, 0));
+}
+#endif
+
 }  // namespace
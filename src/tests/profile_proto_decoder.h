@@ -0,0 +1,223 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Decoder of profile.proto for tests of profile writers. It is
+// written independently of profile-proto.cc, so that the two don't
+// share bugs.
+
+#ifndef TESTS_PROFILE_PROTO_DECODER_H_
+#define TESTS_PROFILE_PROTO_DECODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Reads protobuf wire format: varints, and fields of encoded
+// message one by one.
+class ProtoReader {
+ public:
+  explicit ProtoReader(std::string_view data) : data_(data) {}
+
+  bool done() const { return pos_ == data_.size(); }
+
+  bool Varint(uint64_t* v) {
+    *v = 0;
+    for (int shift = 0; pos_ < data_.size() && shift < 64; shift += 7) {
+      uint8_t b = data_[pos_++];
+      *v |= uint64_t{b & 0x7fu} << shift;
+      if ((b & 0x80) == 0) return true;
+    }
+    return false;
+  }
+
+  // Reads next field. Sets *bytes for length-delimited fields and
+  // *value for varint ones. Other wire types are treated as errors,
+  // since we never write them.
+  bool Field(int* field, uint64_t* value, std::string_view* bytes) {
+    uint64_t tag;
+    if (!Varint(&tag)) return false;
+    *field = tag >> 3;
+    if ((tag & 7) == 0) return Varint(value);
+    if ((tag & 7) != 2 || !Varint(value) || *value > data_.size() - pos_) return false;
+    *bytes = data_.substr(pos_, *value);
+    pos_ += *value;
+    return true;
+  }
+
+ private:
+  std::string_view data_;
+  size_t pos_ = 0;
+};
+
+// The parts of profile.proto Profile message that tests look at.
+struct DecodedProfile {
+  struct Sample {
+    std::vector<uint64_t> location_ids;
+    std::vector<int64_t> values;
+    std::string label_key;  // empty if sample has no label
+    std::string label_value;
+  };
+
+  std::vector<Sample> samples;
+  std::map<uint64_t, uint64_t> location_addresses;  // by location id
+  std::vector<std::string> strings;
+  int64_t period = 0;
+
+  // Returns addresses of sample's stack.
+  std::vector<uint64_t> Stack(const Sample& sample) const {
+    std::vector<uint64_t> result;
+    for (uint64_t id : sample.location_ids) {
+      auto it = location_addresses.find(id);
+      result.push_back(it == location_addresses.end() ? 0 : it->second);
+    }
+    return result;
+  }
+};
+
+// Decodes profile.proto message. Returns false if it is malformed.
+inline bool DecodeProfile(std::string_view msg, DecodedProfile* profile) {
+  auto packed = [](std::string_view bytes, auto* out) {
+    ProtoReader r(bytes);
+    while (!r.done()) {
+      uint64_t v;
+      if (!r.Varint(&v)) return false;
+      out->push_back(v);
+    }
+    return true;
+  };
+
+  // Labels refer to strings, which come later, so resolve them at
+  // the end.
+  std::vector<std::pair<uint64_t, uint64_t>> label_indices;
+
+  ProtoReader reader(msg);
+  while (!reader.done()) {
+    int field;
+    uint64_t value;
+    std::string_view bytes;
+    if (!reader.Field(&field, &value, &bytes)) return false;
+    if (field == 2) {  // sample
+      DecodedProfile::Sample sample;
+      std::pair<uint64_t, uint64_t> label{0, 0};
+      ProtoReader r(bytes);
+      while (!r.done()) {
+        int f;
+        uint64_t v;
+        std::string_view b;
+        if (!r.Field(&f, &v, &b)) return false;
+        if (f == 1 && !packed(b, &sample.location_ids)) return false;
+        if (f == 2 && !packed(b, &sample.values)) return false;
+        if (f == 3) {
+          ProtoReader lr(b);
+          while (!lr.done()) {
+            int lf;
+            uint64_t lv;
+            std::string_view lb;
+            if (!lr.Field(&lf, &lv, &lb)) return false;
+            if (lf == 1) label.first = lv;
+            if (lf == 2) label.second = lv;
+          }
+        }
+      }
+      profile->samples.push_back(sample);
+      label_indices.push_back(label);
+    } else if (field == 4) {  // location
+      uint64_t id = 0;
+      uint64_t address = 0;
+      ProtoReader r(bytes);
+      while (!r.done()) {
+        int f;
+        uint64_t v;
+        std::string_view b;
+        if (!r.Field(&f, &v, &b)) return false;
+        if (f == 1) id = v;
+        if (f == 3) address = v;
+      }
+      if (id == 0 || !profile->location_addresses.emplace(id, address).second) return false;
+    } else if (field == 6) {  // string_table
+      profile->strings.emplace_back(bytes);
+    } else if (field == 12) {  // period
+      profile->period = value;
+    }
+  }
+
+  for (size_t i = 0; i < label_indices.size(); i++) {
+    auto [key, value] = label_indices[i];
+    if (key >= profile->strings.size() || value >= profile->strings.size()) return false;
+    profile->samples[i].label_key = profile->strings[key];
+    profile->samples[i].label_value = profile->strings[value];
+  }
+  return true;
+}
+
+// Bitwise CRC-32 (as in gzip), independent of the table-driven one
+// the writer uses.
+inline uint32_t SlowCrc32(std::string_view data) {
+  uint32_t crc = 0xffffffff;
+  for (unsigned char c : data) {
+    crc ^= c;
+    for (int k = 0; k < 8; k++) {
+      crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+// Unpacks gzip stream made of stored deflate blocks, which is all
+// ProfileFileWriter writes, and checks its CRC and size. Returns
+// false if stream is malformed or uses compressed blocks.
+inline bool Gunzip(std::string_view gz, std::string* out) {
+  auto le16 = [&](size_t pos) { return uint32_t{uint8_t(gz[pos])} | uint32_t{uint8_t(gz[pos + 1])} << 8; };
+  auto le32 = [&](size_t pos) { return le16(pos) | le16(pos + 2) << 16; };
+
+  if (gz.size() < 10 + 8 || gz.substr(0, 3) != "\x1f\x8b\x08" || gz[3] != 0) return false;
+  size_t pos = 10;
+  bool final_block = false;
+  while (!final_block) {
+    if (pos + 5 > gz.size()) return false;
+    uint8_t header = gz[pos];
+    if ((header >> 1) != 0) return false;  // not stored block
+    final_block = header & 1;
+    uint32_t len = le16(pos + 1);
+    if ((len ^ le16(pos + 3)) != 0xffff || pos + 5 + len > gz.size()) return false;
+    out->append(gz.substr(pos + 5, len));
+    pos += 5 + len;
+  }
+  if (pos + 8 != gz.size()) return false;
+  return le32(pos) == SlowCrc32(*out) && le32(pos + 4) == static_cast<uint32_t>(out->size());
+}
+
+#endif  // TESTS_PROFILE_PROTO_DECODER_H_
@@ -37,10 +37,17 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <string.h>
+#include <time.h>
+#include <map>
+#include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "profiledata.h"
+#include "tests/profile_proto_decoder.h"
 
 #include "base/logging.h"
 
@@ -112,11 +119,11 @@ const char kNoError[] = "";
 
 class ProfileDataChecker {
  public:
-  ProfileDataChecker() {
+  explicit ProfileDataChecker(const char* suffix = "") {
     const char* tmpdir = getenv("TMPDIR");
     if (tmpdir == nullptr) tmpdir = "/tmp";
     mkdir(tmpdir, 0755);  // if necessary
-    filename_ = std::string(tmpdir) + "/profiledata_unittest.tmp";
+    filename_ = std::string(tmpdir) + "/profiledata_unittest.tmp" + suffix;
   }
 
   std::string filename() const { return filename_; }
@@ -150,6 +157,9 @@ class ProfileDataChecker {
   // an indication of the problem with the profile.
   std::string ValidateProfile();
 
+  // Returns sum of sample counts in the profile, which must be valid.
+  int64_t CountSamples();
+
  private:
   std::string filename_;
 };
@@ -285,6 +295,25 @@ std::string ProfileDataChecker::ValidateProfile() {
   return kNoError;
 }
 
+int64_t ProfileDataChecker::CountSamples() {
+  FileDescriptor fd(open(filename_.c_str(), O_RDONLY));
+  struct stat statbuf;
+  if (fd.get() < 0 || fstat(fd.get(), &statbuf) != 0) return -1;
+  // File ends with text list of mappings, which needn't fill whole slot.
+  scoped_array<ProfileDataSlot> filedata(new ProfileDataSlot[statbuf.st_size / sizeof(ProfileDataSlot) + 1]);
+  if (ReadPersistent(fd.get(), filedata.get(), statbuf.st_size) != statbuf.st_size) return -1;
+
+  // Skip header, then sum up sample counts until the trailer.
+  int64_t samples = 0;
+  for (ProfileDataSlot* sample = filedata.get() + 5; !(sample[0] == 0 && sample[1] == 1); sample += 2 + sample[1]) {
+    samples += sample[0];
+  }
+  return samples;
+}
+
+}  // namespace
+
+// Outside of anonymous namespace, since ProfileData befriends it.
 class ProfileDataTest : public testing::Test {
  protected:
   void ExpectStopped() { EXPECT_FALSE(collector_.enabled()); }
@@ -303,10 +332,27 @@ class ProfileDataTest : public testing::Test {
     EXPECT_STREQ(before.profile_name, after.profile_name);
   }
 
+  // Waits until the writer thread has written everything handed to
+  // it, so that both generations are available to Add again.
+  void WaitForWriter() {
+    for (;;) {
+      bool idle = (collector_.frozen_.load() == nullptr);
+      for (int i = 0; i < ProfileData::kNumWriteBuffers; i++) {
+        idle = idle && (collector_.write_lengths_[i].load() == 0);
+      }
+      if (idle) return;
+      sched_yield();
+    }
+  }
+
+  int evictions() const { return collector_.evictions_; }
+
   ProfileData collector_;
   ProfileDataChecker checker_;
 };
 
+namespace {
+
 // Check that various operations are safe when stopped.
 TEST_F(ProfileDataTest, OpsWhenStopped) {
   ExpectStopped();
@@ -477,6 +523,60 @@ TEST_F(ProfileDataTest, CollectTwoMatching) {
   EXPECT_EQ(kNoError, checker_.Check(slots, arraysize(slots)));
 }
 
+// Sample added with a count weighs as much as that many samples.
+// Legacy format has no labels, so samples that differ only by label
+// are counted together.
+TEST_F(ProfileDataTest, CollectLegacyIgnoresLabels) {
+  static const tcmalloc::ProfileLabel kOn = {"thread_state", "on-cpu"};
+  static const tcmalloc::ProfileLabel kOff = {"thread_state", "off-cpu"};
+  const int frequency = 2;
+  ProfileDataSlot slots[] = {
+      0,   3,   0,   1000000 / frequency,
+      0,  // binary header
+      3,   5,   100, 201,
+      302, 403, 504,  // all three samples
+      0,   1,   0     // binary trailer
+  };
+
+  ProfileData::Options options;
+  options.set_frequency(frequency);
+  EXPECT_TRUE(collector_.Start(checker_.filename().c_str(), options));
+
+  const void* trace[] = {V(100), V(201), V(302), V(403), V(504)};
+  collector_.Add(arraysize(trace), trace, &kOn);
+  collector_.Add(arraysize(trace), trace, &kOff);
+  collector_.Add(arraysize(trace), trace);
+
+  collector_.Stop();
+  EXPECT_EQ(kNoError, checker_.ValidateProfile());
+  EXPECT_EQ(kNoError, checker_.Check(slots, arraysize(slots)));
+}
+
+TEST_F(ProfileDataTest, CollectWeighted) {
+  const int frequency = 2;
+  ProfileDataSlot slots[] = {
+      0,   3,   0,   1000000 / frequency,
+      0,  // binary header
+      5,   5,   100, 201,
+      302, 403, 504,  // one sample of 4 and one of 1
+      0,   1,   0     // binary trailer
+  };
+
+  ProfileData::Options options;
+  options.set_frequency(frequency);
+  EXPECT_TRUE(collector_.Start(checker_.filename().c_str(), options));
+
+  const void* trace[] = {V(100), V(201), V(302), V(403), V(504)};
+  collector_.Add(arraysize(trace), trace, nullptr, 4);
+  ExpectRunningSamples(4);
+  collector_.Add(arraysize(trace), trace);
+  ExpectRunningSamples(5);
+
+  collector_.Stop();
+  EXPECT_EQ(kNoError, checker_.ValidateProfile());
+  EXPECT_EQ(kNoError, checker_.Check(slots, arraysize(slots)));
+}
+
 TEST_F(ProfileDataTest, CollectTwoFlush) {
   const int frequency = 2;
   ProfileDataSlot slots[] = {
@@ -543,4 +643,404 @@ TEST_F(ProfileDataTest, StartResetRestart) {
   EXPECT_EQ(kNoError, checker_.Check(slots, arraysize(slots)));
 }
 
+// Evictions are written by the background writer thread while we
+// keep adding samples.  Every sample must end up either in the file
+// or in the dropped count.
+TEST_F(ProfileDataTest, CollectManyEvictions) {
+  static const int kSamples = 200000;
+
+  ProfileData::Options options;
+  options.set_frequency(1);
+  EXPECT_TRUE(collector_.Start(checker_.filename().c_str(), options));
+
+  for (int i = 0; i < kSamples; i++) {
+    const void* trace[] = {V(1000 + i), V(2000 + i % 7), V(3000)};
+    collector_.Add(arraysize(trace), trace);
+  }
+
+  ProfileData::State state;
+  collector_.GetCurrentState(&state);
+  EXPECT_EQ(kSamples, state.samples_gathered);
+  int dropped = state.samples_write_dropped;
+
+  collector_.Stop();
+  ASSERT_EQ(kNoError, checker_.ValidateProfile());
+  EXPECT_EQ(kSamples, checker_.CountSamples() + dropped);
+}
+
+// Stacks that share callers are stored once per distinct stack, so
+// many more of them are aggregated than fit into old fixed-size table.
+TEST_F(ProfileDataTest, CollectManyDistinctStacks) {
+  static const int kStacks = 10000;
+  static const int kRepeats = 50;
+  static const int kDepth = 32;
+  // Fewer than the smallest sample table holds, so a batch never
+  // fills both generations.
+  static const int kBatch = 1000;
+  // Rounds it takes tables to grow big enough for all stacks.
+  static const int kWarmRounds = 3;
+
+  ProfileData::Options options;
+  options.set_frequency(1);
+  EXPECT_TRUE(collector_.Start(checker_.filename().c_str(), options));
+
+  const void* trace[kDepth];
+  for (int i = 0; i < kDepth; i++) {
+    trace[i] = V(5000 + i);
+  }
+  int warm_evictions = 0;
+  for (int r = 0; r < kRepeats; r++) {
+    for (int i = 0; i < kStacks; i++) {
+      trace[0] = V(100000 + i);
+      collector_.Add(kDepth, trace);
+      // Real samples come at much lower rate. Let writer thread
+      // catch up and grow the tables.
+      if ((i + 1) % kBatch == 0) {
+        WaitForWriter();
+      }
+    }
+    if (r == kWarmRounds - 1) {
+      warm_evictions = evictions();
+    }
+  }
+
+  ProfileData::State state;
+  collector_.GetCurrentState(&state);
+  EXPECT_EQ(kStacks * kRepeats, state.samples_gathered);
+  EXPECT_EQ(0, state.samples_write_dropped);
+  // Tables grow as they fill up during the first rounds, which write
+  // out a few times the number of stacks. Once they hold all stacks,
+  // nothing is written until Stop.
+  EXPECT_GT(warm_evictions, 0);
+  EXPECT_LT(warm_evictions, 4 * kStacks);
+  EXPECT_EQ(warm_evictions, evictions());
+
+  collector_.Stop();
+  ASSERT_EQ(kNoError, checker_.ValidateProfile());
+  EXPECT_EQ(kStacks * kRepeats, checker_.CountSamples());
+
+  // Each sample written on its own would take this much.
+  struct stat statbuf;
+  ASSERT_EQ(0, stat(checker_.filename().c_str(), &statbuf));
+  EXPECT_LT(statbuf.st_size, int64_t{kStacks} * kRepeats * (2 + kDepth) * sizeof(ProfileDataSlot) / 10);
+}
+
+// Rotate finishes the first file and continues into the second one.
+TEST_F(ProfileDataTest, CollectRotate) {
+  const int frequency = 2;
+  ProfileDataSlot slots1[] = {
+      0,   3,   0,   1000000 / frequency,
+      0,  // binary header
+      1,   5,   100, 201,
+      302, 403, 504,  // sample before rotation
+      0,   1,   0     // binary trailer
+  };
+  ProfileDataSlot slots2[] = {
+      0,   3,   0,   1000000 / frequency,
+      0,  // binary header
+      2,   5,   100, 201,
+      302, 403, 504,  // samples after rotation
+      0,   1,   0     // binary trailer
+  };
+
+  ProfileDataChecker first(".0");
+  ProfileData::Options options;
+  options.set_frequency(frequency);
+  EXPECT_TRUE(collector_.Start(first.filename().c_str(), options));
+
+  const void* trace[] = {V(100), V(201), V(302), V(403), V(504)};
+  collector_.Add(arraysize(trace), trace);
+  EXPECT_TRUE(collector_.Rotate(checker_.filename().c_str()));
+  collector_.Add(arraysize(trace), trace);
+  collector_.Add(arraysize(trace), trace);
+  ExpectRunningSamples(3);
+
+  ProfileData::State state;
+  collector_.GetCurrentState(&state);
+  EXPECT_EQ(checker_.filename(), state.profile_name);
+
+  collector_.Stop();
+  ExpectStopped();
+  EXPECT_EQ(kNoError, first.ValidateProfile());
+  EXPECT_EQ(kNoError, first.Check(slots1, arraysize(slots1)));
+  EXPECT_EQ(kNoError, checker_.ValidateProfile());
+  EXPECT_EQ(kNoError, checker_.Check(slots2, arraysize(slots2)));
+  unlink(first.filename().c_str());
+}
+
+// Samples beyond max_file_bytes are not written, but the file stays
+// valid.
+TEST_F(ProfileDataTest, CollectMaxFileBytes) {
+  ProfileData::Options options;
+  options.set_frequency(1);
+  // Header and two samples of depth 3.
+  options.set_max_file_bytes((5 + 2 * 5) * sizeof(ProfileDataSlot));
+  EXPECT_TRUE(collector_.Start(checker_.filename().c_str(), options));
+
+  for (int i = 0; i < 10; i++) {
+    const void* trace[] = {V(1000 + i), V(2000), V(3000)};
+    collector_.Add(arraysize(trace), trace);
+  }
+
+  collector_.Stop();
+  ASSERT_EQ(kNoError, checker_.ValidateProfile());
+  EXPECT_EQ(2, checker_.CountSamples());
+}
+
+// Reads whole file into string.
+std::string ReadFile(const std::string& filename) {
+  FileDescriptor fd(open(filename.c_str(), O_RDONLY));
+  std::string result;
+  char buf[4096];
+  ssize_t n;
+  while (fd.get() >= 0 && (n = ReadPersistent(fd.get(), buf, sizeof(buf))) > 0) {
+    result.append(buf, n);
+  }
+  return result;
+}
+
+// Counts occurrences of each top-level field of encoded protobuf
+// message. Returns false if message is malformed.
+bool CountProtoFields(const std::string& msg, int counts[16]) {
+  size_t pos = 0;
+  auto varint = [&](uint64_t* v) {
+    *v = 0;
+    for (int shift = 0; pos < msg.size() && shift < 64; shift += 7) {
+      uint8_t b = msg[pos++];
+      *v |= uint64_t{b & 0x7fu} << shift;
+      if ((b & 0x80) == 0) return true;
+    }
+    return false;
+  };
+  while (pos < msg.size()) {
+    uint64_t tag, v;
+    if (!varint(&tag)) return false;
+    if ((tag & 7) == 0) {
+      if (!varint(&v)) return false;
+    } else if ((tag & 7) == 2) {
+      if (!varint(&v) || v > msg.size() - pos) return false;
+      pos += v;
+    } else {
+      return false;
+    }
+    if ((tag >> 3) < 16) counts[tag >> 3]++;
+  }
+  return true;
+}
+
+TEST_F(ProfileDataTest, CollectProto) {
+  ProfileData::Options options;
+  options.set_frequency(100);
+  options.set_format(tcmalloc::kProtoProfileFormat);
+  EXPECT_TRUE(collector_.Start(checker_.filename().c_str(), options));
+
+  const void* trace1[] = {V(100), V(201), V(302)};
+  const void* trace2[] = {V(100), V(202), V(302)};
+  collector_.Add(arraysize(trace1), trace1);
+  collector_.Add(arraysize(trace1), trace1);
+  collector_.Add(arraysize(trace2), trace2);
+  collector_.Stop();
+
+  std::string data = ReadFile(checker_.filename());
+  int counts[16] = {};
+  ASSERT_TRUE(CountProtoFields(data, counts));
+  EXPECT_EQ(2, counts[1]);   // sample_type
+  EXPECT_EQ(1, counts[11]);  // period_type
+
+  DecodedProfile profile;
+  ASSERT_TRUE(DecodeProfile(data, &profile));
+  EXPECT_EQ(10000000, profile.period);
+  // Locations are deduplicated: 100, 201-1, 202-1 and 302-1 (return
+  // addresses except the leaf point past calls).
+  EXPECT_EQ(4, profile.location_addresses.size());
+
+  // One sample per distinct stack, values are count and cpu time.
+  ASSERT_EQ(2, profile.samples.size());
+  const DecodedProfile::Sample* s1 = &profile.samples[0];
+  const DecodedProfile::Sample* s2 = &profile.samples[1];
+  if (profile.Stack(*s1)[1] != 200) {
+    std::swap(s1, s2);
+  }
+  EXPECT_EQ((std::vector<uint64_t>{100, 200, 301}), profile.Stack(*s1));
+  EXPECT_EQ((std::vector<int64_t>{2, 2 * 10000000}), s1->values);
+  EXPECT_EQ((std::vector<uint64_t>{100, 201, 301}), profile.Stack(*s2));
+  EXPECT_EQ((std::vector<int64_t>{1, 10000000}), s2->values);
+  // Shared frames share location ids.
+  EXPECT_EQ(s1->location_ids[0], s2->location_ids[0]);
+  EXPECT_EQ(s1->location_ids[2], s2->location_ids[2]);
+  EXPECT_NE(s1->location_ids[1], s2->location_ids[1]);
+  EXPECT_EQ("", s1->label_key);
+}
+
+// Samples with the same stack but different labels are kept apart,
+// and each label string is written once.
+TEST_F(ProfileDataTest, CollectProtoLabels) {
+  static const tcmalloc::ProfileLabel kOn = {"thread_state", "on-cpu"};
+  static const tcmalloc::ProfileLabel kOff = {"thread_state", "off-cpu"};
+
+  ProfileData::Options options;
+  options.set_frequency(100);
+  options.set_format(tcmalloc::kProtoProfileFormat);
+  options.set_wall_clock(true);
+  EXPECT_TRUE(collector_.Start(checker_.filename().c_str(), options));
+
+  const void* trace[] = {V(100), V(201), V(302)};
+  collector_.Add(arraysize(trace), trace, &kOn);
+  collector_.Add(arraysize(trace), trace, &kOff);
+  collector_.Add(arraysize(trace), trace, &kOn);
+  collector_.Add(arraysize(trace), trace);
+  collector_.Stop();
+
+  std::string data = ReadFile(checker_.filename());
+  DecodedProfile profile;
+  ASSERT_TRUE(DecodeProfile(data, &profile));
+  EXPECT_EQ(3, profile.location_addresses.size());
+  ASSERT_EQ(3, profile.samples.size());
+  std::map<std::string, int64_t> counts_by_label;
+  for (const auto& sample : profile.samples) {
+    EXPECT_EQ((std::vector<uint64_t>{100, 200, 301}), profile.Stack(sample));
+    EXPECT_EQ(0, counts_by_label.count(sample.label_value));
+    counts_by_label[sample.label_value] = sample.values[0];
+    if (!sample.label_value.empty()) {
+      EXPECT_EQ("thread_state", sample.label_key);
+    }
+  }
+  EXPECT_EQ(2, counts_by_label["on-cpu"]);
+  EXPECT_EQ(1, counts_by_label["off-cpu"]);
+  EXPECT_EQ(1, counts_by_label[""]);
+
+  auto occurrences = [&](const char* str) {
+    int n = 0;
+    for (size_t pos = data.find(str); pos != std::string::npos; pos = data.find(str, pos + 1)) {
+      n++;
+    }
+    return n;
+  };
+  EXPECT_EQ(1, occurrences("thread_state"));
+  EXPECT_EQ(1, occurrences("off-cpu"));
+  EXPECT_EQ(2, occurrences("wall"));  // sample_type and period_type
+}
+
+// Each change of effective frequency is written as a comment.
+TEST_F(ProfileDataTest, CollectProtoFrequencyChanges) {
+  ProfileData::Options options;
+  options.set_frequency(100);
+  options.set_format(tcmalloc::kProtoProfileFormat);
+  EXPECT_TRUE(collector_.Start(checker_.filename().c_str(), options));
+
+  const void* trace[] = {V(100), V(201), V(302)};
+  collector_.Add(arraysize(trace), trace);
+  collector_.SetEffectiveFrequency(50);
+  collector_.Add(arraysize(trace), trace, nullptr, 2);
+  collector_.SetEffectiveFrequency(50);
+  collector_.SetEffectiveFrequency(100);
+  collector_.Stop();
+
+  std::string data = ReadFile(checker_.filename());
+  int counts[16] = {};
+  ASSERT_TRUE(CountProtoFields(data, counts));
+  EXPECT_EQ(1, counts[2]);   // sample
+  EXPECT_EQ(2, counts[13]);  // comment
+  EXPECT_NE(std::string::npos, data.find("sampling frequency 50 Hz (of 100 Hz)"));
+  EXPECT_NE(std::string::npos, data.find("sampling frequency 100 Hz (of 100 Hz)"));
+}
+
+TEST(ProfileDataAdaptTest, SampleEvery) {
+  // Too much overhead: record fewer ticks until it's under target.
+  EXPECT_EQ(16, ProfileData::AdaptSampleEvery(1, 0.10, 0.01, 256));
+  EXPECT_EQ(2, ProfileData::AdaptSampleEvery(1, 0.015, 0.01, 256));
+  // But no fewer than max_every.
+  EXPECT_EQ(256, ProfileData::AdaptSampleEvery(128, 1.0, 0.01, 256));
+  EXPECT_EQ(256, ProfileData::AdaptSampleEvery(256, 1.0, 0.01, 256));
+  // Within target, but not far under it: keep going.
+  EXPECT_EQ(8, ProfileData::AdaptSampleEvery(8, 0.01, 0.01, 256));
+  EXPECT_EQ(8, ProfileData::AdaptSampleEvery(8, 0.005, 0.01, 256));
+  EXPECT_EQ(8, ProfileData::AdaptSampleEvery(8, 0.0025, 0.01, 256));
+  // Far under target: record more ticks while overhead would stay
+  // under half of target.
+  EXPECT_EQ(4, ProfileData::AdaptSampleEvery(8, 0.002, 0.01, 256));
+  EXPECT_EQ(2, ProfileData::AdaptSampleEvery(64, 0.0001, 0.01, 256));
+  // But no more than every tick.
+  EXPECT_EQ(1, ProfileData::AdaptSampleEvery(1, 0.0, 0.01, 256));
+  EXPECT_EQ(1, ProfileData::AdaptSampleEvery(256, 0.0, 0.01, 256));
+  // Overhead expected after a change doesn't change it back.
+  EXPECT_EQ(16, ProfileData::AdaptSampleEvery(16, 0.10 / 16, 0.01, 256));
+  EXPECT_EQ(2, ProfileData::AdaptSampleEvery(2, 0.0001 * 32, 0.01, 256));
+}
+
+TEST_F(ProfileDataTest, CollectProtoGzip) {
+  ProfileData::Options options;
+  options.set_format(tcmalloc::kProtoGzipProfileFormat);
+  EXPECT_TRUE(collector_.Start(checker_.filename().c_str(), options));
+  // Enough distinct stacks to need several stored blocks.
+  static const int kStacks = 10000;
+  for (int i = 0; i < kStacks; i++) {
+    const void* trace[] = {V(100), V(1001 + i), V(302)};
+    collector_.Add(arraysize(trace), trace);
+  }
+  collector_.Stop();
+
+  std::string data = ReadFile(checker_.filename());
+  std::string unpacked;
+  ASSERT_TRUE(Gunzip(data, &unpacked));
+  EXPECT_GT(unpacked.size(), tcmalloc::ProfileFileWriter::kSize);
+
+  DecodedProfile profile;
+  ASSERT_TRUE(DecodeProfile(unpacked, &profile));
+  ASSERT_EQ(kStacks, profile.samples.size());
+  std::set<uint64_t> callers;
+  for (const auto& sample : profile.samples) {
+    std::vector<uint64_t> stack = profile.Stack(sample);
+    ASSERT_EQ(3, stack.size());
+    EXPECT_EQ(100, stack[0]);
+    EXPECT_EQ(301, stack[2]);
+    callers.insert(stack[1]);
+    EXPECT_EQ(1, sample.values[0]);
+  }
+  EXPECT_EQ(kStacks, callers.size());
+  EXPECT_EQ(1000, *callers.begin());
+}
+
+// Many threads add samples at once while one of them keeps draining
+// buffers into collector. Every sample must end up either in collector
+// or in dropped count.
+TEST_F(ProfileDataTest, SampleBuffersConcurrentAdd) {
+  static const int kThreads = 8;
+  static const int kSamplesPerThread = 20000;
+
+  ProfileData::Options options;
+  options.set_frequency(1);
+  EXPECT_TRUE(collector_.Start(checker_.filename().c_str(), options));
+
+  ProfileSampleBuffers buffers;
+  buffers.Init();
+  std::atomic<bool> draining{false};
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&, t]() {
+      const void* trace[] = {V(100 + t), V(200), V(300 + t % 2)};
+      for (int i = 0; i < kSamplesPerThread; i++) {
+        buffers.Add(arraysize(trace), trace);
+        if (buffers.drain_requested() && !draining.exchange(true)) {
+          buffers.Drain(&collector_);
+          draining.store(false);
+        }
+      }
+    });
+  }
+  for (std::thread& th : threads) {
+    th.join();
+  }
+  buffers.Drain(&collector_);
+
+  ProfileData::State state;
+  collector_.GetCurrentState(&state);
+  EXPECT_EQ(kThreads * kSamplesPerThread, state.samples_gathered + buffers.dropped());
+  EXPECT_GT(state.samples_gathered, 0);
+
+  collector_.Stop();
+  EXPECT_EQ(kNoError, checker_.ValidateProfile());
+}
+
 }  // namespace
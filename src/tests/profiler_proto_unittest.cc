@@ -0,0 +1,306 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2024, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Runs the cpu profiler for real, with profiles in profile.proto
+// format, and checks what ends up in them.
+
+#include "config_for_unittests.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gperftools/profiler.h"
+#include "tests/profile_proto_decoder.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+
+std::string ProfileName(const char* name) {
+  const char* tmpdir = getenv("TMPDIR");
+  if (tmpdir == nullptr) tmpdir = "/tmp";
+  mkdir(tmpdir, 0755);  // if necessary
+  return std::string(tmpdir) + "/profiler_proto_unittest." + name + "." + std::to_string(getpid());
+}
+
+std::string ReadWholeFile(const std::string& filename) {
+  std::string result;
+  FILE* f = fopen(filename.c_str(), "rb");
+  if (f == nullptr) return result;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    result.append(buf, n);
+  }
+  fclose(f);
+  return result;
+}
+
+// Returns number of queued signals of our user, from "SigQ" line of
+// /proc/self/status, or -1.
+int QueuedSignals() {
+  FILE* f = fopen("/proc/self/status", "r");
+  if (f == nullptr) return -1;
+  char line[256];
+  int queued = -1;
+  while (fgets(line, sizeof(line), f) != nullptr) {
+    if (sscanf(line, "SigQ: %d/", &queued) == 1) break;
+  }
+  fclose(f);
+  return queued;
+}
+
+// Sleeps, possibly less than 'ms' due to sampling signals.
+void SleepMillis(int ms) {
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&ts, nullptr);
+}
+
+// Returns monotonic time in milliseconds.
+int64_t NowMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * int64_t{1000} + ts.tv_nsec / 1000000;
+}
+
+// Sums sample counts of profile by value of sample label.
+std::map<std::string, int64_t> SamplesByLabel(const DecodedProfile& profile) {
+  std::map<std::string, int64_t> result;
+  for (const auto& sample : profile.samples) {
+    result[sample.label_value] += sample.values[0];
+  }
+  return result;
+}
+
+// Burns 'ms' milliseconds of the calling thread's cpu time.
+void SpinMillis(int ms) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  const int64_t end = ts.tv_sec * int64_t{1000} + ts.tv_nsec / 1000000 + ms;
+  volatile uint64_t x = 0;
+  do {
+    for (int i = 0; i < 10000; i++) {
+      x = x + i;
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  } while (ts.tv_sec * int64_t{1000} + ts.tv_nsec / 1000000 < end);
+}
+
+// Samples carry label that was set in the sampled thread when they
+// were taken.
+TEST(ProfilerProtoTest, Labels) {
+  static const ProfilerLabel kTenantA = {"tenant", "a"};
+  static const ProfilerLabel kTenantB = {"tenant", "b"};
+  static const ProfilerLabel kTenantC = {"tenant", "c"};
+
+  setenv("CPUPROFILE_FORMAT", "proto", 1);
+  const std::string name = ProfileName("labels");
+  ASSERT_TRUE(ProfilerStart(name.c_str()));
+  std::thread a([]() {
+    ProfilerRegisterThread();
+    ProfilerSetLabel(&kTenantA);
+    SpinMillis(300);
+    ProfilerSetLabel(nullptr);
+  });
+  std::thread b([]() {
+    ProfilerRegisterThread();
+    const ProfilerLabel* outer = ProfilerPushLabel(&kTenantB);
+    EXPECT_EQ(nullptr, outer);
+    SpinMillis(150);
+    const ProfilerLabel* previous = ProfilerPushLabel(&kTenantC);
+    EXPECT_EQ(&kTenantB, previous);
+    SpinMillis(300);
+    ProfilerPopLabel(previous);
+    EXPECT_EQ(&kTenantB, ProfilerGetLabel());
+    SpinMillis(150);
+    ProfilerPopLabel(outer);
+    EXPECT_EQ(nullptr, ProfilerGetLabel());
+  });
+  a.join();
+  b.join();
+  SpinMillis(100);
+  ProfilerStop();
+  unsetenv("CPUPROFILE_FORMAT");
+
+  DecodedProfile profile;
+  ASSERT_TRUE(DecodeProfile(ReadWholeFile(name), &profile));
+  std::map<std::string, int64_t> samples = SamplesByLabel(profile);
+  // About 30 samples each at default 100 Hz.
+  EXPECT_GE(samples["a"], 5);
+  EXPECT_GE(samples["b"], 5);
+  EXPECT_GE(samples["c"], 5);
+  EXPECT_GE(samples[""], 1);
+  EXPECT_EQ(4, samples.size());
+  for (const auto& sample : profile.samples) {
+    if (!sample.label_value.empty()) {
+      EXPECT_EQ("tenant", sample.label_key);
+    }
+  }
+
+  unlink(name.c_str());
+}
+
+// Threads that don't call ProfilerRegisterThread are profiled with
+// per-thread timers when CPUPROFILE_AUTO_REGISTER_THREADS is set,
+// since pthread_create registers them. Needs both variables set in
+// the environment before the profiler is initialized.
+TEST(ProfilerProtoTest, AutoRegisteredThreads) {
+  if (getenv("CPUPROFILE_PER_THREAD_TIMERS") == nullptr || getenv("CPUPROFILE_AUTO_REGISTER_THREADS") == nullptr) {
+    return;
+  }
+  static const ProfilerLabel kUnregistered = {"thread", "unregistered"};
+
+  setenv("CPUPROFILE_FORMAT", "proto", 1);
+  const std::string name = ProfileName("autoregister");
+  ASSERT_TRUE(ProfilerStart(name.c_str()));
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 2; i++) {
+    threads.emplace_back([]() {
+      ProfilerSetLabel(&kUnregistered);
+      SpinMillis(300);
+      ProfilerSetLabel(nullptr);
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  ProfilerStop();
+  unsetenv("CPUPROFILE_FORMAT");
+
+  DecodedProfile profile;
+  ASSERT_TRUE(DecodeProfile(ReadWholeFile(name), &profile));
+  // About 60 samples at default 100 Hz, and none without the
+  // interposer, since main thread never registers either.
+  EXPECT_GE(SamplesByLabel(profile)["unregistered"], 10);
+
+  unlink(name.c_str());
+}
+
+#if defined(__linux__)
+
+// Runs 'body' for about a second with wall-clock profile written to
+// 'name', and returns samples by thread_state label. 'body' runs in
+// the calling thread, which is the only one registered with the
+// profiler (main thread registers itself), until its argument is
+// NowMillis().
+std::map<std::string, int64_t> WallSamplesOf(const std::string& name, const std::function<void(int64_t)>& body) {
+  setenv("CPUPROFILE_WALLCLOCK", "1", 1);
+  // Legacy cpu profile format, but the wall-clock profile is proto
+  // anyway.
+  unsetenv("CPUPROFILE_FORMAT");
+  unsetenv("CPUPROFILE_WALLCLOCK_SIGNAL");
+
+  EXPECT_TRUE(ProfilerStart(name.c_str()));
+  body(NowMillis() + 1000);
+  ProfilerStop();
+  unsetenv("CPUPROFILE_WALLCLOCK");
+
+  DecodedProfile profile;
+  EXPECT_TRUE(DecodeProfile(ReadWholeFile(name + ".wall"), &profile));
+  for (const auto& sample : profile.samples) {
+    EXPECT_EQ("thread_state", sample.label_key);
+  }
+  unlink(name.c_str());
+  unlink((name + ".wall").c_str());
+  return SamplesByLabel(profile);
+}
+
+// Registered threads are sampled whether they run or not, and
+// samples are labeled with their state. A thread that keeps
+// computing is on cpu, however busy the machine is, and one that
+// keeps sleeping is not.
+TEST(ProfilerProtoTest, WallClockSamples) {
+  std::map<std::string, int64_t> spinner = WallSamplesOf(ProfileName("wall_spin"), [](int64_t deadline) {
+    volatile uint64_t x = 0;
+    while (NowMillis() < deadline) {
+      for (int i = 0; i < 10000; i++) {
+        x = x + i;
+      }
+    }
+  });
+  std::map<std::string, int64_t> sleeper = WallSamplesOf(ProfileName("wall_sleep"), [](int64_t deadline) {
+    while (NowMillis() < deadline) {
+      SleepMillis(1);
+    }
+  });
+
+  // Each gets about 100 samples at default 100 Hz, fewer if the
+  // machine is busy. Either way the spinner's are mostly on cpu, and
+  // the sleeper's mostly off cpu.
+  const int64_t spinner_total = spinner["on-cpu"] + spinner["off-cpu"];
+  const int64_t sleeper_total = sleeper["on-cpu"] + sleeper["off-cpu"];
+  ASSERT_GE(spinner_total, 10);
+  ASSERT_GE(sleeper_total, 10);
+  EXPECT_GT(2 * spinner["on-cpu"], spinner_total);
+  EXPECT_LT(2 * sleeper["on-cpu"], sleeper_total);
+  EXPECT_GT(spinner["on-cpu"] * sleeper_total, sleeper["on-cpu"] * spinner_total);
+  EXPECT_EQ(0, spinner[""]);
+  EXPECT_EQ(0, sleeper[""]);
+}
+
+// Threads that don't handle the sampling signal don't accumulate
+// queued signals.
+TEST(ProfilerProtoTest, WallClockSkipsPendingThreads) {
+  const int queued_before = QueuedSignals();
+  int queued_while_blocked = -1;
+  WallSamplesOf(ProfileName("wall_blocked"), [&](int64_t deadline) {
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGRTMIN + 3);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    while (NowMillis() < deadline) {
+      SleepMillis(1);
+    }
+    queued_while_blocked = QueuedSignals();
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  });
+
+  // At default 100 Hz, the thread was signalled once and then
+  // skipped for some 100 ticks.
+  if (queued_before >= 0) {
+    EXPECT_LE(queued_while_blocked - queued_before, 3);
+  }
+}
+
+#endif  // __linux__
+
+}  // namespace
@@ -52,6 +52,12 @@
 
 static int g_iters;  // argv[1]
 
+// Set by PROFILER_UNITTEST_NO_REGISTER environment variable. Then
+// other threads don't call ProfilerRegisterThread, so they are only
+// profiled with per-thread timers if CPUPROFILE_AUTO_REGISTER_THREADS
+// registers them.
+static bool g_no_register;
+
 // g_ticks_count points to internal profiler's tick count that
 // increments each profiling tick. Makes it possible for this test
 // loops to run long enough to get enough ticks.
@@ -71,8 +77,15 @@ static int volatile* g_ticks_count = ([]() {
 
 std::mutex mutex;
 
+// Samples of other threads are labeled, so that they can be told
+// apart in proto profiles.
+static const ProfilerLabel kOtherThreadLabel = {"thread", "other"};
+
 static void test_other_thread() {
-  ProfilerRegisterThread();
+  if (!g_no_register) {
+    ProfilerRegisterThread();
+  }
+  const ProfilerLabel* previous_label = ProfilerPushLabel(&kOtherThreadLabel);
 
   int result = 0;
   char b[128];
@@ -90,6 +103,8 @@ static void test_other_thread() {
     (void)noopt(b);                               // 'consume' b. Ensure that smart compiler doesn't
                                                   // remove snprintf call
   }
+
+  ProfilerPopLabel(previous_label);
 }
 
 static void test_main_thread() {
@@ -124,6 +139,7 @@ int main(int argc, char** argv) {
   }
 
   g_iters = atoi(argv[1]);
+  g_no_register = (getenv("PROFILER_UNITTEST_NO_REGISTER") != nullptr);
   int num_threads = 1;
   const char* filename = nullptr;
   if (argc > 2) {
@@ -170,8 +186,21 @@ int main(int argc, char** argv) {
 
   test_main_thread();
 
+  int dropped = -1;
+  int write_dropped = -1;
+  ProfilerGetDroppedSamples(&dropped, &write_dropped);
+  if (dropped < 0 || write_dropped < 0) {
+    fprintf(stderr, "bad dropped samples counts: %d %d\n", dropped, write_dropped);
+    abort();
+  }
+
   if (filename) {
     ProfilerStop();
+    ProfilerGetDroppedSamples(&dropped, nullptr);
+    if (dropped != 0) {
+      fprintf(stderr, "dropped samples reported after ProfilerStop: %d\n", dropped);
+      abort();
+    }
   }
 
   return 0;
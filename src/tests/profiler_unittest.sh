@@ -160,6 +160,13 @@ env CPUPROFILE_REALTIME=1 "$PROFILER" 30 2 "$TMPDIR/p16" || RegisterFailure
 env CPUPROFILE_REALTIME=1 "$PROFILER" 60 2 "$TMPDIR/p17" || RegisterFailure
 VerifySimilar p16 p17 2
 
+# With per-thread timers only registered threads are profiled. Other
+# threads don't register themselves here, so their samples only show
+# up if the pthread_create interposer registers them.
+env CPUPROFILE_PER_THREAD_TIMERS=1 CPUPROFILE_AUTO_REGISTER_THREADS=1 PROFILER_UNITTEST_NO_REGISTER=1 \
+  "$PROFILER" 20 4 "$TMPDIR/p18" || RegisterFailure
+VerifyAcrossThreads p18 2
+
 
 # NetBSD has slightly borked environ access when we're updating it
 # early. See
@@ -70,6 +70,10 @@
 #ifdef HAVE_MALLOC_H
 #include <malloc.h>  // defines pvalloc/etc on cygwin
 #endif
+#ifdef __linux__
+#include <sys/mman.h>  // for mincore
+#include <sys/stat.h>  // for mkdir
+#endif
 #include <assert.h>
 
 #ifndef _WIN32
@@ -79,10 +83,14 @@
 
 #include <algorithm>
 #include <array>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <iterator>
+#include <limits>
 #include <mutex>
 #include <new>
+#include <set>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -644,6 +652,92 @@ TEST(TCMallocTest, ManyThreads) {
   }
 }
 
+// One thread allocates and another thread frees. This exercises
+// handing full batches between thread caches via central free list.
+// Allocates 'batches' * 'batch_length' objects of 'obj_size' bytes
+// in this thread and frees them in another one.
+static void RunProducerConsumer(size_t obj_size, int batches, int batch_length) {
+  std::mutex mu;
+  std::condition_variable cv;
+  std::vector<std::vector<char*>> queue;
+  bool done = false;
+
+  std::thread consumer{[&]() {
+    for (;;) {
+      std::vector<char*> batch;
+      {
+        std::unique_lock<std::mutex> l(mu);
+        cv.wait(l, [&]() { return done || !queue.empty(); });
+        if (queue.empty()) {
+          return;
+        }
+        batch = std::move(queue.back());
+        queue.pop_back();
+      }
+      for (char* p : batch) {
+        CHECK_EQ(p[0], static_cast<char>(reinterpret_cast<uintptr_t>(p) >> 4));
+        CHECK_EQ(p[obj_size - 1], p[0]);
+        (operator delete)(p);
+      }
+    }
+  }};
+
+  for (int i = 0; i < batches; i++) {
+    std::vector<char*> batch;
+    batch.reserve(batch_length);
+    for (int j = 0; j < batch_length; j++) {
+      char* p = noopt(static_cast<char*>((operator new)(obj_size)));
+      p[0] = p[obj_size - 1] = static_cast<char>(reinterpret_cast<uintptr_t>(p) >> 4);
+      batch.push_back(p);
+    }
+    std::lock_guard<std::mutex> l(mu);
+    queue.push_back(std::move(batch));
+    cv.notify_one();
+  }
+
+  {
+    std::lock_guard<std::mutex> l(mu);
+    done = true;
+    cv.notify_one();
+  }
+  consumer.join();
+}
+
+TEST(TCMallocTest, ProducerConsumer) {
+  RunProducerConsumer(96, 200, 1000);
+  // Big objects have few batches in transfer cache, so handoff slots
+  // are most of it.
+  RunProducerConsumer(200 << 10, 20, 16);
+
+  // Transfer cache (handoff slots included) holds at most 1MiB or
+  // one batch per size class.  Batches are at least 2 objects.
+  std::vector<MallocExtension::FreeListInfo> info;
+  MallocExtension::instance()->GetFreeListSizes(&info);
+  for (const auto& i : info) {
+    if (strcmp(i.type, "tcmalloc.transfer") != 0) {
+      continue;
+    }
+    EXPECT_LE(i.total_bytes_free, std::max<size_t>(1 << 20, 2 * i.max_object_size)) << i.max_object_size;
+  }
+
+  // Dropping thread cache hands full batches over to handoff slots
+  // first, and ReleaseFreeMemory empties them. Nothing else runs now,
+  // so they stay empty.
+  std::vector<void*> ptrs;
+  for (int i = 0; i < 1000; i++) {
+    ptrs.push_back(noopt(malloc(96)));
+  }
+  for (void* p : ptrs) {
+    free(p);
+  }
+  MallocExtension::instance()->MarkThreadIdle();
+  if (!TestingPortal::Get()->IsDebuggingMalloc()) {
+    EXPECT_GT(TestingPortal::Get()->GetHandoffBytes(), 0);
+  }
+  MallocExtension::instance()->ReleaseFreeMemory();
+  EXPECT_EQ(0, TestingPortal::Get()->GetHandoffBytes());
+}
+
 static void TryHugeAllocation(size_t s, AllocatorState* rnd) {
   void* p = rnd->alloc(noopt(s));
   CHECK(p == nullptr);  // huge allocation s should fail!
@@ -950,29 +1044,31 @@ static void CheckRangeCallback(void* ptr, base::MallocRange::Type type, size_t m
 }
 
 TEST(TCMallocTest, Ranges) {
-  static const int MB = 1048576;
-  void* a = malloc(MB);
-  void* b = malloc(MB);
+  // Freed size-class objects stay in caches and their spans remain
+  // in use, so use something bigger than the largest size class.
+  const size_t kSize = std::max<size_t>(1 << 20, 2 * TestingPortal::Get()->GetMaxSize());
+  void* a = malloc(kSize);
+  void* b = malloc(kSize);
   base::MallocRange::Type releasedType =
       TestingPortal::Get()->HaveSystemRelease() ? base::MallocRange::UNMAPPED : base::MallocRange::FREE;
 
-  CheckRangeCallback(a, base::MallocRange::INUSE, MB);
-  CheckRangeCallback(b, base::MallocRange::INUSE, MB);
+  CheckRangeCallback(a, base::MallocRange::INUSE, kSize);
+  CheckRangeCallback(b, base::MallocRange::INUSE, kSize);
 
   (noopt(free))(a);
 
-  CheckRangeCallback(a, base::MallocRange::FREE, MB);
-  CheckRangeCallback(b, base::MallocRange::INUSE, MB);
+  CheckRangeCallback(a, base::MallocRange::FREE, kSize);
+  CheckRangeCallback(b, base::MallocRange::INUSE, kSize);
 
   MallocExtension::instance()->ReleaseFreeMemory();
 
-  CheckRangeCallback(a, releasedType, MB);
-  CheckRangeCallback(b, base::MallocRange::INUSE, MB);
+  CheckRangeCallback(a, releasedType, kSize);
+  CheckRangeCallback(b, base::MallocRange::INUSE, kSize);
 
   (noopt(free))(b);
 
-  CheckRangeCallback(a, releasedType, MB);
-  CheckRangeCallback(b, base::MallocRange::FREE, MB);
+  CheckRangeCallback(a, releasedType, kSize);
+  CheckRangeCallback(b, base::MallocRange::FREE, kSize);
 }
 
 static size_t GetUnmappedBytes() {
@@ -995,6 +1091,9 @@ TEST(TCMallocTest, ReleaseToSystem) {
   tcmalloc::Cleanup decommit_cleanup = kAggressiveDecommit.Override(0);
 
   static const int MB = 1048576;
+  if (TestingPortal::Get()->GetMaxSize() >= MB) {
+    return;  // 1MB objects are served by size classes, not page heap.
+  }
   void* a = noopt(malloc(MB));
   void* b = noopt(malloc(MB));
   MallocExtension::instance()->ReleaseFreeMemory();
@@ -1041,6 +1140,52 @@ TEST(TCMallocTest, ReleaseToSystem) {
   EXPECT_EQ(starting_bytes + 2 * MB, GetUnmappedBytes());
 }
 
+TEST(TCMallocTest, ReleaseToSystemWithBudget) {
+  if (TestingPortal::Get()->IsDebuggingMalloc()) {
+    return;
+  }
+
+  if (!TestingPortal::Get()->HaveSystemRelease()) return;
+
+  tcmalloc::Cleanup release_rate_cleanup = SetFlag(&TestingPortal::Get()->GetReleaseRate(), 0);
+  tcmalloc::Cleanup decommit_cleanup = kAggressiveDecommit.Override(0);
+
+  MallocExtension* ext = MallocExtension::instance();
+
+  // Big enough to be served by page heap.  Freeing every other
+  // object leaves many free spans that don't coalesce.
+  const size_t kSize = TestingPortal::Get()->GetMaxSize() + 1;
+  constexpr int kCount = 300;
+  std::vector<void*> ptrs;
+  for (int i = 0; i < kCount; i++) {
+    ptrs.push_back(noopt(malloc(kSize)));
+  }
+  ext->ReleaseFreeMemory();
+  size_t starting_bytes = GetUnmappedBytes();
+  for (int i = 1; i < kCount; i += 2) {
+    free(ptrs[i]);
+  }
+
+  size_t held_usec = ~size_t{0};
+  size_t released = ext->ReleaseToSystemWithBudget(1, 0, &held_usec);
+  EXPECT_GE(released, kSize);
+  EXPECT_NE(held_usec, ~size_t{0});
+  EXPECT_EQ(starting_bytes + released, GetUnmappedBytes());
+
+  // Even a tiny time budget makes progress.
+  size_t step = ext->ReleaseToSystemWithBudget(std::numeric_limits<size_t>::max(), 1, &held_usec);
+  EXPECT_GT(step, 0);
+  released += step;
+
+  released += ext->ReleaseToSystemWithBudget(std::numeric_limits<size_t>::max(), 0, nullptr);
+  EXPECT_GE(released, kCount / 2 * kSize);
+  EXPECT_EQ(starting_bytes + released, GetUnmappedBytes());
+
+  for (int i = 0; i < kCount; i += 2) {
+    free(ptrs[i]);
+  }
+}
+
 TEST(TCMallocTest, LargeAllocsRelease) {
   // Debug allocation mode adds overhead to each allocation which
   // messes up all the equality tests here.  I just disable the
@@ -1066,6 +1211,9 @@ TEST(TCMallocTest, LargeAllocsRelease) {
 
   constexpr size_t kNumPtrs = 10;
   constexpr size_t kBigAllocBytes = 3 << 20;
+  if (TestingPortal::Get()->GetMaxSize() >= kBigAllocBytes) {
+    return;  // We need page heap allocations here.
+  }
 
   std::vector<std::unique_ptr<char[]>> cleanup;
   std::vector<std::unique_ptr<char[]>> chunks;
@@ -1158,6 +1306,9 @@ TEST(TCMallocTest, AggressiveDecommit) {
   tcmalloc::Cleanup cleanup = kAggressiveDecommit.Override(1);
 
   static const int MB = 1048576;
+  if (TestingPortal::Get()->GetMaxSize() >= MB) {
+    return;  // 1MB objects are served by size classes, not page heap.
+  }
   void* a = noopt(malloc(MB));
   void* b = noopt(malloc(MB));
 
@@ -1188,6 +1339,54 @@ TEST(TCMallocTest, AggressiveDecommit) {
   printf("Done testing aggressive de-commit\n");
 }
 
+static bool IsAllZeros(const char* p, size_t size) {
+  return std::all_of(p, p + size, [](char c) { return c == 0; });
+}
+
+TEST(TCMallocTest, LargeCalloc) {
+  if (TestingPortal::Get()->IsDebuggingMalloc()) {
+    return;
+  }
+
+  const size_t kSize = std::max<size_t>(16 << 20, 2 * TestingPortal::Get()->GetMaxSize());
+
+  // calloc must not trust pages we've dirtied and freed.
+  char* p = noopt(static_cast<char*>(malloc(kSize)));
+  memset(p, 0xff, kSize);
+  free(p);
+  p = noopt(static_cast<char*>(calloc(1, kSize)));
+  ASSERT_TRUE(IsAllZeros(p, kSize));
+  memset(p, 0xff, kSize);
+  free(p);
+
+  if (!TestingPortal::Get()->HaveSystemRelease()) {
+    return;
+  }
+  const char* memfs_path = getenv("TCMALLOC_MEMFS_MALLOC_PATH");
+  if (memfs_path != nullptr && *memfs_path != '\0') {
+    return;  // memfs memory isn't known to be zeroed.
+  }
+
+  // Released pages read as zero, so calloc must not need to touch
+  // them.
+  MallocExtension::instance()->ReleaseFreeMemory();
+  p = noopt(static_cast<char*>(calloc(1, kSize)));
+
+#ifdef __linux__
+  const size_t pagesize = getpagesize();
+  uintptr_t start = (reinterpret_cast<uintptr_t>(p) + pagesize - 1) & ~(pagesize - 1);
+  uintptr_t end = (reinterpret_cast<uintptr_t>(p) + kSize) & ~(pagesize - 1);
+  std::vector<unsigned char> vec((end - start) / pagesize);
+  ASSERT_EQ(mincore(reinterpret_cast<void*>(start), end - start, vec.data()), 0);
+  size_t resident = std::count_if(vec.begin(), vec.end(), [](unsigned char c) { return (c & 1) != 0; });
+  printf("large calloc: %zu out of %zu pages resident\n", resident, vec.size());
+  EXPECT_LT(resident, vec.size() / 2);
+#endif
+
+  ASSERT_TRUE(IsAllZeros(p, kSize));
+  free(p);
+}
+
 // On MSVC10, in release mode, the optimizer convinces itself
 // g_no_memory is never changed (I guess it doesn't realize OnNoMemory
 // might be called).  Work around this by setting the var volatile.
@@ -1198,6 +1397,376 @@ static void OnNoMemory() {
   std::set_new_handler(g_old_handler);
 }
 
+static std::vector<void*>* soft_limit_ballast;
+static int soft_limit_callback_calls;
+
+static void SoftLimitCallback(size_t bytes_over_limit) {
+  soft_limit_callback_calls++;
+  CHECK_GT(bytes_over_limit, 0);
+  for (void* p : *soft_limit_ballast) {
+    free(p);
+  }
+  soft_limit_ballast->clear();
+}
+
+static size_t GetNumericPropertyOrDie(const char* name) {
+  size_t value;
+  CHECK(MallocExtension::instance()->GetNumericProperty(name, &value));
+  return value;
+}
+
+TEST(TCMallocTest, SoftHeapLimit) {
+  if (TestingPortal::Get()->IsDebuggingMalloc() || !TestingPortal::Get()->HaveSystemRelease()) {
+    return;
+  }
+
+  MallocExtension* ext = MallocExtension::instance();
+  const size_t kChunk = std::max<size_t>(4 << 20, 2 * TestingPortal::Get()->GetMaxSize());
+
+  std::vector<void*> ballast;
+  for (int i = 0; i < 2; i++) {
+    ballast.push_back(noopt(memset(malloc(kChunk), 1, kChunk)));
+  }
+  soft_limit_ballast = &ballast;
+
+  ext->ReleaseFreeMemory();
+  size_t committed;
+  ASSERT_TRUE(ext->GetNumericProperty("tcmalloc.pageheap_committed_bytes", &committed));
+  const size_t limit_mb = (committed >> 20) + 4 * (kChunk >> 20);
+
+  const size_t pageheap_before = GetNumericPropertyOrDie("tcmalloc.soft_limit_pageheap_reclaims");
+  const size_t thread_cache_before = GetNumericPropertyOrDie("tcmalloc.soft_limit_thread_cache_reclaims");
+  const size_t transfer_cache_before = GetNumericPropertyOrDie("tcmalloc.soft_limit_transfer_cache_reclaims");
+
+  ext->SetSoftHeapLimitCallback(SoftLimitCallback);
+  ASSERT_TRUE(ext->SetNumericProperty("tcmalloc.soft_heap_limit_mb", limit_mb));
+  size_t value;
+  ASSERT_TRUE(ext->GetNumericProperty("tcmalloc.soft_heap_limit_mb", &value));
+  ASSERT_EQ(value, limit_mb);
+  ASSERT_EQ(soft_limit_callback_calls, 0);
+
+  // Going over the limit by live memory makes us go through all the
+  // stages, callback included.
+  std::vector<void*> live;
+  for (int i = 0; i < 8; i++) {
+    live.push_back(noopt(memset(malloc(kChunk), 2, kChunk)));
+  }
+
+  EXPECT_GE(soft_limit_callback_calls, 1);
+  EXPECT_TRUE(ballast.empty());
+  EXPECT_GT(GetNumericPropertyOrDie("tcmalloc.soft_limit_pageheap_reclaims"), pageheap_before);
+  EXPECT_GT(GetNumericPropertyOrDie("tcmalloc.soft_limit_thread_cache_reclaims"), thread_cache_before);
+  EXPECT_GT(GetNumericPropertyOrDie("tcmalloc.soft_limit_transfer_cache_reclaims"), transfer_cache_before);
+  EXPECT_GE(GetNumericPropertyOrDie("tcmalloc.soft_limit_callback_reclaims"), soft_limit_callback_calls);
+
+  ASSERT_TRUE(ext->SetNumericProperty("tcmalloc.soft_heap_limit_mb", 0));
+  ext->SetSoftHeapLimitCallback(nullptr);
+  for (void* p : live) {
+    free(p);
+  }
+  for (void* p : ballast) {
+    free(p);
+  }
+  soft_limit_ballast = nullptr;
+}
+
+#ifdef __linux__
+static void WriteCgroupFile(const std::string& dir, const char* name, const char* contents) {
+  std::string path = dir + "/" + name;
+  FILE* f = fopen(path.c_str(), "w");
+  CHECK(f != nullptr);
+  fputs(contents, f);
+  fclose(f);
+}
+
+// Only runs as part of tcmalloc_minimal_cgroup_pressure_unittest,
+// which points TCMALLOC_CGROUP_PATH at scratch directory.
+TEST(TCMallocTest, CgroupPressure) {
+  const char* env = getenv("TCMALLOC_CGROUP_PATH");
+  if (env == nullptr || TestingPortal::Get()->IsDebuggingMalloc() || !TestingPortal::Get()->HaveSystemRelease()) {
+    return;
+  }
+  const std::string dir = env;
+  mkdir(dir.c_str(), 0755);
+
+  MallocExtension* ext = MallocExtension::instance();
+  size_t old_interval;
+  ASSERT_TRUE(ext->GetNumericProperty("tcmalloc.cgroup_poll_interval_ms", &old_interval));
+  ASSERT_TRUE(ext->SetNumericProperty("tcmalloc.cgroup_poll_interval_ms", 0));
+  tcmalloc::Cleanup cleanup([&]() {
+    for (const char* name : {"memory.current", "memory.high", "memory.pressure"}) {
+      unlink((dir + "/" + name).c_str());
+    }
+    ext->SetNumericProperty("tcmalloc.cgroup_poll_interval_ms", old_interval);
+  });
+
+  const size_t kChunk = std::max<size_t>(4 << 20, 2 * TestingPortal::Get()->GetMaxSize());
+
+  // Allocations never poll cgroup files.
+  size_t polls = GetNumericPropertyOrDie("tcmalloc.cgroup_polls");
+  for (int i = 0; i < 10; i++) {
+    free(noopt(malloc(kChunk)));
+  }
+  EXPECT_EQ(GetNumericPropertyOrDie("tcmalloc.cgroup_polls"), polls);
+
+  // Only background actions do.
+  auto poll = [&]() {
+    size_t before = GetNumericPropertyOrDie("tcmalloc.cgroup_polls");
+    std::thread background([ext]() { ext->ProcessBackgroundActions(); });
+    for (int i = 0; i < 10000 && GetNumericPropertyOrDie("tcmalloc.cgroup_polls") == before; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ext->StopBackgroundActions();
+    background.join();
+    ASSERT_GT(GetNumericPropertyOrDie("tcmalloc.cgroup_polls"), before);
+  };
+
+  WriteCgroupFile(dir, "memory.current", "50000000\n");
+  WriteCgroupFile(dir, "memory.high", "100000000\n");
+  WriteCgroupFile(dir, "memory.pressure",
+                  "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n"
+                  "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+  size_t events = GetNumericPropertyOrDie("tcmalloc.cgroup_pressure_events");
+  poll();
+  EXPECT_EQ(GetNumericPropertyOrDie("tcmalloc.cgroup_pressure_permille"), 0);
+  EXPECT_EQ(GetNumericPropertyOrDie("tcmalloc.cgroup_pressure_events"), events);
+
+  // No limit means no usage pressure, but PSI still counts: 5% of
+  // stalled time is half of full pressure.
+  WriteCgroupFile(dir, "memory.high", "max\n");
+  WriteCgroupFile(dir, "memory.pressure", "some avg10=5.00 avg60=1.00 avg300=0.20 total=12345\n");
+  poll();
+  EXPECT_EQ(GetNumericPropertyOrDie("tcmalloc.cgroup_pressure_permille"), 500);
+  EXPECT_GT(GetNumericPropertyOrDie("tcmalloc.cgroup_pressure_events"), events);
+
+  // Now leave some free memory in page heap and hit memory.high.
+  WriteCgroupFile(dir, "memory.pressure", "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+  WriteCgroupFile(dir, "memory.current", "100000000\n");
+  WriteCgroupFile(dir, "memory.high", "100000000\n");
+
+  std::vector<void*> chunks;
+  for (int i = 0; i < 4; i++) {
+    chunks.push_back(noopt(memset(malloc(kChunk), 1, kChunk)));
+  }
+  for (void* p : chunks) {
+    free(p);
+  }
+  const bool have_free = GetNumericPropertyOrDie("tcmalloc.pageheap_free_bytes") > 0;
+
+  size_t released = GetNumericPropertyOrDie("tcmalloc.cgroup_released_bytes");
+  size_t trims = GetNumericPropertyOrDie("tcmalloc.cgroup_thread_cache_trims");
+  poll();
+  EXPECT_EQ(GetNumericPropertyOrDie("tcmalloc.cgroup_pressure_permille"), 1000);
+  EXPECT_GT(GetNumericPropertyOrDie("tcmalloc.cgroup_thread_cache_trims"), trims);
+  if (have_free) {
+    EXPECT_GT(GetNumericPropertyOrDie("tcmalloc.cgroup_released_bytes"), released);
+  }
+}
+
+static size_t CountResidentPages(uintptr_t start, uintptr_t end) {
+  const size_t pagesize = getpagesize();
+  std::vector<unsigned char> vec((end - start) / pagesize);
+  CHECK(mincore(reinterpret_cast<void*>(start), end - start, vec.data()) == 0);
+  return std::count_if(vec.begin(), vec.end(), [](unsigned char c) { return (c & 1) != 0; });
+}
+
+TEST(TCMallocTest, MemfsRelease) {
+  // Only meaningful with TCMALLOC_MEMFS_MALLOC_PATH, since madvise
+  // doesn't free pages of shared file mappings but hole punching does.
+  const char* path = getenv("TCMALLOC_MEMFS_MALLOC_PATH");
+  if (path == nullptr || *path == '\0' || TestingPortal::Get()->IsDebuggingMalloc() ||
+      !TestingPortal::Get()->HaveSystemRelease()) {
+    return;
+  }
+
+  constexpr size_t kSize = 4 << 20;
+  char* p = noopt(static_cast<char*>(malloc(kSize)));
+  memset(p, 1, kSize);
+
+  const size_t pagesize = getpagesize();
+  uintptr_t start = (reinterpret_cast<uintptr_t>(p) + pagesize - 1) & ~(pagesize - 1);
+  uintptr_t end = (reinterpret_cast<uintptr_t>(p) + kSize) & ~(pagesize - 1);
+  EXPECT_EQ(CountResidentPages(start, end), (end - start) / pagesize);
+
+  free(p);
+  MallocExtension::instance()->ReleaseFreeMemory();
+  EXPECT_EQ(CountResidentPages(start, end), 0);
+}
+#endif  // __linux__
+
+TEST(TCMallocTest, PrefaultHeap) {
+  MallocExtension* ext = MallocExtension::instance();
+  size_t aggressive_decommit;
+  ASSERT_TRUE(ext->GetNumericProperty("tcmalloc.aggressive_memory_decommit", &aggressive_decommit));
+  if (aggressive_decommit) {
+    EXPECT_EQ(ext->PrefaultHeap(1 << 20, false), 0);
+    return;
+  }
+  constexpr size_t kBytes = 8 << 20;
+
+  size_t committed_before = GetNumericPropertyOrDie("tcmalloc.pageheap_committed_bytes");
+  size_t added = ext->PrefaultHeap(kBytes, false);
+  ASSERT_GE(added, kBytes);
+  EXPECT_GE(GetNumericPropertyOrDie("tcmalloc.pageheap_committed_bytes"), committed_before + added);
+  EXPECT_GE(GetNumericPropertyOrDie("tcmalloc.pageheap_free_bytes"), added);
+
+  // Background refill brings free memory back after we release it,
+  // by recommitting what we've released rather than growing the heap.
+  ext->ReleaseFreeMemory();
+  const size_t system_before = GetNumericPropertyOrDie("generic.heap_size");
+  const size_t interval_before = GetNumericPropertyOrDie("tcmalloc.background_interval_ms");
+  ASSERT_TRUE(ext->SetNumericProperty("tcmalloc.background_interval_ms", 5));
+  ASSERT_TRUE(ext->SetNumericProperty("tcmalloc.min_free_mb", kBytes >> 20));
+  std::thread background([ext]() { ext->ProcessBackgroundActions(); });
+  for (int i = 0; i < 10000 && GetNumericPropertyOrDie("tcmalloc.pageheap_free_bytes") < kBytes; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_GE(GetNumericPropertyOrDie("tcmalloc.pageheap_free_bytes"), kBytes);
+  EXPECT_EQ(GetNumericPropertyOrDie("generic.heap_size"), system_before);
+  ext->StopBackgroundActions();
+  background.join();
+  ASSERT_TRUE(ext->SetNumericProperty("tcmalloc.min_free_mb", 0));
+  ASSERT_TRUE(ext->SetNumericProperty("tcmalloc.background_interval_ms", interval_before));
+
+  // Stop before start makes next call return right away.
+  ext->StopBackgroundActions();
+  ext->ProcessBackgroundActions();
+
+  // Prefault never goes over the soft limit.
+  ASSERT_TRUE(ext->SetNumericProperty(
+      "tcmalloc.soft_heap_limit_mb", (GetNumericPropertyOrDie("tcmalloc.pageheap_committed_bytes") >> 20) + 1));
+  EXPECT_LE(ext->PrefaultHeap(kBytes, false), 1 << 20);
+  ASSERT_TRUE(ext->SetNumericProperty("tcmalloc.soft_heap_limit_mb", 0));
+}
+
+TEST(TCMallocTest, HeapReservation) {
+  size_t reserved = GetNumericPropertyOrDie("tcmalloc.heap_reservation_bytes");
+  if (reserved == 0) {
+    // Not enabled by TCMALLOC_HEAP_RESERVE_MB.
+    int local;
+    EXPECT_FALSE(TestingPortal::Get()->IsInHeapReservation(&local));
+    return;
+  }
+
+  void* p = noopt(malloc(1 << 20));
+  tcmalloc::Cleanup cleanup([p]() { free(p); });
+  size_t used = GetNumericPropertyOrDie("tcmalloc.heap_reservation_used_bytes");
+  EXPECT_GT(used, 0);
+  EXPECT_LE(used, reserved);
+  if (used + (2 << 20) < reserved) {
+    EXPECT_TRUE(TestingPortal::Get()->IsInHeapReservation(p));
+  }
+  int local;
+  EXPECT_FALSE(TestingPortal::Get()->IsInHeapReservation(&local));
+}
+
+TEST(TCMallocTest, CoroutineStacks) {
+  constexpr size_t kStackSize = 100 << 10;
+  constexpr size_t kGuardSize = 4096;
+  MallocExtension* ext = MallocExtension::instance();
+  ext->ReleaseFreeMemory();
+  ASSERT_EQ(GetNumericPropertyOrDie("tcmalloc.stack_cache_bytes"), 0);
+
+  char* stack = static_cast<char*>(ext->AllocateStack(kStackSize, kGuardSize));
+  ASSERT_NE(stack, nullptr);
+  memset(stack, 0x5a, kStackSize);
+#ifdef __linux__
+  EXPECT_DEATH(noopt(stack)[-1] = 0, "");
+#endif
+
+  ext->FreeStack(stack, kStackSize / 2);
+  EXPECT_GE(GetNumericPropertyOrDie("tcmalloc.stack_cache_bytes"), kStackSize + kGuardSize);
+
+  // Same stack comes back, with guard pages still in place and
+  // released part usable again.
+  char* again = static_cast<char*>(ext->AllocateStack(kStackSize, kGuardSize));
+  EXPECT_EQ(again, stack);
+  EXPECT_EQ(GetNumericPropertyOrDie("tcmalloc.stack_cache_bytes"), 0);
+  memset(again, 0xa5, kStackSize);
+#ifdef __linux__
+  EXPECT_DEATH(noopt(again)[-1] = 0, "");
+#endif
+
+  // Different guard size can't reuse it.
+  ext->FreeStack(again, 0);
+  char* other = static_cast<char*>(ext->AllocateStack(kStackSize, 0));
+  ASSERT_NE(other, nullptr);
+  EXPECT_NE(other, again);
+  memset(other, 0, kStackSize);
+  ext->FreeStack(other, 0);
+
+  // Cached stacks go back to page heap and are usable by malloc.
+  ext->ReleaseFreeMemory();
+  EXPECT_EQ(GetNumericPropertyOrDie("tcmalloc.stack_cache_bytes"), 0);
+  char* p = static_cast<char*>(noopt(malloc(kStackSize + kGuardSize)));
+  memset(p, 0, kStackSize + kGuardSize);
+  free(p);
+}
+
+#ifdef __linux__
+TEST(TCMallocTest, ForkReclaimsThreadCaches) {
+  constexpr int kThreads = 4;
+  std::mutex mu;
+  std::condition_variable cv;
+  int ready = 0;
+  bool done = false;
+
+  // Threads fill their caches, and wait while we fork.
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; i++) {
+    threads.emplace_back([&]() {
+      std::vector<void*> ptrs;
+      for (int j = 0; j < 1000; j++) {
+        ptrs.push_back(noopt(malloc(1024)));
+      }
+      for (void* p : ptrs) {
+        free(p);
+      }
+      std::unique_lock<std::mutex> l(mu);
+      ready++;
+      cv.notify_all();
+      cv.wait(l, [&]() { return done; });
+    });
+  }
+  {
+    std::unique_lock<std::mutex> l(mu);
+    cv.wait(l, [&]() { return ready == kThreads; });
+  }
+  EXPECT_GT(GetNumericPropertyOrDie("tcmalloc.thread_cache_free_bytes"), 0);
+
+  // Child's writes must not reach our heap, whatever backs it.
+  constexpr size_t kBlockSize = 64 << 10;
+  char* block = static_cast<char*>(noopt(malloc(kBlockSize)));
+  memset(block, 'p', kBlockSize);
+
+  pid_t child = fork();
+  ASSERT_GE(child, 0);
+  if (child == 0) {
+    memset(noopt(block), 'c', kBlockSize);
+    free(block);
+    // After we drop our own cache, child has no thread cache memory.
+    MallocExtension::instance()->MarkThreadIdle();
+    size_t bytes = ~size_t{0};
+    MallocExtension::instance()->GetNumericProperty("tcmalloc.thread_cache_free_bytes", &bytes);
+    _exit(bytes == 0 ? 0 : 1);
+  }
+  int status;
+  ASSERT_EQ(waitpid(child, &status, 0), child);
+  EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0) << status;
+  EXPECT_EQ(kBlockSize, std::count(block, block + kBlockSize, 'p'));
+  free(block);
+
+  {
+    std::unique_lock<std::mutex> l(mu);
+    done = true;
+    cv.notify_all();
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+#endif  // __linux__
+
 TEST(TCMallocTest, SetNewMode) {
   int old_mode = tc_set_new_mode(1);
 
@@ -1323,12 +1892,188 @@ TEST(TCMallocTest, NAllocXAlignment) {
       ASSERT_GE(rounded, size);
       ASSERT_EQ(rounded % align, 0);
       void* ptr = tc_memalign(align, size);
+      // Note, this also checks that span coloring keeps objects
+      // aligned.
+      ASSERT_EQ(reinterpret_cast<uintptr_t>(ptr) % align, 0);
       ASSERT_EQ(rounded, MallocExtension::instance()->GetAllocatedSize(ptr));
       free(ptr);
     }
   }
 }
 
+// Allocates a few spans worth of objects of every small size class
+// and returns, per class, set of distinct first object offsets
+// (i.e. cache colors) seen over these spans.
+static std::vector<std::set<size_t>> CollectColorOffsets() {
+  std::vector<std::set<size_t>> result;
+  std::vector<void*> ptrs;
+  size_t prev_rounded = 0;
+  for (size_t size = 1; size <= (32 << 10); size++) {
+    size_t rounded = nallocx(size, 0);
+    if (rounded == prev_rounded) {
+      continue;
+    }
+    prev_rounded = rounded;
+
+    std::set<size_t> offsets;
+    size_t count = std::max<size_t>((256 << 10) / rounded, 16);
+    for (size_t i = 0; i < count; i++) {
+      void* ptr = noopt(malloc(size));
+      offsets.insert(TestingPortal::Get()->GetColorOffset(ptr));
+      ptrs.push_back(ptr);
+    }
+    for (size_t offset : offsets) {
+      // Coloring must keep objects aligned.
+      EXPECT_EQ(offset % (rounded & -rounded), 0) << "size = " << rounded;
+    }
+    result.push_back(std::move(offsets));
+  }
+  for (void* ptr : ptrs) {
+    free(ptr);
+  }
+  return result;
+}
+
+TEST(TCMallocTest, CacheColoringVariesAcrossSpans) {
+  if (TestingPortal::Get()->IsDebuggingMalloc() || !EnvToBool("TCMALLOC_CACHE_COLORING", true)) {
+    return;
+  }
+
+  size_t colored = 0;
+  for (const std::set<size_t>& offsets : CollectColorOffsets()) {
+    if (offsets.size() >= 2) {
+      colored++;
+    }
+  }
+  // Not every class has leftover space at the end of its spans, but
+  // many do.
+  EXPECT_GT(colored, 0);
+}
+
+TEST(TCMallocTest, CacheColoringDisabled) {
+  if (TestingPortal::Get()->IsDebuggingMalloc() || EnvToBool("TCMALLOC_CACHE_COLORING", true)) {
+    return;
+  }
+
+  for (const std::set<size_t>& offsets : CollectColorOffsets()) {
+    EXPECT_EQ(offsets, std::set<size_t>{0});
+  }
+}
+
+TEST(TCMallocTest, MallocX) {
+  static constexpr int kFlags[] = {0, MALLOCX_ZERO, MALLOCX_TCACHE_NONE, MALLOCX_COLD,
+                                   MALLOCX_ZERO | MALLOCX_TCACHE_NONE};
+  for (int flags : kFlags) {
+    for (size_t size = 1; size <= (1 << 20); size = GrowNallocxTestSize(size)) {
+      for (size_t align_log = 0; align_log < 14; align_log += 3) {
+        size_t align = size_t{1} << align_log;
+        int all_flags = flags | MALLOCX_LG_ALIGN(align_log);
+
+        // Dirty some memory first, so that MALLOCX_ZERO has a chance
+        // to see it again.
+        free(noopt(memset(noopt(malloc(size)), 0xff, size)));
+
+        char* p = noopt(static_cast<char*>(mallocx(size, all_flags)));
+        ASSERT_NE(p, nullptr);
+        ASSERT_EQ(reinterpret_cast<uintptr_t>(p) % align, 0);
+        size_t usable = sallocx(p, 0);
+        ASSERT_GE(usable, size);
+        if (flags & MALLOCX_ZERO) {
+          ASSERT_TRUE(IsAllZeros(p, usable)) << size << " " << align;
+        }
+        memset(p, 0xab, size);
+        if (size % 2) {
+          dallocx(p, all_flags);
+        } else {
+          sdallocx(p, size, all_flags);
+        }
+      }
+    }
+  }
+}
+
+TEST(TCMallocTest, RAllocX) {
+  char* p = noopt(static_cast<char*>(mallocx(100, 0)));
+  memset(p, 1, 100);
+  size_t old_usable = sallocx(p, 0);
+  p = static_cast<char*>(rallocx(p, 10000, MALLOCX_ZERO));
+  ASSERT_NE(p, nullptr);
+  size_t usable = sallocx(p, 0);
+  ASSERT_GE(usable, 10000);
+  for (size_t i = 0; i < 100; i++) {
+    ASSERT_EQ(p[i], 1);
+  }
+  // Bytes past old usable size are zeroed.
+  ASSERT_TRUE(IsAllZeros(p + old_usable, usable - old_usable));
+
+  p = static_cast<char*>(rallocx(p, 50, MALLOCX_LG_ALIGN(12)));
+  ASSERT_NE(p, nullptr);
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(p) % 4096, 0);
+  for (size_t i = 0; i < 50; i++) {
+    ASSERT_EQ(p[i], 1);
+  }
+  sdallocx(p, 50, MALLOCX_LG_ALIGN(12));
+
+  p = static_cast<char*>(rallocx(nullptr, 64, 0));
+  ASSERT_NE(p, nullptr);
+  dallocx(p, 0);
+}
+
+TEST(TCMallocTest, XAllocX) {
+  if (TestingPortal::Get()->IsDebuggingMalloc()) {
+    return;
+  }
+
+  // Small objects never change size.
+  void* small = noopt(malloc(100));
+  ASSERT_EQ(xallocx(small, 1000, 0, 0), sallocx(small, 0));
+  ASSERT_EQ(xallocx(small, 10, 0, 0), sallocx(small, 0));
+  free(small);
+
+  // Shrinking always succeeds and leaves free pages right after our
+  // object, so it can grow back.
+  const size_t kSize = std::max<size_t>(16 << 20, 2 * TestingPortal::Get()->GetMaxSize());
+  char* p = noopt(static_cast<char*>(malloc(4 * kSize)));
+  memset(p, 1, kSize);
+  ASSERT_EQ(xallocx(p, kSize, 0, 0), kSize);
+  ASSERT_EQ(sallocx(p, 0), kSize);
+
+  size_t grown = xallocx(p, 2 * kSize, kSize, MALLOCX_ZERO);
+  ASSERT_GE(grown, 3 * kSize);
+  ASSERT_EQ(sallocx(p, 0), grown);
+  ASSERT_TRUE(IsAllZeros(p + kSize, grown - kSize));
+  for (size_t i = 0; i < kSize; i += 4096) {
+    ASSERT_EQ(p[i], 1);
+  }
+
+  // Growing beyond whatever is free after us fails, but leaves
+  // object intact.
+  char* neighbour = noopt(static_cast<char*>(malloc(kSize)));
+  size_t current = sallocx(p, 0);
+  if (neighbour == p + current) {
+    ASSERT_EQ(xallocx(p, current + kSize, 0, 0), current);
+  }
+  free(neighbour);
+
+  // rallocx resizes large objects in place too, and tells hooks.
+  ASSERT_EQ(xallocx(p, kSize, 0, 0), kSize);
+  ASSERT_EQ(sallocx(p, 0), kSize);
+  {
+    SetNewHook();
+    SetDeleteHook();
+    tcmalloc::Cleanup unhook([]() {
+      ResetNewHook();
+      ResetDeleteHook();
+    });
+    ASSERT_EQ(rallocx(p, kSize + 1, 0), p);
+    VerifyNewHookWasCalled();
+    VerifyDeleteHookWasCalled();
+  }
+  ASSERT_GE(sallocx(p, 0), kSize + 1);
+  ASSERT_EQ(p[0], 1);
+  sdallocx(p, kSize + 1, 0);
+}
+
 struct NewHandlerHelper {
   NewHandlerHelper(NewHandlerHelper* prev) : prev(prev) { memset(filler, 0, sizeof(filler)); }
 
@@ -1754,6 +2499,36 @@ TEST(TCMallocTest, EmergencyMalloc) {
   VerifyDeleteHookWasCalled();
 }
 
+TEST(TCMallocTest, EmergencyMallocX) {
+  auto portal = TestingPortal::Get();
+  if (!portal->HasEmergencyMalloc()) {
+    printf("EmergencyMallocX test skipped\n");
+    return;
+  }
+
+  char* p = nullptr;
+  void* q = nullptr;
+  portal->WithEmergencyMallocEnabled([&]() {
+    p = noopt(static_cast<char*>(malloc(32)));
+    q = noopt(malloc(32));
+  });
+  ASSERT_TRUE(portal->IsEmergencyPtr(p));
+  memset(p, 7, 32);
+
+  // Flags are honored for emergency memory too, by moving it.
+  p = static_cast<char*>(rallocx(p, 1000, MALLOCX_LG_ALIGN(8) | MALLOCX_ZERO));
+  ASSERT_NE(p, nullptr);
+  ASSERT_FALSE(portal->IsEmergencyPtr(p));
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(p) % 256, 0);
+  for (int i = 0; i < 32; i++) {
+    ASSERT_EQ(p[i], 7);
+  }
+  dallocx(p, MALLOCX_LG_ALIGN(8));
+
+  ASSERT_TRUE(portal->IsEmergencyPtr(q));
+  dallocx(q, MALLOCX_TCACHE_NONE);
+}
+
 TEST(TCMallocTest, EmergencyMallocNoHook) {
   auto portal = TestingPortal::Get();
   if (!portal->HasEmergencyMalloc()) {
@@ -1831,6 +2606,130 @@ TEST(TCMallocTest, ReallocVsFreeSized) {
   free(p);
 }
 
+TEST(TCMallocTest, MaxCachedObjectSize) {
+  if (TestingPortal::Get()->IsDebuggingMalloc()) {
+    return;
+  }
+
+  // Default is 256 KiB, but TCMALLOC_MAX_CACHED_OBJECT_BYTES can
+  // raise it. Either way the largest size class must cover exactly
+  // the max size, and anything larger must come from page heap.
+  const size_t max_size = TestingPortal::Get()->GetMaxSize();
+  ASSERT_GE(max_size, 256 << 10);
+  ASSERT_EQ(nallocx(max_size, 0), max_size);
+
+  void* p = noopt(malloc)(max_size);
+  ASSERT_NE(TestingPortal::Get()->GetSizeClass(p), 0);
+  free(p);
+
+  p = noopt(malloc)(max_size + 1);
+  ASSERT_EQ(TestingPortal::Get()->GetSizeClass(p), 0);
+  free(p);
+
+  // Extended size classes keep internal fragmentation at most 1/8th.
+  for (size_t size = (256 << 10) + 1; size <= max_size; size += 4099) {
+    size_t rounded = nallocx(size, 0);
+    ASSERT_GE(rounded, size);
+    ASSERT_LE(rounded - size, rounded / 8);
+
+    p = noopt(malloc)(size);
+    ASSERT_NE(TestingPortal::Get()->GetSizeClass(p), 0);
+    memset(p, 0x5a, size);
+    free(p);
+  }
+
+  // Extended classes move single objects, so transfer cache holds at
+  // most 1 MiB or one object of them.
+  std::vector<void*> big;
+  for (int i = 0; i < 16; i++) {
+    big.push_back(noopt(malloc)(max_size));
+  }
+  for (void* b : big) {
+    free(b);
+  }
+  MallocExtension::instance()->MarkThreadIdle();
+  std::vector<MallocExtension::FreeListInfo> info;
+  MallocExtension::instance()->GetFreeListSizes(&info);
+  for (const auto& i : info) {
+    if (strcmp(i.type, "tcmalloc.transfer") == 0 && i.max_object_size > (256 << 10)) {
+      EXPECT_LE(i.total_bytes_free, std::max<size_t>(1 << 20, i.max_object_size)) << i.max_object_size;
+    }
+  }
+}
+
+TEST(TCMallocTest, ColdAllocations) {
+  constexpr int kNum = 256;
+  constexpr size_t kSize = 48;
+  std::vector<void*> hot, cold;
+  for (int i = 0; i < kNum; i++) {
+    hot.push_back(noopt(tc_malloc)(kSize));
+    cold.push_back(noopt(tc_malloc_hinted)(kSize, TC_MALLOC_HINT_COLD));
+    ASSERT_NE(cold.back(), nullptr);
+    memset(cold.back(), 0xcc, kSize);
+  }
+
+  if (!TestingPortal::Get()->IsDebuggingMalloc()) {
+    // Cold objects must not share pages with hot ones. Every span is
+    // at least 4k aligned, so this granularity is fine.
+    std::set<uintptr_t> hot_pages;
+    for (void* p : hot) {
+      hot_pages.insert(reinterpret_cast<uintptr_t>(p) >> 12);
+    }
+    for (void* p : cold) {
+      ASSERT_EQ(hot_pages.count(reinterpret_cast<uintptr_t>(p) >> 12), 0);
+    }
+  }
+
+  std::set<uintptr_t> cold_pages;
+  for (void* p : cold) {
+    cold_pages.insert(reinterpret_cast<uintptr_t>(p) >> 12);
+  }
+
+  for (int i = 0; i < kNum; i++) {
+    free(hot[i]);
+    free(cold[i]);
+  }
+
+  if (!TestingPortal::Get()->IsDebuggingMalloc()) {
+    // Freed cold objects go back to cold spans rather than to thread
+    // cache, so hot allocations never get them.
+    for (int i = 0; i < kNum; i++) {
+      hot[i] = noopt(tc_malloc)(kSize);
+      ASSERT_EQ(cold_pages.count(reinterpret_cast<uintptr_t>(hot[i]) >> 12), 0);
+    }
+    for (void* p : hot) {
+      free(p);
+    }
+  }
+
+  // Sized frees keep their fast path, and cold objects find their way
+  // back to cold spans via central free list.
+  for (int i = 0; i < kNum; i++) {
+    cold[i] = noopt(tc_malloc_hinted)(kSize, TC_MALLOC_HINT_COLD);
+    ASSERT_NE(cold[i], nullptr);
+  }
+  for (int i = 0; i < kNum; i++) {
+    tc_free_sized(cold[i], kSize);
+  }
+  MallocExtension::instance()->MarkThreadIdle();
+  MallocExtension::instance()->ReleaseFreeMemory();
+  for (int i = 0; i < kNum; i++) {
+    cold[i] = noopt(tc_malloc_hinted)(kSize, TC_MALLOC_HINT_COLD);
+    ASSERT_NE(cold[i], nullptr);
+    memset(cold[i], 0xcc, kSize);
+  }
+  for (void* p : cold) {
+    free(p);
+  }
+
+  void* big = noopt(tc_malloc_hinted)(1 << 20, TC_MALLOC_HINT_COLD);
+  ASSERT_NE(big, nullptr);
+  memset(big, 0, 1 << 20);
+  free(big);
+
+  ASSERT_EQ(tc_malloc_hinted(kTooBig, TC_MALLOC_HINT_COLD), nullptr);
+}
+
 TEST(TCMallocTest, ReallocOnInvalidPointer) {
   if (TestingPortal::Get()->IsDebuggingMalloc()) {
     return;
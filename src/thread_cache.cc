@@ -42,7 +42,9 @@
 #include "base/spinlock.h"  // for SpinLockHolder
 #include "central_freelist.h"
 #include "getenv_safe.h"  // for TCMallocGetenvSafe
+#include "soft_limit.h"
 #include "tcmalloc_internal.h"
+#include "thread_cache_ptr.h"
 
 // Note: this is initialized manually in InitModule to ensure that
 // it's configured at right time
@@ -102,6 +104,10 @@ ThreadCache::ThreadCache() {
 
 ThreadCache::~ThreadCache() {
   // Put unused memory back into central cache
+  Flush();
+}
+
+void ThreadCache::Flush() {
   for (uint32_t cl = 0; cl < Static::num_size_classes(); ++cl) {
     if (list_[cl].length() > 0) {
       ReleaseToCentralCache(&list_[cl], cl, list_[cl].length());
@@ -109,6 +115,54 @@ ThreadCache::~ThreadCache() {
   }
 }
 
+// Returns true if p can be a free object of size class cl: it points
+// to an object boundary inside a span of that size class.
+static bool LooksLikeFreeObject(void* p, uint32_t cl) {
+  uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+  Span* span = Static::pageheap()->GetDescriptor(addr >> kPageShift);
+  if (span == nullptr || span->location != Span::IN_USE || span->sizeclass != cl) {
+    return false;
+  }
+  uintptr_t first = (span->start << kPageShift) + Static::sizemap()->ColorOffset(cl, span->start);
+  return addr >= first && (addr - first) % Static::sizemap()->class_to_size(cl) == 0;
+}
+
+void ThreadCache::FlushOrphaned() {
+  for (uint32_t cl = 0; cl < Static::num_size_classes(); ++cl) {
+    uint32_t length;
+    void* head = list_[cl].TakeAll(&length);
+    const int batch_size = Static::sizemap()->num_objects_to_move(cl);
+
+    // Owner thread might have stopped between updating the list and
+    // its length, so we may see one more object than length says.
+    void* start = nullptr;
+    void* end = nullptr;
+    int count = 0;
+    void* next;
+    uint32_t walked = 0;
+    for (void* p = head; p != nullptr && walked <= length; p = next, walked++) {
+      if (!LooksLikeFreeObject(p, cl)) {
+        break;
+      }
+      next = SLL_Next(p);
+      if (count == 0) {
+        start = p;
+      }
+      end = p;
+      if (++count == batch_size) {
+        SLL_SetNext(end, nullptr);
+        Static::central_cache()[cl].InsertRange(start, end, count);
+        count = 0;
+      }
+    }
+    if (count > 0) {
+      SLL_SetNext(end, nullptr);
+      Static::central_cache()[cl].InsertRange(start, end, count);
+    }
+  }
+  size_ = 0;
+}
+
 // Remove some objects of class "cl" from central cache and add to thread heap.
 // On success, return the first object for immediate use; otherwise return nullptr.
 void* ThreadCache::FetchFromCentralCache(uint32_t cl, int32_t byte_size, void* (*oom_handler)(size_t size)) {
@@ -336,15 +390,35 @@ void ThreadCache::DeleteCache(ThreadCache* heap) {
   threadcache_allocator.Delete(heap);
 }
 
+void ThreadCache::DeleteOrphanedCaches() {
+  ThreadCache* self = ThreadCachePtr::GetIfPresent();
+
+  // Child is single-threaded, so nobody but us changes thread_heaps_.
+  ThreadCache* next;
+  for (ThreadCache* h = thread_heaps_; h != nullptr; h = next) {
+    next = h->next_;
+    if (h == self || ThreadCachePtr::IsCacheInSlowTLS(h)) {
+      continue;
+    }
+    h->FlushOrphaned();
+    DeleteCache(h);  // Nothing left for its Flush().
+  }
+
+  SpinLockHolder l(Static::pageheap_lock());
+  RecomputePerThreadCacheSize();
+}
+
 void ThreadCache::RecomputePerThreadCacheSize() {
   // Divide available space across threads
   int n = thread_heap_count_ > 0 ? thread_heap_count_ : 1;
   size_t space = overall_thread_cache_size_ / n;
 
   size_t min_size = min_per_thread_cache_size_.load(std::memory_order_relaxed);
-  // Limit to allowed range
+  // Limit to allowed range.  With extended size classes a thread
+  // cache must still fit a couple of the largest objects.
+  const size_t max_size = std::max(kMaxThreadCacheSize, 2 * Static::sizemap()->max_size());
   if (space < min_size) space = min_size;
-  if (space > kMaxThreadCacheSize) space = kMaxThreadCacheSize;
+  if (space > max_size) space = max_size;
 
   double ratio = space / std::max<double>(1, per_thread_cache_size_);
   size_t claimed = 0;
@@ -371,6 +445,16 @@ void ThreadCache::GetThreadStats(uint64_t* total_bytes, uint64_t* class_count) {
   }
 }
 
+void ThreadCache::ShrinkAllCacheLimits() {
+  const size_t min_size = min_per_thread_cache_size_.load(std::memory_order_relaxed);
+  for (ThreadCache* h = thread_heaps_; h != nullptr; h = h->next_) {
+    if (h->max_size_ > min_size) {
+      unclaimed_cache_space_ += h->max_size_ - min_size;
+      h->SetMaxSize(min_size);
+    }
+  }
+}
+
 void ThreadCache::set_overall_thread_cache_size(size_t new_size) {
   // Clip the value to a reasonable range
   size_t min_size = min_per_thread_cache_size_.load(std::memory_order_relaxed);
@@ -82,6 +82,9 @@ class ThreadCache {
 
   void Scavenge();
 
+  // Returns all cached objects to the central cache.
+  void Flush();
+
   int GetSamplePeriod();
 
   // Record allocation of "k" bytes.  Return true iff allocation
@@ -114,6 +117,13 @@ class ThreadCache {
   static void set_overall_thread_cache_size(size_t new_size);
   static size_t overall_thread_cache_size() { return overall_thread_cache_size_; }
 
+  // Cuts max size of every thread cache down to
+  // min_per_thread_cache_size, so that each thread scavenges its
+  // cache on next deallocation. Threads get their limits back over
+  // time via usual IncreaseCacheLimit stealing.
+  // REQUIRES: Static::pageheap lock is held.
+  static void ShrinkAllCacheLimits();
+
   // Sets the lower bound on per-thread cache size to new_size.
   static void set_min_per_thread_cache_size(size_t new_size) {
     min_per_thread_cache_size_.store(new_size, std::memory_order_relaxed);
@@ -123,6 +133,14 @@ class ThreadCache {
 
   static int thread_heap_count() { return thread_heap_count_; }
 
+  // Called in the child after fork.  Only the forking thread exists
+  // there, so caches of all other threads would never be used again.
+  // Returns their objects to the central cache, deletes them and
+  // gives their share of overall_thread_cache_size to the remaining
+  // caches.
+  // REQUIRES: Static::pageheap_lock is not held.
+  static void DeleteOrphanedCaches();
+
  private:
   class FreeList {
    private:
@@ -206,6 +224,16 @@ class ThreadCache {
 
     void* Next() { return SLL_Next(&list_); }
 
+    // Takes whole list off, returning its head and (possibly
+    // inaccurate, see FlushOrphaned) length.
+    void* TakeAll(uint32_t* length) {
+      void* head = list_;
+      *length = length_;
+      list_ = nullptr;
+      length_ = lowater_ = 0;
+      return head;
+    }
+
     void PushRange(int N, void* start, void* end) {
       SLL_PushRange(&list_, start, end);
       length_ += N;
@@ -224,6 +252,11 @@ class ThreadCache {
   // REQUIRES: Static::pageheap_lock is not held
   ~ThreadCache();
 
+  // Like Flush(), but for cache of a thread that was stopped by fork at
+  // some arbitrary point.  Freelists are walked with sanity checks, and
+  // whatever looks broken is leaked.
+  void FlushOrphaned();
+
   // Gets and returns an object from the central cache, and, if possible,
   // also adds some objects of that size class to this thread cache.
   void* FetchFromCentralCache(uint32_t cl, int32_t byte_size, void* (*oom_handler)(size_t size));
@@ -309,7 +342,7 @@ ALWAYS_INLINE void* ThreadCache::Allocate(size_t size, uint32_t cl, void* (*oom_
   size = list->object_size();
 #endif
 
-  ASSERT(size <= kMaxSize);
+  ASSERT(size <= Static::sizemap()->max_size());
   ASSERT(size != 0);
   ASSERT(size == 0 || size == Static::sizemap()->ByteSizeForClass(cl));
 
@@ -186,6 +186,18 @@ class SlowTLS {
 
   static SpinLock* GetLock() { return &lock_; }
 
+  static bool HasEntryFor(ThreadCache* cache) {
+    SpinLockHolder h(&lock_);
+    for (Entry* head : hash_table_) {
+      for (Entry* entry = head; entry != nullptr; entry = entry->next) {
+        if (entry->cache == cache) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
  private:
   static constexpr inline int kTableSize = 257;
   static inline Entry* hash_table_[kTableSize];
@@ -341,6 +353,8 @@ void ThreadCachePtr::InitThreadCachePtrLate() {
 
 SpinLock* ThreadCachePtr::GetSlowTLSLock() { return SlowTLS::GetLock(); }
 
+bool ThreadCachePtr::IsCacheInSlowTLS(ThreadCache* cache) { return SlowTLS::HasEntryFor(cache); }
+
 #if defined(ENABLE_EMERGENCY_MALLOC)
 
 /* static */ ATTRIBUTE_NOINLINE
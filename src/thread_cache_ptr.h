@@ -120,6 +120,10 @@ class ThreadCachePtr {
   // For pthread_atfork handler
   static SpinLock* GetSlowTLSLock();
 
+  // Returns true if some slow path TLS entry refers to cache.  Such
+  // cache may still be looked up, even if its thread is gone.
+  static bool IsCacheInSlowTLS(ThreadCache* cache);
+
  private:
   friend class SlowTLS;
 
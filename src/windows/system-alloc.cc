@@ -172,6 +172,42 @@ extern PERFTOOLS_DLL_DECL bool TCMalloc_SystemRelease(void* start, size_t length
   return true;
 }
 
+void TCMalloc_SystemPrefault(void* start, size_t length, bool use_hugepages) {
+  // Committed pages are only faulted in on first touch.
+  volatile char* p = static_cast<char*>(start);
+  for (size_t off = 0; off < length; off += 4096) {
+    p[off] = p[off];
+  }
+}
+
+// There is no memfs_malloc on Windows, so nobody hooks release.
+void TCMalloc_SetSystemReleaseHook(SystemReleaseHook hook) {}
+
+bool TCMalloc_SystemReleaseBatch(const SystemReleaseRange* ranges, int count, int* syscalls) {
+  *syscalls = 0;
+  for (int i = 0; i < count; i++) {
+    ++*syscalls;
+    if (!TCMalloc_SystemRelease(ranges[i].start, ranges[i].length)) return false;
+  }
+  return true;
+}
+
+// VirtualAllocator doesn't reserve the heap up front.
+bool TCMalloc_SystemInReservation(const void* ptr) { return false; }
+
+void TCMalloc_SystemGetReservation(size_t* reserved_bytes, size_t* used_bytes) {
+  *reserved_bytes = 0;
+  *used_bytes = 0;
+}
+
+bool TCMalloc_SystemAllocZeroes() {
+  SpinLockHolder lock_holder(&spinlock);
+  return system_alloc_inited && tcmalloc_sys_alloc == virtual_space.get();
+}
+
+// MEM_DECOMMIT followed by MEM_COMMIT always gives us zero pages.
+bool TCMalloc_SystemReleaseZeroes(void* start, size_t length) { return TCMalloc_SystemAllocZeroes(); }
+
 extern PERFTOOLS_DLL_DECL void TCMalloc_SystemCommit(void* start, size_t length) {
   if (VirtualAlloc(start, length, MEM_COMMIT, PAGE_READWRITE) == start) return;
 